@@ -0,0 +1,920 @@
+/**********************************************************************
+ * aupdbench
+ *
+ * Load generator and latency benchmark for Postfix policy servers.
+ *
+ * Many connections each send smtpd_access_policy requests one at a
+ * time, as smtpd does, and time every answer.  Requests are either
+ * replayed from a file of attribute blocks or made up: senders are
+ * drawn from a Zipf distribution over a population, each sender may
+ * send a burst of requests in a row, and a share of requests can come
+ * from whitelisted senders.
+ *
+ * The server is reached over its socket (aupdd), or a command is
+ * started for every connection and spoken to over its standard input
+ * and output, the way Postfix runs the aupd script, so both can be
+ * measured with the same load and compared.
+ *
+ * The report is one line of name=value pairs: throughput, answers by
+ * kind, and latency percentiles in microseconds.
+ ***********************************************************************/
+
+#define _GNU_SOURCE
+
+#include <string.h>
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define BENCH_ADDRESS  "unix:/var/mta/aupd/policy"
+#define BENCH_DOMAIN   "example.com"
+#define BENCH_WHITE    (100)            /* Whitelisted senders made up. */
+#define BENCH_EVENTS   (256)
+#define BENCH_REPLY    (4096)           /* Longest answer read. */
+
+struct bench_conn {
+  int      fd;
+  pid_t    pid;                         /* Command, with -e. */
+  char     request[1024];
+  size_t   len;                         /* Request length. */
+  size_t   sent;
+  char     reply[BENCH_REPLY];
+  size_t   got;
+  int64_t  start;                       /* When the request was sent. */
+  unsigned burst;                       /* Requests left in the burst. */
+  unsigned rank;                        /* Sender of the burst. */
+  int      white;
+};
+
+struct bench_thread {
+  pthread_t          thread;
+  struct bench_conn *conns;
+  int                nconns;
+  uint64_t           rng;
+  uint64_t           todo;              /* Requests left to start. */
+  int64_t           *lat;               /* Latencies in nanoseconds. */
+  size_t             nlat;
+  size_t             maxlat;
+  uint64_t           rejects;
+  uint64_t           others;            /* Neither dunno nor reject. */
+  uint64_t           errors;
+  uint64_t           replayed;          /* Next block to replay. */
+};
+
+char *program_name;
+
+static const char  *address = BENCH_ADDRESS;
+static const char  *command = NULL;
+static unsigned     population = 10000;
+static double       skew = 1.0;
+static unsigned     burst = 1;
+static double       white = 0.0;
+static unsigned     rcpts = 1;
+static double      *cdf;                /* Zipf cumulative distribution. */
+static char       **blocks;             /* Replayed requests. */
+static size_t      *block_len;
+static size_t       nblocks;
+static int64_t      deadline;           /* 0 unless running for a time. */
+static volatile int stopping = 0;
+
+
+
+/*
+----------------------------------------------------------------------
+
+
+                         Local Functions
+
+
+----------------------------------------------------------------------
+*/
+
+
+void
+usage
+(
+ void
+)
+{
+  fprintf(stderr,
+	  "Usage: %s [-s address | -e command] [-c conns] [-j threads]\n"
+	  "       [-n requests | -T seconds] [-f file | [-u senders] [-z skew]\n"
+	  "       [-b burst] [-w share [-a]] [-m rcpts]]\n"
+	  "\n"
+	  "\tSends Postfix policy requests over many connections and\n"
+	  "\treports throughput and latency percentiles.\n"
+	  "\n"
+	  "Options:\n"
+	  "  -s address   Server at unix:path or inet:host:port\n"
+	  "               (default %s)\n"
+	  "\n"
+	  "  -e command   Start command for each connection and talk to\n"
+	  "               it on its standard input and output instead\n"
+	  "\n"
+	  "  -c conns     Connections, each with one request at a time\n"
+	  "               (default 50)\n"
+	  "\n"
+	  "  -j threads   Threads driving the connections (default 1)\n"
+	  "\n"
+	  "  -n requests  Requests to send (default 100000)\n"
+	  "\n"
+	  "  -T seconds   Send requests for this long instead\n"
+	  "\n"
+	  "  -f file      Replay the requests in file, blocks of\n"
+	  "               name=value lines each ending with an empty line\n"
+	  "\n"
+	  "  -u senders   Number of senders made up (default 10000)\n"
+	  "\n"
+	  "  -z skew      Zipf exponent of the sender distribution;\n"
+	  "               0 is uniform (default 1.0)\n"
+	  "\n"
+	  "  -b burst     Requests each chosen sender sends in a row\n"
+	  "               (default 1)\n"
+	  "\n"
+	  "  -w share     Share of requests, 0 to 1, from whitelisted\n"
+	  "               senders (default 0)\n"
+	  "\n"
+	  "  -a           Whitelist those senders first, with aupdd's\n"
+	  "               aupd_whitelist request\n"
+	  "\n"
+	  "  -m rcpts     Most recipients per request; each request has\n"
+	  "               1 to rcpts (default 1)\n"
+	  "\n"
+	  "  -h           Display this help message\n"
+	  "\n"
+	  ,program_name, BENCH_ADDRESS);
+}
+
+
+static int64_t
+clock_ns
+(
+ void
+)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/* xorshift64*: uniform in [0, 1). */
+static double
+uniform
+(
+ uint64_t *state
+)
+{
+  uint64_t x = *state;
+
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+
+  return ((x * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+
+/* ---- Requests ---- */
+
+
+static int
+make_cdf
+(
+ void
+)
+{
+  double   sum = 0;
+  unsigned i;
+
+  if ((cdf = malloc (population * sizeof (double))) == NULL)
+    return -1;
+
+  for (i = 0; i < population; i++)
+    cdf[i] = sum += 1.0 / pow (i + 1, skew);
+  for (i = 0; i < population; i++)
+    cdf[i] /= sum;
+
+  return 0;
+}
+
+
+/* Draws a sender rank, 0 being the busiest. */
+static unsigned
+pick_sender
+(
+ uint64_t *rng
+)
+{
+  double   u = uniform (rng);
+  unsigned lo = 0, hi = population - 1, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (cdf[mid] < u)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+
+/**
+   read_blocks
+
+   Loads the requests to replay from path.  Returns 0, or -1 with a
+   message printed.
+*/
+static int
+read_blocks
+(
+ const char *path
+)
+{
+  FILE   *file;
+  char   *line = NULL, *block = NULL, *p;
+  size_t  linemax = 0, len = 0, max = 0;
+  ssize_t n;
+
+  if ((file = fopen (path, "r")) == NULL) {
+    perror (path);
+    return -1;
+  }
+
+  while ((n = getline (&line, &linemax, file)) >= 0) {
+    if (n > 0 && line[n-1] != '\n') {
+      /* A last line without its newline. */
+      if ((p = realloc (line, n + 2)) == NULL)
+        goto nomem;
+      line = p;
+      line[n++] = '\n';
+      line[n] = '\0';
+    }
+    if ((p = realloc (block, len + n + 1)) == NULL)
+      goto nomem;
+    block = p;
+    memcpy (block + len, line, n + 1);
+    len += n;
+
+    if (strcmp (line, "\n") == 0) {
+      if (len == 1) {
+        len = 0;
+        continue;
+      }
+      if (nblocks == max) {
+        max = max ? 2 * max : 1024;
+        if ((p = realloc (blocks, max * sizeof (char *))) == NULL)
+          goto nomem;
+        blocks = (char **)p;
+        if ((p = realloc (block_len, max * sizeof (size_t))) == NULL)
+          goto nomem;
+        block_len = (size_t *)p;
+      }
+      blocks[nblocks] = block;
+      block_len[nblocks++] = len;
+      block = NULL;
+      len = 0;
+    }
+  }
+  free (line);
+  free (block);
+  fclose (file);
+
+  if (nblocks == 0) {
+    fprintf (stderr, "%s: %s: no requests\n", program_name, path);
+    return -1;
+  }
+
+  return 0;
+
+ nomem:
+  fprintf (stderr, "%s: out of memory\n", program_name);
+  fclose (file);
+  return -1;
+}
+
+
+/* Writes the next request for c into its buffer. */
+static void
+next_request
+(
+ struct bench_thread *t,
+ struct bench_conn   *c
+)
+{
+  size_t   i;
+  unsigned n;
+
+  c->sent = c->got = 0;
+
+  if (blocks != NULL) {
+    i = t->replayed++ % nblocks;
+    c->len = block_len[i] < sizeof (c->request) ? block_len[i] : sizeof (c->request);
+    memcpy (c->request, blocks[i], c->len);
+    return;
+  }
+
+  if (c->burst == 0) {
+    c->burst = burst;
+    c->white = white > 0 && uniform (&t->rng) < white;
+    c->rank = c->white ? (unsigned)(uniform (&t->rng) * BENCH_WHITE) : pick_sender (&t->rng);
+  }
+  c->burst--;
+
+  n = rcpts > 1 ? 1 + (unsigned)(uniform (&t->rng) * rcpts) : 1;
+  c->len = snprintf (c->request, sizeof (c->request),
+                     "request=smtpd_access_policy\n"
+                     "protocol_state=END-OF-MESSAGE\n"
+                     "protocol_name=ESMTP\n"
+                     "client_address=10.0.%u.%u\n"
+                     "sender=%s%u@" BENCH_DOMAIN "\n"
+                     "recipient_count=%u\n"
+                     "\n",
+                     (c->rank >> 8) & 255, c->rank & 255,
+                     c->white ? "white" : "user", c->rank, n);
+}
+
+
+
+/* ---- Connections ---- */
+
+
+/**
+   address_connect
+
+   Connects to a unix:path, /path or inet:host:port address.  Returns
+   the socket, or -1 with a message printed.
+*/
+static int
+address_connect
+(
+ const char *addr
+)
+{
+  struct sockaddr_un  sun;
+  struct addrinfo     hints, *res, *ai;
+  const char         *path = NULL, *port;
+  char                host[256];
+  int                 fd = -1, rc;
+
+  if (strncmp (addr, "unix:", 5) == 0)
+    path = addr + 5;
+  else if (addr[0] == '/')
+    path = addr;
+
+  if (path != NULL) {
+    memset (&sun, 0, sizeof (sun));
+    sun.sun_family = AF_UNIX;
+    strncpy (sun.sun_path, path, sizeof (sun.sun_path) - 1);
+    if (strlen (path) >= sizeof (sun.sun_path) || (fd = socket (AF_UNIX, SOCK_STREAM, 0)) < 0
+        || connect (fd, (struct sockaddr *)&sun, sizeof (sun)) != 0) {
+      perror (path);
+      if (fd >= 0)
+        close (fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  if (strncmp (addr, "inet:", 5) == 0)
+    addr += 5;
+  if ((port = strrchr (addr, ':')) == NULL || (size_t)(port - addr) >= sizeof (host)) {
+    fprintf (stderr, "%s: %s: bad address\n", program_name, addr);
+    return -1;
+  }
+  memcpy (host, addr, port - addr);
+  host[port - addr] = '\0';
+  port++;
+
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if ((rc = getaddrinfo (host[0] ? host : NULL, port, &hints, &res)) != 0) {
+    fprintf (stderr, "%s: %s: %s\n", program_name, addr, gai_strerror (rc));
+    return -1;
+  }
+  for (ai = res; ai != NULL; ai = ai->ai_next) {
+    if ((fd = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+      continue;
+    if (connect (fd, ai->ai_addr, ai->ai_addrlen) == 0)
+      break;
+    close (fd);
+    fd = -1;
+  }
+  if (fd < 0)
+    perror (addr);
+  freeaddrinfo (res);
+
+  return fd;
+}
+
+
+/* Starts command with one end of a socket pair as stdin and stdout.
+   Other connections are closed in it, so each command sees its EOF. */
+static int
+spawn
+(
+ struct bench_conn *c
+)
+{
+  int sv[2];
+
+  if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+    perror (program_name);
+    return -1;
+  }
+
+  if ((c->pid = fork ()) < 0) {
+    perror (program_name);
+    close (sv[0]);
+    close (sv[1]);
+    return -1;
+  }
+  if (c->pid == 0) {
+    close (sv[0]);
+    dup2 (sv[1], 0);
+    dup2 (sv[1], 1);
+    if (sv[1] > 1)
+      close (sv[1]);
+    execl ("/bin/sh", "sh", "-c", command, (char *)NULL);
+    _exit (127);
+  }
+
+  close (sv[1]);
+  c->fd = sv[0];
+
+  return 0;
+}
+
+
+static int
+conn_open
+(
+ struct bench_conn *c
+)
+{
+  memset (c, 0, sizeof (*c));
+  c->fd = -1;
+
+  if (command != NULL ? spawn (c) != 0 : (c->fd = address_connect (address)) < 0)
+    return -1;
+
+  return fcntl (c->fd, F_SETFL, O_NONBLOCK);
+}
+
+
+static void
+conn_close
+(
+ struct bench_conn *c
+)
+{
+  if (c->fd >= 0)
+    close (c->fd);
+  c->fd = -1;
+  if (c->pid > 0)
+    waitpid (c->pid, NULL, 0);
+  c->pid = 0;
+}
+
+
+static int
+record
+(
+ struct bench_thread *t,
+ int64_t              ns
+)
+{
+  int64_t *lat;
+
+  if (t->nlat == t->maxlat) {
+    t->maxlat = t->maxlat ? 2 * t->maxlat : 65536;
+    if ((lat = realloc (t->lat, t->maxlat * sizeof (int64_t))) == NULL)
+      return -1;
+    t->lat = lat;
+  }
+  t->lat[t->nlat++] = ns;
+
+  return 0;
+}
+
+
+/**
+   conn_send
+
+   Starts c's next request if any are left, or closes c.  Returns 1
+   while c is busy, 0 once it is closed.
+*/
+static int
+conn_send
+(
+ struct bench_thread *t,
+ struct bench_conn   *c
+)
+{
+  ssize_t n;
+
+  if (stopping || t->todo == 0 || (deadline && clock_ns () >= deadline)) {
+    conn_close (c);
+    return 0;
+  }
+  t->todo--;
+
+  next_request (t, c);
+  c->start = clock_ns ();
+  n = write (c->fd, c->request, c->len);
+  if (n < 0 && errno != EAGAIN) {
+    t->errors++;
+    conn_close (c);
+    return 0;
+  }
+  c->sent = n > 0 ? n : 0;
+
+  return 1;
+}
+
+
+/**
+   conn_event
+
+   Carries on with c when its socket is ready.  Returns 1 while c is
+   busy, 0 once it is closed.
+*/
+static int
+conn_event
+(
+ struct bench_thread *t,
+ struct bench_conn   *c,
+ uint32_t             events
+)
+{
+  ssize_t n;
+
+  if (c->sent < c->len && (events & EPOLLOUT)) {
+    n = write (c->fd, c->request + c->sent, c->len - c->sent);
+    if (n < 0 && errno != EAGAIN)
+      goto fail;
+    if (n > 0)
+      c->sent += n;
+  }
+
+  if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+    return 1;
+
+  n = read (c->fd, c->reply + c->got, sizeof (c->reply) - 1 - c->got);
+  if (n < 0 && errno == EAGAIN)
+    return 1;
+  if (n <= 0)
+    goto fail;
+  c->got += n;
+  c->reply[c->got] = '\0';
+
+  if (c->got < 2 || strcmp (c->reply + c->got - 2, "\n\n") != 0) {
+    if (c->got == sizeof (c->reply) - 1)
+      goto fail;
+    return 1;
+  }
+
+  if (record (t, clock_ns () - c->start) != 0)
+    goto fail;
+  if (strncmp (c->reply, "action=reject", 13) == 0)
+    t->rejects++;
+  else if (strncmp (c->reply, "action=dunno", 12) != 0)
+    t->others++;
+
+  return conn_send (t, c);
+
+ fail:
+  t->errors++;
+  conn_close (c);
+  return 0;
+}
+
+
+static void *
+drive
+(
+ void *arg
+)
+{
+  struct bench_thread *t = arg;
+  struct epoll_event   ev, events[BENCH_EVENTS];
+  int                  epfd, i, n, busy = 0;
+
+  if ((epfd = epoll_create1 (0)) < 0) {
+    perror (program_name);
+    return NULL;
+  }
+
+  for (i = 0; i < t->nconns; i++) {
+    if (t->conns[i].fd < 0)
+      continue;
+    /* Edge triggered, so a connection waiting for its answer is quiet. */
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = &t->conns[i];
+    if (epoll_ctl (epfd, EPOLL_CTL_ADD, t->conns[i].fd, &ev) != 0) {
+      conn_close (&t->conns[i]);
+      continue;
+    }
+    busy += conn_send (t, &t->conns[i]);
+  }
+
+  while (busy > 0) {
+    if ((n = epoll_wait (epfd, events, BENCH_EVENTS, -1)) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror (program_name);
+      break;
+    }
+    for (i = 0; i < n; i++)
+      if (conn_event (t, events[i].data.ptr, events[i].events) == 0)
+        busy--;
+  }
+
+  close (epfd);
+
+  return NULL;
+}
+
+
+/* Whitelists the made-up whitelisted senders through aupdd. */
+static int
+whitelist
+(
+ void
+)
+{
+  char     buf[256];
+  unsigned i;
+  int      fd, n, len;
+
+  if ((fd = address_connect (address)) < 0)
+    return -1;
+
+  for (i = 0; i < BENCH_WHITE; i++) {
+    len = snprintf (buf, sizeof (buf), "request=aupd_whitelist\nsender=white%u@" BENCH_DOMAIN "\n\n", i);
+    if (write (fd, buf, len) != len || (n = read (fd, buf, sizeof (buf) - 1)) <= 0) {
+      fprintf (stderr, "%s: cannot whitelist senders\n", program_name);
+      close (fd);
+      return -1;
+    }
+    buf[n] = '\0';
+    if (strncmp (buf, "action=ok", 9) != 0) {
+      fprintf (stderr, "%s: whitelist refused: %s", program_name, buf);
+      close (fd);
+      return -1;
+    }
+  }
+  close (fd);
+
+  return 0;
+}
+
+
+static int
+compare_ns
+(
+ const void *a,
+ const void *b
+)
+{
+  int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+
+static double
+percentile
+(
+ const int64_t *lat,
+ size_t         n,
+ double         p
+)
+{
+  size_t i;
+
+  if (n == 0)
+    return 0;
+  i = (size_t)ceil (p * n);
+  return lat[i > 0 ? i - 1 : 0] / 1000.0;
+}
+
+
+void
+stop
+(
+ int sig
+)
+{
+  (void) sig;
+  stopping = 1;
+}
+
+
+/*
+----------------------------------------------------------------------
+
+
+                         Main
+
+
+----------------------------------------------------------------------
+*/
+
+
+int
+main
+(
+ int argc,
+ char *argv[]
+)
+{
+  struct bench_thread *threads;
+  struct bench_conn   *conns;
+  struct sigaction     sa;
+  char                *s;
+  char                *replay = NULL;
+  uint64_t             requests = 100000;
+  uint64_t             rejects = 0, others = 0, errors = 0;
+  int64_t             *lat, begin, elapsed;
+  double               seconds = 0, sum = 0;
+  size_t               nlat = 0, k;
+  int                  nconns = 50, nthreads = 1, add_white = 0;
+  int                  i, j;
+
+  program_name = argv[0];
+
+  while (--argc > 0 && (*++argv)[0] == '-') {
+    for (s = argv[0]+1; *s != '\0'; s++)
+      switch (*s) {
+      case 's':                 /* Server address */
+        address = *++argv;
+        --argc;
+        break;
+      case 'e':                 /* Command per connection */
+        command = *++argv;
+        --argc;
+        break;
+      case 'c':                 /* Connections */
+        nconns = atoi (*++argv);
+        --argc;
+        break;
+      case 'j':                 /* Threads */
+        nthreads = atoi (*++argv);
+        --argc;
+        break;
+      case 'n':                 /* Requests */
+        requests = strtoull (*++argv, NULL, 10);
+        --argc;
+        break;
+      case 'T':                 /* Seconds */
+        seconds = atof (*++argv);
+        --argc;
+        break;
+      case 'f':                 /* Requests to replay */
+        replay = *++argv;
+        --argc;
+        break;
+      case 'u':                 /* Senders */
+        population = atoi (*++argv);
+        --argc;
+        break;
+      case 'z':                 /* Zipf exponent */
+        skew = atof (*++argv);
+        --argc;
+        break;
+      case 'b':                 /* Burst */
+        burst = atoi (*++argv);
+        --argc;
+        break;
+      case 'w':                 /* Whitelisted share */
+        white = atof (*++argv);
+        --argc;
+        break;
+      case 'a':                 /* Whitelist first */
+        add_white = 1;
+        break;
+      case 'm':                 /* Recipients */
+        rcpts = atoi (*++argv);
+        --argc;
+        break;
+      case 'h':                 /* Help */
+        usage ();
+        exit (EXIT_SUCCESS);
+      default:
+        fprintf (stderr, "%s: illegal option %c\n", program_name, *s);
+        usage ();
+        exit (EXIT_FAILURE);
+      }
+  }
+
+  if (argc != 0 || nconns < 1 || nthreads < 1 || population < 1 || burst < 1
+      || rcpts < 1 || skew < 0 || white < 0 || white > 1 || seconds < 0
+      || (add_white && command != NULL)) {
+    usage ();
+    exit (EXIT_FAILURE);
+  }
+  if (nthreads > nconns)
+    nthreads = nconns;
+  if (seconds > 0)
+    requests = UINT64_MAX;
+
+  if (replay != NULL ? read_blocks (replay) != 0 : make_cdf () != 0)
+    exit (EXIT_FAILURE);
+  if (add_white && whitelist () != 0)
+    exit (EXIT_FAILURE);
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = SIG_IGN;
+  sigaction (SIGPIPE, &sa, NULL);
+  sa.sa_handler = stop;
+  sigaction (SIGINT, &sa, NULL);
+
+  threads = calloc (nthreads, sizeof (*threads));
+  conns = calloc (nconns, sizeof (*conns));
+  if (threads == NULL || conns == NULL) {
+    fprintf (stderr, "%s: out of memory\n", program_name);
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < nconns; i++)
+    if (conn_open (&conns[i]) != 0)
+      exit (EXIT_FAILURE);
+
+  /* Connections and requests are dealt out evenly. */
+  for (i = 0, k = 0; i < nthreads; i++) {
+    threads[i].nconns = nconns / nthreads + (i < nconns % nthreads);
+    threads[i].conns = conns + k;
+    k += threads[i].nconns;
+    threads[i].todo = seconds > 0 ? UINT64_MAX
+      : requests / nthreads + ((uint64_t)i < requests % nthreads);
+    threads[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+    threads[i].replayed = i * (nblocks / nthreads + 1);
+  }
+
+  begin = clock_ns ();
+  if (seconds > 0)
+    deadline = begin + (int64_t)(seconds * 1e9);
+  for (i = 0; i < nthreads; i++)
+    if (pthread_create (&threads[i].thread, NULL, drive, &threads[i]) != 0) {
+      perror (program_name);
+      exit (EXIT_FAILURE);
+    }
+  for (i = 0; i < nthreads; i++)
+    pthread_join (threads[i].thread, NULL);
+  elapsed = clock_ns () - begin;
+
+  for (i = 0; i < nthreads; i++) {
+    nlat += threads[i].nlat;
+    rejects += threads[i].rejects;
+    others += threads[i].others;
+    errors += threads[i].errors;
+  }
+  if ((lat = malloc ((nlat + 1) * sizeof (int64_t))) == NULL) {
+    fprintf (stderr, "%s: out of memory\n", program_name);
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0, k = 0; i < nthreads; i++) {
+    for (j = 0; (size_t)j < threads[i].nlat; j++)
+      sum += lat[k++] = threads[i].lat[j];
+    free (threads[i].lat);
+  }
+  qsort (lat, nlat, sizeof (int64_t), compare_ns);
+
+  printf ("requests=%lu conns=%d seconds=%.3f rps=%.0f dunno=%lu reject=%lu other=%lu"
+          " errors=%lu mean_us=%.1f p50_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f\n",
+          (unsigned long)nlat, nconns, elapsed / 1e9, nlat / (elapsed / 1e9),
+          (unsigned long)(nlat - rejects - others), (unsigned long)rejects,
+          (unsigned long)others, (unsigned long)errors,
+          nlat ? sum / nlat / 1000.0 : 0, percentile (lat, nlat, 0.50),
+          percentile (lat, nlat, 0.99), percentile (lat, nlat, 0.999),
+          nlat ? lat[nlat-1] / 1000.0 : 0);
+
+  free (lat);
+  free (conns);
+  free (threads);
+  free (cdf);
+
+  exit (errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,1011 @@
+/**********************************************************************
+ * aupdd
+ *
+ * The acceptable use policy daemon.  A native version of the aupd
+ * Postfix policy script: one process serves every smtpd over a UNIX
+ * or TCP socket, and imposes the same per sender limits.
+ *
+ * Each sender may send limit recipients (default 10000) in a period
+ * (default 86400 seconds) starting with its first message; after that
+ * mail is rejected until the period is over.  Whitelisted senders and
+ * the null sender are never limited.
+ *
+ * Postfix connects once per smtpd process and sends requests in the
+ * usual policy protocol, a list of name=value lines ending with an
+ * empty line, and gets back an action:
+ *
+ *    request=smtpd_access_policy       action=dunno
+ *    sender=foo@bar.tld                [empty line]
+ *    recipient_count=1
+ *    [empty line]
+ *
+ * Requests are handled by epoll event loops, one per worker thread
+ * (-t), sharing a sharded counter store (see aupdstore.c).  Idle
+ * senders are expired and the store is saved to a snapshot file in
+ * the background every minute, and loaded again at startup.  Point
+ * Postfix at the socket with, for example:
+ *
+ *    smtpd_end_of_data_restrictions =
+ *        check_policy_service unix:/var/mta/aupd/policy
+ *
+ * The -c and -w options are passed to the running daemon over its
+ * UNIX socket, as aupd_reset and aupd_whitelist requests; these are
+ * only accepted from root or the daemon's own user.
+ ***********************************************************************/
+
+#define _GNU_SOURCE
+
+#include <string.h>
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include "aupdd.h"
+
+#define AUPD_ADDRESS  "unix:/var/mta/aupd/policy"
+#define AUPD_SNAPSHOT "/var/mta/aupd/senders.snap"
+#define AUPD_LIMIT    (10000)           /* Recipients per period. */
+#define AUPD_PERIOD   (86400)           /* Seconds. */
+#define AUPD_ATTR_MAX AUPD_NAME_MAX     /* Longest name or value kept. */
+#define AUPD_REQUEST  (64 * 1024)       /* Longest request accepted. */
+#define AUPD_EVENTS   (256)             /* Events handled per wait. */
+#define AUPD_SWEEP    (60)              /* Seconds between expiry and snapshots. */
+
+struct aupd_request {
+  char request[AUPD_ATTR_MAX + 1];
+  char sender[AUPD_ATTR_MAX + 1];
+  long recipient_count;
+};
+
+struct aupd_conn {
+  struct aupd_conn    *next;            /* The worker's connections. */
+  struct aupd_conn    *prev;
+  int                  fd;
+  int                  admin;           /* Peer may send admin requests. */
+  char                *in;
+  size_t               inlen;
+  size_t               inmax;
+  char                *out;
+  size_t               outpos;
+  size_t               outlen;
+  size_t               outmax;
+  int                  writing;         /* Waiting for EPOLLOUT. */
+  struct aupd_request  req;
+};
+
+struct aupd_worker {
+  pthread_t            thread;
+  int                  lfd;             /* Shared listening socket. */
+  int                  is_unix;
+  int                  stopfd;          /* Readable when stopping. */
+  int                  epfd;
+  time_t               now;             /* Time of the last wakeup. */
+  struct aupd_conn    *conns;
+};
+
+char *program_name;
+
+static struct aupd_store *store;
+static int                verbose = 0;
+static int                debug = 0;
+
+
+
+/*
+----------------------------------------------------------------------
+
+
+                         Local Functions
+
+
+----------------------------------------------------------------------
+*/
+
+
+void
+usage
+(
+ void
+)
+{
+  fprintf(stderr,
+	  "Usage: %s [-d] [-v] [-s address] [-n limit] [-p period] [-W window]\n"
+	  "       [-t threads] [-f snapshot]\n"
+	  "       %s [-s address] -c sender | -w sender\n"
+	  "\n"
+	  "\tServes Postfix policy requests, limiting the recipients\n"
+	  "\teach sender may send in a period.\n"
+	  "\n"
+	  "Options:\n"
+	  "  -s address   Listen on unix:path or inet:host:port\n"
+	  "               (default %s)\n"
+	  "\n"
+	  "  -n limit     Recipients per sender per period (default %d)\n"
+	  "\n"
+	  "  -p period    Length of a period in seconds (default %d)\n"
+	  "\n"
+	  "  -W window    'fixed', a period starting with the sender's\n"
+	  "               first message (default), or 'sliding', the\n"
+	  "               last period\n"
+	  "\n"
+	  "  -t threads   Serve requests with this many threads (default 1)\n"
+	  "\n"
+	  "  -f snapshot  Keep counts across restarts in this file\n"
+	  "               (default %s, '' for none)\n"
+	  "\n"
+	  "  -c sender    Reset the sender's count and whitelisting\n"
+	  "\n"
+	  "  -w sender    Whitelist the sender\n"
+	  "\n"
+	  "  -v           Log each request's attributes\n"
+	  "\n"
+	  "  -d           Debug mode: stay in the foreground and log to\n"
+	  "               standard error as well\n"
+	  "\n"
+	  "  -h           Display this help message\n"
+	  "\n"
+	  ,program_name, program_name, AUPD_ADDRESS, AUPD_LIMIT, AUPD_PERIOD,
+	  AUPD_SNAPSHOT);
+}
+
+
+
+/* ---- Policy ---- */
+
+
+/**
+   policy
+
+   Counts a request's recipients against its sender and returns the
+   action, as aupd's smtpd_access_policy does.  Returns NULL if out of
+   memory.
+*/
+static const char *
+policy
+(
+ const struct aupd_request *req,
+ time_t                     now
+)
+{
+  struct aupd_verdict v;
+  const char         *action;
+
+  /* We can't restrict the mailer daemon. */
+  if (req->sender[0] == '\0')
+    return "dunno";
+
+  if (aupd_store_charge (store, req->sender, req->recipient_count, now, &v) != 0)
+    return NULL;
+
+  if (v.action == AUPD_WHITE)
+    return "dunno";
+
+  if (v.reset)
+    syslog (LOG_INFO, "from=<%s>, count=%ld, action=reset", req->sender, v.before);
+  action = v.action == AUPD_REJECT ? "reject Too much mail" : "dunno";
+  syslog (LOG_INFO, "from=<%s>, count=%ld, action=%s", req->sender, v.count, action);
+
+  return action;
+}
+
+
+/* Handles aupd_reset and aupd_whitelist, sent by -c and -w. */
+static const char *
+admin
+(
+ const struct aupd_request *req
+)
+{
+  int rc;
+
+  if (req->sender[0] == '\0')
+    return "error no sender";
+
+  if (strcmp (req->request, "aupd_reset") == 0)
+    rc = aupd_store_reset (store, req->sender);
+  else
+    rc = aupd_store_whitelist (store, req->sender);
+  if (rc != 0)
+    return "error out of memory";
+
+  syslog (LOG_INFO, "%s: %s", req->request, req->sender);
+
+  return "ok";
+}
+
+
+
+/* ---- Connections ---- */
+
+
+static int
+conn_reserve
+(
+ char   **buf,
+ size_t  *max,
+ size_t   need
+)
+{
+  char   *p;
+  size_t  n = *max ? *max : 4096;
+
+  if (need <= *max)
+    return 0;
+  while (n < need)
+    n *= 2;
+  if ((p = realloc (*buf, n)) == NULL)
+    return -1;
+  *buf = p;
+  *max = n;
+
+  return 0;
+}
+
+
+static int
+conn_reply
+(
+ struct aupd_conn *c,
+ const char       *action
+)
+{
+  size_t n = strlen (action);
+
+  if (conn_reserve (&c->out, &c->outmax, c->outlen + n + 9) != 0)
+    return -1;
+  memcpy (c->out + c->outlen, "action=", 7);
+  memcpy (c->out + c->outlen + 7, action, n);
+  memcpy (c->out + c->outlen + 7 + n, "\n\n", 2);
+  c->outlen += n + 9;
+
+  return 0;
+}
+
+
+static void
+conn_free
+(
+ struct aupd_worker *w,
+ struct aupd_conn   *c
+)
+{
+  if (c->prev != NULL)
+    c->prev->next = c->next;
+  else
+    w->conns = c->next;
+  if (c->next != NULL)
+    c->next->prev = c->prev;
+
+  close (c->fd);
+  free (c->in);
+  free (c->out);
+  free (c);
+}
+
+
+/* Copies at most AUPD_ATTR_MAX bytes, as aupd does. */
+static void
+attr_copy
+(
+ char       *dst,
+ const char *src,
+ size_t      len
+)
+{
+  if (len > AUPD_ATTR_MAX)
+    len = AUPD_ATTR_MAX;
+  memcpy (dst, src, len);
+  dst[len] = '\0';
+}
+
+
+/**
+   conn_line
+
+   Takes one line of a request, without its newline.  An empty line
+   ends the request and queues its reply.  Returns 0, 1 if the
+   connection should be closed after the reply, or -1 on error.
+*/
+static int
+conn_line
+(
+ struct aupd_conn *c,
+ char             *line,
+ size_t            len,
+ time_t            now
+)
+{
+  struct aupd_request *req = &c->req;
+  const char          *action;
+  char                *eq;
+  size_t               n;
+
+  if (len > 0 && line[len-1] == '\r')
+    len--;
+
+  if (len > 0) {
+    if ((eq = memchr (line, '=', len)) == NULL || eq == line) {
+      syslog (LOG_WARNING, "warning: ignoring garbage: %.100s", line);
+      return 0;
+    }
+    n = eq - line;
+    if (verbose)
+      syslog (LOG_INFO, "Attribute: %.*s", (int)(len < AUPD_ATTR_MAX ? len : AUPD_ATTR_MAX), line);
+    eq++;
+    if (n == 7 && memcmp (line, "request", 7) == 0)
+      attr_copy (req->request, eq, line + len - eq);
+    else if (n == 6 && memcmp (line, "sender", 6) == 0)
+      attr_copy (req->sender, eq, line + len - eq);
+    else if (n == 15 && memcmp (line, "recipient_count", 15) == 0)
+      req->recipient_count = strtol (eq, NULL, 10);
+    return 0;
+  }
+
+  if (strcmp (req->request, "smtpd_access_policy") == 0) {
+    if ((action = policy (req, now)) == NULL) {
+      syslog (LOG_ERR, "fatal: out of memory");
+      action = "dunno";
+    }
+  }
+  else if (c->admin && (strcmp (req->request, "aupd_reset") == 0
+                        || strcmp (req->request, "aupd_whitelist") == 0))
+    action = admin (req);
+  else {
+    /* As aupd does, answer and hang up. */
+    syslog (LOG_ERR, "fatal: unrecognized request type: '%s'", req->request);
+    if (conn_reply (c, "dunno") != 0)
+      return -1;
+    return 1;
+  }
+
+  if (verbose)
+    syslog (LOG_INFO, "Action: %s", action);
+  memset (req, 0, sizeof (*req));
+
+  return conn_reply (c, action);
+}
+
+
+/**
+   conn_flush
+
+   Writes as much pending output as the socket takes and asks for
+   EPOLLOUT while any is left.  Returns 0, or -1 if the connection
+   failed.
+*/
+static int
+conn_flush
+(
+ int               epfd,
+ struct aupd_conn *c
+)
+{
+  struct epoll_event ev;
+  ssize_t            n;
+
+  while (c->outpos < c->outlen) {
+    n = write (c->fd, c->out + c->outpos, c->outlen - c->outpos);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && errno == EAGAIN)
+      break;
+    if (n < 0)
+      return -1;
+    c->outpos += n;
+  }
+  if (c->outpos == c->outlen)
+    c->outpos = c->outlen = 0;
+
+  if ((c->outlen > 0) != c->writing) {
+    c->writing = c->outlen > 0;
+    ev.events = EPOLLIN | (c->writing ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    if (epoll_ctl (epfd, EPOLL_CTL_MOD, c->fd, &ev) != 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+
+/**
+   conn_read
+
+   Reads what has arrived and answers each complete request.  Returns
+   0, or -1 when the connection is finished.
+*/
+static int
+conn_read
+(
+ struct aupd_worker *w,
+ struct aupd_conn   *c
+)
+{
+  char    *line, *nl;
+  size_t   used, room;
+  ssize_t  n;
+  int      hangup = 0;
+
+  for (;;) {
+    /* Past a request's worth, answer what is here first; the rest is
+       read on the next event, so the buffer stays bounded. */
+    if (c->inlen > AUPD_REQUEST)
+      break;
+    if (conn_reserve (&c->in, &c->inmax, c->inlen + 4096) != 0)
+      return -1;
+    room = c->inmax - c->inlen;
+    n = read (c->fd, c->in + c->inlen, room);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && errno == EAGAIN)
+      break;
+    if (n <= 0) {
+      hangup = 1;
+      break;
+    }
+    c->inlen += n;
+    /* A short read has drained the socket. */
+    if ((size_t)n < room)
+      break;
+  }
+
+  /* Answer every complete line. */
+  for (line = c->in; (nl = memchr (line, '\n', c->in + c->inlen - line)) != NULL; line = nl + 1) {
+    *nl = '\0';
+    if (conn_line (c, line, nl - line, w->now) != 0) {
+      conn_flush (w->epfd, c);
+      return -1;
+    }
+  }
+
+  used = line - c->in;
+  memmove (c->in, line, c->inlen - used);
+  c->inlen -= used;
+
+  if (c->inlen > AUPD_REQUEST) {
+    syslog (LOG_WARNING, "warning: request line too long, closing connection");
+    return -1;
+  }
+
+  if (conn_flush (w->epfd, c) != 0 || hangup)
+    return -1;
+
+  return 0;
+}
+
+
+/* Lets root and our own user send admin requests on a UNIX socket. */
+static int
+conn_is_admin
+(
+ int fd
+)
+{
+  struct ucred cred;
+  socklen_t    len = sizeof (cred);
+
+  if (getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+    return 0;
+
+  return cred.uid == 0 || cred.uid == geteuid ();
+}
+
+
+static void
+conn_accept
+(
+ struct aupd_worker *w
+)
+{
+  struct aupd_conn   *c;
+  struct epoll_event  ev;
+  int                 fd;
+
+  for (;;) {
+    if ((fd = accept4 (w->lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno != EAGAIN)
+        syslog (LOG_ERR, "accept: %m");
+      return;
+    }
+
+    if ((c = calloc (1, sizeof (*c))) == NULL) {
+      close (fd);
+      continue;
+    }
+    c->fd = fd;
+    c->admin = w->is_unix && conn_is_admin (fd);
+    if ((c->next = w->conns) != NULL)
+      c->next->prev = c;
+    w->conns = c;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl (w->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      syslog (LOG_ERR, "epoll_ctl: %m");
+      conn_free (w, c);
+    }
+  }
+}
+
+
+
+/* ---- Sockets ---- */
+
+
+/**
+   address_unix
+
+   Returns the path of a unix:path or /path address, or NULL for an
+   inet address.
+*/
+static const char *
+address_unix
+(
+ const char *address
+)
+{
+  if (strncmp (address, "unix:", 5) == 0)
+    return address + 5;
+  if (address[0] == '/')
+    return address;
+  return NULL;
+}
+
+
+static int
+address_sun
+(
+ const char         *path,
+ struct sockaddr_un *sun
+)
+{
+  memset (sun, 0, sizeof (*sun));
+  sun->sun_family = AF_UNIX;
+  if (strlen (path) >= sizeof (sun->sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy (sun->sun_path, path);
+
+  return 0;
+}
+
+
+/**
+   listen_on
+
+   Opens a non-blocking listening socket on address.  Returns it, or
+   -1 with a message printed.
+*/
+static int
+listen_on
+(
+ const char *address
+)
+{
+  struct addrinfo     hints, *res, *ai;
+  struct sockaddr_un  sun;
+  const char         *path, *port;
+  char                host[256];
+  mode_t              mask;
+  int                 fd = -1, on = 1, rc;
+
+  if ((path = address_unix (address)) != NULL) {
+    if (address_sun (path, &sun) != 0
+        || (fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+      perror (path);
+      return -1;
+    }
+    unlink (path);
+    /* Any local user may ask for a decision; admin is checked per peer. */
+    mask = umask (0);
+    rc = bind (fd, (struct sockaddr *)&sun, sizeof (sun));
+    umask (mask);
+    if (rc != 0 || listen (fd, SOMAXCONN) != 0) {
+      perror (path);
+      close (fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  if (strncmp (address, "inet:", 5) == 0)
+    address += 5;
+  if ((port = strrchr (address, ':')) == NULL || (size_t)(port - address) >= sizeof (host)) {
+    fprintf (stderr, "%s: %s: bad address\n", program_name, address);
+    return -1;
+  }
+  memcpy (host, address, port - address);
+  host[port - address] = '\0';
+  port++;
+
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  if ((rc = getaddrinfo (host[0] ? host : NULL, port, &hints, &res)) != 0) {
+    fprintf (stderr, "%s: %s: %s\n", program_name, address, gai_strerror (rc));
+    return -1;
+  }
+
+  for (ai = res; ai != NULL; ai = ai->ai_next) {
+    fd = socket (ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+    if (fd < 0)
+      continue;
+    setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+    if (bind (fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen (fd, SOMAXCONN) == 0)
+      break;
+    close (fd);
+    fd = -1;
+  }
+  if (fd < 0)
+    perror (address);
+  freeaddrinfo (res);
+
+  return fd;
+}
+
+
+/**
+   send_admin
+
+   Sends an admin request for sender to the daemon listening on the
+   UNIX socket address and prints any error.  Returns the exit status.
+*/
+static int
+send_admin
+(
+ const char *address,
+ const char *request,
+ const char *sender
+)
+{
+  struct sockaddr_un  sun;
+  const char         *path;
+  char                buf[1024];
+  FILE               *file;
+  int                 fd;
+
+  if ((path = address_unix (address)) == NULL) {
+    fprintf (stderr, "%s: -c and -w need the daemon's UNIX socket\n", program_name);
+    return EXIT_FAILURE;
+  }
+  if (address_sun (path, &sun) != 0 || (fd = socket (AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    perror (path);
+    return EXIT_FAILURE;
+  }
+  if (connect (fd, (struct sockaddr *)&sun, sizeof (sun)) != 0 || (file = fdopen (fd, "r+")) == NULL) {
+    perror (path);
+    close (fd);
+    return EXIT_FAILURE;
+  }
+
+  fprintf (file, "request=%s\nsender=%s\n\n", request, sender);
+  fflush (file);
+  if (fgets (buf, sizeof (buf), file) == NULL) {
+    fprintf (stderr, "%s: %s: no reply\n", program_name, path);
+    fclose (file);
+    return EXIT_FAILURE;
+  }
+  fclose (file);
+
+  if (strcmp (buf, "action=ok\n") != 0) {
+    buf[strcspn (buf, "\n")] = '\0';
+    fprintf (stderr, "%s: %s\n", program_name, strncmp (buf, "action=", 7) == 0 ? buf + 7 : buf);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+
+/**
+   serve
+
+   Runs a worker's event loop until its stop descriptor is readable.
+   Every worker waits on the shared listening socket; EPOLLEXCLUSIVE
+   wakes just one of them for each new connection.
+*/
+static void *
+serve
+(
+ void *arg
+)
+{
+  static char         stopper;
+  struct aupd_worker *w = arg;
+  struct epoll_event  ev, events[AUPD_EVENTS];
+  struct aupd_conn   *c;
+  int                 i, n, stopping = 0;
+
+  ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+  ev.data.ptr = NULL;
+  if (epoll_ctl (w->epfd, EPOLL_CTL_ADD, w->lfd, &ev) != 0) {
+    syslog (LOG_ERR, "epoll_ctl: %m");
+    return NULL;
+  }
+  ev.events = EPOLLIN;
+  ev.data.ptr = &stopper;
+  if (epoll_ctl (w->epfd, EPOLL_CTL_ADD, w->stopfd, &ev) != 0) {
+    syslog (LOG_ERR, "epoll_ctl: %m");
+    return NULL;
+  }
+
+  while (!stopping) {
+    if ((n = epoll_wait (w->epfd, events, AUPD_EVENTS, -1)) < 0) {
+      if (errno == EINTR)
+        continue;
+      syslog (LOG_ERR, "epoll_wait: %m");
+      break;
+    }
+    w->now = time (NULL);
+
+    for (i = 0; i < n; i++) {
+      if ((c = events[i].data.ptr) == NULL) {
+        conn_accept (w);
+        continue;
+      }
+      if (events[i].data.ptr == &stopper) {
+        stopping = 1;
+        continue;
+      }
+      if ((events[i].events & (EPOLLERR | EPOLLHUP)) && !(events[i].events & EPOLLIN)) {
+        conn_free (w, c);
+        continue;
+      }
+      if (((events[i].events & EPOLLIN) && conn_read (w, c) != 0)
+          || ((events[i].events & EPOLLOUT) && conn_flush (w->epfd, c) != 0))
+        conn_free (w, c);
+    }
+  }
+
+  while (w->conns != NULL)
+    conn_free (w, w->conns);
+
+  return NULL;
+}
+
+
+/**
+   sweep
+
+   Expires idle senders and saves a snapshot every AUPD_SWEEP seconds
+   until SIGTERM or SIGINT, which the caller has blocked.
+*/
+static void
+sweep
+(
+ const char *snapshot
+)
+{
+  struct timespec timeout;
+  sigset_t        set;
+  size_t          dropped;
+  int             sig;
+
+  sigemptyset (&set);
+  sigaddset (&set, SIGTERM);
+  sigaddset (&set, SIGINT);
+
+  for (;;) {
+    timeout.tv_sec = AUPD_SWEEP;
+    timeout.tv_nsec = 0;
+    if ((sig = sigtimedwait (&set, NULL, &timeout)) < 0 && errno == EINTR)
+      continue;
+    if (sig > 0)
+      break;
+
+    dropped = aupd_store_expire (store, time (NULL));
+    if (debug)
+      syslog (LOG_DEBUG, "expired %lu senders, %lu left", (unsigned long)dropped,
+              (unsigned long)aupd_store_count (store));
+    if (snapshot[0] != '\0' && aupd_store_save (store, snapshot) != 0)
+      syslog (LOG_ERR, "%s: %m", snapshot);
+  }
+}
+
+
+/*
+----------------------------------------------------------------------
+
+
+                         Main
+
+
+----------------------------------------------------------------------
+*/
+
+
+int
+main
+(
+ int argc,
+ char *argv[]
+)
+{
+  struct aupd_worker *workers;
+  struct sigaction    sa;
+  sigset_t            set;
+  char               *s;
+  char               *address = AUPD_ADDRESS;
+  char               *snapshot = AUPD_SNAPSHOT;
+  char               *reset = NULL;
+  char               *whitelist = NULL;
+  char                path[PATH_MAX];
+  long                limit = AUPD_LIMIT;
+  long                period = AUPD_PERIOD;
+  int                 window = AUPD_FIXED;
+  int                 nthreads = 1;
+  int                 lfd, stopfd, i, started = 0;
+  uint64_t            one = 1;
+
+  program_name = argv[0];
+
+  while (--argc > 0 && (*++argv)[0] == '-') {
+    for (s = argv[0]+1; *s != '\0'; s++)
+      switch (*s) {
+      case 's':                 /* Listen address */
+        address = *++argv;
+        --argc;
+        break;
+      case 'n':                 /* Recipients per period */
+        limit = atol (*++argv);
+        --argc;
+        break;
+      case 'p':                 /* Period in seconds */
+        period = atol (*++argv);
+        --argc;
+        break;
+      case 'W':                 /* Window */
+        --argc;
+        if (strcmp (*++argv, "fixed") == 0) {
+          window = AUPD_FIXED;
+        } else if (strcmp (*argv, "sliding") == 0) {
+          window = AUPD_SLIDING;
+        } else {
+          usage ();
+          exit (EXIT_FAILURE);
+        }
+        break;
+      case 't':                 /* Worker threads */
+        nthreads = atoi (*++argv);
+        --argc;
+        break;
+      case 'f':                 /* Snapshot file */
+        snapshot = *++argv;
+        --argc;
+        break;
+      case 'c':                 /* Reset a sender */
+        reset = *++argv;
+        --argc;
+        break;
+      case 'w':                 /* Whitelist a sender */
+        whitelist = *++argv;
+        --argc;
+        break;
+      case 'v':                 /* Log attributes */
+        verbose = !verbose;
+        break;
+      case 'd':                 /* Toggle debug mode */
+        debug = !debug;
+        break;
+      case 'h':                 /* Help */
+        usage ();
+        exit (EXIT_SUCCESS);
+      default:
+        fprintf (stderr, "%s: illegal option %c\n", program_name, *s);
+        usage ();
+        exit (EXIT_FAILURE);
+      }
+  }
+
+  if (argc != 0 || address == NULL || snapshot == NULL || (reset && whitelist)
+      || period <= 0 || nthreads < 1) {
+    usage ();
+    exit (EXIT_FAILURE);
+  }
+
+  if (reset != NULL)
+    exit (send_admin (address, "aupd_reset", reset));
+  if (whitelist != NULL)
+    exit (send_admin (address, "aupd_whitelist", whitelist));
+
+  /* The daemon runs in /, so keep the snapshot where it was meant. */
+  if (snapshot[0] != '\0' && snapshot[0] != '/') {
+    if (getcwd (path, sizeof (path)) == NULL
+        || strlen (path) + strlen (snapshot) + 2 > sizeof (path)) {
+      perror (snapshot);
+      exit (EXIT_FAILURE);
+    }
+    strcat (strcat (path, "/"), snapshot);
+    snapshot = path;
+  }
+
+  if ((store = aupd_store_new (limit, period, window)) == NULL) {
+    fprintf (stderr, "%s: out of memory\n", program_name);
+    exit (EXIT_FAILURE);
+  }
+  if (snapshot[0] != '\0' && aupd_store_load (store, snapshot) != 0 && errno != ENOENT) {
+    perror (snapshot);
+    exit (EXIT_FAILURE);
+  }
+
+  if ((lfd = listen_on (address)) < 0)
+    exit (EXIT_FAILURE);
+
+  openlog ("aupdd", LOG_PID | (debug ? LOG_PERROR : 0), LOG_MAIL);
+
+  if (!debug && daemon (0, 0) != 0) {
+    perror (program_name);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Signals are taken by sweep; the workers never see them. */
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = SIG_IGN;
+  sigaction (SIGPIPE, &sa, NULL);
+  sigemptyset (&set);
+  sigaddset (&set, SIGTERM);
+  sigaddset (&set, SIGINT);
+  pthread_sigmask (SIG_BLOCK, &set, NULL);
+
+  if ((stopfd = eventfd (0, EFD_CLOEXEC)) < 0
+      || (workers = calloc (nthreads, sizeof (*workers))) == NULL) {
+    syslog (LOG_ERR, "cannot start: %m");
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < nthreads; i++) {
+    workers[i].lfd = lfd;
+    workers[i].is_unix = address_unix (address) != NULL;
+    workers[i].stopfd = stopfd;
+    if ((workers[i].epfd = epoll_create1 (EPOLL_CLOEXEC)) < 0
+        || pthread_create (&workers[i].thread, NULL, serve, &workers[i]) != 0) {
+      syslog (LOG_ERR, "cannot start worker: %m");
+      break;
+    }
+    started++;
+  }
+
+  if (started > 0) {
+    syslog (LOG_INFO, "listening on %s with %d threads, limit %ld per %ld seconds, %lu senders",
+            address, started, limit, period, (unsigned long)aupd_store_count (store));
+    sweep (snapshot);
+    syslog (LOG_INFO, "stopping");
+  }
+
+  if (write (stopfd, &one, sizeof (one)) != sizeof (one))
+    syslog (LOG_ERR, "cannot stop workers: %m");
+  for (i = 0; i < started; i++) {
+    pthread_join (workers[i].thread, NULL);
+    close (workers[i].epfd);
+  }
+  close (lfd);
+  close (stopfd);
+  free (workers);
+
+  if (snapshot[0] != '\0' && aupd_store_save (store, snapshot) != 0)
+    syslog (LOG_ERR, "%s: %m", snapshot);
+  aupd_store_free (store);
+
+  exit (started == nthreads ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,49 @@
+/**********************************************************************
+ * aupdstore
+ *
+ * Sender counter store for aupdd.  Senders are spread over shards by
+ * hash, each its own open addressing table with its own lock, so
+ * requests for different senders rarely wait for each other.
+ ***********************************************************************/
+
+#ifndef AUPDD_H
+#define AUPDD_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define AUPD_NAME_MAX (512)             /* Longest sender kept. */
+#define AUPD_SHARDS   (64)              /* Independently locked tables. */
+
+enum aupd_window {
+  AUPD_FIXED,                           /* A period starts with the first message. */
+  AUPD_SLIDING                          /* The last period, estimated. */
+};
+
+enum aupd_action {
+  AUPD_PASS,
+  AUPD_REJECT,
+  AUPD_WHITE                            /* Whitelisted; not counted. */
+};
+
+struct aupd_verdict {
+  int  action;
+  int  reset;                           /* A new period was started. */
+  long before;                          /* Count before the new period. */
+  long count;                           /* Count after this request. */
+};
+
+struct aupd_store;
+
+struct aupd_store *aupd_store_new (long, long, int);
+void               aupd_store_free (struct aupd_store *);
+int                aupd_store_charge (struct aupd_store *, const char *, long, time_t,
+                                      struct aupd_verdict *);
+int                aupd_store_reset (struct aupd_store *, const char *);
+int                aupd_store_whitelist (struct aupd_store *, const char *);
+size_t             aupd_store_expire (struct aupd_store *, time_t);
+size_t             aupd_store_count (struct aupd_store *);
+int                aupd_store_save (struct aupd_store *, const char *);
+int                aupd_store_load (struct aupd_store *, const char *);
+
+#endif /* AUPDD_H */
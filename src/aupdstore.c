@@ -0,0 +1,651 @@
+/**********************************************************************
+ * aupdstore
+ *
+ * Sender counter store for aupdd.
+ *
+ * Senders are spread over AUPD_SHARDS tables by hash.  Each table is
+ * an open addressing table with linear probing, kept under half full,
+ * and has its own lock, held only for the few loads and stores of one
+ * decision.
+ *
+ * A fixed window is aupd's: a period starts with a sender's first
+ * message after the last one ended.  A sliding window keeps the count
+ * for the current and the previous period and weights the previous
+ * one by how much of it still falls in the last period length.
+ *
+ * Snapshots are a single file, written in native byte order through a
+ * temporary file and read back by mapping it:
+ *
+ *   struct aupd_snap_header            magic, window, count
+ *   struct aupd_snap_record, name      one per sender, padded to 8
+ ***********************************************************************/
+
+#include <string.h>
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "aupdd.h"
+
+#define AUPD_SNAP_MAGIC "AUS1"
+
+struct aupd_entry {
+  uint64_t  hash;                       /* 0 for an empty slot. */
+  char     *name;                       /* Lowercased address. */
+  long      count;                      /* Recipients this period. */
+  long      prev;                       /* Recipients last period, if sliding. */
+  time_t    start;                      /* Start of this period, 0 for none. */
+  int       white;
+};
+
+struct aupd_shard {
+  pthread_mutex_t    lock;
+  struct aupd_entry *slots;
+  size_t             mask;
+  size_t             count;
+} __attribute__ ((aligned (64)));
+
+struct aupd_store {
+  struct aupd_shard shards[AUPD_SHARDS];
+  long              limit;
+  long              period;
+  int               window;
+};
+
+struct aupd_snap_header {
+  char     magic[4];
+  uint32_t window;
+  uint64_t count;
+};
+
+struct aupd_snap_record {
+  uint64_t hash;
+  int64_t  count;
+  int64_t  prev;
+  int64_t  start;
+  uint32_t white;
+  uint32_t namelen;
+};
+
+
+/* FNV-1a over the lowercased address; never 0. */
+static uint64_t
+aupd_hash
+(
+ const char *name
+)
+{
+  uint64_t h = 14695981039346656037ULL;
+
+  for (; *name != '\0'; name++)
+    h = (h ^ (unsigned char)*name) * 1099511628211ULL;
+
+  return h ? h : 1;
+}
+
+
+/* Copies at most AUPD_NAME_MAX bytes of name, lowercased. */
+static void
+aupd_lowercase
+(
+ char       *dst,
+ const char *src
+)
+{
+  char *end = dst + AUPD_NAME_MAX;
+
+  for (; *src != '\0' && dst < end; src++)
+    *dst++ = (*src >= 'A' && *src <= 'Z') ? *src - 'A' + 'a' : *src;
+  *dst = '\0';
+}
+
+
+static struct aupd_shard *
+aupd_shard
+(
+ struct aupd_store *st,
+ uint64_t           hash
+)
+{
+  return &st->shards[(hash >> 32) % AUPD_SHARDS];
+}
+
+
+
+/* ---- Tables ---- */
+
+
+static int
+aupd_grow
+(
+ struct aupd_shard *sh
+)
+{
+  struct aupd_entry *slots, *e;
+  size_t             size = sh->slots ? 2 * (sh->mask + 1) : 64, i, j;
+
+  if ((slots = calloc (size, sizeof (*slots))) == NULL)
+    return -1;
+
+  for (i = 0; sh->slots != NULL && i <= sh->mask; i++) {
+    e = &sh->slots[i];
+    if (e->hash == 0)
+      continue;
+    for (j = e->hash & (size - 1); slots[j].hash != 0; j = (j + 1) & (size - 1))
+      ;
+    slots[j] = *e;
+  }
+
+  free (sh->slots);
+  sh->slots = slots;
+  sh->mask = size - 1;
+
+  return 0;
+}
+
+
+/**
+   aupd_get
+
+   Finds a sender in a locked shard, adding it if it is not there.
+   Returns NULL if out of memory.
+*/
+static struct aupd_entry *
+aupd_get
+(
+ struct aupd_shard *sh,
+ uint64_t           hash,
+ const char        *name
+)
+{
+  struct aupd_entry *e;
+  size_t             i;
+
+  if (2 * (sh->count + 1) > sh->mask + 1 && aupd_grow (sh) != 0)
+    return NULL;
+
+  for (i = hash & sh->mask; sh->slots[i].hash != 0; i = (i + 1) & sh->mask) {
+    e = &sh->slots[i];
+    if (e->hash == hash && strcmp (e->name, name) == 0)
+      return e;
+  }
+
+  e = &sh->slots[i];
+  if ((e->name = strdup (name)) == NULL)
+    return NULL;
+  e->hash = hash;
+  e->count = e->prev = 0;
+  e->start = 0;
+  e->white = 0;
+  sh->count++;
+
+  return e;
+}
+
+
+/* Empties slot i, moving later entries of its run back into the hole. */
+static void
+aupd_remove
+(
+ struct aupd_shard *sh,
+ size_t             i
+)
+{
+  size_t j = i, k;
+
+  free (sh->slots[i].name);
+
+  for (;;) {
+    j = (j + 1) & sh->mask;
+    if (sh->slots[j].hash == 0)
+      break;
+    k = sh->slots[j].hash & sh->mask;
+    /* Move j back unless its home lies cyclically in (i, j]. */
+    if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+      sh->slots[i] = sh->slots[j];
+      i = j;
+    }
+  }
+
+  sh->slots[i].hash = 0;
+  sh->slots[i].name = NULL;
+  sh->count--;
+}
+
+
+
+/* ---- Store ---- */
+
+
+struct aupd_store *
+aupd_store_new
+(
+ long limit,
+ long period,
+ int  window
+)
+{
+  struct aupd_store *st;
+  int                i;
+
+  if ((st = calloc (1, sizeof (*st))) == NULL)
+    return NULL;
+  st->limit = limit;
+  st->period = period;
+  st->window = window;
+  for (i = 0; i < AUPD_SHARDS; i++)
+    pthread_mutex_init (&st->shards[i].lock, NULL);
+
+  return st;
+}
+
+
+void
+aupd_store_free
+(
+ struct aupd_store *st
+)
+{
+  struct aupd_shard *sh;
+  size_t             j;
+  int                i;
+
+  if (st == NULL)
+    return;
+
+  for (i = 0; i < AUPD_SHARDS; i++) {
+    sh = &st->shards[i];
+    for (j = 0; sh->slots != NULL && j <= sh->mask; j++)
+      free (sh->slots[j].name);
+    free (sh->slots);
+    pthread_mutex_destroy (&sh->lock);
+  }
+  free (st);
+}
+
+
+/**
+   aupd_store_charge
+
+   Counts rcpts recipients against sender at time now and fills in the
+   verdict.  Returns 0, or -1 if out of memory.
+*/
+int
+aupd_store_charge
+(
+ struct aupd_store   *st,
+ const char          *sender,
+ long                 rcpts,
+ time_t               now,
+ struct aupd_verdict *v
+)
+{
+  struct aupd_shard *sh;
+  struct aupd_entry *e;
+  char               name[AUPD_NAME_MAX + 1];
+  uint64_t           hash;
+  long               used, n;
+
+  aupd_lowercase (name, sender);
+  hash = aupd_hash (name);
+  sh = aupd_shard (st, hash);
+
+  memset (v, 0, sizeof (*v));
+
+  pthread_mutex_lock (&sh->lock);
+  if ((e = aupd_get (sh, hash, name)) == NULL) {
+    pthread_mutex_unlock (&sh->lock);
+    return -1;
+  }
+
+  if (e->white) {
+    pthread_mutex_unlock (&sh->lock);
+    v->action = AUPD_WHITE;
+    return 0;
+  }
+
+  if (st->window == AUPD_FIXED) {
+    if (now > e->start + st->period) {
+      v->reset = 1;
+      v->before = e->count;
+      e->start = now;
+      e->count = rcpts;
+    }
+    else if (e->count + rcpts <= st->limit)
+      e->count += rcpts;
+    else
+      v->action = AUPD_REJECT;
+    v->count = e->count;
+  }
+  else {
+    /* Move on to the period holding now. */
+    if (e->start == 0 || now >= e->start + st->period) {
+      v->reset = 1;
+      v->before = e->count;
+      n = e->start ? (now - e->start) / st->period : 0;
+      e->prev = n == 1 ? e->count : 0;
+      e->start = n ? e->start + n * st->period : now;
+      e->count = 0;
+    }
+    used = e->count + (long)((long long)e->prev * (e->start + st->period - now) / st->period);
+    if (used + rcpts <= st->limit) {
+      e->count += rcpts;
+      used += rcpts;
+    }
+    else
+      v->action = AUPD_REJECT;
+    v->count = used;
+  }
+  pthread_mutex_unlock (&sh->lock);
+
+  return 0;
+}
+
+
+static int
+aupd_store_set
+(
+ struct aupd_store *st,
+ const char        *sender,
+ int                white
+)
+{
+  struct aupd_shard *sh;
+  struct aupd_entry *e;
+  char               name[AUPD_NAME_MAX + 1];
+  uint64_t           hash;
+
+  aupd_lowercase (name, sender);
+  hash = aupd_hash (name);
+  sh = aupd_shard (st, hash);
+
+  pthread_mutex_lock (&sh->lock);
+  if ((e = aupd_get (sh, hash, name)) != NULL) {
+    if (!white)
+      e->count = e->prev = e->start = 0;
+    e->white = white;
+  }
+  pthread_mutex_unlock (&sh->lock);
+
+  return e != NULL ? 0 : -1;
+}
+
+
+/**
+   aupd_store_reset
+
+   Clears a sender's counts and whitelisting, as aupd -c does.
+   Returns 0, or -1 if out of memory.
+*/
+int
+aupd_store_reset
+(
+ struct aupd_store *st,
+ const char        *sender
+)
+{
+  return aupd_store_set (st, sender, 0);
+}
+
+
+int
+aupd_store_whitelist
+(
+ struct aupd_store *st,
+ const char        *sender
+)
+{
+  return aupd_store_set (st, sender, 1);
+}
+
+
+/**
+   aupd_store_expire
+
+   Drops senders that are not whitelisted and whose periods are all
+   over, one shard at a time.  Returns the number dropped.
+*/
+size_t
+aupd_store_expire
+(
+ struct aupd_store *st,
+ time_t             now
+)
+{
+  struct aupd_shard *sh;
+  struct aupd_entry *e;
+  time_t             idle = st->window == AUPD_FIXED ? st->period : 2 * st->period;
+  size_t             j, dropped = 0;
+  int                i;
+
+  for (i = 0; i < AUPD_SHARDS; i++) {
+    sh = &st->shards[i];
+    pthread_mutex_lock (&sh->lock);
+    for (j = 0; sh->slots != NULL && j <= sh->mask; ) {
+      e = &sh->slots[j];
+      if (e->hash != 0 && !e->white && now > e->start + idle) {
+        /* Check j again: a later entry may have moved into it. */
+        aupd_remove (sh, j);
+        dropped++;
+      }
+      else
+        j++;
+    }
+    pthread_mutex_unlock (&sh->lock);
+  }
+
+  return dropped;
+}
+
+
+size_t
+aupd_store_count
+(
+ struct aupd_store *st
+)
+{
+  size_t n = 0;
+  int    i;
+
+  for (i = 0; i < AUPD_SHARDS; i++) {
+    pthread_mutex_lock (&st->shards[i].lock);
+    n += st->shards[i].count;
+    pthread_mutex_unlock (&st->shards[i].lock);
+  }
+
+  return n;
+}
+
+
+
+/* ---- Snapshots ---- */
+
+
+/**
+   aupd_store_save
+
+   Writes every sender to path, through a temporary file renamed into
+   place.  Each shard is copied out under its lock and written after.
+   Returns 0, or -1 with errno set.
+*/
+int
+aupd_store_save
+(
+ struct aupd_store *st,
+ const char        *path
+)
+{
+  struct aupd_snap_header  header;
+  struct aupd_snap_record  r;
+  struct aupd_shard       *sh;
+  struct aupd_entry       *e;
+  char                     tmp[PATH_MAX], *buf = NULL, *p;
+  size_t                   len = 0, max = 0, need, j;
+  FILE                    *file;
+  int                      i, err;
+
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, AUPD_SNAP_MAGIC, 4);
+  header.window = st->window;
+  memset (&r, 0, sizeof (r));
+
+  for (i = 0; i < AUPD_SHARDS; i++) {
+    sh = &st->shards[i];
+    pthread_mutex_lock (&sh->lock);
+    for (j = 0; sh->slots != NULL && j <= sh->mask; j++) {
+      e = &sh->slots[j];
+      if (e->hash == 0)
+        continue;
+      r.hash = e->hash;
+      r.count = e->count;
+      r.prev = e->prev;
+      r.start = e->start;
+      r.white = e->white;
+      r.namelen = strlen (e->name);
+      need = sizeof (r) + ((r.namelen + 8) & ~(size_t)7);
+      if (len + need > max) {
+        max = max ? 2 * max : 64 * 1024;
+        while (max < len + need)
+          max *= 2;
+        if ((p = realloc (buf, max)) == NULL) {
+          pthread_mutex_unlock (&sh->lock);
+          free (buf);
+          errno = ENOMEM;
+          return -1;
+        }
+        buf = p;
+      }
+      memset (buf + len, 0, need);
+      memcpy (buf + len, &r, sizeof (r));
+      memcpy (buf + len + sizeof (r), e->name, r.namelen);
+      len += need;
+      header.count++;
+    }
+    pthread_mutex_unlock (&sh->lock);
+  }
+
+  snprintf (tmp, sizeof (tmp), "%s.tmp", path);
+  if ((file = fopen (tmp, "w")) == NULL) {
+    free (buf);
+    return -1;
+  }
+
+  if (fwrite (&header, sizeof (header), 1, file) != 1
+      || (len > 0 && fwrite (buf, len, 1, file) != 1)
+      || fflush (file) != 0 || fsync (fileno (file)) != 0) {
+    err = errno;
+    fclose (file);
+    unlink (tmp);
+    free (buf);
+    errno = err;
+    return -1;
+  }
+  fclose (file);
+  free (buf);
+
+  if (rename (tmp, path) != 0) {
+    err = errno;
+    unlink (tmp);
+    errno = err;
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/**
+   aupd_store_load
+
+   Maps a snapshot written by aupd_store_save and adds its senders.
+   Returns 0, or -1 with errno set (EINVAL if it is not a snapshot).
+*/
+int
+aupd_store_load
+(
+ struct aupd_store *st,
+ const char        *path
+)
+{
+  const struct aupd_snap_header *h;
+  struct aupd_snap_record        r;
+  struct aupd_shard             *sh;
+  struct aupd_entry             *e;
+  struct stat                    sb;
+  char                           name[AUPD_NAME_MAX + 1];
+  const char                    *map, *p, *end;
+  uint64_t                       n, hash;
+  size_t                         pad;
+  int                            fd, status = 0;
+
+  if ((fd = open (path, O_RDONLY)) < 0)
+    return -1;
+  if (fstat (fd, &sb) != 0) {
+    close (fd);
+    return -1;
+  }
+  if (sb.st_size < (off_t)sizeof (*h)) {
+    close (fd);
+    errno = EINVAL;
+    return -1;
+  }
+  map = mmap (NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  h = (const struct aupd_snap_header *)map;
+  end = map + sb.st_size;
+  if (memcmp (h->magic, AUPD_SNAP_MAGIC, 4) != 0) {
+    munmap ((void *)map, sb.st_size);
+    errno = EINVAL;
+    return -1;
+  }
+
+  for (n = 0, p = map + sizeof (*h); n < h->count; n++) {
+    if ((size_t)(end - p) < sizeof (r)) {
+      status = -1;
+      errno = EINVAL;
+      break;
+    }
+    memcpy (&r, p, sizeof (r));
+    p += sizeof (r);
+    pad = (r.namelen + 8) & ~(size_t)7;
+    if (r.namelen > AUPD_NAME_MAX || (size_t)(end - p) < pad) {
+      status = -1;
+      errno = EINVAL;
+      break;
+    }
+    memcpy (name, p, r.namelen);
+    name[r.namelen] = '\0';
+    p += pad;
+
+    hash = aupd_hash (name);
+    sh = aupd_shard (st, hash);
+    pthread_mutex_lock (&sh->lock);
+    if ((e = aupd_get (sh, hash, name)) != NULL) {
+      e->count = r.count;
+      e->prev = r.prev;
+      e->start = r.start;
+      e->white = r.white;
+    }
+    pthread_mutex_unlock (&sh->lock);
+    if (e == NULL) {
+      status = -1;
+      errno = ENOMEM;
+      break;
+    }
+  }
+
+  munmap ((void *)map, sb.st_size);
+
+  return status;
+}
@@ -0,0 +1,713 @@
+/**********************************************************************
+ * csv2ics (C) M. Brent Harp 2011-2012
+ *
+ * Convert tab separated event lists to an iCalendar file.
+ *
+ * Each line holds a date, a summary and a description, and becomes
+ * one all day event.  The input is read and the calendar written a
+ * block at a time; UIDs and dates are worked out in process, and
+ * every value is escaped and every line folded as RFC 5545 asks.
+ ***********************************************************************/
+
+#include <string.h>
+
+#include <config.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ICS_BLOCK     (1 << 20)         /* Bytes read or written at a time. */
+#define ICS_FOLD      (75)              /* Octets on a line before folding. */
+#define ICS_ALARM     (2880)            /* Minutes before, by default. */
+#define ICS_DATE_MAX  (64)
+#define ICS_ALT_DESC  "X-ALT-DESC;FMTTYPE=text/html:<html><body>"
+
+enum ics_field {
+  ICS_DATE,
+  ICS_SUMMARY,
+  ICS_DESCRIPTION,
+  ICS_FIELDS
+};
+
+/* Input, a block at a time. */
+struct ics_in {
+  int     fd;
+  char   *buf;
+  size_t  size;
+  size_t  pos;                          /* Start of the next line. */
+  size_t  end;                          /* End of what has been read. */
+  int     eof;
+};
+
+/* Output, a block at a time. */
+struct ics_out {
+  char   *buf;
+  size_t  len;
+  int     col;                          /* Octets on the line so far. */
+};
+
+char *program_name;
+
+static int                columns[ICS_FIELDS] = { 1, 2, 3 };
+static int                alarm_minutes = ICS_ALARM;
+static const char        *prodid;
+static char               dtstamp[32];
+static unsigned long long uid_state;
+static struct ics_out     out;
+
+static const char *month_names[] = {
+  "jan", "feb", "mar", "apr", "may", "jun",
+  "jul", "aug", "sep", "oct", "nov", "dec"
+};
+
+static const char *day_names[] = {
+  "sun", "mon", "tue", "wed", "thu", "fri", "sat"
+};
+
+
+
+/*
+----------------------------------------------------------------------
+
+
+                         Local Functions
+
+
+----------------------------------------------------------------------
+*/
+
+
+void
+usage
+(
+ void
+)
+{
+  fprintf(stderr,
+	  "Usage: %s [options] [file...]\n"
+	  "\n"
+	  "\tConverts lines of tab separated date, summary and\n"
+	  "\tdescription, from the files or standard input, to an\n"
+	  "\tiCalendar file of all day events on standard output.\n"
+	  "\n"
+	  "Options:\n"
+	  "  -f d,s,e     Columns of the date, summary and description\n"
+	  "               (default 1,2,3); 0 leaves a field out.  The last\n"
+	  "               column takes the rest of the line\n"
+	  "\n"
+	  "  -a minutes   Alarm this long before each event (default %d)\n"
+	  "\n"
+	  "  -A           No alarms\n"
+	  "\n"
+	  "  -p prodid    Product identifier (default the program name)\n"
+	  "\n"
+	  "  -h           Display this help message\n"
+	  "\n"
+	  ,program_name, ICS_ALARM);
+}
+
+
+void
+ics_nomem
+(
+ void
+)
+{
+  fprintf (stderr, "%s: out of memory\n", program_name);
+  exit (EXIT_FAILURE);
+}
+
+
+/* ---- Output ---- */
+
+
+void
+ics_flush
+(
+ void
+)
+{
+  size_t  off;
+  ssize_t n;
+
+  for (off = 0; off < out.len; off += n) {
+    if ((n = write (STDOUT_FILENO, out.buf + off, out.len - off)) < 0) {
+      if (errno == EINTR) {
+        n = 0;
+        continue;
+      }
+      perror (program_name);
+      exit (EXIT_FAILURE);
+    }
+  }
+  out.len = 0;
+}
+
+
+static void
+ics_write
+(
+ const char *s,
+ size_t      n
+)
+{
+  if (ICS_BLOCK - out.len < n)
+    ics_flush ();
+  memcpy (out.buf + out.len, s, n);
+  out.len += n;
+}
+
+
+/* Writes one character, UTF-8 or escaped, folding first if need be. */
+static void
+ics_char
+(
+ const char *s,
+ size_t      n
+)
+{
+  if (out.col + n > ICS_FOLD) {
+    ics_write ("\r\n ", 3);
+    out.col = 1;
+  }
+  ics_write (s, n);
+  out.col += n;
+}
+
+
+/**
+   ics_text
+
+   Writes a value, escaped as RFC 5545 TEXT if escape is set, folding
+   between whole UTF-8 characters.
+*/
+static void
+ics_text
+(
+ const char *s,
+ size_t      len,
+ int         escape
+)
+{
+  const char *end = s + len;
+  char        esc[2];
+  size_t      n;
+
+  while (s < end) {
+    /* Most values fit the line and need no escape; copy them whole. */
+    for (n = 0; s + n < end && n < (size_t)(ICS_FOLD - out.col); n++)
+      if (escape && (s[n] == '\\' || s[n] == ';' || s[n] == ','))
+        break;
+    if (n > 0 && (s + n == end || (s[n] & 0xc0) != 0x80)) {
+      ics_write (s, n);
+      out.col += n;
+      s += n;
+      continue;
+    }
+    if (escape && (*s == '\\' || *s == ';' || *s == ',')) {
+      esc[0] = '\\';
+      esc[1] = *s++;
+      ics_char (esc, 2);
+      continue;
+    }
+    for (n = 1; s + n < end && (s[n] & 0xc0) == 0x80; n++)
+      ;
+    ics_char (s, n);
+    s += n;
+  }
+}
+
+
+/* Writes a content line: name, then the value as ics_text does. */
+static void
+ics_line
+(
+ const char *name,
+ const char *value,
+ size_t      len,
+ int         escape
+)
+{
+  out.col = 0;
+  ics_text (name, strlen (name), 0);
+  ics_char (":", 1);
+  ics_text (value, len, escape);
+  ics_write ("\r\n", 2);
+}
+
+
+/* Writes a fixed content line, short enough not to fold. */
+static void
+ics_const
+(
+ const char *line
+)
+{
+  ics_write (line, strlen (line));
+  ics_write ("\r\n", 2);
+}
+
+
+/* ---- Input ---- */
+
+
+/**
+   ics_read_line
+
+   Points line at the next line, without its line ending, valid until
+   the next call.  Returns its length, -1 at the end of the input, or
+   exits on error.
+*/
+ssize_t
+ics_read_line
+(
+ struct ics_in  *in,
+ const char    **line
+)
+{
+  char    *nl, *buf;
+  size_t   len, seen = 0;
+  ssize_t  n;
+
+  for (;;) {
+    if ((nl = memchr (in->buf + in->pos + seen, '\n', in->end - in->pos - seen)) != NULL
+        || (in->eof && in->end > in->pos)) {
+      len = (nl != NULL ? nl : in->buf + in->end) - (in->buf + in->pos);
+      *line = in->buf + in->pos;
+      in->pos += len + (nl != NULL);
+      if (len > 0 && (*line)[len - 1] == '\r')
+        len--;
+      return len;
+    }
+    if (in->eof)
+      return -1;
+    seen = in->end - in->pos;
+
+    /* Keep the partial line and read more after it. */
+    if (in->pos > 0) {
+      memmove (in->buf, in->buf + in->pos, in->end - in->pos);
+      in->end -= in->pos;
+      in->pos = 0;
+    }
+    if (in->end == in->size) {
+      if ((buf = realloc (in->buf, 2 * in->size)) == NULL)
+        ics_nomem ();
+      in->buf = buf;
+      in->size *= 2;
+    }
+
+    do
+      n = read (in->fd, in->buf + in->end, in->size - in->end);
+    while (n < 0 && errno == EINTR);
+    if (n < 0) {
+      perror (program_name);
+      exit (EXIT_FAILURE);
+    }
+    if (n == 0)
+      in->eof = 1;
+    in->end += n;
+  }
+}
+
+
+/* ---- Dates and UIDs ---- */
+
+
+static int
+ics_days_in_month
+(
+ int y,
+ int m
+)
+{
+  static const int days[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+  if (m == 2 && ((y % 4 == 0 && y % 100 != 0) || y % 400 == 0))
+    return 29;
+  return days[m - 1];
+}
+
+
+/* Which of names a word starts, as a number from 1, or 0. */
+static int
+ics_name
+(
+ const char  *word,
+ const char **names,
+ int          count
+)
+{
+  int i;
+
+  if (strlen (word) < 3)
+    return 0;
+  for (i = 0; i < count; i++)
+    if (strncmp (word, names[i], 3) == 0)
+      return i + 1;
+
+  return 0;
+}
+
+
+/**
+   ics_parse_date
+
+   Reads a date as date -d would for the forms calendars are kept in:
+   2012-09-10, 20120910, 2012/09/10, 09/10/2012, September 10, 2012
+   and 10 Sep 2012, with or without a weekday before or a time after.
+   Returns 0, or -1 if the date is not one of these or does not exist.
+*/
+int
+ics_parse_date
+(
+ const char *s,
+ size_t      len,
+ int        *year,
+ int        *month,
+ int        *day
+)
+{
+  char  buf[ICS_DATE_MAX], *w, *save;
+  long  num[3];
+  int   digits[3], count = 0, m = 0, slash = 0, y, d;
+
+  if (len >= sizeof (buf))
+    return -1;
+  memcpy (buf, s, len);
+  buf[len] = '\0';
+  slash = strchr (buf, '/') != NULL;
+  for (w = buf; *w != '\0'; w++)
+    *w = tolower ((unsigned char)*w);
+
+  for (w = strtok_r (buf, " \t,-/.", &save); w != NULL; w = strtok_r (NULL, " \t,-/.", &save)) {
+    if (isdigit ((unsigned char)*w)) {
+      if (strchr (w, ':') != NULL)
+        continue;                       /* A time; the events last all day. */
+      if (count == 3 || strspn (w, "0123456789") != strlen (w))
+        return -1;
+      digits[count] = strlen (w);
+      num[count++] = strtol (w, NULL, 10);
+    } else if (m == 0 && (m = ics_name (w, month_names, 12)) != 0)
+      ;
+    else if (ics_name (w, day_names, 7) == 0)
+      return -1;
+  }
+
+  if (m != 0) {                         /* September 10, 2012 or 10 Sep 2012 */
+    if (count != 2)
+      return -1;
+    if (digits[0] == 4) {
+      y = num[0];
+      d = num[1];
+    } else {
+      d = num[0];
+      y = num[1];
+    }
+  } else if (count == 1 && digits[0] == 8) {
+    y = num[0] / 10000;
+    m = num[0] / 100 % 100;
+    d = num[0] % 100;
+  } else if (count == 3 && digits[0] == 4) {
+    y = num[0];
+    m = num[1];
+    d = num[2];
+  } else if (count == 3 && digits[2] == 4 && slash) {
+    m = num[0];
+    d = num[1];
+    y = num[2];
+  } else
+    return -1;
+
+  if (y < 1000 || y > 9999 || m < 1 || m > 12 || d < 1 || d > ics_days_in_month (y, m))
+    return -1;
+  *year = y;
+  *month = m;
+  *day = d;
+
+  return 0;
+}
+
+
+/* Seeds the UID generator once, from the kernel if it can. */
+void
+ics_uid_seed
+(
+ void
+)
+{
+  int fd;
+
+  if ((fd = open ("/dev/urandom", O_RDONLY)) >= 0) {
+    if (read (fd, &uid_state, sizeof (uid_state)) != sizeof (uid_state))
+      uid_state = 0;
+    close (fd);
+  }
+  uid_state ^= (unsigned long long)time (NULL) << 20 ^ getpid ();
+}
+
+
+static unsigned long long
+ics_random
+(
+ void
+)
+{
+  unsigned long long z = (uid_state += 0x9e3779b97f4a7c15ULL);   /* splitmix64 */
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+
+/* Formats a random (version 4) UUID, as uuidgen prints one. */
+void
+ics_uid
+(
+ char *buf
+)
+{
+  unsigned long long hi = ics_random (), lo = ics_random ();
+
+  hi = (hi & ~0xf000ULL) | 0x4000ULL;
+  lo = (lo & ~(3ULL << 62)) | (2ULL << 62);
+  sprintf (buf, "%08llx-%04llx-%04llx-%04llx-%012llx",
+           hi >> 32, (hi >> 16) & 0xffff, hi & 0xffff,
+           lo >> 48, lo & 0xffffffffffffULL);
+}
+
+
+/* ---- Events ---- */
+
+
+/**
+   ics_event
+
+   Writes the event for one input line.  Returns 0, or -1 if its date
+   cannot be read.
+*/
+int
+ics_event
+(
+ const char *line,
+ size_t      len
+)
+{
+  const char *field[ICS_FIELDS], *p, *tab, *end = line + len;
+  size_t      flen[ICS_FIELDS];
+  char        buf[64];
+  int         i, col, last = 0, y, m, d;
+
+  for (i = 0; i < ICS_FIELDS; i++)
+    if (columns[i] > last)
+      last = columns[i];
+  for (i = 0; i < ICS_FIELDS; i++) {
+    field[i] = "";
+    flen[i] = 0;
+  }
+  for (p = line, col = 1; col <= last && p <= end; col++, p = tab + 1) {
+    if (col == last || (tab = memchr (p, '\t', end - p)) == NULL)
+      tab = end;
+    for (i = 0; i < ICS_FIELDS; i++)
+      if (columns[i] == col) {
+        field[i] = p;
+        flen[i] = tab - p;
+      }
+  }
+
+  if (ics_parse_date (field[ICS_DATE], flen[ICS_DATE], &y, &m, &d) != 0)
+    return -1;
+
+  ics_const ("BEGIN:VEVENT");
+  ics_uid (buf);
+  ics_line ("UID", buf, strlen (buf), 0);
+  ics_line ("DTSTAMP", dtstamp, strlen (dtstamp), 0);
+  if (columns[ICS_SUMMARY] > 0)
+    ics_line ("SUMMARY", field[ICS_SUMMARY], flen[ICS_SUMMARY], 1);
+  if (columns[ICS_DESCRIPTION] > 0) {
+    ics_line ("DESCRIPTION", field[ICS_DESCRIPTION], flen[ICS_DESCRIPTION], 1);
+    out.col = 0;
+    ics_text (ICS_ALT_DESC, strlen (ICS_ALT_DESC), 0);
+    ics_text (field[ICS_DESCRIPTION], flen[ICS_DESCRIPTION], 1);
+    ics_text ("</body></html>", 14, 0);
+    ics_write ("\r\n", 2);
+  }
+
+  sprintf (buf, "%04d%02d%02d", y, m, d);
+  ics_line ("DTSTART;VALUE=DATE", buf, 8, 0);
+  if (++d > ics_days_in_month (y, m)) {
+    d = 1;
+    if (++m > 12) {
+      m = 1;
+      y++;
+    }
+  }
+  sprintf (buf, "%04d%02d%02d", y, m, d);
+  ics_line ("DTEND;VALUE=DATE", buf, 8, 0);
+
+  ics_const ("STATUS:CONFIRMED");
+  ics_const ("CLASS:PUBLIC");
+  ics_const ("X-MICROSOFT-CDO-ALLDAYEVENT:TRUE");
+  ics_const ("X-MICROSOFT-CDO-INTENDEDSTATUS:FREE");
+  ics_const ("TRANSP:TRANSPARENT");
+  ics_const ("X-MICROSOFT-DISALLOW-COUNTER:TRUE");
+  if (alarm_minutes >= 0) {
+    ics_const ("BEGIN:VALARM");
+    ics_const ("ACTION:DISPLAY");
+    sprintf (buf, "-PT%dM", alarm_minutes);
+    ics_line ("TRIGGER;RELATED=START", buf, strlen (buf), 0);
+    ics_const ("DESCRIPTION:Reminder");
+    ics_const ("END:VALARM");
+  }
+  ics_const ("END:VEVENT");
+
+  return 0;
+}
+
+
+/* Converts every line of a file.  Returns the number not converted. */
+long
+ics_convert
+(
+ int         fd,
+ const char *file
+)
+{
+  struct ics_in  in;
+  const char    *line;
+  ssize_t        len;
+  long           n = 0, bad = 0;
+
+  memset (&in, 0, sizeof (in));
+  in.fd = fd;
+  in.size = ICS_BLOCK;
+  if ((in.buf = malloc (in.size)) == NULL)
+    ics_nomem ();
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  while ((len = ics_read_line (&in, &line)) >= 0) {
+    n++;
+    if (len == 0)
+      continue;
+    if (ics_event (line, len) != 0) {
+      fprintf (stderr, "%s: %s:%ld: bad date\n", program_name, file, n);
+      bad++;
+    }
+  }
+
+  free (in.buf);
+
+  return bad;
+}
+
+
+
+/*
+----------------------------------------------------------------------
+
+
+                               Main
+
+
+----------------------------------------------------------------------
+*/
+
+
+int
+main
+(
+ int   argc,
+ char *argv[]
+)
+{
+  struct tm  tm;
+  time_t     now;
+  char      *s, *end;
+  long       bad = 0;
+  int        i, fd;
+
+  program_name = argv[0];
+  prodid = (s = strrchr (program_name, '/')) != NULL ? s + 1 : program_name;
+
+  while (--argc > 0 && (*++argv)[0] == '-' && (*argv)[1] != '\0') {
+    for (s = argv[0]+1; *s != '\0'; s++) {
+      if (strchr ("fap", *s) != NULL && argc < 2) {
+        usage ();
+        exit (EXIT_FAILURE);
+      }
+      switch (*s) {
+      case 'f':                 /* Field columns */
+        end = *++argv;
+        --argc;
+        for (i = 0; i < ICS_FIELDS; i++) {
+          columns[i] = strtol (end, &end, 10);
+          if (*end != (i < ICS_FIELDS - 1 ? ',' : '\0') || columns[i] < 0) {
+            usage ();
+            exit (EXIT_FAILURE);
+          }
+          end++;
+        }
+        if (columns[ICS_DATE] == 0) {
+          usage ();
+          exit (EXIT_FAILURE);
+        }
+        break;
+      case 'a':                 /* Alarm */
+        alarm_minutes = atoi (*++argv);
+        --argc;
+        break;
+      case 'A':                 /* No alarms */
+        alarm_minutes = -1;
+        break;
+      case 'p':                 /* Product identifier */
+        prodid = *++argv;
+        --argc;
+        break;
+      case 'h':
+        usage ();
+        exit (EXIT_SUCCESS);
+      default:
+        fprintf (stderr, "%s: illegal option -%c\n", program_name, *s);
+        usage ();
+        exit (EXIT_FAILURE);
+      }
+    }
+  }
+
+  if ((out.buf = malloc (ICS_BLOCK)) == NULL)
+    ics_nomem ();
+  ics_uid_seed ();
+  now = time (NULL);
+  gmtime_r (&now, &tm);
+  strftime (dtstamp, sizeof (dtstamp), "%Y%m%dT%H%M%SZ", &tm);
+
+  ics_const ("BEGIN:VCALENDAR");
+  ics_line ("PRODID", prodid, strlen (prodid), 1);
+  ics_const ("VERSION:2.0");
+  ics_const ("METHOD:PUBLISH");
+
+  if (argc == 0)
+    bad += ics_convert (STDIN_FILENO, "stdin");
+  for (; argc > 0; argc--, argv++) {
+    if (strcmp (*argv, "-") == 0)
+      bad += ics_convert (STDIN_FILENO, "stdin");
+    else if ((fd = open (*argv, O_RDONLY)) < 0) {
+      perror (*argv);
+      bad++;
+    } else {
+      bad += ics_convert (fd, *argv);
+      close (fd);
+    }
+  }
+
+  ics_const ("END:VCALENDAR");
+  ics_flush ();
+
+  exit (bad == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,581 @@
+/**********************************************************************
+ * dlbulk (C) M. Brent Harp 2010-2012
+ *
+ * Bulk directory operations on a context's Zimbra directory handle.
+ *
+ * dl_search_paged walks a search a page at a time (RFC 2696), handing
+ * each entry over as it arrives, so a directory-wide search costs one
+ * page of memory and the caller can start on the first entries while
+ * the server reads the rest.  On it are built the lookups several
+ * programs share: accounts by name, a chunk of names to a search,
+ * and the classes of service, read once and kept.
+ *
+ * A dl_batch pipelines modifies: up to a window of them are in flight
+ * on the connection at once, and results are collected as they come
+ * back, so a run of changes costs one round trip per window instead of
+ * one per entry.  While a batch has modifies in flight it owns the
+ * handle; searches must not run on it until dl_batch_flush.
+ ***********************************************************************/
+
+#include <string.h>
+
+#include <config.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ldap.h>
+
+#include "dlsync.h"
+
+#define DL_PAGE_SIZE (1000)             /* Entries per search page. */
+#define DL_NAME_CHUNK (200)             /* Names per account search. */
+#define DL_NAME_MAX  (256)              /* No account name is longer. */
+#define DL_COS_BASE  "cn=cos,cn=zimbra"
+
+struct dl_cos_list {
+  struct dl_cos  *cos;
+  int             count;
+  int             max;
+  void         *(*fn)(dl_context *, LDAPMessage *, void *);
+  void           *arg;
+};
+
+struct dl_batch {
+  dl_context   *ctx;
+  int           window;                 /* Modifies in flight at most. */
+  int           count;                  /* Modifies in flight. */
+  int          *msgids;
+  char        **dns;
+  long          sent;
+  long          failed;
+  void        (*fn)(dl_context *, const char *, int, void *);
+  void         *arg;
+};
+
+
+static int
+dl_bulk_error
+(
+ dl_context *ctx,
+ int         rc
+)
+{
+  ctx->error = rc == LDAP_TIMEOUT ? DL_ERR_TIMEOUT : DL_ERR_LDAP;
+  ctx->ldap_error = rc;
+  return DL_FAILURE;
+}
+
+
+
+/* ---- Paged search ---- */
+
+
+/**
+   dl_search_paged
+
+   Searches under base (ctx->ldap_base if NULL) for filter, asking for
+   attrs only, a page at a time, and calls fn with each entry.  fn
+   returns 0 to go on, 1 to stop the search early, or -1 to fail it.
+   The context must be initialized with dl_init.  Returns DL_SUCCESS,
+   or DL_FAILURE with the error in ctx (left alone if fn failed).
+*/
+int
+dl_search_paged
+(
+ dl_context  *ctx,
+ const char  *base,
+ const char  *filter,
+ char       **attrs,
+ int        (*fn)(dl_context *, LDAPMessage *, void *),
+ void        *arg
+)
+{
+  LDAP          *ld = ctx->ldap;
+  LDAPControl   *page = NULL, *sctrls[2], **rctrls = NULL, *resp;
+  LDAPMessage   *msg;
+  struct berval  cookie;
+  struct timeval tv;
+  ber_int_t      estimate;
+  long           entries = 0;
+  int            msgid, rc, err, done, stop = 0, pages = 0, status = DL_SUCCESS;
+
+  memset (&cookie, 0, sizeof (cookie));
+  if (base == NULL)
+    base = ctx->ldap_base;
+
+  do {
+    if ((rc = ldap_create_page_control (ld, DL_PAGE_SIZE, &cookie, 0, &page)) != LDAP_SUCCESS) {
+      status = dl_bulk_error (ctx, rc);
+      break;
+    }
+    sctrls[0] = page;
+    sctrls[1] = NULL;
+
+    rc = ldap_search_ext (ld, base, ctx->ldap_scope, filter, attrs, 0,
+                          sctrls, NULL, NULL, 0, &msgid);
+    ldap_control_free (page);
+    if (cookie.bv_val != NULL) {
+      ldap_memfree (cookie.bv_val);
+      memset (&cookie, 0, sizeof (cookie));
+    }
+    if (rc != LDAP_SUCCESS) {
+      status = dl_bulk_error (ctx, rc);
+      break;
+    }
+    pages++;
+
+    for (done = 0; !done && !stop && status == DL_SUCCESS; ) {
+      tv.tv_sec = ctx->op_timeout;
+      tv.tv_usec = 0;
+      if ((rc = ldap_result (ld, msgid, LDAP_MSG_ONE, ctx->op_timeout ? &tv : NULL, &msg)) <= 0) {
+        status = dl_bulk_error (ctx, rc == 0 ? LDAP_TIMEOUT : LDAP_SERVER_DOWN);
+        break;
+      }
+
+      switch (ldap_msgtype (msg)) {
+      case LDAP_RES_SEARCH_ENTRY:
+        entries++;
+        if ((rc = fn (ctx, ldap_first_entry (ld, msg), arg)) < 0)
+          status = DL_FAILURE;
+        else if (rc > 0)
+          stop = 1;
+        break;
+
+      case LDAP_RES_SEARCH_RESULT:
+        rc = ldap_parse_result (ld, msg, &err, NULL, NULL, NULL, &rctrls, 0);
+        if (rc != LDAP_SUCCESS || err != LDAP_SUCCESS)
+          status = dl_bulk_error (ctx, rc != LDAP_SUCCESS ? rc : err);
+        else if (rctrls != NULL
+                 && (resp = ldap_control_find (LDAP_CONTROL_PAGEDRESULTS, rctrls, NULL)) != NULL)
+          ldap_parse_pageresponse_control (ld, resp, &estimate, &cookie);
+        if (rctrls != NULL) {
+          ldap_controls_free (rctrls);
+          rctrls = NULL;
+        }
+        done = 1;
+        break;
+      }
+      ldap_msgfree (msg);
+    }
+
+    if (!done)
+      ldap_abandon_ext (ld, msgid, NULL, NULL);
+
+  } while (status == DL_SUCCESS && !stop && cookie.bv_len > 0);
+
+  if (cookie.bv_val != NULL)
+    ldap_memfree (cookie.bv_val);
+
+  if (ctx->debug)
+    fprintf (stderr, "Read %ld entries in %d pages\n", entries, pages);
+
+  return status;
+}
+
+
+
+/* ---- Lookups ---- */
+
+
+/**
+   dl_filter_escape
+
+   Writes value into a search filter at out with the RFC 4515
+   specials escaped, so it matches only itself.  out must have room
+   for three times its length, plus one.  Returns the length written.
+*/
+size_t
+dl_filter_escape
+(
+ char       *out,
+ const char *value
+)
+{
+  size_t n = 0;
+
+  for (; *value != '\0'; value++) {
+    if (strchr ("*()\\", *value) != NULL)
+      n += sprintf (out + n, "\\%02x", (unsigned char)*value);
+    else
+      out[n++] = *value;
+  }
+  out[n] = '\0';
+
+  return n;
+}
+
+
+/**
+   dl_search_accounts
+
+   Searches for the accounts named, DL_NAME_CHUNK names to a search,
+   and calls fn with each entry as dl_search_paged does.  Names with
+   an @ are matched against mail, others against uid; names longer
+   than any account's are skipped.  Returns as dl_search_paged.
+*/
+int
+dl_search_accounts
+(
+ dl_context  *ctx,
+ char       **names,
+ long         count,
+ char       **attrs,
+ int        (*fn)(dl_context *, LDAPMessage *, void *),
+ void        *arg
+)
+{
+  char   *filter;
+  size_t  len;
+  long    i, j;
+  int     status = DL_SUCCESS;
+
+  if ((filter = malloc (DL_NAME_CHUNK * (3 * DL_NAME_MAX + 8) + 64)) == NULL) {
+    ctx->error = DL_ERR_OUT_OF_MEMORY;
+    return DL_FAILURE;
+  }
+
+  for (i = 0; i < count && status == DL_SUCCESS; i = j) {
+    len = sprintf (filter, "(&(objectClass=zimbraAccount)(|");
+    for (j = i; j < count && j < i + DL_NAME_CHUNK; j++) {
+      if (strlen (names[j]) > DL_NAME_MAX)
+        continue;
+      len += sprintf (filter + len, "(%s=", strchr (names[j], '@') ? "mail" : "uid");
+      len += dl_filter_escape (filter + len, names[j]);
+      len += sprintf (filter + len, ")");
+    }
+    sprintf (filter + len, "))");
+
+    status = dl_search_paged (ctx, NULL, filter, attrs, fn, arg);
+  }
+  free (filter);
+
+  return status;
+}
+
+
+/* Files a COS entry, and the caller's data for it. */
+static int
+dl_cos_found
+(
+ dl_context  *ctx,
+ LDAPMessage *entry,
+ void        *arg
+)
+{
+  struct dl_cos_list *l = arg;
+  struct dl_cos      *c;
+  char              **id, **name;
+  int                 status = 0;
+
+  id = ldap_get_values (ctx->ldap, entry, "zimbraId");
+  name = ldap_get_values (ctx->ldap, entry, "cn");
+  if (id == NULL || id[0] == NULL || name == NULL || name[0] == NULL)
+    goto done;
+
+  if (l->count == l->max) {
+    int max = l->max ? 2 * l->max : 16;
+
+    if ((c = realloc (l->cos, max * sizeof (*c))) == NULL) {
+      status = -1;
+      goto done;
+    }
+    l->cos = c;
+    l->max = max;
+  }
+  c = &l->cos[l->count];
+  c->data = NULL;
+  if ((c->id = strdup (id[0])) == NULL || (c->name = strdup (name[0])) == NULL
+      || (l->fn != NULL && (c->data = l->fn (ctx, entry, l->arg)) == NULL)) {
+    free (c->id);
+    free (c->name);
+    status = -1;
+    goto done;
+  }
+  l->count++;
+
+ done:
+  if (status != 0)
+    ctx->error = DL_ERR_OUT_OF_MEMORY;
+  if (id != NULL)
+    ldap_value_free (id);
+  if (name != NULL)
+    ldap_value_free (name);
+
+  return status;
+}
+
+
+/**
+   dl_cos_read
+
+   Reads every class of service once, asking for attrs (which may be
+   NULL) besides cn and zimbraId.  fn, if not NULL, is called with
+   each entry and returns the caller's data for it, kept in the
+   dl_cos, or NULL if out of memory.  Returns the list, or NULL with
+   the error in ctx.
+*/
+dl_cos_list *
+dl_cos_read
+(
+ dl_context  *ctx,
+ char       **attrs,
+ void      *(*fn)(dl_context *, LDAPMessage *, void *),
+ void        *arg
+)
+{
+  dl_cos_list  *l;
+  char        **all;
+  int           i, n;
+
+  for (n = 0; attrs != NULL && attrs[n] != NULL; n++)
+    ;
+  if ((l = calloc (1, sizeof (*l))) == NULL
+      || (all = malloc ((n + 3) * sizeof (*all))) == NULL) {
+    free (l);
+    ctx->error = DL_ERR_OUT_OF_MEMORY;
+    return NULL;
+  }
+  all[0] = "cn";
+  all[1] = "zimbraId";
+  for (i = 0; i < n; i++)
+    all[i + 2] = attrs[i];
+  all[n + 2] = NULL;
+  l->fn = fn;
+  l->arg = arg;
+
+  if (dl_search_paged (ctx, DL_COS_BASE, "(objectClass=zimbraCOS)", all,
+                       dl_cos_found, l) != DL_SUCCESS) {
+    dl_cos_free (l, NULL);
+    l = NULL;
+  }
+  free (all);
+
+  return l;
+}
+
+
+/**
+   dl_cos_find
+
+   The class of service with zimbraId id, or if id is NULL, the one
+   named name, in any case.  Returns NULL if there is none.
+*/
+const struct dl_cos *
+dl_cos_find
+(
+ dl_cos_list *l,
+ const char  *id,
+ const char  *name
+)
+{
+  int i;
+
+  for (i = 0; i < l->count; i++)
+    if (id != NULL ? strcmp (l->cos[i].id, id) == 0
+        : strcasecmp (l->cos[i].name, name) == 0)
+      return &l->cos[i];
+
+  return NULL;
+}
+
+
+/* Frees a list read by dl_cos_read, and with fn the caller's data. */
+void
+dl_cos_free
+(
+ dl_cos_list *l,
+ void       (*fn)(void *)
+)
+{
+  if (l == NULL)
+    return;
+  while (l->count > 0) {
+    l->count--;
+    if (fn != NULL)
+      fn (l->cos[l->count].data);
+    free (l->cos[l->count].id);
+    free (l->cos[l->count].name);
+  }
+  free (l->cos);
+  free (l);
+}
+
+
+
+/* ---- Pipelined modifies ---- */
+
+
+/**
+   dl_batch_new
+
+   Starts a batch of modifies on the context's directory handle with
+   at most window of them in flight.  fn, if not NULL, is called with
+   the DN and result code of each modify that fails.  Returns NULL if
+   out of memory.
+*/
+dl_batch *
+dl_batch_new
+(
+ dl_context  *ctx,
+ int          window,
+ void       (*fn)(dl_context *, const char *, int, void *),
+ void        *arg
+)
+{
+  dl_batch *b;
+
+  if (window < 1)
+    window = 1;
+  if ((b = calloc (1, sizeof (*b))) == NULL)
+    return NULL;
+  b->ctx = ctx;
+  b->window = window;
+  b->fn = fn;
+  b->arg = arg;
+  b->msgids = malloc (window * sizeof (*b->msgids));
+  b->dns = malloc (window * sizeof (*b->dns));
+  if (b->msgids == NULL || b->dns == NULL) {
+    free (b->msgids);
+    free (b->dns);
+    free (b);
+    return NULL;
+  }
+
+  return b;
+}
+
+
+/* Collects one result.  Returns DL_FAILURE only if the connection did. */
+static int
+dl_batch_wait
+(
+ dl_batch *b
+)
+{
+  LDAP          *ld = b->ctx->ldap;
+  LDAPMessage   *msg;
+  struct timeval tv;
+  int            rc, err, id, i;
+
+  tv.tv_sec = b->ctx->op_timeout;
+  tv.tv_usec = 0;
+  if ((rc = ldap_result (ld, LDAP_RES_ANY, LDAP_MSG_ONE, b->ctx->op_timeout ? &tv : NULL,
+                         &msg)) <= 0)
+    return dl_bulk_error (b->ctx, rc == 0 ? LDAP_TIMEOUT : LDAP_SERVER_DOWN);
+
+  id = ldap_msgid (msg);
+  rc = ldap_parse_result (ld, msg, &err, NULL, NULL, NULL, NULL, 1);
+  if (rc != LDAP_SUCCESS)
+    err = rc;
+
+  for (i = 0; i < b->count && b->msgids[i] != id; i++)
+    ;
+  if (i == b->count)
+    return DL_SUCCESS;                  /* Not ours. */
+
+  if (err != LDAP_SUCCESS) {
+    b->failed++;
+    if (b->fn != NULL)
+      b->fn (b->ctx, b->dns[i], err, b->arg);
+    if (b->ctx->debug)
+      fprintf (stderr, "  modify %s: %s\n", b->dns[i], ldap_err2string (err));
+  }
+  free (b->dns[i]);
+  b->count--;
+  b->msgids[i] = b->msgids[b->count];
+  b->dns[i] = b->dns[b->count];
+
+  return DL_SUCCESS;
+}
+
+
+/**
+   dl_batch_modify
+
+   Sends a modify of dn, first waiting for a result if the window is
+   full.  mods need only last until the call returns.  A modify the
+   server refuses is counted and reported, not returned; DL_FAILURE
+   means the connection failed, with the error in the context.
+*/
+int
+dl_batch_modify
+(
+ dl_batch    *b,
+ const char  *dn,
+ LDAPMod    **mods
+)
+{
+  char *copy;
+  int   msgid, rc;
+
+  while (b->count >= b->window)
+    if (dl_batch_wait (b) != DL_SUCCESS)
+      return DL_FAILURE;
+
+  if ((copy = strdup (dn)) == NULL) {
+    b->ctx->error = DL_ERR_OUT_OF_MEMORY;
+    return DL_FAILURE;
+  }
+  if ((rc = ldap_modify_ext (b->ctx->ldap, dn, mods, NULL, NULL, &msgid)) != LDAP_SUCCESS) {
+    free (copy);
+    return dl_bulk_error (b->ctx, rc);
+  }
+  b->msgids[b->count] = msgid;
+  b->dns[b->count] = copy;
+  b->count++;
+  b->sent++;
+
+  return DL_SUCCESS;
+}
+
+
+/**
+   dl_batch_flush
+
+   Waits for every modify in flight.  Returns DL_SUCCESS, or
+   DL_FAILURE if the connection failed.
+*/
+int
+dl_batch_flush
+(
+ dl_batch *b
+)
+{
+  while (b->count > 0)
+    if (dl_batch_wait (b) != DL_SUCCESS)
+      return DL_FAILURE;
+
+  return DL_SUCCESS;
+}
+
+
+/**
+   dl_batch_free
+
+   Flushes a batch and releases it.  Stores the modifies sent and
+   failed in *sent and *failed if they are not NULL.  Returns as
+   dl_batch_flush.
+*/
+int
+dl_batch_free
+(
+ dl_batch *b,
+ long     *sent,
+ long     *failed
+)
+{
+  int status = dl_batch_flush (b);
+
+  if (sent != NULL)
+    *sent = b->sent;
+  if (failed != NULL)
+    *failed = b->failed + b->count;
+
+  while (b->count > 0)
+    free (b->dns[--b->count]);
+  free (b->msgids);
+  free (b->dns);
+  free (b);
+
+  return status;
+}
@@ -0,0 +1,891 @@
+/**********************************************************************
+ * dlindex (C) M. Brent Harp 2010-2012
+ *
+ * Reverse membership index: member address -> distribution lists.
+ *
+ * The index is a single file, written in native byte order and read
+ * by mapping it into memory:
+ *
+ *   struct dl_index_header            magic, pair and string counts
+ *   struct dl_index_pair [count]      sorted by member, then list
+ *   char strings [strings]            NUL terminated names
+ *
+ * Each pair holds the offsets of a member address and a list name in
+ * the string table.  Lookups binary search the pairs, so answering
+ * "which lists is this address on" touches a handful of pages.
+ *
+ * The sync engine logs the adds and removes it makes to each list.
+ * dl_index_commit merges them into the previous index and replaces
+ * the file, so lists not synced in a run keep their entries.  A list
+ * that is synced is seeded again with the members it had before the
+ * changes, replacing its old entries, so changes made by other tools
+ * do not linger in the index.
+ ***********************************************************************/
+
+#include <string.h>
+#include <strings.h>
+
+#include <config.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dlsync.h"
+
+#define DL_INDEX_MAGIC "DLX1"
+
+struct dl_index_header {
+  char     magic[4];
+  uint32_t count;                 /* Number of pairs. */
+  uint32_t strings;               /* Size of the string table. */
+  uint32_t reserved;
+};
+
+struct dl_index_pair {
+  uint32_t member;                /* Offset of member address. */
+  uint32_t list;                  /* Offset of list name. */
+};
+
+struct dl_index_map {
+  void                         *base;
+  size_t                        size;
+  const struct dl_index_header *header;
+  const struct dl_index_pair   *pairs;
+  const char                   *strings;
+};
+
+struct dl_index_change {
+  char       *member;
+  const char *list;
+  unsigned    seq;                /* Later changes win. */
+  int         op;                 /* DL_INDEX_ADD or DL_INDEX_DEL. */
+};
+
+struct dl_index_log {
+  char                   *path;
+  struct dl_index_map     old;    /* Previous index, if any. */
+  uint32_t               *old_lists; /* Sorted offsets of its list names. */
+  uint32_t                n_old_lists;
+  uint32_t               *reseeded; /* Sorted offsets of lists seeded again. */
+  uint32_t                n_reseeded;
+  char                  **lists;  /* Names of lists logged so far. */
+  int                     n_lists;
+  struct dl_index_change *changes;
+  size_t                  n_changes;
+  size_t                  max_changes;
+};
+
+
+/**
+   dl_index_map_open
+
+   Maps an index file.  Returns DL_SUCCESS, or DL_FAILURE if the file
+   is missing or is not an index.
+*/
+static int
+dl_index_map_open
+(
+ const char          *path,
+ struct dl_index_map *map
+)
+{
+  struct stat st;
+  int         fd;
+
+  memset (map, 0, sizeof (*map));
+
+  if ((fd = open (path, O_RDONLY)) < 0)
+    return DL_FAILURE;
+
+  if (fstat (fd, &st) < 0 || st.st_size < (off_t)sizeof (struct dl_index_header)) {
+    close (fd);
+    return DL_FAILURE;
+  }
+
+  map->base = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (map->base == MAP_FAILED) {
+    map->base = NULL;
+    return DL_FAILURE;
+  }
+  map->size = st.st_size;
+
+  map->header = map->base;
+  map->pairs = (const struct dl_index_pair *)(map->header + 1);
+  map->strings = (const char *)(map->pairs + map->header->count);
+
+  /* With the table terminated, any offset inside it is a string. */
+  if (memcmp (map->header->magic, DL_INDEX_MAGIC, 4) != 0
+      || sizeof (struct dl_index_header)
+         + (size_t)map->header->count * sizeof (struct dl_index_pair)
+         + map->header->strings != map->size
+      || (map->header->strings > 0 && map->strings[map->header->strings - 1] != '\0')
+      || (map->header->count > 0 && map->header->strings == 0)) {
+    munmap (map->base, map->size);
+    memset (map, 0, sizeof (*map));
+    return DL_FAILURE;
+  }
+
+  return DL_SUCCESS;
+}
+
+
+static void
+dl_index_map_close
+(
+ struct dl_index_map *map
+)
+{
+  if (map->base != NULL)
+    munmap (map->base, map->size);
+  memset (map, 0, sizeof (*map));
+}
+
+
+/* Returns the string at offset in the table, or NULL if it is outside. */
+static const char *
+dl_index_string
+(
+ const struct dl_index_map *map,
+ uint32_t                   offset
+)
+{
+  return offset < map->header->strings ? map->strings + offset : NULL;
+}
+
+
+/**
+   dl_index_map_check
+
+   Checks that every pair in a mapped index points inside its string
+   table.  Returns DL_FAILURE if one does not.
+*/
+static int
+dl_index_map_check
+(
+ const struct dl_index_map *map
+)
+{
+  uint32_t i;
+
+  for (i = 0; map->base != NULL && i < map->header->count; i++)
+    if (dl_index_string (map, map->pairs[i].member) == NULL
+        || dl_index_string (map, map->pairs[i].list) == NULL)
+      return DL_FAILURE;
+
+  return DL_SUCCESS;
+}
+
+
+/**
+   dl_index_lower_bound
+
+   Stores in *pos the position of the first pair whose member is not
+   less than member.  Returns DL_FAILURE if a pair it reads points
+   outside the string table.
+*/
+static int
+dl_index_lower_bound
+(
+ const struct dl_index_map *map,
+ const char                *member,
+ uint32_t                  *pos
+)
+{
+  uint32_t    lo = 0, hi = map->header->count, mid;
+  const char *s;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if ((s = dl_index_string (map, map->pairs[mid].member)) == NULL)
+      return DL_FAILURE;
+    if (strcasecmp (s, member) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  *pos = lo;
+  return DL_SUCCESS;
+}
+
+
+/**
+   dl_index_lookup
+
+   Calls fn with the name of every list that member belongs to,
+   according to the index at path.  Returns the number of lists, or
+   -1 with DL_ERR_INDEX set if the index cannot be read or is corrupt.
+*/
+int
+dl_index_lookup
+(
+ dl_context  *ctx,
+ const char  *path,
+ const char  *member,
+ void       (*fn)(const char *, void *),
+ void        *arg
+)
+{
+  struct dl_index_map map;
+  const char         *m, *list;
+  uint32_t            i;
+  int                 n = 0;
+
+  if (dl_index_map_open (path, &map) != DL_SUCCESS) {
+    ctx->error = DL_ERR_INDEX;
+    return -1;
+  }
+
+  if (dl_index_lower_bound (&map, member, &i) != DL_SUCCESS)
+    n = -1;
+
+  for (; n >= 0 && i < map.header->count; i++, n++) {
+    if ((m = dl_index_string (&map, map.pairs[i].member)) == NULL
+        || (list = dl_index_string (&map, map.pairs[i].list)) == NULL) {
+      n = -1;
+      break;
+    }
+    if (strcasecmp (m, member) != 0)
+      break;
+    fn (list, arg);
+  }
+
+  dl_index_map_close (&map);
+
+  if (n < 0)
+    ctx->error = DL_ERR_INDEX;
+
+  return n;
+}
+
+
+static int
+dl_index_offset_compare
+(
+ const void *p1,
+ const void *p2
+)
+{
+  uint32_t o1 = *(const uint32_t *)p1, o2 = *(const uint32_t *)p2;
+
+  return o1 < o2 ? -1 : o1 > o2;
+}
+
+
+/**
+   dl_index_scan_lists
+
+   Collects the distinct list names in the previous index.  Names are
+   interned when written, so each list has a single offset.
+*/
+static int
+dl_index_scan_lists
+(
+ struct dl_index_log *log
+)
+{
+  const struct dl_index_map *map = &log->old;
+  uint32_t                   i, o, *lists, last = UINT32_MAX;
+
+  free (log->old_lists);
+  log->old_lists = NULL;
+  log->n_old_lists = 0;
+  free (log->reseeded);
+  log->reseeded = NULL;
+  log->n_reseeded = 0;
+
+  for (i = 0; map->base != NULL && i < map->header->count; i++) {
+    o = map->pairs[i].list;
+    if (o == last || (log->n_old_lists > 0
+                      && bsearch (&o, log->old_lists, log->n_old_lists,
+                                  sizeof (uint32_t), dl_index_offset_compare)))
+      continue;
+    last = o;
+    if ((lists = realloc (log->old_lists, (log->n_old_lists + 1) * sizeof (uint32_t))) == NULL)
+      return DL_FAILURE;
+    log->old_lists = lists;
+    lists[log->n_old_lists++] = o;
+    qsort (lists, log->n_old_lists, sizeof (uint32_t), dl_index_offset_compare);
+  }
+
+  return DL_SUCCESS;
+}
+
+
+/**
+   dl_index_open
+
+   Starts logging membership changes for the index at path.  The
+   previous index, if there is one, is mapped for the merge.
+*/
+int
+dl_index_open
+(
+ dl_context *ctx,
+ const char *path
+)
+{
+  struct dl_index_log *log;
+
+  if ((log = calloc (1, sizeof (*log))) == NULL
+      || (log->path = strdup (path)) == NULL) {
+    free (log);
+    ctx->error = DL_ERR_OUT_OF_MEMORY;
+    return DL_FAILURE;
+  }
+
+  if (dl_index_map_open (path, &log->old) != DL_SUCCESS && ctx->debug) {
+    fprintf (stderr, "No previous index at %s\n", path);
+  }
+
+  ctx->index_log = log;
+
+  /* Every old pair is merged at commit, so check them all now. */
+  if (dl_index_map_check (&log->old) != DL_SUCCESS) {
+    dl_index_close (ctx);
+    ctx->error = DL_ERR_INDEX;
+    return DL_FAILURE;
+  }
+
+  if (dl_index_scan_lists (log) != DL_SUCCESS) {
+    dl_index_close (ctx);
+    ctx->error = DL_ERR_OUT_OF_MEMORY;
+    return DL_FAILURE;
+  }
+
+  return DL_SUCCESS;
+}
+
+
+/* Whether the list at offset o in the previous index is seeded again. */
+static int
+dl_index_is_reseeded
+(
+ const struct dl_index_log *log,
+ uint32_t                   o
+)
+{
+  return log->n_reseeded > 0
+    && bsearch (&o, log->reseeded, log->n_reseeded, sizeof (uint32_t),
+                dl_index_offset_compare) != NULL;
+}
+
+
+/**
+   dl_index_reseed
+
+   Marks list's pairs in the previous index to be dropped at commit,
+   if it has any, as the members logged by dl_index_begin replace
+   them.
+*/
+static int
+dl_index_reseed
+(
+ struct dl_index_log *log,
+ const char          *list
+)
+{
+  uint32_t i, o, *reseeded;
+
+  for (i = 0; i < log->n_old_lists; i++)
+    if (strcmp (log->old.strings + log->old_lists[i], list) == 0)
+      break;
+  if (i == log->n_old_lists)
+    return DL_SUCCESS;
+
+  o = log->old_lists[i];
+  if (dl_index_is_reseeded (log, o))
+    return DL_SUCCESS;
+
+  if ((reseeded = realloc (log->reseeded, (log->n_reseeded + 1) * sizeof (uint32_t))) == NULL)
+    return DL_FAILURE;
+  log->reseeded = reseeded;
+  reseeded[log->n_reseeded++] = o;
+  qsort (reseeded, log->n_reseeded, sizeof (uint32_t), dl_index_offset_compare);
+
+  return DL_SUCCESS;
+}
+
+
+static int
+dl_index_add_change
+(
+ dl_context *ctx,
+ const char *member,
+ const char *list,
+ int         op
+)
+{
+  struct dl_index_log    *log = ctx->index_log;
+  struct dl_index_change *c;
+
+  if (log->n_changes == log->max_changes) {
+    size_t max = log->max_changes ? 2 * log->max_changes : 1024;
+    if ((c = realloc (log->changes, max * sizeof (*c))) == NULL) {
+      ctx->error = DL_ERR_OUT_OF_MEMORY;
+      return DL_FAILURE;
+    }
+    log->changes = c;
+    log->max_changes = max;
+  }
+
+  c = &log->changes[log->n_changes];
+  if ((c->member = strdup (member)) == NULL) {
+    ctx->error = DL_ERR_OUT_OF_MEMORY;
+    return DL_FAILURE;
+  }
+  c->list = list;
+  c->seq = log->n_changes++;
+  c->op = op;
+
+  return DL_SUCCESS;
+}
+
+
+/**
+   dl_index_list
+
+   Returns the logged copy of the current list's name.
+*/
+static const char *
+dl_index_list
+(
+ dl_context *ctx
+)
+{
+  struct dl_index_log *log = ctx->index_log;
+  char               **lists;
+  int                  i;
+
+  for (i = log->n_lists - 1; i >= 0; i--)
+    if (strcmp (log->lists[i], ctx->name) == 0)
+      return log->lists[i];
+
+  if ((lists = realloc (log->lists, (log->n_lists + 1) * sizeof (char *))) == NULL)
+    return NULL;
+  log->lists = lists;
+  if ((lists[log->n_lists] = strdup (ctx->name)) == NULL)
+    return NULL;
+
+  return lists[log->n_lists++];
+}
+
+
+/**
+   dl_index_begin
+
+   Called by the sync engine with the current list's members before
+   it changes them.  Seeds the index with them, replacing whatever the
+   previous index held for the list.  Does nothing unless an index is
+   open.
+*/
+int
+dl_index_begin
+(
+ dl_context *ctx,
+ char      **members,
+ int         n
+)
+{
+  const char *list;
+  int         i;
+
+  if (ctx->index_log == NULL)
+    return DL_SUCCESS;
+
+  if ((list = dl_index_list (ctx)) == NULL) {
+    ctx->error = DL_ERR_OUT_OF_MEMORY;
+    return DL_FAILURE;
+  }
+
+  if (dl_index_reseed (ctx->index_log, list) != DL_SUCCESS) {
+    ctx->error = DL_ERR_OUT_OF_MEMORY;
+    return DL_FAILURE;
+  }
+
+  for (i = 0; i < n; i++)
+    if (dl_index_add_change (ctx, members[i], list, DL_INDEX_ADD) != DL_SUCCESS)
+      return DL_FAILURE;
+
+  return DL_SUCCESS;
+}
+
+
+/**
+   dl_index_note
+
+   Logs members added to (DL_INDEX_ADD) or removed from (DL_INDEX_DEL)
+   the current list.  Does nothing unless an index is open.
+*/
+int
+dl_index_note
+(
+ dl_context *ctx,
+ char      **members,
+ int         n,
+ int         op
+)
+{
+  const char *list;
+  int         i;
+
+  if (ctx->index_log == NULL)
+    return DL_SUCCESS;
+
+  if ((list = dl_index_list (ctx)) == NULL) {
+    ctx->error = DL_ERR_OUT_OF_MEMORY;
+    return DL_FAILURE;
+  }
+
+  for (i = 0; i < n; i++)
+    if (dl_index_add_change (ctx, members[i], list, op) != DL_SUCCESS)
+      return DL_FAILURE;
+
+  return DL_SUCCESS;
+}
+
+
+static int
+dl_index_change_compare
+(
+ const void *p1,
+ const void *p2
+)
+{
+  const struct dl_index_change *c1 = p1, *c2 = p2;
+  int d;
+
+  if ((d = strcasecmp (c1->member, c2->member)) != 0)
+    return d;
+  if ((d = strcmp (c1->list, c2->list)) != 0)
+    return d;
+  return c1->seq < c2->seq ? -1 : c1->seq > c2->seq;
+}
+
+
+/*
+  String table under construction.  List names repeat in every pair,
+  so they are interned in an open addressed hash table; member
+  addresses arrive sorted, so repeats are always adjacent.
+*/
+
+struct dl_index_name {
+  const char *name;               /* NULL if the slot is free. */
+  uint32_t    offset;
+};
+
+struct dl_index_strtab {
+  char                 *data;
+  size_t                size, max;
+  struct dl_index_name *names;    /* Interned list names. */
+  size_t                n_slots;  /* A power of two. */
+  size_t                n_names;
+  char                 *last_member;
+  uint32_t              last_offset;
+};
+
+
+static int
+dl_index_strtab_add
+(
+ struct dl_index_strtab *tab,
+ const char             *s,
+ uint32_t               *offset
+)
+{
+  size_t len = strlen (s) + 1;
+  char  *data;
+
+  while (tab->size + len > tab->max) {
+    size_t max = tab->max ? 2 * tab->max : 65536;
+    if ((data = realloc (tab->data, max)) == NULL)
+      return DL_FAILURE;
+    tab->data = data;
+    tab->max = max;
+  }
+
+  memcpy (tab->data + tab->size, s, len);
+  *offset = tab->size;
+  tab->size += len;
+
+  return DL_SUCCESS;
+}
+
+
+/* FNV-1a of a list name. */
+static size_t
+dl_index_hash
+(
+ const char *s
+)
+{
+  uint32_t h = 2166136261U;
+
+  for (; *s != '\0'; s++)
+    h = (h ^ (unsigned char)*s) * 16777619U;
+
+  return h;
+}
+
+
+/**
+   dl_index_intern
+
+   Stores the offset of list in the string table in *offset, adding it
+   the first time it is seen.  The table of names is kept under half
+   full.  Returns DL_SUCCESS, or DL_FAILURE if out of memory.
+*/
+static int
+dl_index_intern
+(
+ struct dl_index_strtab *tab,
+ const char             *list,
+ uint32_t               *offset
+)
+{
+  struct dl_index_name *slot, *names;
+  size_t                i, k, n;
+
+  if (2 * (tab->n_names + 1) > tab->n_slots) {
+    n = tab->n_slots ? 2 * tab->n_slots : 256;
+    if ((names = calloc (n, sizeof (*names))) == NULL)
+      return DL_FAILURE;
+    for (k = 0; k < tab->n_slots; k++) {
+      if (tab->names[k].name == NULL)
+        continue;
+      i = dl_index_hash (tab->names[k].name) & (n - 1);
+      while (names[i].name != NULL)
+        i = (i + 1) & (n - 1);
+      names[i] = tab->names[k];
+    }
+    free (tab->names);
+    tab->names = names;
+    tab->n_slots = n;
+  }
+
+  i = dl_index_hash (list) & (tab->n_slots - 1);
+  for (slot = &tab->names[i]; slot->name != NULL; slot = &tab->names[i]) {
+    if (strcmp (slot->name, list) == 0) {
+      *offset = slot->offset;
+      return DL_SUCCESS;
+    }
+    i = (i + 1) & (tab->n_slots - 1);
+  }
+
+  if (dl_index_strtab_add (tab, list, &slot->offset) != DL_SUCCESS)
+    return DL_FAILURE;
+  slot->name = list;
+  tab->n_names++;
+  *offset = slot->offset;
+
+  return DL_SUCCESS;
+}
+
+
+static int
+dl_index_emit
+(
+ struct dl_index_strtab *tab,
+ struct dl_index_pair  **pairs,
+ size_t                 *n,
+ size_t                 *max,
+ const char             *member,
+ const char             *list
+)
+{
+  struct dl_index_pair *p;
+
+  if (*n == *max) {
+    size_t m = *max ? 2 * *max : 4096;
+    if ((p = realloc (*pairs, m * sizeof (*p))) == NULL)
+      return DL_FAILURE;
+    *pairs = p;
+    *max = m;
+  }
+  p = &(*pairs)[*n];
+
+  if (tab->last_member == NULL || strcmp (tab->last_member, member) != 0) {
+    if (dl_index_strtab_add (tab, member, &tab->last_offset) != DL_SUCCESS)
+      return DL_FAILURE;
+    tab->last_member = tab->data + tab->last_offset;
+  }
+  p->member = tab->last_offset;
+
+  if (dl_index_intern (tab, list, &p->list) != DL_SUCCESS)
+    return DL_FAILURE;
+
+  (*n)++;
+
+  /* last_member may move when the table grows. */
+  tab->last_member = tab->data + tab->last_offset;
+
+  return DL_SUCCESS;
+}
+
+
+/**
+   dl_index_commit
+
+   Merges the logged changes into the previous index and atomically
+   replaces the index file.  The log is emptied.
+*/
+int
+dl_index_commit
+(
+ dl_context *ctx
+)
+{
+  struct dl_index_log    *log = ctx->index_log;
+  const struct dl_index_map *old;
+  struct dl_index_strtab  tab;
+  struct dl_index_header  header;
+  struct dl_index_pair   *pairs = NULL;
+  size_t                  n = 0, max = 0, j = 0, k;
+  uint32_t                i = 0, count;
+  const char             *om = NULL, *ol = NULL;
+  char                    tmp[PATH_MAX];
+  FILE                   *file;
+  int                     d, status = DL_FAILURE;
+
+  if (log == NULL)
+    return DL_SUCCESS;
+
+  old = &log->old;
+  count = old->base ? old->header->count : 0;
+  memset (&tab, 0, sizeof (tab));
+
+  qsort (log->changes, log->n_changes, sizeof (struct dl_index_change),
+         dl_index_change_compare);
+
+  /* Merge the old pairs with the changes, both sorted. */
+  while (i < count || j < log->n_changes) {
+    if (i < count) {
+      om = old->strings + old->pairs[i].member;
+      ol = old->strings + old->pairs[i].list;
+    }
+    if (i == count)
+      d = 1;
+    else if (j == log->n_changes)
+      d = -1;
+    else if ((d = strcasecmp (om, log->changes[j].member)) == 0)
+      d = strcmp (ol, log->changes[j].list);
+
+    /* Old pairs of a reseeded list are replaced by its changes. */
+    if (d < 0) {
+      if (!dl_index_is_reseeded (log, old->pairs[i].list)
+          && dl_index_emit (&tab, &pairs, &n, &max, om, ol) != DL_SUCCESS)
+        goto nomem;
+      i++;
+      continue;
+    }
+
+    /* The last change to a pair decides whether it stays. */
+    for (k = j; k + 1 < log->n_changes
+           && strcasecmp (log->changes[k+1].member, log->changes[j].member) == 0
+           && strcmp (log->changes[k+1].list, log->changes[j].list) == 0; k++)
+      ;
+    if (log->changes[k].op == DL_INDEX_ADD
+        && dl_index_emit (&tab, &pairs, &n, &max,
+                          log->changes[j].member, log->changes[j].list) != DL_SUCCESS)
+      goto nomem;
+    j = k + 1;
+    if (d == 0)
+      i++;
+  }
+
+  if (ctx->debug) {
+    fprintf (stderr, "Write index %s: %lu pairs, %lu changes\n", log->path,
+             (unsigned long)n, (unsigned long)log->n_changes);
+  }
+
+  /* Write a new file beside the old one and swap it in. */
+  memcpy (header.magic, DL_INDEX_MAGIC, 4);
+  header.count = n;
+  header.strings = tab.size;
+  header.reserved = 0;
+
+  snprintf (tmp, sizeof (tmp), "%s.tmp", log->path);
+  if ((file = fopen (tmp, "w")) == NULL) {
+    perror (tmp);
+    ctx->error = DL_ERR_INDEX;
+    goto cleanup;
+  }
+  if (fwrite (&header, sizeof (header), 1, file) != 1
+      || (n && fwrite (pairs, sizeof (*pairs), n, file) != n)
+      || (tab.size && fwrite (tab.data, 1, tab.size, file) != tab.size)
+      || fflush (file) != 0 || fsync (fileno (file)) != 0) {
+    perror (tmp);
+    fclose (file);
+    unlink (tmp);
+    ctx->error = DL_ERR_INDEX;
+    goto cleanup;
+  }
+  fclose (file);
+
+  dl_index_map_close (&log->old);
+  if (rename (tmp, log->path) != 0) {
+    perror (log->path);
+    unlink (tmp);
+    ctx->error = DL_ERR_INDEX;
+    goto cleanup;
+  }
+
+  status = DL_SUCCESS;
+  goto cleanup;
+
+ nomem:
+  ctx->error = DL_ERR_OUT_OF_MEMORY;
+
+ cleanup:
+  for (k = 0; k < log->n_changes; k++)
+    free (log->changes[k].member);
+  log->n_changes = 0;
+  dl_index_map_close (&log->old);
+  dl_index_map_open (log->path, &log->old);
+  dl_index_scan_lists (log);
+  free (pairs);
+  free (tab.data);
+  free (tab.names);
+
+  return status;
+}
+
+
+/**
+   dl_index_close
+
+   Discards any uncommitted changes and releases the index log.
+*/
+void
+dl_index_close
+(
+ dl_context *ctx
+)
+{
+  struct dl_index_log *log = ctx->index_log;
+  size_t               k;
+  int                  i;
+
+  if (log == NULL)
+    return;
+
+  for (k = 0; k < log->n_changes; k++)
+    free (log->changes[k].member);
+  free (log->changes);
+  for (i = 0; i < log->n_lists; i++)
+    free (log->lists[i]);
+  free (log->lists);
+  dl_index_map_close (&log->old);
+  free (log->old_lists);
+  free (log->reseeded);
+  free (log->path);
+  free (log);
+
+  ctx->index_log = NULL;
+}
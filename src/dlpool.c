@@ -0,0 +1,648 @@
+/**********************************************************************
+ * dlpool (C) M. Brent Harp 2010-2012
+ *
+ * A pool of interactive zmprov or zmmailbox sessions.
+ *
+ * Each session is one long running process fed commands on its
+ * standard input, so the JVM is started once per session instead of
+ * once per command.  Both tools print a prompt ("prov> ", "mbox> ",
+ * "mbox user@domain> ") when they are ready for the next command;
+ * each prompt marks the end of the previous command's output, which
+ * is handed back whole, so output from different sessions never
+ * interleaves.
+ *
+ * Every session has its own queue.  Up to depth commands are written
+ * to a session before the first of them answers, so the session never
+ * waits on us between commands; its prompts are then matched to the
+ * commands in order.  A command can be submitted as a gate: nothing
+ * behind it is sent until it answers, and if the callback rejects its
+ * output, the commands queued behind it up to the next gate are
+ * dropped.  This is how a zmmailbox "selectMailbox" keeps the
+ * commands meant for one mailbox from running against another.
+ *
+ * Callers should ignore SIGPIPE, as a session that dies is noticed by
+ * its pipe closing.
+ ***********************************************************************/
+
+#include <string.h>
+
+#include <config.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "dlsync.h"
+
+#define ZM_QUEUE_MAX (1024)             /* Commands queued per session. */
+
+enum zm_state {
+  ZM_STARTING,                          /* Waiting for the first prompt. */
+  ZM_READY,
+  ZM_DEAD
+};
+
+struct zm_command {
+  char              *line;
+  void              *tag;
+  int                gate;
+  struct zm_command *next;
+};
+
+struct zm_queue {
+  struct zm_command *head;
+  struct zm_command *tail;
+  int                count;
+};
+
+struct zm_session {
+  pid_t            pid;
+  int              in;                  /* Its standard input. */
+  int              out;                 /* Its standard output. */
+  int              state;
+  struct zm_queue  sent;                /* Written, waiting for a prompt. */
+  struct zm_queue  waiting;             /* Not yet written. */
+  int              gated;               /* A gate is among those sent. */
+  char            *buf;                 /* Output not yet handed back. */
+  size_t           len;
+  size_t           max;
+  size_t           scan;                /* Lines before here hold no prompt. */
+};
+
+struct zm_pool {
+  struct zm_session *sessions;
+  int                count;
+  int                depth;             /* Commands sent ahead. */
+  char              *prompt;            /* What a prompt starts with. */
+  int              (*fn)(const char *, size_t, void *, void *);
+  void              *arg;
+  long               lost;              /* Commands whose session died. */
+};
+
+
+static void
+zm_queue_put
+(
+ struct zm_queue   *q,
+ struct zm_command *c
+)
+{
+  c->next = NULL;
+  if (q->tail != NULL)
+    q->tail->next = c;
+  else
+    q->head = c;
+  q->tail = c;
+  q->count++;
+}
+
+
+static struct zm_command *
+zm_queue_get
+(
+ struct zm_queue *q
+)
+{
+  struct zm_command *c;
+
+  if ((c = q->head) != NULL) {
+    if ((q->head = c->next) == NULL)
+      q->tail = NULL;
+    q->count--;
+  }
+
+  return c;
+}
+
+
+/* Hands a command's output, or NULL if it never ran, to the callback. */
+static int
+zm_command_done
+(
+ zm_pool           *p,
+ struct zm_command *c,
+ const char        *out,
+ size_t             len
+)
+{
+  int status = 0;
+
+  if (p->fn != NULL)
+    status = p->fn (out, len, c->tag, p->arg);
+  free (c->line);
+  free (c);
+
+  return status;
+}
+
+
+/* Starts command under sh with pipes to and from it. */
+static int
+zm_session_start
+(
+ struct zm_session *s,
+ const char        *command
+)
+{
+  int to[2], from[2];
+
+  if (pipe (to) != 0)
+    return -1;
+  if (pipe (from) != 0) {
+    close (to[0]);
+    close (to[1]);
+    return -1;
+  }
+
+  if ((s->pid = fork ()) < 0) {
+    close (to[0]);
+    close (to[1]);
+    close (from[0]);
+    close (from[1]);
+    return -1;
+  }
+
+  if (s->pid == 0) {
+    dup2 (to[0], STDIN_FILENO);
+    dup2 (from[1], STDOUT_FILENO);
+    close (to[0]);
+    close (to[1]);
+    close (from[0]);
+    close (from[1]);
+    execl ("/bin/sh", "sh", "-c", command, (char *)NULL);
+    _exit (127);
+  }
+
+  close (to[0]);
+  close (from[1]);
+  fcntl (to[1], F_SETFD, FD_CLOEXEC);
+  fcntl (from[0], F_SETFD, FD_CLOEXEC);
+  s->in = to[1];
+  s->out = from[0];
+  s->state = ZM_STARTING;
+
+  return 0;
+}
+
+
+static void
+zm_session_close
+(
+ zm_pool           *p,
+ struct zm_session *s
+)
+{
+  struct zm_command *c;
+
+  if (s->in >= 0)
+    close (s->in);
+  if (s->out >= 0)
+    close (s->out);
+  s->in = s->out = -1;
+  if (s->pid > 0)
+    waitpid (s->pid, NULL, 0);
+  s->pid = 0;
+  s->state = ZM_DEAD;
+  s->gated = 0;
+
+  while ((c = zm_queue_get (&s->sent)) != NULL
+         || (c = zm_queue_get (&s->waiting)) != NULL) {
+    p->lost++;
+    zm_command_done (p, c, NULL, 0);
+  }
+}
+
+
+/**
+   zm_session_feed
+
+   Writes waiting commands to a session until depth are outstanding or
+   a gate is.  The lines are short and few, so they fit in the pipe
+   even while the session is busy writing output we have not read.
+*/
+static void
+zm_session_feed
+(
+ zm_pool           *p,
+ struct zm_session *s
+)
+{
+  struct zm_command *c;
+  size_t             len, off;
+  ssize_t            n;
+
+  while (s->state == ZM_READY && !s->gated && s->sent.count < p->depth
+         && (c = zm_queue_get (&s->waiting)) != NULL) {
+    zm_queue_put (&s->sent, c);
+    if (c->gate)
+      s->gated = 1;
+    len = strlen (c->line);
+    c->line[len++] = '\n';              /* Room was left for it. */
+    for (off = 0; off < len; off += n) {
+      if ((n = write (s->in, c->line + off, len - off)) < 0) {
+        if (errno == EINTR) {
+          n = 0;
+          continue;
+        }
+        zm_session_close (p, s);
+        return;
+      }
+    }
+    c->line[len - 1] = '\0';
+  }
+}
+
+
+/* Whether a whole prompt starts at buf[at]; if so, where it ends. */
+static int
+zm_prompt
+(
+ zm_pool           *p,
+ struct zm_session *s,
+ size_t             at,
+ size_t            *end
+)
+{
+  size_t i, n = strlen (p->prompt);
+
+  if (s->len - at < n + 2 || memcmp (s->buf + at, p->prompt, n) != 0)
+    return 0;
+  i = at + n;
+  if (s->buf[i] == ' ')                 /* "mbox user@domain> " */
+    for (i++; i < s->len && s->buf[i] != '>' && !isspace ((unsigned char)s->buf[i]); i++)
+      ;
+  if (i + 1 >= s->len || s->buf[i] != '>' || s->buf[i + 1] != ' ')
+    return 0;
+  *end = i + 2;
+
+  return 1;
+}
+
+
+/* Hands back the output of every command a prompt has ended. */
+static void
+zm_session_parse
+(
+ zm_pool           *p,
+ struct zm_session *s
+)
+{
+  struct zm_command *c, *skip;
+  size_t             at, end;
+
+  for (at = s->scan; at < s->len; ) {
+    if (!zm_prompt (p, s, at, &end)) {
+      while (at < s->len && s->buf[at] != '\n')
+        at++;
+      if (at == s->len)
+        break;
+      s->scan = ++at;
+      continue;
+    }
+
+    if (s->state == ZM_STARTING)
+      s->state = ZM_READY;              /* The banner, if any, is dropped. */
+    else if ((c = zm_queue_get (&s->sent)) != NULL) {
+      s->buf[at] = '\0';
+      if (c->gate) {
+        s->gated = 0;
+        if (zm_command_done (p, c, s->buf, at) != 0) {
+          while (s->waiting.head != NULL && !s->waiting.head->gate) {
+            skip = zm_queue_get (&s->waiting);
+            zm_command_done (p, skip, NULL, 0);
+          }
+        }
+      } else
+        zm_command_done (p, c, s->buf, at);
+    }
+
+    memmove (s->buf, s->buf + end, s->len - end + 1);
+    s->len -= end;
+    at = s->scan = 0;
+  }
+}
+
+
+/* Reads what a session has written.  Returns -1 if out of memory. */
+static int
+zm_session_read
+(
+ zm_pool           *p,
+ struct zm_session *s
+)
+{
+  ssize_t  n;
+  char    *buf;
+
+  if (s->max - s->len < 4096) {
+    if ((buf = realloc (s->buf, s->max ? 2 * s->max : 16384)) == NULL)
+      return -1;
+    s->buf = buf;
+    s->max = s->max ? 2 * s->max : 16384;
+  }
+
+  if ((n = read (s->out, s->buf + s->len, s->max - s->len - 1)) < 0) {
+    if (errno == EINTR || errno == EAGAIN)
+      return 0;
+    n = 0;
+  }
+  if (n == 0) {
+    zm_session_close (p, s);
+    return 0;
+  }
+  s->len += n;
+  s->buf[s->len] = '\0';
+
+  zm_session_parse (p, s);
+  zm_session_feed (p, s);
+
+  return 0;
+}
+
+
+/**
+   zm_pool_wait
+
+   Waits until some session has written output, and handles it, so a
+   caller can wait for a command it depends on to finish.  Returns 0,
+   or -1 with errno set.
+*/
+int
+zm_pool_wait
+(
+ zm_pool *p
+)
+{
+  struct pollfd *fds;
+  int           *which, i, n = 0, status = 0;
+
+  if ((fds = malloc (p->count * sizeof (*fds))) == NULL
+      || (which = malloc (p->count * sizeof (*which))) == NULL) {
+    free (fds);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  for (i = 0; i < p->count; i++)
+    if (p->sessions[i].state == ZM_STARTING
+        || (p->sessions[i].state == ZM_READY && p->sessions[i].sent.count > 0)) {
+      fds[n].fd = p->sessions[i].out;
+      fds[n].events = POLLIN;
+      which[n++] = i;
+    }
+
+  if (n > 0) {
+    if (poll (fds, n, -1) < 0 && errno != EINTR)
+      status = -1;
+    for (i = 0; i < n && status == 0; i++)
+      if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+        if (zm_session_read (p, &p->sessions[which[i]]) != 0) {
+          errno = ENOMEM;
+          status = -1;
+        }
+  }
+
+  free (fds);
+  free (which);
+
+  return status;
+}
+
+
+/**
+   zm_pool_new
+
+   Starts sessions copies of command, which is run by /bin/sh and
+   prompts with a line starting with prompt and ending in "> ".  Up
+   to depth commands are sent to a session ahead of its answers.  fn,
+   if not NULL, is called with the output of each command, less the
+   prompt that follows it, and the tag it was submitted with; or with
+   NULL output if the command never ran.  For a gate, fn returns
+   non-zero to drop the commands behind it.  Returns NULL with errno
+   set if the sessions cannot be started.
+*/
+zm_pool *
+zm_pool_new
+(
+ const char *command,
+ const char *prompt,
+ int         sessions,
+ int         depth,
+ int       (*fn)(const char *, size_t, void *, void *),
+ void       *arg
+)
+{
+  zm_pool *p;
+  int      i;
+
+  if (sessions < 1)
+    sessions = 1;
+  if ((p = calloc (1, sizeof (*p))) == NULL
+      || (p->sessions = calloc (sessions, sizeof (*p->sessions))) == NULL
+      || (p->prompt = strdup (prompt)) == NULL) {
+    if (p != NULL)
+      free (p->sessions);
+    free (p);
+    errno = ENOMEM;
+    return NULL;
+  }
+  p->depth = depth < 1 ? 1 : depth;
+  p->fn = fn;
+  p->arg = arg;
+
+  for (i = 0; i < sessions; i++, p->count++) {
+    p->sessions[i].in = p->sessions[i].out = -1;
+    if (zm_session_start (&p->sessions[i], command) != 0) {
+      int err = errno;
+
+      zm_pool_free (p);
+      errno = err;
+      return NULL;
+    }
+  }
+
+  return p;
+}
+
+
+/**
+   zm_pool_route
+
+   Returns the session that commands for key, an account name, should
+   go to, so that they run in the order submitted; or -1 if every
+   session has died.  A key keeps its session while that session
+   lives.
+*/
+int
+zm_pool_route
+(
+ zm_pool    *p,
+ const char *key
+)
+{
+  unsigned long h = 2166136261UL;       /* FNV-1a */
+  int           i, n;
+
+  for (; *key != '\0'; key++)
+    h = ((h ^ tolower ((unsigned char)*key)) * 16777619UL) & 0xffffffffUL;
+  for (i = 0, n = h % p->count; i < p->count; i++, n = (n + 1) % p->count)
+    if (p->sessions[n].state != ZM_DEAD)
+      return n;
+
+  return -1;
+}
+
+
+/**
+   zm_pool_submit
+
+   Queues a command line, without its newline, on the given session,
+   or on the least loaded one if session is -1, waiting while that
+   queue is full.  A gate holds back the commands behind it until it
+   answers.  Returns 0, or -1 with errno set; EPIPE if the session has
+   died, or every one has.
+*/
+int
+zm_pool_submit
+(
+ zm_pool    *p,
+ int         session,
+ const char *line,
+ void       *tag,
+ int         gate
+)
+{
+  struct zm_session *s;
+  struct zm_command *c;
+  int                i, load, best;
+
+  if (session < 0) {
+    for (i = 0, best = -1; i < p->count; i++) {
+      if (p->sessions[i].state == ZM_DEAD)
+        continue;
+      load = p->sessions[i].sent.count + p->sessions[i].waiting.count;
+      if (session < 0 || load < best) {
+        session = i;
+        best = load;
+      }
+    }
+    if (session < 0) {
+      errno = EPIPE;
+      return -1;
+    }
+  }
+  s = &p->sessions[session];
+
+  while (s->state != ZM_DEAD && s->waiting.count >= ZM_QUEUE_MAX)
+    if (zm_pool_wait (p) != 0)
+      return -1;
+  if (s->state == ZM_DEAD) {
+    errno = EPIPE;
+    return -1;
+  }
+
+  if ((c = malloc (sizeof (*c))) == NULL
+      || (c->line = malloc (strlen (line) + 2)) == NULL) {
+    free (c);
+    errno = ENOMEM;
+    return -1;
+  }
+  strcpy (c->line, line);
+  c->tag = tag;
+  c->gate = gate;
+  zm_queue_put (&s->waiting, c);
+  zm_session_feed (p, s);
+
+  return 0;
+}
+
+
+/**
+   zm_pool_drain
+
+   Waits for every command submitted to finish.  Returns the number of
+   commands lost to sessions that died, or -1 with errno set.
+*/
+long
+zm_pool_drain
+(
+ zm_pool *p
+)
+{
+  struct zm_session *s;
+  int                i;
+
+  for (;;) {
+    for (i = 0; i < p->count; i++) {
+      s = &p->sessions[i];
+      if (s->state == ZM_STARTING
+          || (s->state == ZM_READY && s->sent.count + s->waiting.count > 0))
+        break;
+    }
+    if (i == p->count)
+      break;
+    if (zm_pool_wait (p) != 0)
+      return -1;
+  }
+
+  return p->lost;
+}
+
+
+/* Whether a command's output holds an error line, as both tools print. */
+int
+zm_output_error
+(
+ const char *out
+)
+{
+  const char *s;
+
+  for (s = out; (s = strstr (s, "ERROR: ")) != NULL; s++)
+    if (s == out || s[-1] == '\n')
+      return 1;
+
+  return 0;
+}
+
+
+/**
+   zm_pool_free
+
+   Closes every session's input, so each exits, and waits for them.
+   Commands still queued or running are lost.  Returns the number of
+   commands lost in all.
+*/
+long
+zm_pool_free
+(
+ zm_pool *p
+)
+{
+  long lost;
+  int  i;
+
+  for (i = 0; i < p->count; i++) {
+    if (p->sessions[i].in >= 0) {
+      close (p->sessions[i].in);
+      p->sessions[i].in = -1;
+    }
+  }
+  for (i = 0; i < p->count; i++) {
+    if (p->sessions[i].state != ZM_DEAD)
+      zm_session_close (p, &p->sessions[i]);
+    free (p->sessions[i].buf);
+  }
+  lost = p->lost;
+  free (p->sessions);
+  free (p->prompt);
+  free (p);
+
+  return lost;
+}
@@ -0,0 +1,197 @@
+/**********************************************************************
+ * libdlsync (C) M. Brent Harp 2010-2012
+ *
+ * Synchronize Zimbra distribution lists from LDAP.
+ *
+ * All state lives in a dl_context.  Calls on different contexts may
+ * run concurrently in different threads; a single context must only
+ * be used by one thread at a time.
+ ***********************************************************************/
+
+#ifndef DLSYNC_H
+#define DLSYNC_H
+
+#include <stdio.h>
+#include <time.h>
+#include <ldap.h>
+
+#define DL_SUCCESS (0)
+#define DL_FAILURE (-1)
+
+enum dl_read_policy {
+  DL_READ_MASTER,                 /* All reads go to the master. */
+  DL_READ_ROUND_ROBIN,            /* Rotate reads over healthy replicas. */
+  DL_READ_LEAST_LATENCY           /* Read from the fastest healthy replica. */
+};
+
+enum dl_err {
+  DL_ERR_NONE,
+  DL_ERR_LDAP,
+  DL_ERR_LDAP_CONNECT,
+  DL_ERR_LDAP_URL,
+  DL_ERR_NO_LIST_SELECTED,
+  DL_ERR_UNRECOGNIZED_SYNC_SOURCE,
+  DL_ERR_LIST_NOT_FOUND,
+  DL_ERR_OUT_OF_MEMORY,
+  DL_ERR_UNSORTED,
+  DL_ERR_TIMEOUT,
+  DL_ERR_INDEX
+};
+
+enum dl_index_op {
+  DL_INDEX_ADD,                   /* Member joined the list. */
+  DL_INDEX_DEL                    /* Member left the list. */
+};
+
+#define DL_LATENCY_SAMPLES (128)        /* Read latencies kept for hedging. */
+
+typedef struct dl_batch dl_batch;
+typedef struct dl_cos_list dl_cos_list;
+typedef struct zm_pool  zm_pool;
+
+
+typedef struct dl_replica {
+  char   *url;                    /* Replica URL. */
+  LDAP   *ldap;                   /* Bound handle, or NULL. */
+  int     healthy;                /* Zero once a connect or read fails. */
+  time_t  retry_at;               /* When to try an unhealthy replica again. */
+  double  latency;                /* Smoothed read latency (ms). */
+} dl_replica;
+
+
+/* A class of service, as dl_cos_read keeps it. */
+struct dl_cos {
+  char   *id;                     /* zimbraId. */
+  char   *name;                   /* cn. */
+  void   *data;                   /* The caller's, from dl_cos_read's fn. */
+};
+
+
+typedef struct dl_context {
+
+  /* Options */
+  const char *program_name;       /* Prefix for messages. */
+  int   debug;                    /* Trace to stderr. */
+  int   usezmprov;                /* Mirror changes through zmprov. */
+  int   delete_shared_folders;    /* Remove mounted shares on add. */
+  int   create_shared_folders;    /* Mount published shares on add. */
+  int   server_side_sort;         /* Stream sorted source results. */
+  char *sync_attribute;           /* Source attribute holding addresses. */
+
+  /* Zimbra directory */
+  LDAP *ldap;                     /* Handle to Zimbra directory. */
+  char *ldap_url;                 /* Zimbra directory URL. */
+  char *ldap_base;                /* Zimbra directory search base. */
+  int   ldap_scope;               /* Zimbra directory search scope. */
+  char *ldap_binddn;              /* Zimbra admin DN. */
+  char *ldap_passwd;              /* Zimbra admin password. */
+  int   ldap_version;
+
+  /* Read replicas */
+  int         read_policy;        /* enum dl_read_policy */
+  char       *replica_urls;       /* Space separated replica URLs. */
+  dl_replica *replicas;
+  int         replica_count;
+  int         replica_next;       /* Round robin position. */
+  int         read_master;        /* Force reads to the master. */
+  LDAP       *read_ldap;          /* Handle that served the last read. */
+  char       *members_csn;        /* entryCSN seen by dl_get_members. */
+
+  /* Timeouts */
+  int         op_timeout;         /* Seconds per connect or operation; 0 for none. */
+  int         list_timeout;       /* Seconds per list sync; 0 for none. */
+  double      deadline;           /* Monotonic time the current list must finish by. */
+  int         hedge;              /* Re-send slow replica reads to a second replica. */
+  double      samples[DL_LATENCY_SAMPLES]; /* Recent replica read latencies (ms). */
+  int         sample_count;
+
+  /* Reverse membership index */
+  struct dl_index_log *index_log; /* Changes logged for dl_index_commit. */
+
+  /* Selected list */
+  char  *name;                    /* Name of selected list. */
+  char  *ldap_dn;                 /* LDAP DN of selected list. */
+  char **share_info;              /* Share info. */
+  int    share_info_count;        /* Number of shares. */
+
+  /* Helper processes */
+  FILE *zmprov;
+  FILE *zmmailbox;
+
+  /* Errors */
+  int   error;                    /* Error code (enum dl_err). */
+  int   ldap_error;               /* LDAP result code, if error is DL_ERR_LDAP. */
+
+} dl_context;
+
+
+dl_context *dl_context_new (void);
+void        dl_context_free (dl_context *);
+
+void        dl_zmsetvars (int, char *[]);
+int         dl_init (dl_context *);
+int         dl_cleanup (dl_context *);
+const char *dl_strerror (dl_context *);
+void        dl_perror (dl_context *, const char *);
+
+int         dl_select (dl_context *, const char *);
+char       *dl_get_name (dl_context *);
+char      **dl_get_members (dl_context *);
+int         dl_add_members (dl_context *, char **);
+int         dl_remove_members (dl_context *, char **);
+int         dl_add_member (dl_context *, const char *);
+int         dl_remove_member (dl_context *, const char *);
+
+int         dl_ldap_sync (dl_context *, const char *, const char *,
+                          const char *, const char *, int *);
+int         dl_sync (dl_context *, const char *, const char *,
+                     const char *, const char *, int *);
+
+int         dl_index_open (dl_context *, const char *);
+int         dl_index_begin (dl_context *, char **, int);
+int         dl_index_note (dl_context *, char **, int, int);
+int         dl_index_commit (dl_context *);
+void        dl_index_close (dl_context *);
+int         dl_index_lookup (dl_context *, const char *, const char *,
+                             void (*)(const char *, void *), void *);
+
+int         dl_search_paged (dl_context *, const char *, const char *, char **,
+                             int (*)(dl_context *, LDAPMessage *, void *), void *);
+size_t      dl_filter_escape (char *, const char *);
+int         dl_search_accounts (dl_context *, char **, long, char **,
+                                int (*)(dl_context *, LDAPMessage *, void *), void *);
+dl_cos_list *dl_cos_read (dl_context *, char **,
+                          void *(*)(dl_context *, LDAPMessage *, void *), void *);
+const struct dl_cos *dl_cos_find (dl_cos_list *, const char *, const char *);
+void        dl_cos_free (dl_cos_list *, void (*)(void *));
+dl_batch   *dl_batch_new (dl_context *, int,
+                          void (*)(dl_context *, const char *, int, void *), void *);
+int         dl_batch_modify (dl_batch *, const char *, LDAPMod **);
+int         dl_batch_flush (dl_batch *);
+int         dl_batch_free (dl_batch *, long *, long *);
+
+int         zmprov_open (dl_context *);
+int         zmprov_close (dl_context *);
+int         zmprov_add_dl_member (dl_context *, const char *, const char *);
+int         zmprov_remove_dl_member (dl_context *, const char *, const char *);
+
+int         zmmailbox_open (dl_context *);
+int         zmmailbox_close (dl_context *);
+int         zmmailbox_select_mailbox (dl_context *, const char *);
+int         zmmailbox_create_mountpoint (dl_context *, const char *, const char *,
+                                         const char *, const char *);
+int         zmmailbox_delete_folder (dl_context *, const char *);
+
+zm_pool    *zm_pool_new (const char *, const char *, int, int,
+                         int (*)(const char *, size_t, void *, void *), void *);
+int         zm_pool_route (zm_pool *, const char *);
+int         zm_pool_submit (zm_pool *, int, const char *, void *, int);
+int         zm_pool_wait (zm_pool *);
+long        zm_pool_drain (zm_pool *);
+long        zm_pool_free (zm_pool *);
+int         zm_output_error (const char *);
+
+int         dl_alphasort (const void *, const void *);
+int         dl_alphacasesort (const void *, const void *);
+
+#endif /* DLSYNC_H */
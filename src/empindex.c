@@ -0,0 +1,423 @@
+/**********************************************************************
+ * empindex
+ *
+ * Key index for empnomail: a snapshot of an extract's keys, kept so
+ * later runs can join against it or report what changed.
+ *
+ * The index is a single file, written in native byte order and read
+ * by mapping it into memory:
+ *
+ *   struct emp_index_header            magic, key spec, counts
+ *   struct emp_index_entry [count]     one per key, sorted by key
+ *   char strings [strings]             key text
+ *
+ * Each entry holds the offset of its first row in the extract, the
+ * number of rows with the key and a hash of their text, so a changed
+ * row shows up as a changed hash without keeping the rows themselves.
+ ***********************************************************************/
+
+#include <string.h>
+
+#include <config.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "empnomail.h"
+
+#define EMP_INDEX_MAGIC "EMX1"
+
+struct emp_index_header {
+  char     magic[4];
+  uint32_t delim;                       /* Key spec the index was built with. */
+  uint32_t field;
+  uint32_t length;
+  uint32_t localpart;
+  uint32_t reserved;
+  uint64_t count;                       /* Number of entries. */
+  uint64_t strings;                     /* Size of the string table. */
+};
+
+struct emp_index_entry {
+  uint64_t hash;                        /* Hash of the key's rows. */
+  uint64_t offset;                      /* First row in the extract. */
+  uint64_t key;                         /* Offset of the key text. */
+  uint32_t keylen;
+  uint32_t rows;                        /* Rows with this key. */
+};
+
+
+
+/* ---- Reading ---- */
+
+
+/**
+   emp_index_open
+
+   Maps an index file and checks that it was built with the same key
+   spec and that every key lies inside its string table.  Returns 0,
+   or -1 with errno set (EINVAL if it is not a usable index).
+*/
+int
+emp_index_open
+(
+ struct emp_index          *ix,
+ const char                *path,
+ const struct emp_key_spec *spec
+)
+{
+  const struct emp_index_header *h;
+  struct stat                    st;
+  size_t                         i;
+  int                            fd;
+
+  memset (ix, 0, sizeof (*ix));
+
+  if ((fd = open (path, O_RDONLY)) < 0)
+    return -1;
+
+  if (fstat (fd, &st) < 0) {
+    close (fd);
+    return -1;
+  }
+  if (st.st_size < (off_t)sizeof (struct emp_index_header)) {
+    close (fd);
+    errno = EINVAL;
+    return -1;
+  }
+
+  ix->base = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (ix->base == MAP_FAILED) {
+    ix->base = NULL;
+    return -1;
+  }
+  ix->size = st.st_size;
+
+  h = ix->base;
+  ix->count = h->count;
+  ix->entries = (const struct emp_index_entry *)(h + 1);
+  ix->strings = (const char *)(ix->entries + h->count);
+
+  if (memcmp (h->magic, EMP_INDEX_MAGIC, 4) != 0
+      || h->count > ix->size / sizeof (struct emp_index_entry)
+      || h->strings > ix->size
+      || sizeof (struct emp_index_header)
+         + h->count * sizeof (struct emp_index_entry) + h->strings != ix->size
+      || h->delim != (uint32_t)spec->delim || h->field != (uint32_t)spec->field
+      || h->length != spec->length || h->localpart != (uint32_t)spec->localpart) {
+    emp_index_close (ix);
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* Every key must lie inside the string table. */
+  for (i = 0; i < ix->count; i++)
+    if (ix->entries[i].key > h->strings
+        || ix->entries[i].keylen > h->strings - ix->entries[i].key) {
+      emp_index_close (ix);
+      errno = EINVAL;
+      return -1;
+    }
+
+  return 0;
+}
+
+
+void
+emp_index_close
+(
+ struct emp_index *ix
+)
+{
+  if (ix->base != NULL)
+    munmap (ix->base, ix->size);
+  memset (ix, 0, sizeof (*ix));
+}
+
+
+/**
+   emp_index_key
+
+   Points key at the key of entry i and returns its length.
+*/
+size_t
+emp_index_key
+(
+ const struct emp_index  *ix,
+ size_t                   i,
+ const char             **key
+)
+{
+  *key = ix->strings + ix->entries[i].key;
+  return ix->entries[i].keylen;
+}
+
+
+uint64_t
+emp_index_hash
+(
+ const struct emp_index *ix,
+ size_t                  i
+)
+{
+  return ix->entries[i].hash;
+}
+
+
+
+/* ---- Snapshots ---- */
+
+
+static int
+emp_line_compare
+(
+ const void *a,
+ const void *b
+)
+{
+  const struct emp_line *x = a, *y = b;
+  int c;
+
+  if ((c = emp_key_compare (x->key, x->keylen, y->key, y->keylen)) != 0)
+    return c;
+
+  return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+
+/* Reads compressed input, or a pipe, into memory in place of a mapping. */
+static int
+emp_snapshot_read
+(
+ struct emp_snapshot *snap,
+ int                  fd
+)
+{
+  struct emp_scan  scan;
+  const char      *line;
+  char            *map;
+  size_t           max = 0;
+  ssize_t          len;
+
+  if ((lseek (fd, 0, SEEK_SET) != 0 && errno != ESPIPE) || emp_scan_init (&scan, fd) != 0)
+    return -1;
+
+  snap->copied = 1;
+  while ((len = emp_scan_line (&scan, &line)) > 0) {
+    if (snap->size + len > max) {
+      max = max ? 2 * max : EMP_SCAN_BLOCK;
+      while (max < snap->size + len)
+        max *= 2;
+      if ((map = realloc (snap->map, max)) == NULL) {
+        len = -1;
+        errno = ENOMEM;
+        break;
+      }
+      snap->map = map;
+    }
+    memcpy (snap->map + snap->size, line, len);
+    snap->size += len;
+  }
+  emp_scan_free (&scan);
+
+  return len < 0 ? -1 : 0;
+}
+
+
+/**
+   emp_snapshot_take
+
+   Maps the regular file fd, or reads it in if it is compressed or
+   not a regular file, and groups its lines by key: lines are sorted
+   by key, in file order within a key, and each group gets the hash
+   of its rows.  Lines with an empty key are left out.  Returns 0, or
+   -1 with errno set.
+*/
+int
+emp_snapshot_take
+(
+ struct emp_snapshot       *snap,
+ int                        fd,
+ const struct emp_key_spec *spec
+)
+{
+  struct emp_line  *lines;
+  struct emp_group *g;
+  struct stat       st;
+  const char       *p, *end, *nl;
+  size_t            i, len, max = 0, body;
+
+  memset (snap, 0, sizeof (*snap));
+
+  if (fstat (fd, &st) != 0)
+    return -1;
+
+  /* A pipe's size says nothing of what is in it, and it cannot be mapped. */
+  if (!S_ISREG (st.st_mode) || emp_zip_detect (fd) != EMP_ZIP_NONE) {
+    if (emp_snapshot_read (snap, fd) != 0) {
+      emp_snapshot_free (snap);
+      return -1;
+    }
+    if (snap->size == 0)
+      return 0;
+  }
+  else {
+    if ((snap->size = st.st_size) == 0)
+      return 0;
+
+    snap->map = mmap (NULL, snap->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (snap->map == MAP_FAILED) {
+      snap->map = NULL;
+      return -1;
+    }
+  }
+  end = snap->map + snap->size;
+
+  for (p = snap->map; p < end; p += len) {
+    nl = memchr (p, '\n', end - p);
+    len = nl ? (size_t)(nl + 1 - p) : (size_t)(end - p);
+
+    if (snap->nlines == max) {
+      max = max ? 2 * max : 4096;
+      if ((lines = realloc (snap->lines, max * sizeof (*lines))) == NULL)
+        goto nomem;
+      snap->lines = lines;
+    }
+    lines = &snap->lines[snap->nlines];
+    lines->key = emp_key (spec, p, len, &lines->keylen);
+    lines->offset = p - snap->map;
+    lines->len = len;
+    if (lines->keylen > 0)
+      snap->nlines++;
+  }
+
+  qsort (snap->lines, snap->nlines, sizeof (struct emp_line), emp_line_compare);
+
+  if ((snap->groups = malloc ((snap->nlines + 1) * sizeof (struct emp_group))) == NULL)
+    goto nomem;
+
+  for (i = 0; i < snap->nlines; i++) {
+    if (i == 0 || emp_key_compare (snap->lines[i].key, snap->lines[i].keylen,
+                                   snap->lines[i-1].key, snap->lines[i-1].keylen) != 0) {
+      g = &snap->groups[snap->ngroups++];
+      g->first = i;
+      g->rows = 0;
+      g->hash = 0;
+    }
+    /* Rows are hashed without their newline, in file order. */
+    body = snap->lines[i].len;
+    if (body > 0 && snap->map[snap->lines[i].offset + body - 1] == '\n')
+      body--;
+    g->hash = g->hash * 1099511628211ULL
+      ^ emp_hash (snap->map + snap->lines[i].offset, body);
+    g->rows++;
+  }
+
+  return 0;
+
+ nomem:
+  emp_snapshot_free (snap);
+  errno = ENOMEM;
+  return -1;
+}
+
+
+void
+emp_snapshot_free
+(
+ struct emp_snapshot *snap
+)
+{
+  if (snap->copied)
+    free (snap->map);
+  else if (snap->map != NULL)
+    munmap (snap->map, snap->size);
+  free (snap->lines);
+  free (snap->groups);
+  memset (snap, 0, sizeof (*snap));
+}
+
+
+/**
+   emp_snapshot_save
+
+   Writes the index of a snapshot to path, through a temporary file
+   renamed into place.  Returns 0, or -1 with errno set.
+*/
+int
+emp_snapshot_save
+(
+ const struct emp_snapshot *snap,
+ const char                *path,
+ const struct emp_key_spec *spec
+)
+{
+  struct emp_index_header  header;
+  struct emp_index_entry   e;
+  const struct emp_line   *line;
+  char                     tmp[PATH_MAX];
+  FILE                    *file;
+  size_t                   i;
+  int                      err;
+
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, EMP_INDEX_MAGIC, 4);
+  header.delim = spec->delim;
+  header.field = spec->field;
+  header.length = spec->length;
+  header.localpart = spec->localpart;
+  header.count = snap->ngroups;
+  for (i = 0; i < snap->ngroups; i++)
+    header.strings += snap->lines[snap->groups[i].first].keylen;
+
+  snprintf (tmp, sizeof (tmp), "%s.tmp", path);
+  if ((file = fopen (tmp, "w")) == NULL)
+    return -1;
+
+  if (fwrite (&header, sizeof (header), 1, file) != 1)
+    goto fail;
+
+  memset (&e, 0, sizeof (e));
+  for (i = 0; i < snap->ngroups; i++) {
+    line = &snap->lines[snap->groups[i].first];
+    e.hash = snap->groups[i].hash;
+    e.offset = line->offset;
+    e.keylen = line->keylen;
+    e.rows = snap->groups[i].rows;
+    if (fwrite (&e, sizeof (e), 1, file) != 1)
+      goto fail;
+    e.key += line->keylen;
+  }
+
+  for (i = 0; i < snap->ngroups; i++) {
+    line = &snap->lines[snap->groups[i].first];
+    if (fwrite (line->key, 1, line->keylen, file) != line->keylen)
+      goto fail;
+  }
+
+  if (fflush (file) != 0 || fsync (fileno (file)) != 0)
+    goto fail;
+  fclose (file);
+
+  if (rename (tmp, path) != 0) {
+    err = errno;
+    unlink (tmp);
+    errno = err;
+    return -1;
+  }
+
+  return 0;
+
+ fail:
+  err = errno;
+  fclose (file);
+  unlink (tmp);
+  errno = err;
+  return -1;
+}
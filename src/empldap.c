@@ -0,0 +1,137 @@
+/**********************************************************************
+ * empldap
+ *
+ * Directory rows for empnomail.  Accounts are read from the Zimbra
+ * directory with a paged search for just the attributes wanted, and
+ * each entry is handed on as a delimited line while the next page is
+ * still to come, so no export file is needed.
+ ***********************************************************************/
+
+#include <string.h>
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dlsync.h"
+#include "empnomail.h"
+
+
+/* What emp_ldap_rows hands each entry on to. */
+struct emp_ldap_rows {
+  char   **attrs;
+  int      delim;
+  char    *buf;
+  size_t   max;
+  int    (*fn)(const char *, size_t, void *);
+  void    *arg;
+};
+
+
+/**
+   emp_ldap_row
+
+   Formats an entry as the first value of each attribute, separated by
+   delim and ending in a newline; a missing attribute is an empty
+   field.  Returns the length, or -1 if out of memory.
+*/
+static ssize_t
+emp_ldap_row
+(
+ LDAP         *ld,
+ LDAPMessage  *entry,
+ char        **attrs,
+ int           delim,
+ char        **buf,
+ size_t       *max
+)
+{
+  char   **values, *p;
+  size_t   len = 0, n;
+  int      i;
+
+  for (i = 0; attrs[i] != NULL; i++) {
+    values = ldap_get_values (ld, entry, attrs[i]);
+    n = values != NULL && values[0] != NULL ? strlen (values[0]) : 0;
+
+    if (len + n + 2 > *max) {
+      if ((p = realloc (*buf, len + n + 256)) == NULL) {
+        if (values != NULL)
+          ldap_value_free (values);
+        return -1;
+      }
+      *buf = p;
+      *max = len + n + 256;
+    }
+
+    if (i > 0)
+      (*buf)[len++] = delim;
+    if (n > 0)
+      memcpy (*buf + len, values[0], n);
+    len += n;
+
+    if (values != NULL)
+      ldap_value_free (values);
+  }
+  (*buf)[len++] = '\n';
+
+  return len;
+}
+
+
+/* dl_search_paged callback: formats an entry and hands it on. */
+static int
+emp_ldap_found
+(
+ dl_context  *ctx,
+ LDAPMessage *entry,
+ void        *arg
+)
+{
+  struct emp_ldap_rows *r = arg;
+  ssize_t               len;
+
+  if ((len = emp_ldap_row (ctx->ldap, entry, r->attrs, r->delim, &r->buf, &r->max)) < 0) {
+    ctx->error = DL_ERR_OUT_OF_MEMORY;
+    return -1;
+  }
+
+  return r->fn (r->buf, len, r->arg) != 0 ? -1 : 0;
+}
+
+
+/**
+   emp_ldap_rows
+
+   Searches the directory under ctx->ldap_base for filter, a page at a
+   time with dl_search_paged, and calls fn with each entry formatted
+   by emp_ldap_row.  The context must be initialized with dl_init.  A
+   non-zero return from fn stops the search.  Returns DL_SUCCESS, or
+   DL_FAILURE with the error in ctx.
+*/
+int
+emp_ldap_rows
+(
+ dl_context  *ctx,
+ const char  *filter,
+ char       **attrs,
+ int          delim,
+ int        (*fn)(const char *, size_t, void *),
+ void        *arg
+)
+{
+  struct emp_ldap_rows r;
+  int                  status;
+
+  r.attrs = attrs;
+  r.delim = delim;
+  r.buf = NULL;
+  r.max = 0;
+  r.fn = fn;
+  r.arg = arg;
+
+  status = dl_search_paged (ctx, NULL, filter, attrs, emp_ldap_found, &r);
+  free (r.buf);
+
+  return status;
+}
@@ -1,37 +1,1044 @@
+/**********************************************************************
+ * empnomail
+ *
+ * Print the lines of an account extract whose key appears in an
+ * employee extract.
+ ***********************************************************************/
+
+#include <string.h>
+
+#include <config.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 
-#define SIZE 1024
+#include "dlsync.h"
+#include "empnomail.h"
+
+struct emp_input {
+  const char          *name;
+  int                  fd;
+  struct emp_key_spec  spec;
+};
+
+char *program_name;
+
+
+
+/*
+----------------------------------------------------------------------
+
+
+                         Local Functions
+
+
+----------------------------------------------------------------------
+*/
+
+
+void
+usage
+(
+ void
+)
+{
+  fprintf(stderr,
+	  "Usage: %s [-H [-j n] | -M [-c] [-S size] [-T dir]] [-t c] [-k n | -1 n -2 n]\n"
+	  "       [-l n] [-e] [-z n] [--semi | --anti | --both] [-x index] keyfile datafile\n"
+	  "       %s [key options] -i index datafile\n"
+	  "       %s [key options] -u index [-x index] keyfile\n"
+	  "       %s [key options] [--semi | --anti | --both] -L filter [-A attrs]\n"
+	  "       [-x index] keyfile\n"
+	  "\n"
+	  "\tPrints the lines of datafile whose key matches the key\n"
+	  "\tof a line in keyfile.  The key is the first %d characters\n"
+	  "\tunless a field is given.\n"
+	  "\n"
+	  "Options:\n"
+	  "  --semi       Print datafile lines with a match (default)\n"
+	  "\n"
+	  "  --anti       Print keyfile lines without a match instead\n"
+	  "\n"
+	  "  --both       Print both, tagged '=' and '<' and a tab\n"
+	  "\n"
+	  "  -t c         Field separator (default tab)\n"
+	  "\n"
+	  "  -k n         Key is field n of both files\n"
+	  "\n"
+	  "  -1 n         Key is field n of keyfile\n"
+	  "\n"
+	  "  -2 n         Key is field n of datafile\n"
+	  "\n"
+	  "  -l n         Use at most n characters of the key (0 for all)\n"
+	  "\n"
+	  "  -e           Key stops at '@', for joining on address localparts\n"
+	  "\n"
+	  "  -H           Hash join; inputs may be in any order\n"
+	  "\n"
+	  "  -j n         Hash join, probing datafile with n threads\n"
+	  "\n"
+	  "  -M           Merge join; unsorted inputs are reported and\n"
+	  "               sorted in temporary files first\n"
+	  "\n"
+	  "  -c           With -M, fail on unsorted input instead\n"
+	  "\n"
+	  "  -S size      Memory for sorting, in MB or with a K, M or G\n"
+	  "               suffix (default %dM)\n"
+	  "\n"
+	  "  -T dir       Directory for sort runs (default $TMPDIR or /tmp)\n"
+	  "\n"
+	  "  -x index     Save an index of keyfile's keys\n"
+	  "\n"
+	  "  -i index     Join datafile against a saved index instead\n"
+	  "               of a keyfile\n"
+	  "\n"
+	  "  -u index     Print only what changed in keyfile since the\n"
+	  "               index was saved: new keys' rows tagged '+',\n"
+	  "               changed rows '~' and dropped keys '-'\n"
+	  "\n"
+	  "  -L filter    Read datafile from the Zimbra directory: one\n"
+	  "               line per entry matching filter\n"
+	  "\n"
+	  "  -A attrs     Comma separated attributes making up each\n"
+	  "               directory line (default %s)\n"
+	  "\n"
+	  "  -z n         Decompress multi-frame zstd input with n threads\n"
+	  "               (default one per processor); gzip and zstd\n"
+	  "               input is recognised and read decompressed\n"
+	  "\n"
+	  "  -d           Debug mode\n"
+	  "\n"
+	  "  -h           Display this help message\n"
+	  "\n"
+	  ,program_name, program_name, program_name, program_name,
+	  EMP_KEY_LENGTH, EMP_SORT_MEMORY, EMP_LDAP_ATTRS);
+}
+
+
+static int
+open_input
+(
+ struct emp_input *in,
+ const char       *path
+)
+{
+  in->name = path;
+  if ((in->fd = open (path, O_RDONLY)) < 0)
+    perror (path);
+
+  return in->fd;
+}
+
+
+/* Writes a line, after tag and a tab if there is a tag, adding the
+   newline a last line may lack. */
+static void
+put_line
+(
+ const char *tag,
+ const char *line,
+ size_t      len
+)
+{
+  if (tag != NULL)
+    printf ("%s\t", tag);
+  fwrite (line, 1, len, stdout);
+  if (len > 0 && line[len-1] != '\n')
+    putchar ('\n');
+}
+
+
+/**
+   parse_size
+
+   Parses a size in megabytes, or in units given by a K, M or G
+   suffix.  Returns 0 if it is not a size.
+*/
+static size_t
+parse_size
+(
+ const char *arg
+)
+{
+  char          *end;
+  unsigned long  n;
+
+  if (arg == NULL || (n = strtoul (arg, &end, 10)) == 0)
+    return 0;
 
-int main ( int argc, char * argv [] )
+  switch (*end) {
+  case 'K': case 'k':
+    return (size_t)n << 10;
+  case '\0':
+  case 'M': case 'm':
+    return (size_t)n << 20;
+  case 'G': case 'g':
+    return (size_t)n << 30;
+  }
+
+  return 0;
+}
+
+
+/**
+   scan_join
+
+   The original forward scan.  Both files must be in the same order
+   and every key must appear in datafile, or later keys are missed.
+*/
+static int
+scan_join
+(
+ struct emp_input *where,
+ struct emp_input *from
+)
 {
-  FILE * where, * from ;
-  char key[SIZE], data[SIZE];
+  struct emp_scan  ks, ds;
+  const char      *k, *d, *kk, *dk;
+  size_t           kklen, dklen;
+  ssize_t          klen, dlen = 0;
+  int              status = EXIT_SUCCESS;
+
+  if (emp_scan_init (&ks, where->fd) != 0 || emp_scan_init (&ds, from->fd) != 0) {
+    fprintf (stderr, "%s: out of memory\n", program_name);
+    return EXIT_FAILURE;
+  }
 
-  if ( (where = fopen ( argv [1], "r" )) == NULL )
-    {
-      exit (1);
+  while ((klen = emp_scan_line (&ks, &k)) > 0) {
+    kk = emp_key (&where->spec, k, klen, &kklen);
+    while ((dlen = emp_scan_line (&ds, &d)) > 0) {
+      dk = emp_key (&from->spec, d, dlen, &dklen);
+      if (emp_key_compare (kk, kklen, dk, dklen) == 0) {
+        put_line (NULL, d, dlen);
+        break;
+      }
     }
+    if (dlen < 0)
+      break;
+  }
 
-  if ( (from = fopen (argv[2], "r")) == NULL )
-    {
-      exit (2);
+  if (klen < 0 || dlen < 0) {
+    perror (program_name);
+    status = EXIT_FAILURE;
+  }
+
+  emp_scan_free (&ks);
+  emp_scan_free (&ds);
+
+  return status;
+}
+
+
+/* Adds a line's key, and with rows the line, to a table. */
+static int
+build_line
+(
+ struct emp_table          *table,
+ const struct emp_key_spec *spec,
+ int                        rows,
+ const char                *line,
+ size_t                     len
+)
+{
+  const char *key;
+  size_t      keylen;
+
+  key = emp_key (spec, line, len, &keylen);
+  if (keylen == 0)
+    return 0;
+
+  return emp_table_insert (table, key, keylen, rows ? line : NULL, len);
+}
+
+
+/**
+   probe_line
+
+   Looks a line's key up in a table.  With mode -1 the table holds
+   keyfile's keys and the line is from datafile; it is printed if it
+   matches.  Otherwise the table holds datafile and the line is from
+   keyfile: its key's rows are printed once for --semi and --both, and
+   the line itself if unmatched for --anti and --both.
+*/
+static void
+probe_line
+(
+ struct emp_table          *table,
+ const struct emp_key_spec *spec,
+ int                        mode,
+ const char                *line,
+ size_t                     len
+)
+{
+  struct emp_slot *slot;
+  const char      *key;
+  size_t           keylen;
+  int64_t          r;
+
+  key = emp_key (spec, line, len, &keylen);
+  slot = keylen > 0 ? emp_table_find (table, key, keylen) : NULL;
+
+  if (mode < 0) {
+    if (slot != NULL)
+      put_line (NULL, line, len);
+  }
+  else if (slot == NULL) {
+    if (mode != EMP_SEMI)
+      put_line (mode == EMP_BOTH ? "<" : NULL, line, len);
+  }
+  else if (mode != EMP_ANTI && !slot->printed) {
+    for (r = slot->row; r >= 0; r = table->rows[r].next)
+      put_line (mode == EMP_BOTH ? "=" : NULL,
+                table->arena + table->rows[r].offset, table->rows[r].length);
+    slot->printed = 1;
+  }
+}
+
+
+/**
+   hash_join
+
+   Builds a key table from one input and streams the other through
+   it, so the result does not depend on input order.
+
+   For a semi-join from a smaller keyfile, only keyfile's keys are
+   stored and datafile is printed in its own order.  Otherwise the
+   table is built from datafile, with its lines unless only the
+   anti-join is wanted, and keyfile is streamed: matching datafile
+   lines are printed once per key and unmatched keyfile lines as they
+   come.  Lines with an empty key never match.
+
+   With more than one thread a semi-join always builds from keyfile,
+   and the streamed file, if regular, is probed in parallel; --both
+   is always probed on one thread.
+*/
+static int
+hash_join
+(
+ struct emp_input *where,
+ struct emp_input *from,
+ int               mode,
+ int               nthreads
+)
+{
+  struct emp_table  table;
+  struct emp_scan   scan;
+  struct emp_input *build, *probe;
+  struct stat       ws, fs;
+  const char       *line;
+  ssize_t           len;
+  int               build_keys, rows;
+
+  if (fstat (where->fd, &ws) != 0 || fstat (from->fd, &fs) != 0) {
+    perror (program_name);
+    return EXIT_FAILURE;
+  }
+  build_keys = mode == EMP_SEMI && (ws.st_size <= fs.st_size || nthreads > 1);
+  rows = !build_keys && mode != EMP_ANTI;
+  build = build_keys ? where : from;
+  probe = build_keys ? from : where;
+
+  memset (&scan, 0, sizeof (scan));
+
+  /* Assume rows of about 64 bytes to size the table. */
+  if (emp_table_init (&table, (build_keys ? ws.st_size : fs.st_size) / 64) != 0
+      || emp_scan_init (&scan, build->fd) != 0)
+    goto nomem;
+
+  while ((len = emp_scan_line (&scan, &line)) > 0)
+    if (build_line (&table, &build->spec, rows, line, len) != 0)
+      goto nomem;
+  if (len < 0)
+    goto fail;
+
+  if (emp_table_seal (&table) != 0)
+    goto nomem;
+
+  /* Compressed input has to go through the scanner. */
+  if (nthreads > 1 && mode != EMP_BOTH && S_ISREG (build_keys ? fs.st_mode : ws.st_mode)
+      && emp_zip_detect (probe->fd) == EMP_ZIP_NONE) {
+    if (emp_probe_parallel (&table, &probe->spec, probe->fd, nthreads,
+                            mode == EMP_ANTI, stdout) != 0)
+      goto fail;
+  }
+  else {
+    emp_scan_free (&scan);
+    if (emp_scan_init (&scan, probe->fd) != 0)
+      goto nomem;
+    while ((len = emp_scan_line (&scan, &line)) > 0)
+      probe_line (&table, &probe->spec, build_keys ? -1 : mode, line, len);
+    if (len < 0)
+      goto fail;
+  }
+
+  emp_scan_free (&scan);
+  emp_table_free (&table);
+  return EXIT_SUCCESS;
+
+ nomem:
+  errno = ENOMEM;
+ fail:
+  perror (program_name);
+  emp_scan_free (&scan);
+  emp_table_free (&table);
+  return EXIT_FAILURE;
+}
+
+
+/**
+   merge_join
+
+   Merges the two inputs in key order.  Inputs that are not already
+   sorted are reported and sorted with bounded memory first, or with
+   opts->check make the join fail.  Output is in key order.
+*/
+static int
+merge_join
+(
+ struct emp_input              *where,
+ struct emp_input              *from,
+ int                            mode,
+ const struct emp_sort_options *opts
+)
+{
+  struct emp_stream  keys, data;
+  const char        *k = NULL, *d = NULL, *kk, *dk = NULL;
+  char              *last = NULL, *p;
+  size_t             kklen, dklen = 0, lastlen = 0, lastmax = 0;
+  ssize_t            klen, dlen;
+  int                c, status = EXIT_SUCCESS;
+
+  if (emp_stream_open (&keys, where->fd, where->name, &where->spec, opts) != 0)
+    return EXIT_FAILURE;
+  if (emp_stream_open (&data, from->fd, from->name, &from->spec, opts) != 0) {
+    emp_stream_close (&keys);
+    return EXIT_FAILURE;
+  }
+
+  klen = emp_stream_next (&keys, &k);
+  dlen = emp_stream_next (&data, &d);
+
+  while (klen > 0 && dlen >= 0 && (dlen > 0 || mode != EMP_SEMI)) {
+    kk = emp_key (&where->spec, k, klen, &kklen);
+    if (dlen > 0) {
+      dk = emp_key (&from->spec, d, dlen, &dklen);
+      c = emp_key_compare (kk, kklen, dk, dklen);
     }
+    else
+      c = -1;
 
-  while (fgets(key, SIZE, where) != 0)
-    {
-      while (fgets(data, SIZE, from) != 0)
-        {
-          if (strncmp(key,data,9) == 0)
-            {
-              printf("%s",data);
-              break;
-            }
-          else
-            {
-              continue;
-            }
+    if (c < 0) {
+      /* Done with this keyfile line; it matched if its key did. */
+      if (mode != EMP_SEMI
+          && (last == NULL || emp_key_compare (kk, kklen, last, lastlen) != 0))
+        put_line (mode == EMP_BOTH ? "<" : NULL, k, klen);
+      klen = emp_stream_next (&keys, &k);
+    }
+    else {
+      if (c == 0 && dklen > 0) {
+        if (mode != EMP_ANTI)
+          put_line (mode == EMP_BOTH ? "=" : NULL, d, dlen);
+        if (dklen > lastmax) {
+          if ((p = realloc (last, dklen)) == NULL) {
+            dlen = -1;
+            break;
+          }
+          last = p;
+          lastmax = dklen;
         }
+        memcpy (last, dk, dklen);
+        lastlen = dklen;
+      }
+      dlen = emp_stream_next (&data, &d);
     }
+  }
+
+  if (klen < 0 || dlen < 0) {
+    fprintf (stderr, "%s: join failed\n", program_name);
+    status = EXIT_FAILURE;
+  }
+
+  free (last);
+  emp_stream_close (&keys);
+  emp_stream_close (&data);
+
+  return status;
 }
 
+
+struct directory_join {
+  struct emp_table          *table;
+  const struct emp_key_spec *spec;
+  int                        mode;      /* As for probe_line, or -2 to build. */
+};
+
+
+static int
+directory_row
+(
+ const char *line,
+ size_t      len,
+ void       *arg
+)
+{
+  struct directory_join *dj = arg;
+
+  if (dj->mode == -2) {
+    if (build_line (dj->table, dj->spec, 1, line, len) != 0) {
+      fprintf (stderr, "%s: out of memory\n", program_name);
+      return -1;
+    }
+  }
+  else
+    probe_line (dj->table, dj->spec, dj->mode, line, len);
+
+  return 0;
+}
+
+
+/**
+   directory_join
+
+   Joins keyfile with accounts read straight from the directory.  Each
+   entry matching filter becomes a datafile line of the values of
+   attrs, separated by the datafile delimiter.  For --semi the table
+   is built from keyfile and entries are probed as their pages arrive;
+   otherwise the entries are loaded into the table page by page and
+   keyfile is streamed through it.
+*/
+static int
+directory_join
+(
+ struct emp_input *where,
+ struct emp_input *from,
+ const char       *filter,
+ char            **attrs,
+ int               mode,
+ int               debug
+)
+{
+  struct directory_join  dj;
+  struct emp_table       table;
+  struct emp_scan        scan;
+  struct stat            ws;
+  dl_context            *ctx;
+  const char            *line;
+  ssize_t                len = 0;
+  int                    status = EXIT_FAILURE;
+
+  memset (&table, 0, sizeof (table));
+  memset (&scan, 0, sizeof (scan));
+
+  if ((ctx = dl_context_new ()) == NULL) {
+    fprintf (stderr, "%s: out of memory\n", program_name);
+    return EXIT_FAILURE;
+  }
+  ctx->program_name = program_name;
+  ctx->debug = debug;
+
+  if (dl_init (ctx) != DL_SUCCESS) {
+    dl_perror (ctx, "directory");
+    goto cleanup;
+  }
+
+  if (fstat (where->fd, &ws) != 0 || emp_table_init (&table, ws.st_size / 64) != 0
+      || emp_scan_init (&scan, where->fd) != 0) {
+    perror (program_name);
+    goto cleanup;
+  }
+
+  dj.table = &table;
+  dj.spec = &from->spec;
+
+  if (mode == EMP_SEMI) {
+    while ((len = emp_scan_line (&scan, &line)) > 0)
+      if (build_line (&table, &where->spec, 0, line, len) != 0)
+        break;
+    if (len != 0 || emp_table_seal (&table) != 0) {
+      perror (where->name);
+      goto cleanup;
+    }
+    dj.mode = -1;
+    if (emp_ldap_rows (ctx, filter, attrs, from->spec.delim, directory_row, &dj) != DL_SUCCESS) {
+      if (ctx->error != DL_ERR_NONE)
+        dl_perror (ctx, "directory");
+      goto cleanup;
+    }
+  }
+  else {
+    dj.mode = -2;
+    if (emp_ldap_rows (ctx, filter, attrs, from->spec.delim, directory_row, &dj) != DL_SUCCESS) {
+      if (ctx->error != DL_ERR_NONE)
+        dl_perror (ctx, "directory");
+      goto cleanup;
+    }
+    if (emp_table_seal (&table) != 0) {
+      perror (program_name);
+      goto cleanup;
+    }
+    while ((len = emp_scan_line (&scan, &line)) > 0)
+      probe_line (&table, &where->spec, mode, line, len);
+    if (len < 0) {
+      perror (where->name);
+      goto cleanup;
+    }
+  }
+
+  status = EXIT_SUCCESS;
+
+ cleanup:
+  emp_scan_free (&scan);
+  emp_table_free (&table);
+  dl_context_free (ctx);
+
+  return status;
+}
+
+
+/* Splits a comma separated attribute list into a NULL terminated array. */
+static char **
+split_attrs
+(
+ char *list
+)
+{
+  char **attrs, *s, *last;
+  int    n = 2;
+
+  for (s = list; *s; s++)
+    if (*s == ',')
+      n++;
+
+  if ((attrs = calloc (n, sizeof (char *))) == NULL)
+    return NULL;
+
+  for (n = 0, s = strtok_r (list, ",", &last); s; s = strtok_r (NULL, ",", &last))
+    attrs[n++] = s;
+
+  return attrs;
+}
+
+
+/**
+   index_join
+
+   Prints the lines of datafile whose key is in the index made from an
+   earlier keyfile.  The key table is loaded straight from the mapped
+   index, without reading or parsing the keyfile, and probed as in
+   hash_join.
+*/
+static int
+index_join
+(
+ const char       *index_path,
+ struct emp_input *where,
+ struct emp_input *from,
+ int               nthreads
+)
+{
+  struct emp_index  ix;
+  struct emp_table  table;
+  struct emp_scan   scan;
+  struct stat       fs;
+  const char       *line, *key;
+  size_t            i, keylen;
+  ssize_t           len = 0;
+
+  if (emp_index_open (&ix, index_path, &where->spec) != 0) {
+    perror (index_path);
+    return EXIT_FAILURE;
+  }
+
+  memset (&scan, 0, sizeof (scan));
+  memset (&table, 0, sizeof (table));
+  if (fstat (from->fd, &fs) != 0 || emp_table_init (&table, ix.count) != 0)
+    goto fail;
+  for (i = 0; i < ix.count; i++) {
+    keylen = emp_index_key (&ix, i, &key);
+    if (emp_table_insert (&table, key, keylen, NULL, 0) != 0)
+      goto fail;
+  }
+  emp_index_close (&ix);
+  if (emp_table_seal (&table) != 0)
+    goto fail;
+
+  if (nthreads > 1 && S_ISREG (fs.st_mode) && emp_zip_detect (from->fd) == EMP_ZIP_NONE) {
+    if (emp_probe_parallel (&table, &from->spec, from->fd, nthreads, 0, stdout) != 0)
+      goto fail;
+  }
+  else {
+    if (emp_scan_init (&scan, from->fd) != 0)
+      goto fail;
+    while ((len = emp_scan_line (&scan, &line)) > 0) {
+      key = emp_key (&from->spec, line, len, &keylen);
+      if (keylen > 0 && emp_table_find (&table, key, keylen) != NULL)
+        put_line (NULL, line, len);
+    }
+    if (len < 0)
+      goto fail;
+  }
+
+  emp_scan_free (&scan);
+  emp_table_free (&table);
+  return EXIT_SUCCESS;
+
+ fail:
+  perror (program_name);
+  emp_index_close (&ix);
+  emp_scan_free (&scan);
+  emp_table_free (&table);
+  return EXIT_FAILURE;
+}
+
+
+static void
+put_group
+(
+ const char                *tag,
+ const struct emp_snapshot *snap,
+ const struct emp_group    *g
+)
+{
+  const struct emp_line *line;
+  size_t                 i;
+
+  for (i = 0; i < g->rows; i++) {
+    line = &snap->lines[g->first + i];
+    put_line (tag, snap->map + line->offset, line->len);
+  }
+}
+
+
+/**
+   delta
+
+   Compares an extract with the index of an earlier one and prints the
+   rows of keys that are new, tagged '+', or whose rows changed,
+   tagged '~', and the keys that are gone, tagged '-', in key order.
+   A missing index counts as empty.  With new_path, saves the index
+   of the extract there.
+*/
+static int
+delta
+(
+ const char       *old_path,
+ const char       *new_path,
+ struct emp_input *in
+)
+{
+  struct emp_snapshot  snap;
+  struct emp_index     ix;
+  const struct emp_line *line;
+  const char          *key;
+  size_t               i = 0, j = 0, keylen;
+  int                  c, status = EXIT_SUCCESS;
+
+  if (emp_snapshot_take (&snap, in->fd, &in->spec) != 0) {
+    perror (in->name);
+    return EXIT_FAILURE;
+  }
+
+  if (emp_index_open (&ix, old_path, &in->spec) != 0 && errno != ENOENT) {
+    perror (old_path);
+    emp_snapshot_free (&snap);
+    return EXIT_FAILURE;
+  }
+
+  while (i < snap.ngroups || j < ix.count) {
+    if (i == snap.ngroups)
+      c = 1;
+    else if (j == ix.count)
+      c = -1;
+    else {
+      line = &snap.lines[snap.groups[i].first];
+      keylen = emp_index_key (&ix, j, &key);
+      c = emp_key_compare (line->key, line->keylen, key, keylen);
+    }
+
+    if (c < 0)
+      put_group ("+", &snap, &snap.groups[i++]);
+    else if (c > 0) {
+      keylen = emp_index_key (&ix, j++, &key);
+      put_line ("-", key, keylen);
+    }
+    else {
+      if (snap.groups[i].hash != emp_index_hash (&ix, j))
+        put_group ("~", &snap, &snap.groups[i]);
+      i++;
+      j++;
+    }
+  }
+
+  emp_index_close (&ix);
+
+  if (new_path != NULL && emp_snapshot_save (&snap, new_path, &in->spec) != 0) {
+    perror (new_path);
+    status = EXIT_FAILURE;
+  }
+
+  emp_snapshot_free (&snap);
+
+  return status;
+}
+
+
+/* Saves the index of keyfile after a join. */
+static int
+save_index
+(
+ const char       *path,
+ struct emp_input *in
+)
+{
+  struct emp_snapshot snap;
+  int                 status = EXIT_SUCCESS;
+
+  if (emp_snapshot_take (&snap, in->fd, &in->spec) != 0) {
+    perror (in->name);
+    return EXIT_FAILURE;
+  }
+  if (emp_snapshot_save (&snap, path, &in->spec) != 0) {
+    perror (path);
+    status = EXIT_FAILURE;
+  }
+  emp_snapshot_free (&snap);
+
+  return status;
+}
+
+
+/*
+----------------------------------------------------------------------
+
+
+                         Main
+
+
+----------------------------------------------------------------------
+*/
+
+
+int
+main
+(
+ int argc,
+ char *argv[]
+)
+{
+  struct emp_sort_options opts;
+  struct emp_input where, from;
+  struct stat st;
+  char *s;
+  int   hash = 0;
+  int   merge = 0;
+  int   nthreads = 1;
+  int   mode = EMP_SEMI;
+  char *index_path = NULL;
+  char *use_index = NULL;
+  char *delta_index = NULL;
+  char *filter = NULL;
+  char *attrs = NULL;
+  char **attr_list;
+  int   status;
+
+  program_name = argv[0];
+  if ((emp_zip_threads = sysconf (_SC_NPROCESSORS_ONLN)) < 1)
+    emp_zip_threads = 1;
+
+  memset (&where, 0, sizeof (where));
+  where.spec.delim = '\t';
+  where.spec.length = (size_t)-1;
+  from.spec = where.spec;
+
+  memset (&opts, 0, sizeof (opts));
+  opts.memory = (size_t)EMP_SORT_MEMORY << 20;
+  if ((opts.tmpdir = getenv ("TMPDIR")) == NULL)
+    opts.tmpdir = "/tmp";
+
+  while (--argc > 0 && (*++argv)[0] == '-') {
+    if (argv[0][1] == '-') {
+      if (strcmp (argv[0], "--semi") == 0)
+        mode = EMP_SEMI;
+      else if (strcmp (argv[0], "--anti") == 0)
+        mode = EMP_ANTI;
+      else if (strcmp (argv[0], "--both") == 0)
+        mode = EMP_BOTH;
+      else {
+        fprintf (stderr, "%s: illegal option %s\n", program_name, argv[0]);
+        usage ();
+        exit (EXIT_FAILURE);
+      }
+      continue;
+    }
+    for (s = argv[0]+1; *s != '\0'; s++)
+      switch (*s) {
+      case 'H':                 /* Hash join */
+        hash = 1;
+        break;
+      case 'j':                 /* Probe threads */
+        hash = 1;
+        nthreads = atoi (*++argv);
+        --argc;
+        break;
+      case 'x':                 /* Index to write */
+        index_path = *++argv;
+        --argc;
+        break;
+      case 'i':                 /* Index to join against */
+        use_index = *++argv;
+        --argc;
+        break;
+      case 'u':                 /* Index to report changes from */
+        delta_index = *++argv;
+        --argc;
+        break;
+      case 'L':                 /* Read datafile from the directory */
+        filter = *++argv;
+        --argc;
+        break;
+      case 'A':                 /* Directory attributes */
+        attrs = *++argv;
+        --argc;
+        break;
+      case 'M':                 /* Merge join */
+        merge = 1;
+        break;
+      case 'c':                 /* Require sorted input */
+        opts.check = 1;
+        break;
+      case 'S':                 /* Sort memory (MB) */
+        opts.memory = parse_size (*++argv);
+        --argc;
+        break;
+      case 'T':                 /* Sort directory */
+        opts.tmpdir = *++argv;
+        --argc;
+        break;
+      case 'z':                 /* Decompression threads */
+        emp_zip_threads = atoi (*++argv);
+        --argc;
+        break;
+      case 'd':                 /* Toggle debug mode */
+        opts.debug = !opts.debug;
+        break;
+      case 't':                 /* Field separator */
+        where.spec.delim = from.spec.delim = (*++argv)[0];
+        --argc;
+        break;
+      case 'k':                 /* Key field of both files */
+        where.spec.field = from.spec.field = atoi (*++argv);
+        --argc;
+        break;
+      case '1':                 /* Key field of keyfile */
+        where.spec.field = atoi (*++argv);
+        --argc;
+        break;
+      case '2':                 /* Key field of datafile */
+        from.spec.field = atoi (*++argv);
+        --argc;
+        break;
+      case 'l':                 /* Key length */
+        where.spec.length = from.spec.length = atoi (*++argv);
+        --argc;
+        break;
+      case 'e':                 /* Key stops at '@' */
+        where.spec.localpart = from.spec.localpart = 1;
+        break;
+      case 'h':                 /* Help */
+        usage ();
+        exit (EXIT_SUCCESS);
+      default:
+        fprintf (stderr, "%s: illegal option %c\n", program_name, *s);
+        usage ();
+        exit (EXIT_FAILURE);
+      }
+  }
+
+  if (argc != ((use_index || delta_index || filter) ? 1 : 2)
+      || (hash && merge) || opts.memory == 0 || nthreads < 1
+      || emp_zip_threads < 1
+      || (filter && (merge || use_index || delta_index))
+      || where.spec.field < 0 || from.spec.field < 0
+      || (use_index && (delta_index || index_path || mode != EMP_SEMI))) {
+    usage ();
+    exit (EXIT_FAILURE);
+  }
+
+  /* Without a field the key is the fixed width prefix. */
+  if (where.spec.length == (size_t)-1)
+    where.spec.length = where.spec.field ? 0 : EMP_KEY_LENGTH;
+  if (from.spec.length == (size_t)-1)
+    from.spec.length = from.spec.field ? 0 : EMP_KEY_LENGTH;
+
+  setvbuf (stdout, NULL, _IOFBF, EMP_SCAN_BLOCK);
+
+  if (use_index) {
+    if (open_input (&from, argv[0]) < 0)
+      exit (2);
+    status = index_join (use_index, &where, &from, nthreads);
+    fflush (stdout);
+    exit (status);
+  }
+
+  if (open_input (&where, argv[0]) < 0)
+    exit (1);
+
+  /* -x reads keyfile again after the join; a pipe is empty by then. */
+  if (index_path != NULL && !delta_index
+      && (fstat (where.fd, &st) != 0 || !S_ISREG (st.st_mode))) {
+    fprintf (stderr, "%s: %s: -x needs keyfile to be a regular file\n",
+             program_name, argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  if (delta_index) {
+    status = delta (delta_index, index_path, &where);
+    fflush (stdout);
+    exit (status);
+  }
+
+  if (filter) {
+    from.name = "directory";
+    if (attrs == NULL && (attrs = strdup (EMP_LDAP_ATTRS)) == NULL) {
+      perror (program_name);
+      exit (EXIT_FAILURE);
+    }
+    if ((attr_list = split_attrs (attrs)) == NULL) {
+      perror (program_name);
+      exit (EXIT_FAILURE);
+    }
+    status = directory_join (&where, &from, filter, attr_list, mode, opts.debug);
+    if (index_path != NULL && status == EXIT_SUCCESS)
+      status = save_index (index_path, &where);
+    fflush (stdout);
+    exit (status);
+  }
+
+  if (open_input (&from, argv[1]) < 0)
+    exit (2);
+
+  /* The forward scan only finds matches. */
+  if (merge)
+    status = merge_join (&where, &from, mode, &opts);
+  else if (hash || mode != EMP_SEMI)
+    status = hash_join (&where, &from, mode, nthreads);
+  else
+    status = scan_join (&where, &from);
+
+  if (index_path != NULL && status == EXIT_SUCCESS)
+    status = save_index (index_path, &where);
+
+  if (fflush (stdout) != 0) {
+    perror (program_name);
+    status = EXIT_FAILURE;
+  }
+
+  close (where.fd);
+  close (from.fd);
+
+  exit (status);
+}
@@ -0,0 +1,260 @@
+/**********************************************************************
+ * empnomail
+ *
+ * Join an employee extract against an account extract on a key taken
+ * from the start of each line or from a delimited field.
+ ***********************************************************************/
+
+#ifndef EMPNOMAIL_H
+#define EMPNOMAIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#define EMP_KEY_LENGTH (9)              /* Default key is the first 9 characters. */
+#define EMP_SCAN_BLOCK (1 << 20)        /* Bytes read at a time. */
+#define EMP_BLOOM_BITS (16)             /* Bloom filter bits per key. */
+
+enum emp_mode {
+  EMP_SEMI,                             /* Datafile lines with a match. */
+  EMP_ANTI,                             /* Keyfile lines without a match. */
+  EMP_BOTH                              /* Both, tagged '=' and '<'. */
+};
+
+#define EMP_SORT_MEMORY (64)            /* Default sort memory (MB). */
+#define EMP_MERGE_WAYS  (64)            /* Runs merged at once. */
+
+extern char *program_name;
+
+
+
+/*
+  Keys.  By default the key is the first EMP_KEY_LENGTH characters of
+  the line.  With a field number it is that field, split on delim; it
+  may then be cut at the '@' of an address and to a maximum length.
+*/
+
+struct emp_key_spec {
+  int    delim;                         /* Field separator. */
+  int    field;                         /* 1-based field, or 0 for the whole line. */
+  size_t length;                        /* Maximum key length, or 0 for any. */
+  int    localpart;                     /* Key stops at '@'. */
+};
+
+const char      *emp_key (const struct emp_key_spec *, const char *, size_t, size_t *);
+int              emp_key_compare (const char *, size_t, const char *, size_t);
+
+
+/*
+  Compressed input.  A gzip or zstd file is decompressed by its own
+  threads, a buffer ahead of the reader; see empzip.c.
+*/
+
+enum emp_zip_format {
+  EMP_ZIP_NONE,
+  EMP_ZIP_GZIP,
+  EMP_ZIP_ZSTD
+};
+
+struct emp_zip;
+
+extern int       emp_zip_threads;
+
+int              emp_zip_detect (int);
+struct emp_zip  *emp_zip_open (int, int);
+ssize_t          emp_zip_read (struct emp_zip *, char *, size_t);
+void             emp_zip_close (struct emp_zip *);
+
+
+/*
+  Line scanner.  Reads large blocks and splits them with memchr; a
+  line longer than the buffer grows it, so any length is read whole.
+  Compressed input is recognised and read decompressed.
+*/
+
+struct emp_scan {
+  int             fd;
+  struct emp_zip *zip;                  /* Decompressor, or NULL for plain input. */
+  char           *buf;
+  size_t          size;
+  size_t          pos;                  /* Start of the next line. */
+  size_t          end;                  /* End of the data read. */
+  size_t          seen;                 /* Bytes after pos known to hold no newline. */
+  int             eof;
+};
+
+int              emp_scan_init (struct emp_scan *, int);
+ssize_t          emp_scan_line (struct emp_scan *, const char **);
+int              emp_scan_rewind (struct emp_scan *);
+void             emp_scan_free (struct emp_scan *);
+
+
+/*
+  Key table.  An open addressing hash table of keys, each with an
+  optional chain of rows, all stored in one growable arena so the
+  table can be rebuilt without moving the strings.  Once sealed, a
+  blocked Bloom filter (one 64-bit word per key) answers most misses
+  without touching the table.
+*/
+
+struct emp_row {
+  size_t  offset;                       /* Row text in the arena. */
+  size_t  length;
+  int64_t next;                         /* Next row with the same key, or -1. */
+};
+
+struct emp_slot {
+  uint64_t hash;                        /* 0 marks an empty slot. */
+  size_t   key;                         /* Key text in the arena. */
+  size_t   keylen;
+  int64_t  row;                         /* First row, or -1. */
+  int64_t  last;                        /* Last row, for appending. */
+  int      printed;                     /* Rows already written. */
+};
+
+struct emp_table {
+  struct emp_slot *slots;
+  size_t           mask;                /* Capacity - 1; capacity is a power of 2. */
+  size_t           count;
+  char            *arena;
+  size_t           arena_size;
+  size_t           arena_max;
+  struct emp_row  *rows;
+  size_t           nrows;
+  size_t           maxrows;
+  uint64_t        *bloom;               /* NULL until sealed. */
+  size_t           bloom_mask;
+};
+
+uint64_t         emp_hash (const char *, size_t);
+int              emp_table_init (struct emp_table *, size_t);
+void             emp_table_free (struct emp_table *);
+int              emp_table_insert (struct emp_table *, const char *, size_t,
+                                   const char *, size_t);
+struct emp_slot *emp_table_find (const struct emp_table *, const char *, size_t);
+int              emp_table_seal (struct emp_table *);
+
+int              emp_probe_parallel (const struct emp_table *,
+                                     const struct emp_key_spec *, int, int, int,
+                                     FILE *);
+
+
+/*
+  Key index.  A snapshot groups an extract's lines by key; its index
+  file keeps, per key, the key, the row count, the first row's offset
+  and a hash of the rows, and is mapped to answer lookups.
+*/
+
+struct emp_line {
+  const char *key;
+  size_t      keylen;
+  size_t      offset;                   /* Line position in the extract. */
+  size_t      len;
+};
+
+struct emp_group {
+  size_t   first;                       /* First line with the key. */
+  size_t   rows;
+  uint64_t hash;                        /* Hash of the rows, in file order. */
+};
+
+struct emp_snapshot {
+  char             *map;                /* The extract, mapped. */
+  size_t            size;
+  int               copied;             /* map was read into memory instead. */
+  struct emp_line  *lines;              /* Sorted by key, then position. */
+  size_t            nlines;
+  struct emp_group *groups;
+  size_t            ngroups;
+};
+
+struct emp_index {
+  void                         *base;
+  size_t                        size;
+  size_t                        count;
+  const struct emp_index_entry *entries;
+  const char                   *strings;
+};
+
+int              emp_index_open (struct emp_index *, const char *,
+                                 const struct emp_key_spec *);
+void             emp_index_close (struct emp_index *);
+size_t           emp_index_key (const struct emp_index *, size_t, const char **);
+uint64_t         emp_index_hash (const struct emp_index *, size_t);
+
+int              emp_snapshot_take (struct emp_snapshot *, int,
+                                    const struct emp_key_spec *);
+int              emp_snapshot_save (const struct emp_snapshot *, const char *,
+                                    const struct emp_key_spec *);
+void             emp_snapshot_free (struct emp_snapshot *);
+
+/*
+  Directory rows.  Entries from a paged search of the Zimbra directory,
+  each formatted as a line of attribute values.
+*/
+
+#define EMP_LDAP_ATTRS "employeeNumber,mail" /* Default row attributes. */
+
+struct dl_context;
+
+int              emp_ldap_rows (struct dl_context *, const char *, char **, int,
+                                int (*)(const char *, size_t, void *), void *);
+
+/*
+  Sorted streams.  Yields the lines of an input in key order, reading
+  the file directly when it is already sorted, and otherwise sorting
+  it in runs of bounded size spilled to temporary files.
+*/
+
+struct emp_sort_options {
+  size_t      memory;                   /* Bytes of lines held per run. */
+  const char *tmpdir;                   /* Where runs are spilled. */
+  int         check;                    /* Fail on unsorted input instead of sorting. */
+  int         debug;
+};
+
+struct emp_run {
+  FILE       *file;
+  char       *line;
+  size_t      max;
+  ssize_t     len;
+  const char *key;                      /* Key of the current line. */
+  size_t      keylen;
+};
+
+struct emp_stream {
+  const char     *name;
+  const struct emp_key_spec *spec;
+  struct emp_scan scan;
+  int             direct;               /* Sorted input read directly. */
+  char           *prev;                 /* Previous key, to check the order. */
+  size_t          prevlen;
+  size_t          prevmax;
+  unsigned long   lineno;
+
+  /* Last run, kept in memory when nothing was spilled. */
+  char           *arena;
+  size_t          used;
+  size_t          size;
+  struct emp_rec *recs;
+  size_t          nrecs;
+  size_t          maxrecs;
+  size_t          next;
+
+  /* Spilled runs and their merge heap. */
+  struct emp_run *runs;
+  size_t          nruns;
+  size_t         *heap;
+  size_t          nheap;
+  int             pending;              /* Top run must advance before the next read. */
+};
+
+int              emp_stream_open (struct emp_stream *, int, const char *,
+                                  const struct emp_key_spec *,
+                                  const struct emp_sort_options *);
+ssize_t          emp_stream_next (struct emp_stream *, const char **);
+void             emp_stream_close (struct emp_stream *);
+
+#endif /* EMPNOMAIL_H */
@@ -0,0 +1,236 @@
+/**********************************************************************
+ * empprobe
+ *
+ * Parallel probe phase for the empnomail hash join.  The probe file
+ * is mapped and cut into line-aligned chunks; worker threads look
+ * each line up in the shared, read-only key table and buffer their
+ * matches, which the calling thread writes out in input order.
+ ***********************************************************************/
+
+#include <string.h>
+
+#include <config.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "empnomail.h"
+
+#define EMP_CHUNKS_PER_THREAD (4)       /* Keeps threads busy when chunks differ. */
+#define EMP_CHUNK_MIN         (1 << 20) /* Smallest chunk worth a thread. */
+
+struct emp_chunk {
+  const char *start;
+  const char *end;
+  char       *out;                      /* Matching lines. */
+  size_t      len;
+  size_t      max;
+  int         done;                     /* 1 when probed, -1 if out of memory. */
+};
+
+struct emp_probe {
+  const struct emp_table    *table;
+  const struct emp_key_spec *spec;
+  int                        absent;    /* Keep lines whose key is missing. */
+  struct emp_chunk          *chunks;
+  size_t                     nchunks;
+  size_t                     next;      /* Next chunk to hand out. */
+  pthread_mutex_t            lock;
+  pthread_cond_t             done;
+};
+
+
+static int
+emp_chunk_put
+(
+ struct emp_chunk *c,
+ const char       *line,
+ size_t            len
+)
+{
+  char   *out;
+  size_t  need = len + (line[len-1] != '\n');
+
+  if (c->len + need > c->max) {
+    size_t max = c->max ? 2 * c->max : 64 * 1024;
+    while (max < c->len + need)
+      max *= 2;
+    if ((out = realloc (c->out, max)) == NULL)
+      return -1;
+    c->out = out;
+    c->max = max;
+  }
+
+  memcpy (c->out + c->len, line, len);
+  c->len += len;
+  if (need > len)
+    c->out[c->len++] = '\n';
+
+  return 0;
+}
+
+
+static int
+emp_chunk_probe
+(
+ struct emp_probe *p,
+ struct emp_chunk *c
+)
+{
+  const char *line, *nl, *key;
+  size_t      len, keylen;
+  int         found;
+
+  for (line = c->start; line < c->end; line += len) {
+    nl = memchr (line, '\n', c->end - line);
+    len = nl ? (size_t)(nl + 1 - line) : (size_t)(c->end - line);
+    key = emp_key (p->spec, line, len, &keylen);
+    found = keylen > 0 && emp_table_find (p->table, key, keylen) != NULL;
+    if (found != p->absent && emp_chunk_put (c, line, len) != 0)
+      return -1;
+  }
+
+  return 1;
+}
+
+
+static void *
+emp_probe_worker
+(
+ void *arg
+)
+{
+  struct emp_probe *p = arg;
+  size_t            i;
+  int               done;
+
+  for (;;) {
+    pthread_mutex_lock (&p->lock);
+    i = p->next++;
+    pthread_mutex_unlock (&p->lock);
+    if (i >= p->nchunks)
+      break;
+
+    done = emp_chunk_probe (p, &p->chunks[i]);
+
+    pthread_mutex_lock (&p->lock);
+    p->chunks[i].done = done;
+    pthread_cond_broadcast (&p->done);
+    pthread_mutex_unlock (&p->lock);
+  }
+
+  return NULL;
+}
+
+
+/**
+   emp_probe_parallel
+
+   Writes to out the lines of the regular file fd whose key is in
+   table, or with absent those whose key is not, in file order,
+   probing with nthreads threads.  Returns 0, or -1 with errno set.
+*/
+int
+emp_probe_parallel
+(
+ const struct emp_table    *table,
+ const struct emp_key_spec *spec,
+ int                        fd,
+ int                        nthreads,
+ int                        absent,
+ FILE                      *out
+)
+{
+  struct emp_probe  p;
+  struct stat       st;
+  pthread_t        *threads;
+  const char       *map, *end, *q;
+  size_t            size, i, step;
+  int               t, started = 0, status = 0, err = 0;
+
+  if (fstat (fd, &st) != 0)
+    return -1;
+  if ((size = st.st_size) == 0)
+    return 0;
+
+  if ((map = mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+    return -1;
+  end = map + size;
+
+  memset (&p, 0, sizeof (p));
+  p.table = table;
+  p.spec = spec;
+  p.absent = absent != 0;
+
+  step = size / ((size_t)nthreads * EMP_CHUNKS_PER_THREAD);
+  if (step < EMP_CHUNK_MIN)
+    step = EMP_CHUNK_MIN;
+
+  threads = calloc (nthreads, sizeof (pthread_t));
+  p.chunks = calloc (size / step + 1, sizeof (struct emp_chunk));
+  if (threads == NULL || p.chunks == NULL) {
+    err = ENOMEM;
+    status = -1;
+    goto out;
+  }
+
+  /* Cut chunks just after the first newline past each step. */
+  for (q = map; q < end; p.nchunks++) {
+    p.chunks[p.nchunks].start = q;
+    if ((size_t)(end - q) <= step || (q = memchr (q + step, '\n', end - q - step)) == NULL)
+      q = end;
+    else
+      q++;
+    p.chunks[p.nchunks].end = q;
+  }
+
+  pthread_mutex_init (&p.lock, NULL);
+  pthread_cond_init (&p.done, NULL);
+
+  for (t = 0; t < nthreads; t++) {
+    if (pthread_create (&threads[t], NULL, emp_probe_worker, &p) != 0)
+      break;
+    started++;
+  }
+
+  /* Without any threads, probe here. */
+  if (started == 0)
+    emp_probe_worker (&p);
+
+  for (i = 0; i < p.nchunks; i++) {
+    pthread_mutex_lock (&p.lock);
+    while (p.chunks[i].done == 0)
+      pthread_cond_wait (&p.done, &p.lock);
+    pthread_mutex_unlock (&p.lock);
+
+    if (p.chunks[i].done < 0) {
+      err = ENOMEM;
+      status = -1;
+    }
+    if (status == 0)
+      fwrite (p.chunks[i].out, 1, p.chunks[i].len, out);
+    free (p.chunks[i].out);
+    p.chunks[i].out = NULL;
+  }
+
+  for (t = 0; t < started; t++)
+    pthread_join (threads[t], NULL);
+
+  pthread_mutex_destroy (&p.lock);
+  pthread_cond_destroy (&p.done);
+
+ out:
+  free (threads);
+  free (p.chunks);
+  munmap ((void *)map, size);
+
+  if (status != 0)
+    errno = err;
+
+  return status;
+}
@@ -0,0 +1,236 @@
+/**********************************************************************
+ * empscan
+ *
+ * Block line scanner and key extraction for empnomail.
+ ***********************************************************************/
+
+#include <string.h>
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#include "empnomail.h"
+
+
+
+/* ---- Scanner ---- */
+
+
+/* Starts a decompressor if the input is compressed. */
+static int
+emp_scan_unzip
+(
+ struct emp_scan *sc
+)
+{
+  int format = emp_zip_detect (sc->fd);
+
+  if (format != EMP_ZIP_NONE && (sc->zip = emp_zip_open (sc->fd, format)) == NULL) {
+    emp_scan_free (sc);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+int
+emp_scan_init
+(
+ struct emp_scan *sc,
+ int              fd
+)
+{
+  memset (sc, 0, sizeof (*sc));
+  sc->fd = fd;
+  sc->size = EMP_SCAN_BLOCK;
+
+  if ((sc->buf = malloc (sc->size)) == NULL)
+    return -1;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  return emp_scan_unzip (sc);
+}
+
+
+void
+emp_scan_free
+(
+ struct emp_scan *sc
+)
+{
+  emp_zip_close (sc->zip);
+  sc->zip = NULL;
+  free (sc->buf);
+  sc->buf = NULL;
+}
+
+
+/**
+   emp_scan_rewind
+
+   Starts again from the beginning of a seekable input.
+*/
+int
+emp_scan_rewind
+(
+ struct emp_scan *sc
+)
+{
+  if (sc->zip != NULL) {
+    emp_zip_close (sc->zip);
+    sc->zip = NULL;
+  }
+  if (lseek (sc->fd, 0, SEEK_SET) != 0)
+    return -1;
+
+  sc->pos = sc->end = sc->seen = 0;
+  sc->eof = 0;
+
+  return emp_scan_unzip (sc);
+}
+
+
+/**
+   emp_scan_line
+
+   Points line at the next line, including its newline if it has one,
+   valid until the next call.  Returns its length, 0 at the end of the
+   input, or -1 on error.
+*/
+ssize_t
+emp_scan_line
+(
+ struct emp_scan  *sc,
+ const char      **line
+)
+{
+  char    *nl, *buf;
+  size_t   len;
+  ssize_t  n;
+
+  for (;;) {
+    nl = memchr (sc->buf + sc->pos + sc->seen, '\n', sc->end - sc->pos - sc->seen);
+    if (nl != NULL) {
+      len = nl + 1 - (sc->buf + sc->pos);
+      *line = sc->buf + sc->pos;
+      sc->pos += len;
+      sc->seen = 0;
+      return len;
+    }
+    sc->seen = sc->end - sc->pos;
+
+    if (sc->eof) {
+      if ((len = sc->end - sc->pos) == 0)
+        return 0;
+      *line = sc->buf + sc->pos;
+      sc->pos = sc->end;
+      sc->seen = 0;
+      return len;
+    }
+
+    /* Keep the partial line and read more after it. */
+    if (sc->pos > 0) {
+      memmove (sc->buf, sc->buf + sc->pos, sc->end - sc->pos);
+      sc->end -= sc->pos;
+      sc->pos = 0;
+    }
+    if (sc->end == sc->size) {
+      if ((buf = realloc (sc->buf, 2 * sc->size)) == NULL)
+        return -1;
+      sc->buf = buf;
+      sc->size *= 2;
+    }
+
+    if (sc->zip != NULL)
+      n = emp_zip_read (sc->zip, sc->buf + sc->end, sc->size - sc->end);
+    else
+      do
+        n = read (sc->fd, sc->buf + sc->end, sc->size - sc->end);
+      while (n < 0 && errno == EINTR);
+
+    if (n < 0)
+      return -1;
+    if (n == 0)
+      sc->eof = 1;
+    sc->end += n;
+  }
+}
+
+
+
+/* ---- Keys ---- */
+
+
+/**
+   emp_key
+
+   Finds the key in line as spec describes and sets keylen.  A line
+   without the field has an empty key.
+*/
+const char *
+emp_key
+(
+ const struct emp_key_spec *spec,
+ const char                *line,
+ size_t                     len,
+ size_t                    *keylen
+)
+{
+  const char *end = line + len, *p = line, *q;
+  int         field;
+
+  if (len > 0 && end[-1] == '\n')
+    end--;
+  if (end > line && end[-1] == '\r')
+    end--;
+
+  for (field = spec->field; field > 1; field--) {
+    if ((q = memchr (p, spec->delim, end - p)) == NULL) {
+      *keylen = 0;
+      return end;
+    }
+    p = q + 1;
+  }
+
+  if (spec->field > 0 && (q = memchr (p, spec->delim, end - p)) != NULL)
+    end = q;
+
+  if (spec->localpart && (q = memchr (p, '@', end - p)) != NULL)
+    end = q;
+
+  *keylen = end - p;
+  if (spec->length > 0 && *keylen > spec->length)
+    *keylen = spec->length;
+
+  return p;
+}
+
+
+/**
+   emp_key_compare
+
+   Orders keys bytewise, as sort(1) does with LC_ALL=C.
+*/
+int
+emp_key_compare
+(
+ const char *a,
+ size_t      alen,
+ const char *b,
+ size_t      blen
+)
+{
+  int c = memcmp (a, b, alen < blen ? alen : blen);
+
+  if (c != 0)
+    return c;
+
+  return alen < blen ? -1 : alen > blen;
+}
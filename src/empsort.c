@@ -0,0 +1,633 @@
+/**********************************************************************
+ * empsort
+ *
+ * Sorted input streams for the empnomail merge join.  An input that
+ * is already in key order is read directly; anything else is sorted
+ * in memory-bounded runs, spilled to temporary files and merged.
+ ***********************************************************************/
+
+#include <string.h>
+
+#include <config.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "empnomail.h"
+
+struct emp_rec {
+  const char *line;
+  size_t      offset;                   /* Position in the run, for a stable sort. */
+  size_t      len;
+  size_t      key;                      /* Key position in the line. */
+  size_t      keylen;
+};
+
+
+
+/* ---- Runs ---- */
+
+
+static FILE *
+emp_tmpfile
+(
+ const char *dir
+)
+{
+  FILE *file;
+  char *path;
+  int   fd;
+
+  if ((path = malloc (strlen (dir) + sizeof ("/empnomailXXXXXX"))) == NULL)
+    return NULL;
+  sprintf (path, "%s/empnomailXXXXXX", dir);
+
+  if ((fd = mkstemp (path)) < 0) {
+    perror (path);
+    free (path);
+    return NULL;
+  }
+  unlink (path);
+  free (path);
+
+  if ((file = fdopen (fd, "w+")) == NULL)
+    close (fd);
+
+  return file;
+}
+
+
+static int
+emp_rec_compare
+(
+ const void *a,
+ const void *b
+)
+{
+  const struct emp_rec *x = a, *y = b;
+  int c;
+
+  c = emp_key_compare (x->line + x->key, x->keylen, y->line + y->key, y->keylen);
+  if (c != 0)
+    return c;
+
+  return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+
+static void
+emp_sort_recs
+(
+ struct emp_stream *s
+)
+{
+  size_t i;
+
+  /* The arena may have moved while it grew. */
+  for (i = 0; i < s->nrecs; i++)
+    s->recs[i].line = s->arena + s->recs[i].offset;
+
+  qsort (s->recs, s->nrecs, sizeof (struct emp_rec), emp_rec_compare);
+}
+
+
+static int
+emp_add_run
+(
+ struct emp_stream *s,
+ FILE              *file
+)
+{
+  struct emp_run *runs;
+
+  if ((runs = realloc (s->runs, (s->nruns + 1) * sizeof (*runs))) == NULL)
+    return -1;
+  s->runs = runs;
+
+  memset (&runs[s->nruns], 0, sizeof (*runs));
+  runs[s->nruns++].file = file;
+
+  return 0;
+}
+
+
+/**
+   emp_spill
+
+   Sorts the lines held in memory and writes them out as a new run.
+   Returns -1 if the run could not be written in full.
+*/
+static int
+emp_spill
+(
+ struct emp_stream             *s,
+ const struct emp_sort_options *opts
+)
+{
+  FILE   *file;
+  size_t  i;
+
+  emp_sort_recs (s);
+
+  if ((file = emp_tmpfile (opts->tmpdir)) == NULL)
+    return -1;
+
+  for (i = 0; i < s->nrecs; i++)
+    if (fwrite (s->recs[i].line, 1, s->recs[i].len, file) != s->recs[i].len)
+      break;
+
+  /* A short run would silently drop lines, as on a full disk. */
+  if (i < s->nrecs || ferror (file)
+      || fflush (file) != 0 || fseek (file, 0, SEEK_SET) != 0) {
+    perror (opts->tmpdir);
+    fclose (file);
+    return -1;
+  }
+
+  if (emp_add_run (s, file) != 0) {
+    fclose (file);
+    return -1;
+  }
+
+  if (opts->debug)
+    fprintf (stderr, "%s: %s: spilled run %lu of %lu lines\n",
+             program_name, s->name, (unsigned long)s->nruns,
+             (unsigned long)s->nrecs);
+
+  s->used = s->nrecs = 0;
+
+  return 0;
+}
+
+
+/**
+   emp_hold
+
+   Copies a line into the run being built, adding the newline a last
+   line may lack.
+*/
+static int
+emp_hold
+(
+ struct emp_stream *s,
+ const char        *line,
+ size_t             len
+)
+{
+  struct emp_rec *recs;
+  char           *arena;
+  const char     *key;
+  size_t          need = len + (line[len-1] != '\n');
+
+  while (s->used + need > s->size) {
+    size_t size = s->size ? 2 * s->size : 1 << 20;
+    if ((arena = realloc (s->arena, size)) == NULL)
+      return -1;
+    s->arena = arena;
+    s->size = size;
+  }
+
+  if (s->nrecs == s->maxrecs) {
+    size_t max = s->maxrecs ? 2 * s->maxrecs : 4096;
+    if ((recs = realloc (s->recs, max * sizeof (*recs))) == NULL)
+      return -1;
+    s->recs = recs;
+    s->maxrecs = max;
+  }
+
+  memcpy (s->arena + s->used, line, len);
+  if (need > len)
+    s->arena[s->used + len] = '\n';
+
+  key = emp_key (s->spec, line, len, &s->recs[s->nrecs].keylen);
+  s->recs[s->nrecs].key = key - line;
+  s->recs[s->nrecs].offset = s->used;
+  s->recs[s->nrecs].len = need;
+  s->nrecs++;
+  s->used += need;
+
+  return 0;
+}
+
+
+
+/* ---- Merging ---- */
+
+
+static int
+emp_run_advance
+(
+ struct emp_run            *r,
+ const struct emp_key_spec *spec
+)
+{
+  if ((r->len = getline (&r->line, &r->max, r->file)) > 0) {
+    r->key = emp_key (spec, r->line, r->len, &r->keylen);
+    return 1;
+  }
+
+  return ferror (r->file) ? -1 : 0;
+}
+
+
+/* Orders runs by their current line; earlier runs win ties. */
+static int
+emp_run_less
+(
+ const struct emp_run *runs,
+ size_t                a,
+ size_t                b
+)
+{
+  int c;
+
+  c = emp_key_compare (runs[a].key, runs[a].keylen, runs[b].key, runs[b].keylen);
+
+  return c < 0 || (c == 0 && a < b);
+}
+
+
+static void
+emp_heap_down
+(
+ const struct emp_run *runs,
+ size_t               *heap,
+ size_t                n,
+ size_t                i
+)
+{
+  size_t child, t;
+
+  while ((child = 2 * i + 1) < n) {
+    if (child + 1 < n && emp_run_less (runs, heap[child+1], heap[child]))
+      child++;
+    if (!emp_run_less (runs, heap[child], heap[i]))
+      break;
+    t = heap[i]; heap[i] = heap[child]; heap[child] = t;
+    i = child;
+  }
+}
+
+
+/**
+   emp_heap_build
+
+   Reads the first line of runs[0..n) and heaps the non-empty ones.
+   Returns the heap size, or -1 on a read error.
+*/
+static ssize_t
+emp_heap_build
+(
+ struct emp_run            *runs,
+ size_t                    *heap,
+ size_t                     n,
+ const struct emp_key_spec *spec
+)
+{
+  size_t i, nheap = 0;
+  int    r;
+
+  for (i = 0; i < n; i++) {
+    if ((r = emp_run_advance (&runs[i], spec)) < 0)
+      return -1;
+    if (r > 0)
+      heap[nheap++] = i;
+  }
+
+  for (i = nheap / 2; i-- > 0; )
+    emp_heap_down (runs, heap, nheap, i);
+
+  return nheap;
+}
+
+
+static void
+emp_run_close
+(
+ struct emp_run *r
+)
+{
+  if (r->file != NULL)
+    fclose (r->file);
+  free (r->line);
+  memset (r, 0, sizeof (*r));
+}
+
+
+/**
+   emp_merge_runs
+
+   Merges runs[at..at+n) into one, which takes their place so ties
+   still resolve in input order.  Returns -1 if the merged run could
+   not be written in full.
+*/
+static int
+emp_merge_runs
+(
+ struct emp_stream             *s,
+ size_t                         at,
+ size_t                         n,
+ const struct emp_sort_options *opts
+)
+{
+  struct emp_run *runs = &s->runs[at];
+  FILE           *file;
+  size_t          i, top;
+  ssize_t         nheap;
+  int             r;
+
+  if ((file = emp_tmpfile (opts->tmpdir)) == NULL)
+    return -1;
+
+  if ((nheap = emp_heap_build (runs, s->heap, n, s->spec)) < 0)
+    goto fail;
+
+  while (nheap > 0) {
+    top = s->heap[0];
+    if (fwrite (runs[top].line, 1, runs[top].len, file) != (size_t)runs[top].len
+        || (r = emp_run_advance (&runs[top], s->spec)) < 0)
+      goto fail;
+    if (r == 0)
+      s->heap[0] = s->heap[--nheap];
+    emp_heap_down (runs, s->heap, nheap, 0);
+  }
+
+  if (ferror (file) || fflush (file) != 0 || fseek (file, 0, SEEK_SET) != 0)
+    goto fail;
+
+  for (i = 0; i < n; i++)
+    emp_run_close (&runs[i]);
+  runs[0].file = file;
+  memmove (&runs[1], &runs[n], (s->nruns - at - n) * sizeof (struct emp_run));
+  s->nruns -= n - 1;
+
+  return 0;
+
+ fail:
+  perror (opts->tmpdir);
+  fclose (file);
+  return -1;
+}
+
+
+
+/* ---- Streams ---- */
+
+
+static int
+emp_remember
+(
+ struct emp_stream *s,
+ const char        *key,
+ size_t             keylen
+)
+{
+  char *prev;
+
+  if (keylen > s->prevmax) {
+    if ((prev = realloc (s->prev, keylen)) == NULL)
+      return -1;
+    s->prev = prev;
+    s->prevmax = keylen;
+  }
+
+  memcpy (s->prev, key, keylen);
+  s->prevlen = keylen;
+
+  return 0;
+}
+
+
+/**
+   emp_in_order
+
+   Checks the line just read against the previous key.  Returns 1 if
+   it is in order, 0 if it is not, -1 if out of memory.
+*/
+static int
+emp_in_order
+(
+ struct emp_stream *s,
+ const char        *line,
+ size_t             len
+)
+{
+  const char *key;
+  size_t      keylen;
+
+  key = emp_key (s->spec, line, len, &keylen);
+
+  s->lineno++;
+  if (s->lineno > 1 && emp_key_compare (key, keylen, s->prev, s->prevlen) < 0) {
+    fprintf (stderr, "%s: %s: line %lu is out of order\n",
+             program_name, s->name, s->lineno);
+    return 0;
+  }
+
+  return emp_remember (s, key, keylen) == 0 ? 1 : -1;
+}
+
+
+/**
+   emp_is_sorted
+
+   Reads a seekable input through once to see whether it is in key
+   order, reporting the first line that is not, and rewinds it.
+   Returns 1 if sorted, 0 if not or if the input cannot be rewound,
+   -1 on error.
+*/
+static int
+emp_is_sorted
+(
+ struct emp_stream *s
+)
+{
+  const char *line;
+  ssize_t     len;
+  int         sorted = 1;
+
+  if (lseek (s->scan.fd, 0, SEEK_CUR) < 0)
+    return 0;
+
+  while (sorted > 0 && (len = emp_scan_line (&s->scan, &line)) > 0)
+    sorted = emp_in_order (s, line, len);
+
+  if (sorted < 0 || len < 0)
+    return -1;
+
+  s->lineno = 0;
+  if (emp_scan_rewind (&s->scan) != 0)
+    return -1;
+
+  return sorted;
+}
+
+
+/**
+   emp_stream_open
+
+   Prepares to read fd in key order.  A sorted, seekable input is read
+   directly.  Otherwise, unless opts->check is set, it is read in runs
+   of at most opts->memory bytes which are sorted and, if there is more
+   than one, spilled to opts->tmpdir and merged EMP_MERGE_WAYS at a
+   time.  A pipe is always sorted, or with opts->check read directly
+   and checked as it goes.
+*/
+int
+emp_stream_open
+(
+ struct emp_stream             *s,
+ int                            fd,
+ const char                    *name,
+ const struct emp_key_spec     *spec,
+ const struct emp_sort_options *opts
+)
+{
+  const char *line;
+  size_t      i, n;
+  ssize_t     len, nheap;
+  int         sorted;
+
+  memset (s, 0, sizeof (*s));
+  s->name = name;
+  s->spec = spec;
+
+  if (emp_scan_init (&s->scan, fd) != 0)
+    goto fail;
+
+  if ((sorted = emp_is_sorted (s)) < 0)
+    goto fail;
+
+  if (sorted || (opts->check && lseek (fd, 0, SEEK_CUR) < 0)) {
+    s->direct = 1;
+    return 0;
+  }
+
+  if (opts->check)
+    return -1;
+
+  if (opts->debug)
+    fprintf (stderr, "%s: %s: sorting\n", program_name, name);
+
+  while ((len = emp_scan_line (&s->scan, &line)) > 0) {
+    if (s->nrecs > 0
+        && s->used + len + (s->nrecs + 1) * sizeof (struct emp_rec) > opts->memory
+        && emp_spill (s, opts) != 0)
+      goto fail;
+    if (emp_hold (s, line, len) != 0)
+      goto fail;
+  }
+  if (len < 0)
+    goto fail;
+
+  if (s->nruns == 0) {
+    emp_sort_recs (s);
+    return 0;
+  }
+
+  if (s->nrecs > 0 && emp_spill (s, opts) != 0)
+    goto fail;
+  free (s->arena);
+  free (s->recs);
+  s->arena = NULL;
+  s->recs = NULL;
+
+  if ((s->heap = malloc (s->nruns * sizeof (size_t))) == NULL)
+    goto fail;
+
+  /* Each pass merges every group of runs once, keeping their order. */
+  while (s->nruns > EMP_MERGE_WAYS)
+    for (i = 0; i + 1 < s->nruns; i++) {
+      n = s->nruns - i < EMP_MERGE_WAYS ? s->nruns - i : EMP_MERGE_WAYS;
+      if (emp_merge_runs (s, i, n, opts) != 0)
+        goto fail;
+    }
+
+  if ((nheap = emp_heap_build (s->runs, s->heap, s->nruns, s->spec)) < 0)
+    goto fail;
+  s->nheap = nheap;
+
+  return 0;
+
+ fail:
+  perror (name);
+  emp_stream_close (s);
+  return -1;
+}
+
+
+/**
+   emp_stream_next
+
+   Points line at the next line in key order, valid until the next
+   call.  Returns its length, 0 at the end, or -1 on error, including
+   a directly read input found to be out of order.
+*/
+ssize_t
+emp_stream_next
+(
+ struct emp_stream  *s,
+ const char        **line
+)
+{
+  struct emp_rec *rec;
+  size_t          top;
+  ssize_t         len;
+  int             r;
+
+  if (s->direct) {
+    if ((len = emp_scan_line (&s->scan, line)) <= 0)
+      return len;
+    if (emp_in_order (s, *line, len) <= 0)
+      return -1;
+    return len;
+  }
+
+  if (s->nruns == 0) {
+    if (s->next == s->nrecs)
+      return 0;
+    rec = &s->recs[s->next++];
+    *line = rec->line;
+    return rec->len;
+  }
+
+  if (s->pending) {
+    top = s->heap[0];
+    if ((r = emp_run_advance (&s->runs[top], s->spec)) < 0)
+      return -1;
+    if (r == 0)
+      s->heap[0] = s->heap[--s->nheap];
+    emp_heap_down (s->runs, s->heap, s->nheap, 0);
+    s->pending = 0;
+  }
+
+  if (s->nheap == 0)
+    return 0;
+
+  top = s->heap[0];
+  s->pending = 1;
+  *line = s->runs[top].line;
+  return s->runs[top].len;
+}
+
+
+void
+emp_stream_close
+(
+ struct emp_stream *s
+)
+{
+  size_t i;
+
+  for (i = 0; i < s->nruns; i++)
+    emp_run_close (&s->runs[i]);
+
+  free (s->runs);
+  free (s->heap);
+  free (s->arena);
+  free (s->recs);
+  free (s->prev);
+  emp_scan_free (&s->scan);
+  memset (s, 0, sizeof (*s));
+}
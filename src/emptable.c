@@ -0,0 +1,267 @@
+/**********************************************************************
+ * emptable
+ *
+ * Open addressing key table for empnomail.
+ ***********************************************************************/
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <config.h>
+
+#include "empnomail.h"
+
+
+/**
+   emp_hash
+
+   FNV-1a.  Never returns 0, which marks an empty slot.
+*/
+uint64_t
+emp_hash
+(
+ const char *key,
+ size_t      len
+)
+{
+  uint64_t h = 14695981039346656037ULL;
+
+  while (len--) {
+    h ^= (unsigned char)*key++;
+    h *= 1099511628211ULL;
+  }
+
+  return h ? h : 1;
+}
+
+
+/* The word comes from the upper half of the hash, its three bits from a remix. */
+#define EMP_BLOOM_WORD(t, h) ((t)->bloom[((h) >> 32) & (t)->bloom_mask])
+#define EMP_BLOOM_MIX(h)     ((h) * 0x9E3779B97F4A7C15ULL)
+#define EMP_BLOOM_MASK(h)    ((1ULL << (EMP_BLOOM_MIX (h) >> 58)) \
+                              | (1ULL << ((EMP_BLOOM_MIX (h) >> 52) & 63)) \
+                              | (1ULL << ((EMP_BLOOM_MIX (h) >> 46) & 63)))
+
+
+int
+emp_table_init
+(
+ struct emp_table *t,
+ size_t            expected
+)
+{
+  size_t capacity = 1024;
+
+  memset (t, 0, sizeof (*t));
+
+  /* Keep the load factor under one half. */
+  while (capacity < 2 * expected)
+    capacity <<= 1;
+
+  if ((t->slots = calloc (capacity, sizeof (struct emp_slot))) == NULL)
+    return -1;
+  t->mask = capacity - 1;
+
+  return 0;
+}
+
+
+void
+emp_table_free
+(
+ struct emp_table *t
+)
+{
+  free (t->slots);
+  free (t->arena);
+  free (t->rows);
+  free (t->bloom);
+  memset (t, 0, sizeof (*t));
+}
+
+
+static int
+emp_table_grow
+(
+ struct emp_table *t
+)
+{
+  struct emp_slot *slots, *old = t->slots;
+  size_t           i, j, capacity = 2 * (t->mask + 1);
+
+  if ((slots = calloc (capacity, sizeof (struct emp_slot))) == NULL)
+    return -1;
+
+  for (i = 0; i <= t->mask; i++) {
+    if (old[i].hash == 0)
+      continue;
+    for (j = old[i].hash & (capacity - 1); slots[j].hash != 0; j = (j + 1) & (capacity - 1))
+      ;
+    slots[j] = old[i];
+  }
+
+  free (old);
+  t->slots = slots;
+  t->mask = capacity - 1;
+
+  return 0;
+}
+
+
+static int
+emp_table_store
+(
+ struct emp_table *t,
+ const char       *s,
+ size_t            len,
+ size_t           *offset
+)
+{
+  char *arena;
+
+  while (t->arena_size + len > t->arena_max) {
+    size_t max = t->arena_max ? 2 * t->arena_max : 1 << 20;
+    if ((arena = realloc (t->arena, max)) == NULL)
+      return -1;
+    t->arena = arena;
+    t->arena_max = max;
+  }
+
+  memcpy (t->arena + t->arena_size, s, len);
+  *offset = t->arena_size;
+  t->arena_size += len;
+
+  return 0;
+}
+
+
+/**
+   emp_table_insert
+
+   Adds a key to the table, if it is not already there, and appends
+   row to the key's rows unless row is NULL.  Returns 0, or -1 if out
+   of memory.
+*/
+int
+emp_table_insert
+(
+ struct emp_table *t,
+ const char       *key,
+ size_t            keylen,
+ const char       *row,
+ size_t            rowlen
+)
+{
+  struct emp_slot *slot;
+  struct emp_row  *rows;
+  uint64_t         h = emp_hash (key, keylen);
+  size_t           i;
+
+  if (2 * (t->count + 1) > t->mask + 1 && emp_table_grow (t) != 0)
+    return -1;
+
+  for (i = h & t->mask; t->slots[i].hash != 0; i = (i + 1) & t->mask) {
+    slot = &t->slots[i];
+    if (slot->hash == h && slot->keylen == keylen
+        && memcmp (t->arena + slot->key, key, keylen) == 0)
+      break;
+  }
+
+  slot = &t->slots[i];
+  if (slot->hash == 0) {
+    if (emp_table_store (t, key, keylen, &slot->key) != 0)
+      return -1;
+    if (t->bloom != NULL)
+      EMP_BLOOM_WORD (t, h) |= EMP_BLOOM_MASK (h);
+    slot->hash = h;
+    slot->keylen = keylen;
+    slot->row = slot->last = -1;
+    slot->printed = 0;
+    t->count++;
+  }
+
+  if (row == NULL)
+    return 0;
+
+  if (t->nrows == t->maxrows) {
+    size_t max = t->maxrows ? 2 * t->maxrows : 4096;
+    if ((rows = realloc (t->rows, max * sizeof (*rows))) == NULL)
+      return -1;
+    t->rows = rows;
+    t->maxrows = max;
+  }
+
+  rows = &t->rows[t->nrows];
+  if (emp_table_store (t, row, rowlen, &rows->offset) != 0)
+    return -1;
+  rows->length = rowlen;
+  rows->next = -1;
+
+  if (slot->last < 0)
+    slot->row = t->nrows;
+  else
+    t->rows[slot->last].next = t->nrows;
+  slot->last = t->nrows++;
+
+  return 0;
+}
+
+
+/**
+   emp_table_find
+
+   Returns the slot holding key, or NULL.
+*/
+struct emp_slot *
+emp_table_find
+(
+ const struct emp_table *t,
+ const char             *key,
+ size_t                  keylen
+)
+{
+  struct emp_slot *slot;
+  uint64_t         h = emp_hash (key, keylen);
+  size_t           i;
+
+  if (t->bloom != NULL && (~EMP_BLOOM_WORD (t, h) & EMP_BLOOM_MASK (h)) != 0)
+    return NULL;
+
+  for (i = h & t->mask; (slot = &t->slots[i])->hash != 0; i = (i + 1) & t->mask)
+    if (slot->hash == h && slot->keylen == keylen
+        && memcmp (t->arena + slot->key, key, keylen) == 0)
+      return slot;
+
+  return NULL;
+}
+
+
+/**
+   emp_table_seal
+
+   Builds the Bloom filter over the keys inserted so far, to be used
+   by emp_table_find from now on.  Returns 0, or -1 if out of memory.
+*/
+int
+emp_table_seal
+(
+ struct emp_table *t
+)
+{
+  size_t   i, words = 1;
+  uint64_t h;
+
+  while (words * 64 < t->count * EMP_BLOOM_BITS)
+    words <<= 1;
+
+  free (t->bloom);
+  if ((t->bloom = calloc (words, sizeof (uint64_t))) == NULL)
+    return -1;
+  t->bloom_mask = words - 1;
+
+  for (i = 0; i <= t->mask; i++)
+    if ((h = t->slots[i].hash) != 0)
+      EMP_BLOOM_WORD (t, h) |= EMP_BLOOM_MASK (h);
+
+  return 0;
+}
@@ -0,0 +1,655 @@
+/**********************************************************************
+ * empzip
+ *
+ * Compressed input for empnomail.  A gzip or zstd input is inflated
+ * by its own threads into a ring of buffers that the line scanner
+ * reads from, so decompression runs alongside the join instead of in
+ * front of it.
+ *
+ * A regular zstd file made of several frames (as written by pzstd or
+ * split and concatenated) is mapped, and its frames are decompressed
+ * in parallel, one ring buffer per frame, and handed out in order.
+ * Anything else is decompressed as a stream by one thread.
+ ***********************************************************************/
+
+#include <string.h>
+
+#include <config.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+#include "empnomail.h"
+
+#define EMP_ZIP_RING  (8)               /* Buffers in flight. */
+#define EMP_ZIP_BLOCK EMP_SCAN_BLOCK    /* Size of a streamed buffer. */
+#define EMP_ZIP_INPUT (256 * 1024)      /* Compressed bytes read at a time. */
+
+int emp_zip_threads = 1;                /* Threads for multi-frame zstd. */
+
+struct emp_zip_slot {
+  char   *data;
+  size_t  len;
+  size_t  max;
+  size_t  seq;                          /* Block this slot holds next. */
+  int     full;
+};
+
+struct emp_zip {
+  int                  fd;
+  int                  format;
+  pthread_mutex_t      lock;
+  pthread_cond_t       cond;
+  pthread_t           *threads;
+  int                  nthreads;
+  struct emp_zip_slot  ring[EMP_ZIP_RING];
+  size_t               next;            /* Block the reader is on. */
+  size_t               pos;             /* Read position in it. */
+  size_t               total;           /* Blocks in all, once known. */
+  int                  error;
+  int                  stop;
+
+  /* Frames of a mapped zstd file. */
+  const char          *map;
+  size_t               size;
+  size_t              *frames;          /* Offsets, with size at the end. */
+  size_t               nframes;
+  size_t               next_frame;
+};
+
+
+/**
+   emp_zip_detect
+
+   Looks at the first bytes of a regular file for a gzip or zstd
+   magic number.  Other inputs are taken to be plain text.
+*/
+int
+emp_zip_detect
+(
+ int fd
+)
+{
+  unsigned char magic[4];
+
+  if (pread (fd, magic, sizeof (magic), 0) != sizeof (magic))
+    return EMP_ZIP_NONE;
+
+  if (magic[0] == 0x1f && magic[1] == 0x8b)
+    return EMP_ZIP_GZIP;
+  if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+    return EMP_ZIP_ZSTD;
+
+  return EMP_ZIP_NONE;
+}
+
+
+
+/* ---- Ring ---- */
+
+
+/* Waits until block seq may be written.  Returns NULL when stopping. */
+static struct emp_zip_slot *
+emp_zip_claim
+(
+ struct emp_zip *z,
+ size_t          seq
+)
+{
+  struct emp_zip_slot *slot = &z->ring[seq % EMP_ZIP_RING];
+
+  pthread_mutex_lock (&z->lock);
+  while (!z->stop && (slot->full || slot->seq != seq))
+    pthread_cond_wait (&z->cond, &z->lock);
+  if (z->stop)
+    slot = NULL;
+  pthread_mutex_unlock (&z->lock);
+
+  return slot;
+}
+
+
+static void
+emp_zip_publish
+(
+ struct emp_zip      *z,
+ struct emp_zip_slot *slot
+)
+{
+  pthread_mutex_lock (&z->lock);
+  slot->full = 1;
+  pthread_cond_broadcast (&z->cond);
+  pthread_mutex_unlock (&z->lock);
+}
+
+
+static void
+emp_zip_finish
+(
+ struct emp_zip *z,
+ size_t          total,
+ int             error
+)
+{
+  pthread_mutex_lock (&z->lock);
+  if (error)
+    z->error = 1;
+  else if (total != (size_t)-1)
+    z->total = total;
+  pthread_cond_broadcast (&z->cond);
+  pthread_mutex_unlock (&z->lock);
+}
+
+
+static int
+emp_zip_reserve
+(
+ struct emp_zip_slot *slot,
+ size_t               max
+)
+{
+  char *data;
+
+  if (slot->max >= max)
+    return 0;
+  if ((data = realloc (slot->data, max)) == NULL)
+    return -1;
+  slot->data = data;
+  slot->max = max;
+
+  return 0;
+}
+
+
+/**
+   emp_zip_read
+
+   Copies up to n decompressed bytes into buf.  Returns the number
+   copied, 0 at the end, or -1 if decompression failed.
+*/
+ssize_t
+emp_zip_read
+(
+ struct emp_zip *z,
+ char           *buf,
+ size_t          n
+)
+{
+  struct emp_zip_slot *slot;
+  size_t               c;
+
+  for (;;) {
+    slot = &z->ring[z->next % EMP_ZIP_RING];
+
+    pthread_mutex_lock (&z->lock);
+    while (!z->error && z->next < z->total && !(slot->full && slot->seq == z->next))
+      pthread_cond_wait (&z->cond, &z->lock);
+    if (z->error) {
+      pthread_mutex_unlock (&z->lock);
+      errno = EIO;
+      return -1;
+    }
+    if (z->next >= z->total) {
+      pthread_mutex_unlock (&z->lock);
+      return 0;
+    }
+    pthread_mutex_unlock (&z->lock);
+
+    /* The slot is ours until it is released. */
+    c = slot->len - z->pos;
+    if (c > n)
+      c = n;
+    memcpy (buf, slot->data + z->pos, c);
+    z->pos += c;
+
+    if (z->pos == slot->len) {
+      pthread_mutex_lock (&z->lock);
+      slot->full = 0;
+      slot->seq += EMP_ZIP_RING;
+      z->next++;
+      z->pos = 0;
+      pthread_cond_broadcast (&z->cond);
+      pthread_mutex_unlock (&z->lock);
+    }
+
+    if (c > 0)
+      return c;
+  }
+}
+
+
+
+/* ---- Streams ---- */
+
+
+#ifdef HAVE_LIBZ
+/* Inflates gzip input, including concatenated members. */
+static void *
+emp_zip_gzip
+(
+ void *arg
+)
+{
+  struct emp_zip      *z = arg;
+  struct emp_zip_slot *slot;
+  z_stream             zs;
+  unsigned char       *in;
+  size_t               seq = 0;
+  ssize_t              n;
+  int                  rc = Z_OK, error = 1;
+
+  memset (&zs, 0, sizeof (zs));
+  if ((in = malloc (EMP_ZIP_INPUT)) == NULL || inflateInit2 (&zs, 15 + 32) != Z_OK) {
+    free (in);
+    emp_zip_finish (z, 0, 1);
+    return NULL;
+  }
+
+  if ((slot = emp_zip_claim (z, seq)) == NULL || emp_zip_reserve (slot, EMP_ZIP_BLOCK) != 0)
+    goto out;
+  zs.next_out = (unsigned char *)slot->data;
+  zs.avail_out = EMP_ZIP_BLOCK;
+
+  for (;;) {
+    if (zs.avail_in == 0) {
+      do
+        n = read (z->fd, in, EMP_ZIP_INPUT);
+      while (n < 0 && errno == EINTR);
+      if (n < 0)
+        goto out;
+      if (n == 0)
+        break;
+      zs.next_in = in;
+      zs.avail_in = n;
+    }
+
+    /* A new member after the end of the last one. */
+    if (rc == Z_STREAM_END && inflateReset (&zs) != Z_OK)
+      goto out;
+
+    rc = inflate (&zs, Z_NO_FLUSH);
+    if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR)
+      goto out;
+
+    if (zs.avail_out == 0) {
+      slot->len = EMP_ZIP_BLOCK;
+      emp_zip_publish (z, slot);
+      if ((slot = emp_zip_claim (z, ++seq)) == NULL
+          || emp_zip_reserve (slot, EMP_ZIP_BLOCK) != 0)
+        goto out;
+      zs.next_out = (unsigned char *)slot->data;
+      zs.avail_out = EMP_ZIP_BLOCK;
+    }
+  }
+
+  /* Truncated input is an error, not a short file. */
+  if (rc != Z_STREAM_END)
+    goto out;
+
+  slot->len = EMP_ZIP_BLOCK - zs.avail_out;
+  emp_zip_publish (z, slot);
+  seq++;
+  error = 0;
+
+ out:
+  inflateEnd (&zs);
+  free (in);
+  emp_zip_finish (z, seq, error);
+  return NULL;
+}
+#endif
+
+
+#ifdef HAVE_LIBZSTD
+/* Decompresses zstd input as a stream. */
+static void *
+emp_zip_zstd
+(
+ void *arg
+)
+{
+  struct emp_zip      *z = arg;
+  struct emp_zip_slot *slot;
+  ZSTD_DCtx           *dctx;
+  ZSTD_inBuffer        zin;
+  ZSTD_outBuffer       zout;
+  char                *in;
+  size_t               seq = 0, rc = 0;
+  ssize_t              n;
+  int                  error = 1;
+
+  dctx = ZSTD_createDCtx ();
+  if ((in = malloc (EMP_ZIP_INPUT)) == NULL || dctx == NULL)
+    goto out;
+
+  if ((slot = emp_zip_claim (z, seq)) == NULL || emp_zip_reserve (slot, EMP_ZIP_BLOCK) != 0)
+    goto out;
+  zout.dst = slot->data;
+  zout.size = EMP_ZIP_BLOCK;
+  zout.pos = 0;
+  zin.src = in;
+  zin.size = zin.pos = 0;
+
+  for (;;) {
+    if (zin.pos == zin.size) {
+      do
+        n = read (z->fd, in, EMP_ZIP_INPUT);
+      while (n < 0 && errno == EINTR);
+      if (n < 0)
+        goto out;
+      if (n == 0)
+        break;
+      zin.size = n;
+      zin.pos = 0;
+    }
+
+    rc = ZSTD_decompressStream (dctx, &zout, &zin);
+    if (ZSTD_isError (rc))
+      goto out;
+
+    if (zout.pos == zout.size) {
+      slot->len = zout.pos;
+      emp_zip_publish (z, slot);
+      if ((slot = emp_zip_claim (z, ++seq)) == NULL
+          || emp_zip_reserve (slot, EMP_ZIP_BLOCK) != 0)
+        goto out;
+      zout.dst = slot->data;
+      zout.pos = 0;
+    }
+  }
+
+  /* Flush what the decoder still holds. */
+  while (rc != 0) {
+    rc = ZSTD_decompressStream (dctx, &zout, &zin);
+    if (ZSTD_isError (rc) || (zout.pos < zout.size && rc != 0))
+      goto out;
+    if (zout.pos == zout.size) {
+      slot->len = zout.pos;
+      emp_zip_publish (z, slot);
+      if ((slot = emp_zip_claim (z, ++seq)) == NULL
+          || emp_zip_reserve (slot, EMP_ZIP_BLOCK) != 0)
+        goto out;
+      zout.dst = slot->data;
+      zout.pos = 0;
+    }
+  }
+
+  slot->len = zout.pos;
+  emp_zip_publish (z, slot);
+  seq++;
+  error = 0;
+
+ out:
+  ZSTD_freeDCtx (dctx);
+  free (in);
+  emp_zip_finish (z, seq, error);
+  return NULL;
+}
+
+
+/* Decompresses one frame of a mapped file into its slot. */
+static int
+emp_zip_frame
+(
+ ZSTD_DCtx           *dctx,
+ const char          *src,
+ size_t               len,
+ struct emp_zip_slot *slot
+)
+{
+  unsigned long long size = ZSTD_getFrameContentSize (src, len);
+  ZSTD_inBuffer      zin;
+  ZSTD_outBuffer     zout;
+  size_t             rc;
+
+  if (size == ZSTD_CONTENTSIZE_ERROR)
+    return -1;
+
+  if (size != ZSTD_CONTENTSIZE_UNKNOWN) {
+    if (emp_zip_reserve (slot, size ? size : 1) != 0)
+      return -1;
+    rc = ZSTD_decompressDCtx (dctx, slot->data, size, src, len);
+    if (ZSTD_isError (rc) || rc != size)
+      return -1;
+    slot->len = size;
+    return 0;
+  }
+
+  /* No size in the header: grow the buffer as the frame decodes. */
+  if (emp_zip_reserve (slot, EMP_ZIP_BLOCK) != 0)
+    return -1;
+  ZSTD_DCtx_reset (dctx, ZSTD_reset_session_only);
+  zin.src = src;
+  zin.size = len;
+  zin.pos = 0;
+  zout.dst = slot->data;
+  zout.size = slot->max;
+  zout.pos = 0;
+
+  do {
+    if (zout.pos == zout.size) {
+      if (emp_zip_reserve (slot, 2 * slot->max) != 0)
+        return -1;
+      zout.dst = slot->data;
+      zout.size = slot->max;
+    }
+    rc = ZSTD_decompressStream (dctx, &zout, &zin);
+    if (ZSTD_isError (rc))
+      return -1;
+  } while (rc != 0 && (zin.pos < zin.size || zout.pos == zout.size));
+
+  if (rc != 0)
+    return -1;
+  slot->len = zout.pos;
+
+  return 0;
+}
+
+
+/* Takes frames in order and decompresses them until none are left. */
+static void *
+emp_zip_frames
+(
+ void *arg
+)
+{
+  struct emp_zip      *z = arg;
+  struct emp_zip_slot *slot;
+  ZSTD_DCtx           *dctx;
+  size_t               f;
+
+  if ((dctx = ZSTD_createDCtx ()) == NULL) {
+    emp_zip_finish (z, (size_t)-1, 1);
+    return NULL;
+  }
+
+  for (;;) {
+    pthread_mutex_lock (&z->lock);
+    f = z->next_frame++;
+    pthread_mutex_unlock (&z->lock);
+    if (f >= z->nframes || (slot = emp_zip_claim (z, f)) == NULL)
+      break;
+
+    if (emp_zip_frame (dctx, z->map + z->frames[f],
+                       z->frames[f+1] - z->frames[f], slot) != 0) {
+      emp_zip_finish (z, (size_t)-1, 1);
+      break;
+    }
+    emp_zip_publish (z, slot);
+  }
+
+  ZSTD_freeDCtx (dctx);
+  return NULL;
+}
+
+
+/**
+   emp_zip_split
+
+   Maps a regular zstd file and finds its frames.  Returns the number
+   of frames, or 0 if the file cannot be split.
+*/
+static size_t
+emp_zip_split
+(
+ struct emp_zip *z
+)
+{
+  struct stat  st;
+  size_t       off = 0, len, max = 0, *frames;
+  void        *map;
+
+  if (fstat (z->fd, &st) != 0 || !S_ISREG (st.st_mode) || st.st_size == 0)
+    return 0;
+  if ((map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, z->fd, 0)) == MAP_FAILED)
+    return 0;
+  z->map = map;
+  z->size = st.st_size;
+
+  while (off < z->size) {
+    len = ZSTD_findFrameCompressedSize (z->map + off, z->size - off);
+    if (ZSTD_isError (len))
+      goto fail;
+    if (z->nframes + 2 > max) {
+      max = max ? 2 * max : 64;
+      if ((frames = realloc (z->frames, max * sizeof (size_t))) == NULL)
+        goto fail;
+      z->frames = frames;
+    }
+    z->frames[z->nframes++] = off;
+    off += len;
+  }
+  z->frames[z->nframes] = off;
+
+  return z->nframes;
+
+ fail:
+  munmap ((void *)z->map, z->size);
+  free (z->frames);
+  z->map = NULL;
+  z->frames = NULL;
+  z->nframes = 0;
+  return 0;
+}
+#endif
+
+
+
+/* ---- Opening and closing ---- */
+
+
+/**
+   emp_zip_open
+
+   Starts decompressing fd, which holds input in format, from its
+   current offset.  Returns NULL, with a message printed, if the
+   format is not supported or threads cannot be started.
+*/
+struct emp_zip *
+emp_zip_open
+(
+ int fd,
+ int format
+)
+{
+  struct emp_zip  *z;
+  void          *(*producer)(void *) = NULL;
+  int              i, n = 1;
+
+  if ((z = calloc (1, sizeof (*z))) == NULL)
+    return NULL;
+  z->fd = fd;
+  z->format = format;
+  z->total = (size_t)-1;
+  for (i = 0; i < EMP_ZIP_RING; i++)
+    z->ring[i].seq = i;
+
+  switch (format) {
+#ifdef HAVE_LIBZ
+  case EMP_ZIP_GZIP:
+    producer = emp_zip_gzip;
+    break;
+#endif
+#ifdef HAVE_LIBZSTD
+  case EMP_ZIP_ZSTD:
+    if (emp_zip_threads > 1 && emp_zip_split (z) > 1) {
+      producer = emp_zip_frames;
+      z->total = z->nframes;
+      n = emp_zip_threads;
+    }
+    else
+      producer = emp_zip_zstd;
+    break;
+#endif
+  }
+
+  if (producer == NULL) {
+    fprintf (stderr, "%s: built without support for %s input\n", program_name,
+             format == EMP_ZIP_GZIP ? "gzip" : "zstd");
+    free (z);
+    return NULL;
+  }
+
+  pthread_mutex_init (&z->lock, NULL);
+  pthread_cond_init (&z->cond, NULL);
+
+  if ((z->threads = calloc (n, sizeof (pthread_t))) == NULL) {
+    emp_zip_close (z);
+    return NULL;
+  }
+  for (i = 0; i < n; i++) {
+    if (pthread_create (&z->threads[i], NULL, producer, z) != 0)
+      break;
+    z->nthreads++;
+  }
+  if (z->nthreads == 0) {
+    fprintf (stderr, "%s: cannot start decompression\n", program_name);
+    emp_zip_close (z);
+    return NULL;
+  }
+
+  return z;
+}
+
+
+void
+emp_zip_close
+(
+ struct emp_zip *z
+)
+{
+  int i;
+
+  if (z == NULL)
+    return;
+
+  pthread_mutex_lock (&z->lock);
+  z->stop = 1;
+  pthread_cond_broadcast (&z->cond);
+  pthread_mutex_unlock (&z->lock);
+
+  for (i = 0; i < z->nthreads; i++)
+    pthread_join (z->threads[i], NULL);
+
+  for (i = 0; i < EMP_ZIP_RING; i++)
+    free (z->ring[i].data);
+  if (z->map != NULL)
+    munmap ((void *)z->map, z->size);
+  free (z->frames);
+  free (z->threads);
+  pthread_mutex_destroy (&z->lock);
+  pthread_cond_destroy (&z->cond);
+  free (z);
+}
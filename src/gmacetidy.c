@@ -0,0 +1,602 @@
+/**********************************************************************
+ * gmacetidy (C) M. Brent Harp 2010-2012
+ *
+ * Delete orphaned Zimbra ACEs.
+ *
+ * Every live zimbraId is read once, in a paged search of every naming
+ * context the server holds, into a hash set.  The entries carrying
+ * zimbraACE are then streamed past it, and each ACE whose grantee is
+ * not in the set is printed as LDIF or, with -a, deleted in pipelined
+ * modifies.  The directory is read twice however many ACEs it holds.
+ ***********************************************************************/
+
+#include <string.h>
+
+#include <config.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dlsync.h"
+
+#define AT_BASES_MAX   (16)
+#define AT_WINDOW      (64)             /* Modifies in flight by default. */
+#define AT_FILTER_MAX  (8192)
+#define AT_ACE         "zimbraACE"
+
+char *program_name;
+
+/* Grantee types whose grantee is a zimbraId.  Others (all, pub, gst,
+   key, ...) name no directory entry. */
+static const char *at_id_types[] = { "usr", "grp", "dom", "cos", NULL };
+
+/* The set of live zimbraIds, open addressed. */
+struct at_set {
+  char **slots;
+  long   size;                          /* A power of two. */
+  long   count;
+};
+
+/* The orphans of one entry, deleted once the scan is done. */
+struct at_orphans {
+  char  *dn;
+  char **aces;
+  int    count;
+};
+
+struct at_run {
+  struct at_set      ids;
+  int                apply;             /* Delete rather than print LDIF. */
+  long               entries;           /* Entries with ACEs seen. */
+  long               aces;
+  long               orphans;
+  struct at_orphans *pending;           /* Kept for -a. */
+  long               pending_count;
+  long               pending_max;
+};
+
+
+
+/*
+----------------------------------------------------------------------
+
+
+                         Local Functions
+
+
+----------------------------------------------------------------------
+*/
+
+
+void
+usage
+(
+ void
+)
+{
+  fprintf(stderr,
+	  "Usage: %s [options] [uid...]\n"
+	  "\n"
+	  "\tFinds ACEs granted to users, groups, domains or classes of\n"
+	  "\tservice that no longer exist, on the accounts named by uid\n"
+	  "\tor address, or on every entry if none are named, and prints\n"
+	  "\tLDIF to delete them.\n"
+	  "\n"
+	  "Options:\n"
+	  "  -a           Delete the orphaned ACEs instead of printing LDIF\n"
+	  "\n"
+	  "  -b base      Look for ACEs under base; may be repeated (default\n"
+	  "               every naming context).  Grantees are always\n"
+	  "               looked for in every naming context\n"
+	  "\n"
+	  "  -w window    Modifies in flight at once for -a (default %d)\n"
+	  "\n"
+	  "  -t seconds   Timeout for each LDAP operation\n"
+	  "\n"
+	  "  -d           Debug mode\n"
+	  "\n"
+	  "  -h           Display this help message\n"
+	  "\n"
+	  ,program_name, AT_WINDOW);
+}
+
+
+void
+at_nomem
+(
+ void
+)
+{
+  fprintf (stderr, "%s: out of memory\n", program_name);
+  exit (EXIT_FAILURE);
+}
+
+
+/* FNV-1a; zimbraIds are compared case-insensitively. */
+unsigned long
+at_hash
+(
+ const char *s,
+ size_t      len
+)
+{
+  unsigned long h = 2166136261UL;
+  size_t        i;
+
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char)(s[i] >= 'A' && s[i] <= 'Z' ? s[i] + 'a' - 'A' : s[i]);
+    h *= 16777619UL;
+  }
+
+  return h;
+}
+
+
+/* Slot holding id, or the empty slot it belongs in. */
+long
+at_slot
+(
+ struct at_set *set,
+ const char    *id,
+ size_t         len
+)
+{
+  long i = at_hash (id, len) & (set->size - 1);
+
+  while (set->slots[i] != NULL
+         && (strncasecmp (set->slots[i], id, len) != 0 || set->slots[i][len] != '\0'))
+    i = (i + 1) & (set->size - 1);
+
+  return i;
+}
+
+
+void
+at_set_add
+(
+ struct at_set *set,
+ const char    *id,
+ size_t         len
+)
+{
+  long i;
+
+  if (2 * (set->count + 1) > set->size) {
+    struct at_set bigger;
+    long          j;
+
+    bigger.size = set->size ? 2 * set->size : 65536;
+    bigger.count = set->count;
+    if ((bigger.slots = calloc (bigger.size, sizeof (*bigger.slots))) == NULL)
+      at_nomem ();
+    for (j = 0; j < set->size; j++)
+      if (set->slots[j] != NULL)
+        bigger.slots[at_slot (&bigger, set->slots[j], strlen (set->slots[j]))] = set->slots[j];
+    free (set->slots);
+    *set = bigger;
+  }
+
+  i = at_slot (set, id, len);
+  if (set->slots[i] == NULL) {
+    if ((set->slots[i] = strndup (id, len)) == NULL)
+      at_nomem ();
+    set->count++;
+  }
+}
+
+
+int
+at_set_has
+(
+ struct at_set *set,
+ const char    *id,
+ size_t         len
+)
+{
+  return set->size > 0 && set->slots[at_slot (set, id, len)] != NULL;
+}
+
+
+/* Whether dn is base or lies under it. */
+int
+at_under
+(
+ const char *dn,
+ const char *base
+)
+{
+  size_t d = strlen (dn), b = strlen (base);
+
+  if (b == 0)
+    return 1;
+  if (d < b || strcasecmp (dn + d - b, base) != 0)
+    return 0;
+  return d == b || dn[d - b - 1] == ',';
+}
+
+
+/**
+   at_naming_contexts
+
+   Reads the naming contexts from the server's root DSE into bases,
+   leaving out any that lie under another, so every entry is searched
+   once.  Returns the number stored, or -1 on error.
+*/
+int
+at_naming_contexts
+(
+ dl_context *ctx,
+ const char *bases[]
+)
+{
+  static char    *attrs[] = { "namingContexts", NULL };
+  LDAPMessage    *res = NULL, *entry;
+  struct berval **vals;
+  struct timeval  tv;
+  int             rc, i, j, n = 0;
+
+  tv.tv_sec = ctx->op_timeout;
+  tv.tv_usec = 0;
+  rc = ldap_search_ext_s (ctx->ldap, "", LDAP_SCOPE_BASE, "(objectClass=*)", attrs, 0,
+                          NULL, NULL, ctx->op_timeout > 0 ? &tv : NULL, LDAP_NO_LIMIT, &res);
+  if (rc != LDAP_SUCCESS) {
+    fprintf (stderr, "%s: root DSE: %s\n", program_name, ldap_err2string (rc));
+    if (res != NULL)
+      ldap_msgfree (res);
+    return -1;
+  }
+
+  if ((entry = ldap_first_entry (ctx->ldap, res)) != NULL
+      && (vals = ldap_get_values_len (ctx->ldap, entry, "namingContexts")) != NULL) {
+    for (i = 0; vals[i] != NULL && n < AT_BASES_MAX; i++) {
+      for (j = 0; vals[j] != NULL; j++)
+        if (j != i && at_under (vals[i]->bv_val, vals[j]->bv_val)
+            && (!at_under (vals[j]->bv_val, vals[i]->bv_val) || j < i))
+          break;
+      if (vals[j] == NULL && (bases[n++] = strdup (vals[i]->bv_val)) == NULL)
+        at_nomem ();
+    }
+    ldap_value_free_len (vals);
+  }
+  ldap_msgfree (res);
+
+  if (n == 0)
+    fprintf (stderr, "%s: root DSE lists no naming contexts\n", program_name);
+
+  return n > 0 ? n : -1;
+}
+
+
+/* Adds each entry's zimbraId to the set. */
+int
+at_id_found
+(
+ dl_context  *ctx,
+ LDAPMessage *entry,
+ void        *arg
+)
+{
+  struct at_run  *run = arg;
+  struct berval **vals;
+  int             i;
+
+  if ((vals = ldap_get_values_len (ctx->ldap, entry, "zimbraId")) != NULL) {
+    for (i = 0; vals[i] != NULL; i++)
+      at_set_add (&run->ids, vals[i]->bv_val, vals[i]->bv_len);
+    ldap_value_free_len (vals);
+  }
+
+  return 0;
+}
+
+
+/* Whether an ACE names a grantee that should exist but does not. */
+int
+at_orphaned
+(
+ struct at_run       *run,
+ const struct berval *ace
+)
+{
+  const char *s = ace->bv_val, *end = ace->bv_val + ace->bv_len, *type;
+  size_t      len, tlen;
+  int         i;
+
+  for (len = 0; s + len < end && s[len] != ' '; len++)
+    ;
+  for (type = s + len; type < end && *type == ' '; type++)
+    ;
+  for (tlen = 0; type + tlen < end && type[tlen] != ' '; tlen++)
+    ;
+
+  for (i = 0; at_id_types[i] != NULL; i++)
+    if (tlen == strlen (at_id_types[i]) && strncmp (type, at_id_types[i], tlen) == 0)
+      return len > 0 && !at_set_has (&run->ids, s, len);
+
+  return 0;
+}
+
+
+/* Prints or keeps the orphaned ACEs of each entry. */
+int
+at_ace_found
+(
+ dl_context  *ctx,
+ LDAPMessage *entry,
+ void        *arg
+)
+{
+  struct at_run     *run = arg;
+  struct at_orphans  o;
+  struct berval    **vals;
+  char              *dn;
+  int                i;
+
+  if ((vals = ldap_get_values_len (ctx->ldap, entry, AT_ACE)) == NULL)
+    return 0;
+  memset (&o, 0, sizeof (o));
+  run->entries++;
+
+  for (i = 0; vals[i] != NULL; i++) {
+    run->aces++;
+    if (!at_orphaned (run, vals[i]))
+      continue;
+    if ((o.aces = realloc (o.aces, (o.count + 1) * sizeof (*o.aces))) == NULL
+        || (o.aces[o.count++] = strndup (vals[i]->bv_val, vals[i]->bv_len)) == NULL)
+      at_nomem ();
+  }
+  ldap_value_free_len (vals);
+
+  if (o.count == 0)
+    return 0;
+  run->orphans += o.count;
+  if ((dn = ldap_get_dn (ctx->ldap, entry)) == NULL)
+    at_nomem ();
+
+  if (!run->apply) {
+    printf ("dn: %s\nchangetype: modify\ndelete: %s\n", dn, AT_ACE);
+    for (i = 0; i < o.count; i++) {
+      printf ("%s: %s\n", AT_ACE, o.aces[i]);
+      free (o.aces[i]);
+    }
+    printf ("-\n\n");
+    free (o.aces);
+  } else {
+    if (run->pending_count == run->pending_max) {
+      struct at_orphans *p;
+
+      run->pending_max = run->pending_max ? 2 * run->pending_max : 256;
+      if ((p = realloc (run->pending, run->pending_max * sizeof (*p))) == NULL)
+        at_nomem ();
+      run->pending = p;
+    }
+    if ((o.dn = strdup (dn)) == NULL)
+      at_nomem ();
+    run->pending[run->pending_count++] = o;
+  }
+  ldap_memfree (dn);
+
+  return 0;
+}
+
+
+/* Reports a delete the server refused. */
+void
+at_modify_failed
+(
+ dl_context *ctx,
+ const char *dn,
+ int         rc,
+ void       *arg
+)
+{
+  (void) ctx;
+  (void) arg;
+  fprintf (stderr, "%s: %s: %s\n", program_name, dn, ldap_err2string (rc));
+}
+
+
+/**
+   at_apply
+
+   Deletes the orphans kept, one modify per entry, window at a time.
+   Returns the number of entries that could not be changed, or -1 if
+   the connection failed.
+*/
+long
+at_apply
+(
+ dl_context    *ctx,
+ struct at_run *run,
+ int            window
+)
+{
+  dl_batch *b;
+  LDAPMod   mod, *mods[2];
+  char    **vals;
+  long      i, sent, failed;
+  int       j, status = DL_SUCCESS;
+
+  if ((b = dl_batch_new (ctx, window, at_modify_failed, NULL)) == NULL)
+    at_nomem ();
+  mod.mod_op = LDAP_MOD_DELETE;
+  mod.mod_type = AT_ACE;
+  mods[0] = &mod;
+  mods[1] = NULL;
+
+  for (i = 0; i < run->pending_count; i++) {
+    struct at_orphans *o = &run->pending[i];
+
+    if (status == DL_SUCCESS) {
+      if ((vals = malloc ((o->count + 1) * sizeof (*vals))) == NULL)
+        at_nomem ();
+      memcpy (vals, o->aces, o->count * sizeof (*vals));
+      vals[o->count] = NULL;
+      mod.mod_values = vals;
+      if (ctx->debug)
+        fprintf (stderr, "delete %d ACE(s) from %s\n", o->count, o->dn);
+      status = dl_batch_modify (b, o->dn, mods);
+      free (vals);
+    }
+    for (j = 0; j < o->count; j++)
+      free (o->aces[j]);
+    free (o->aces);
+    free (o->dn);
+  }
+
+  if (dl_batch_free (b, &sent, &failed) != DL_SUCCESS)
+    status = DL_FAILURE;
+  if (status != DL_SUCCESS) {
+    dl_perror (ctx, "modify");
+    return -1;
+  }
+
+  return failed;
+}
+
+
+
+/*
+----------------------------------------------------------------------
+
+
+                               Main
+
+
+----------------------------------------------------------------------
+*/
+
+
+int
+main
+(
+ int   argc,
+ char *argv[]
+)
+{
+  static char   *id_attrs[] = { "zimbraId", NULL };
+  static char   *ace_attrs[] = { AT_ACE, NULL };
+  dl_context    *ctx;
+  struct at_run  run;
+  const char    *bases[AT_BASES_MAX], *contexts[AT_BASES_MAX];
+  char           filter[AT_FILTER_MAX], *s;
+  int            base_count = 0, context_count, window = AT_WINDOW, i, n;
+  long           failed = 0;
+
+  program_name = argv[0];
+  dl_zmsetvars (argc, argv);
+
+  memset (&run, 0, sizeof (run));
+
+  if ((ctx = dl_context_new ()) == NULL)
+    at_nomem ();
+  ctx->program_name = program_name;
+
+  while (--argc > 0 && (*++argv)[0] == '-') {
+    for (s = argv[0]+1; *s != '\0'; s++) {
+      if (strchr ("bwt", *s) != NULL && argc < 2) {
+        usage ();
+        exit (EXIT_FAILURE);
+      }
+      switch (*s) {
+      case 'a':                 /* Delete, not print */
+        run.apply = !run.apply;
+        break;
+      case 'b':                 /* Search base */
+        if (base_count == AT_BASES_MAX) {
+          fprintf (stderr, "%s: too many bases\n", program_name);
+          exit (EXIT_FAILURE);
+        }
+        bases[base_count++] = *++argv;
+        --argc;
+        break;
+      case 'w':                 /* Modify window */
+        window = atoi (*++argv);
+        --argc;
+        break;
+      case 't':                 /* Per-operation timeout */
+        ctx->op_timeout = atoi (*++argv);
+        --argc;
+        break;
+      case 'd':                 /* Toggle debug mode */
+        ctx->debug = !ctx->debug;
+        break;
+      case 'h':
+        usage ();
+        exit (EXIT_SUCCESS);
+      default:
+        fprintf (stderr, "%s: illegal option -%c\n", program_name, *s);
+        usage ();
+        exit (EXIT_FAILURE);
+      }
+    }
+  }
+
+  /* Named accounts: (&(zimbraACE=*)(|(uid=a)(mail=b)...)). */
+  n = snprintf (filter, sizeof (filter), "(&(%s=*)%s", AT_ACE, argc > 0 ? "(|" : "");
+  for (; argc > 0 && n < (int)sizeof (filter); argc--, argv++) {
+    if (strpbrk (*argv, "*()\\") != NULL) {
+      fprintf (stderr, "%s: bad uid: %s\n", program_name, *argv);
+      exit (EXIT_FAILURE);
+    }
+    n += snprintf (filter + n, sizeof (filter) - n, "(%s=%s)",
+                   strchr (*argv, '@') != NULL ? "mail" : "uid", *argv);
+    if (argc == 1 && n < (int)sizeof (filter))
+      n += snprintf (filter + n, sizeof (filter) - n, ")");
+  }
+  if (n < (int)sizeof (filter))
+    n += snprintf (filter + n, sizeof (filter) - n, ")");
+  if (n >= (int)sizeof (filter)) {
+    fprintf (stderr, "%s: too many uids\n", program_name);
+    exit (EXIT_FAILURE);
+  }
+
+  if (dl_init (ctx) != DL_SUCCESS) {
+    dl_perror (ctx, "dl_init");
+    exit (EXIT_FAILURE);
+  }
+
+  /* A grantee may live in any tree, whatever bases the ACEs are in. */
+  if ((context_count = at_naming_contexts (ctx, contexts)) < 0)
+    exit (EXIT_FAILURE);
+  if (base_count == 0) {
+    memcpy (bases, contexts, context_count * sizeof (char *));
+    base_count = context_count;
+  }
+
+  for (i = 0; i < context_count; i++)
+    if (dl_search_paged (ctx, contexts[i], "(zimbraId=*)", id_attrs,
+                         at_id_found, &run) != DL_SUCCESS) {
+      dl_perror (ctx, contexts[i]);
+      exit (EXIT_FAILURE);
+    }
+  if (ctx->debug)
+    fprintf (stderr, "%ld live zimbraIds\n", run.ids.count);
+  if (run.ids.count == 0) {
+    /* Every ACE would look orphaned. */
+    fprintf (stderr, "%s: no zimbraIds found\n", program_name);
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < base_count; i++)
+    if (dl_search_paged (ctx, bases[i], filter, ace_attrs,
+                         at_ace_found, &run) != DL_SUCCESS) {
+      dl_perror (ctx, bases[i]);
+      exit (EXIT_FAILURE);
+    }
+  fflush (stdout);
+
+  if (run.apply)
+    failed = at_apply (ctx, &run, window);
+
+  if (ctx->debug || run.apply)
+    fprintf (stderr, "%ld entries with %ld ACEs, %ld orphaned\n",
+             run.entries, run.aces, run.orphans);
+
+  for (i = 0; i < context_count; i++)
+    free ((char *)contexts[i]);
+  dl_cleanup (ctx);
+  dl_context_free (ctx);
+
+  exit (failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
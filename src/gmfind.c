@@ -0,0 +1,836 @@
+/**********************************************************************
+ * gmfind (C) M. Brent Harp 2010-2012
+ *
+ * Find Gryph Mail accounts, optionally changing each.
+ *
+ * Accounts are read with a paged search asking only for the
+ * attributes needed.  Changes are made either as direct LDAP modifies
+ * pipelined on one connection (-M) or by zmprov commands spread over a
+ * pool of long running zmprov sessions (-e).
+ ***********************************************************************/
+
+#include <string.h>
+
+#include <config.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dlsync.h"
+
+#define GM_ZMPROV    "${ZMPROV:-/opt/zimbra/bin/zmprov} 2>&1" /* environment var or default */
+#define GM_FILTER_MAX (8192)
+#define GM_WINDOW    (64)               /* Modifies in flight by default. */
+#define GM_SESSIONS  (4)                /* zmprov sessions by default. */
+#define GM_ATTRS_MAX (32)
+
+char *program_name;
+
+/* A change given with -M. */
+struct gm_change {
+  int   op;                             /* LDAP_MOD_ADD, _DELETE or _REPLACE. */
+  char *attr;
+  char *value;                          /* NULL to delete every value. */
+};
+
+/* An account found, kept when there are changes to make. */
+struct gm_account {
+  char *dn;
+  char *uid;
+};
+
+struct gm_find {
+  char              **print;            /* Attributes to print (-A). */
+  int                 print_count;
+  long                limit;            /* Accounts wanted; 0 for all. */
+  long                found;
+  int                 keep;             /* Collect rather than print. */
+  struct gm_account  *accounts;
+  long                count;
+  long                max;
+};
+
+
+
+/*
+----------------------------------------------------------------------
+
+
+                         Local Functions
+
+
+----------------------------------------------------------------------
+*/
+
+
+void
+usage
+(
+ void
+)
+{
+  fprintf(stderr,
+	  "Usage: %s [options]\n"
+	  "\n"
+	  "\tFinds Gryph Mail accounts, printing the uid of each\n"
+	  "\tor changing each.\n"
+	  "\n"
+	  "Options:\n"
+	  "  -a status    Account status (active, closed, ...)\n"
+	  "\n"
+	  "  -C cos       Class of service name\n"
+	  "\n"
+	  "  -f feature   zimbraFeature<feature>Enabled=TRUE\n"
+	  "\n"
+	  "  -F address   Forwards mail to address (preference)\n"
+	  "\n"
+	  "  -g address   Forwards mail to address (admin)\n"
+	  "\n"
+	  "  -H host      Mail host\n"
+	  "\n"
+	  "  -L date      Last logon at or before date: YYYY-MM-DD[ HH:MM[:SS]],\n"
+	  "               'N days ago' or a generalized time\n"
+	  "\n"
+	  "  -m address   Mail address\n"
+	  "\n"
+	  "  -p zimlet    Zimlet in zimbraPrefZimlets\n"
+	  "\n"
+	  "  -Q bytes     Mail quota\n"
+	  "\n"
+	  "  -u uid       Account uid\n"
+	  "\n"
+	  "  -z zimlet    Zimlet in zimbraZimletAvailableZimlets\n"
+	  "\n"
+	  "  -Z limit     Find at most limit accounts\n"
+	  "\n"
+	  "  -A attrs     Print these comma separated attributes instead of uid\n"
+	  "\n"
+	  "  -e cmd... ;  Run zmprov command cmd for each account; {} is\n"
+	  "               replaced by its uid\n"
+	  "\n"
+	  "  -j sessions  zmprov sessions for -e (default %d)\n"
+	  "\n"
+	  "  -M change    Modify each account in LDAP directly: attr=value,\n"
+	  "               attr+=value, attr-=value or attr-= (all values);\n"
+	  "               {} in value is replaced by the uid.  May be repeated\n"
+	  "\n"
+	  "  -w window    Modifies in flight at once for -M (default %d)\n"
+	  "\n"
+	  "  -t seconds   Timeout for each LDAP operation\n"
+	  "\n"
+	  "  -d           Debug mode\n"
+	  "\n"
+	  "  -h           Display this help message\n"
+	  "\n"
+	  ,program_name, GM_SESSIONS, GM_WINDOW);
+}
+
+
+/* Appends (attr=value) to the filter, or exits if it is too long. */
+void
+gm_filter_add
+(
+ char       *filter,
+ const char *attr,
+ const char *value
+)
+{
+  size_t len = strlen (filter);
+  int    n;
+
+  n = snprintf (filter + len, GM_FILTER_MAX - len, "(%s=%s)", attr, value);
+  if (n < 0 || (size_t)n >= GM_FILTER_MAX - len) {
+    fprintf (stderr, "%s: filter too long\n", program_name);
+    exit (EXIT_FAILURE);
+  }
+}
+
+
+/**
+   gm_timestamp
+
+   Converts a date to LDAP generalized time in UTC.  Takes
+   YYYY-MM-DD[ HH:MM[:SS]] in local time, "N days ago", "N weeks ago"
+   or a generalized time, which is passed through.  Returns 0, or -1
+   if the date is not understood.
+*/
+int
+gm_timestamp
+(
+ const char *date,
+ char       *out,
+ size_t      max
+)
+{
+  struct tm tm;
+  time_t    t;
+  long      n;
+  char      unit[16], tail[8];
+  int       len;
+
+  memset (&tm, 0, sizeof (tm));
+  len = strlen (date);
+
+  if (len == 15 && date[14] == 'Z' && strspn (date, "0123456789") == 14) {
+    snprintf (out, max, "%s", date);
+    return 0;
+  }
+
+  if (sscanf (date, "%ld %15s %7s", &n, unit, tail) == 3 && strcmp (tail, "ago") == 0) {
+    if (strcmp (unit, "day") == 0 || strcmp (unit, "days") == 0)
+      t = time (NULL) - n * 86400;
+    else if (strcmp (unit, "week") == 0 || strcmp (unit, "weeks") == 0)
+      t = time (NULL) - n * 7 * 86400;
+    else
+      return -1;
+  } else {
+    if (sscanf (date, "%4d-%2d-%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &len) != 3)
+      return -1;
+    if (date[len] != '\0'
+        && sscanf (date + len, " %2d:%2d:%2d", &tm.tm_hour, &tm.tm_min, &tm.tm_sec) < 2)
+      return -1;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    tm.tm_isdst = -1;
+    if ((t = mktime (&tm)) == (time_t)-1)
+      return -1;
+  }
+
+  if (gmtime_r (&t, &tm) == NULL || strftime (out, max, "%Y%m%d%H%M%SZ", &tm) == 0)
+    return -1;
+
+  return 0;
+}
+
+
+/* Parses a -M change.  Returns 0, or -1 if it is malformed. */
+int
+gm_change_parse
+(
+ const char       *spec,
+ struct gm_change *c
+)
+{
+  const char *eq = strchr (spec, '=');
+  size_t      len;
+
+  if (eq == NULL || eq == spec)
+    return -1;
+  len = eq - spec;
+  c->op = LDAP_MOD_REPLACE;
+  if (spec[len - 1] == '+' || spec[len - 1] == '-') {
+    c->op = spec[len - 1] == '+' ? LDAP_MOD_ADD : LDAP_MOD_DELETE;
+    len--;
+  }
+  if (len == 0 || (c->attr = strndup (spec, len)) == NULL)
+    return -1;
+
+  c->value = NULL;
+  if (eq[1] != '\0' || c->op == LDAP_MOD_ADD)
+    if ((c->value = strdup (eq + 1)) == NULL)
+      return -1;
+
+  return 0;
+}
+
+
+/* Copies s with each {} replaced by uid.  Returns NULL if out of memory. */
+char *
+gm_expand
+(
+ const char *s,
+ const char *uid
+)
+{
+  const char *p;
+  char       *out, *o;
+  size_t      n = 0, len = strlen (uid);
+
+  for (p = s; (p = strstr (p, "{}")) != NULL; p += 2)
+    n++;
+  if ((out = malloc (strlen (s) + n * len + 1)) == NULL)
+    return NULL;
+
+  for (o = out; *s != '\0'; ) {
+    if (s[0] == '{' && s[1] == '}') {
+      memcpy (o, uid, len);
+      o += len;
+      s += 2;
+    } else
+      *o++ = *s++;
+  }
+  *o = '\0';
+
+  return out;
+}
+
+
+/* Keeps an account found for the actions to come. */
+int
+gm_keep
+(
+ struct gm_find *f,
+ const char     *dn,
+ const char     *uid
+)
+{
+  struct gm_account *a;
+
+  if (f->count == f->max) {
+    long max = f->max ? 2 * f->max : 1024;
+
+    if ((a = realloc (f->accounts, max * sizeof (*a))) == NULL)
+      return -1;
+    f->accounts = a;
+    f->max = max;
+  }
+  a = &f->accounts[f->count];
+  if ((a->dn = strdup (dn)) == NULL || (a->uid = strdup (uid)) == NULL) {
+    free (a->dn);
+    return -1;
+  }
+  f->count++;
+
+  return 0;
+}
+
+
+/* First value of attr in entry, or "" if it has none. */
+char *
+gm_first_value
+(
+ LDAP        *ld,
+ LDAPMessage *entry,
+ const char  *attr,
+ char        *buf,
+ size_t       max
+)
+{
+  struct berval **vals;
+  size_t          len = 0;
+
+  if ((vals = ldap_get_values_len (ld, entry, attr)) != NULL) {
+    if (vals[0] != NULL) {
+      len = vals[0]->bv_len < max - 1 ? vals[0]->bv_len : max - 1;
+      memcpy (buf, vals[0]->bv_val, len);
+    }
+    ldap_value_free_len (vals);
+  }
+  buf[len] = '\0';
+
+  return buf;
+}
+
+
+/* Prints or keeps each account found. */
+int
+gm_found
+(
+ dl_context  *ctx,
+ LDAPMessage *entry,
+ void        *arg
+)
+{
+  struct gm_find *f = arg;
+  char            uid[1024], value[4096], *dn;
+  int             i, status = 0;
+
+  gm_first_value (ctx->ldap, entry, "uid", uid, sizeof (uid));
+  if (uid[0] == '\0')
+    return 0;
+
+  if (f->keep) {
+    if ((dn = ldap_get_dn (ctx->ldap, entry)) == NULL)
+      return 0;
+    if (gm_keep (f, dn, uid) != 0) {
+      ctx->error = DL_ERR_OUT_OF_MEMORY;
+      status = -1;
+    }
+    ldap_memfree (dn);
+  } else if (f->print_count == 0) {
+    puts (uid);
+  } else {
+    for (i = 0; i < f->print_count; i++)
+      printf ("%s%s", i ? "\t" : "",
+              gm_first_value (ctx->ldap, entry, f->print[i], value, sizeof (value)));
+    putchar ('\n');
+  }
+
+  if (status == 0 && f->limit > 0 && ++f->found >= f->limit)
+    return 1;
+
+  return status;
+}
+
+
+/**
+   gm_cos_id
+
+   The zimbraId of the named COS.  Every COS is read the first time
+   one is looked up.  Returns NULL if there is no such COS.
+*/
+const char *
+gm_cos_id
+(
+ dl_context *ctx,
+ const char *name
+)
+{
+  static dl_cos_list  *list;
+  const struct dl_cos *c;
+
+  if (list == NULL && (list = dl_cos_read (ctx, NULL, NULL, NULL)) == NULL) {
+    dl_perror (ctx, "COS lookup");
+    exit (EXIT_FAILURE);
+  }
+
+  return (c = dl_cos_find (list, NULL, name)) != NULL ? c->id : NULL;
+}
+
+
+/* Reports a modify the server refused. */
+void
+gm_modify_failed
+(
+ dl_context *ctx,
+ const char *dn,
+ int         rc,
+ void       *arg
+)
+{
+  (void) ctx;
+  (void) arg;
+  fprintf (stderr, "%s: %s: %s\n", program_name, dn, ldap_err2string (rc));
+}
+
+
+/**
+   gm_modify
+
+   Applies the -M changes to every account kept, window modifies in
+   flight at a time.  Returns the number that failed, or -1 if the
+   connection did.
+*/
+long
+gm_modify
+(
+ dl_context       *ctx,
+ struct gm_find   *f,
+ struct gm_change *changes,
+ int               count,
+ int               window
+)
+{
+  dl_batch  *b;
+  LDAPMod   *mods, **modp;
+  char     **vals;
+  long       i, sent, failed;
+  int        j, status = DL_SUCCESS;
+
+  mods = calloc (count, sizeof (*mods));
+  modp = calloc (count + 1, sizeof (*modp));
+  vals = calloc (2 * count, sizeof (*vals));
+  if (mods == NULL || modp == NULL || vals == NULL
+      || (b = dl_batch_new (ctx, window, gm_modify_failed, NULL)) == NULL) {
+    fprintf (stderr, "%s: out of memory\n", program_name);
+    exit (EXIT_FAILURE);
+  }
+
+  for (j = 0; j < count; j++) {
+    mods[j].mod_op = changes[j].op;
+    mods[j].mod_type = changes[j].attr;
+    mods[j].mod_values = changes[j].value != NULL ? &vals[2 * j] : NULL;
+    modp[j] = &mods[j];
+  }
+
+  for (i = 0; i < f->count && status == DL_SUCCESS; i++) {
+    for (j = 0; j < count; j++)
+      if (changes[j].value != NULL
+          && (vals[2 * j] = gm_expand (changes[j].value, f->accounts[i].uid)) == NULL) {
+        fprintf (stderr, "%s: out of memory\n", program_name);
+        exit (EXIT_FAILURE);
+      }
+    if (ctx->debug)
+      fprintf (stderr, "modify %s\n", f->accounts[i].dn);
+    status = dl_batch_modify (b, f->accounts[i].dn, modp);
+    for (j = 0; j < count; j++) {
+      free (vals[2 * j]);
+      vals[2 * j] = NULL;
+    }
+  }
+
+  if (dl_batch_free (b, &sent, &failed) != DL_SUCCESS)
+    status = DL_FAILURE;
+  if (status != DL_SUCCESS)
+    dl_perror (ctx, "modify");
+
+  free (mods);
+  free (modp);
+  free (vals);
+
+  if (ctx->debug)
+    fprintf (stderr, "Modified %ld of %ld accounts, %ld failed\n",
+             sent - failed, f->count, failed);
+
+  return status == DL_SUCCESS ? failed : -1;
+}
+
+
+/* Prints the output of a zmprov command whole, counting errors in *arg. */
+int
+gm_print_output
+(
+ const char *out,
+ size_t      len,
+ void       *tag,
+ void       *arg
+)
+{
+  long *failed = arg;
+
+  if (out == NULL)
+    return 0;                           /* Counted as lost. */
+  if (zm_output_error (out)) {
+    (*failed)++;
+    fprintf (stderr, "%s: %s: ", program_name, (const char *)tag);
+    fwrite (out, 1, len, stderr);
+  } else
+    fwrite (out, 1, len, stdout);
+  fflush (stdout);
+
+  return 0;
+}
+
+
+/* Appends s to the command line, quoting it if zmprov would split it. */
+int
+gm_append_arg
+(
+ char      **line,
+ size_t     *len,
+ size_t     *max,
+ const char *s
+)
+{
+  size_t need = 2 * strlen (s) + 4;
+  char  *buf;
+  int    quote = s[0] == '\0' || strpbrk (s, " \t\"'\\") != NULL;
+
+  if (*len + need > *max) {
+    *max = 2 * (*len + need);
+    if ((buf = realloc (*line, *max)) == NULL)
+      return -1;
+    *line = buf;
+  }
+
+  if (*len > 0)
+    (*line)[(*len)++] = ' ';
+  if (quote)
+    (*line)[(*len)++] = '"';
+  for (; *s != '\0'; s++) {
+    if (quote && (*s == '"' || *s == '\\'))
+      (*line)[(*len)++] = '\\';
+    (*line)[(*len)++] = *s;
+  }
+  if (quote)
+    (*line)[(*len)++] = '"';
+  (*line)[*len] = '\0';
+
+  return 0;
+}
+
+
+/**
+   gm_execute
+
+   Runs the -e command for every account kept on a pool of zmprov
+   sessions.  Returns the number of commands that printed an error or
+   were lost to sessions that died, or -1 if none could be run.
+*/
+long
+gm_execute
+(
+ dl_context     *ctx,
+ struct gm_find *f,
+ char          **command,
+ int             argc,
+ int             sessions
+)
+{
+  zm_pool *pool;
+  char    *line = NULL, *arg;
+  size_t   len, max = 0;
+  long     i, lost, failed = 0;
+  int      j;
+
+  signal (SIGPIPE, SIG_IGN);
+  if ((pool = zm_pool_new (GM_ZMPROV, "prov", sessions, 1, gm_print_output, &failed)) == NULL) {
+    perror (program_name);
+    return -1;
+  }
+
+  for (i = 0; i < f->count; i++) {
+    for (j = 0, len = 0; j < argc; j++) {
+      if ((arg = gm_expand (command[j], f->accounts[i].uid)) == NULL
+          || gm_append_arg (&line, &len, &max, arg) != 0) {
+        fprintf (stderr, "%s: out of memory\n", program_name);
+        exit (EXIT_FAILURE);
+      }
+      free (arg);
+    }
+    if (ctx->debug)
+      fprintf (stderr, "zmprov %s\n", line);
+    if (zm_pool_submit (pool, -1, line, f->accounts[i].uid, 0) != 0) {
+      fprintf (stderr, "%s: zmprov: %s\n", program_name, strerror (errno));
+      break;
+    }
+  }
+
+  zm_pool_drain (pool);
+  lost = zm_pool_free (pool) + (f->count - i);
+  free (line);
+
+  return lost + failed;
+}
+
+
+
+/*
+----------------------------------------------------------------------
+
+
+                               Main
+
+
+----------------------------------------------------------------------
+*/
+
+
+int
+main
+(
+ int   argc,
+ char *argv[]
+)
+{
+  dl_context        *ctx;
+  struct gm_find     find;
+  struct gm_change  *changes = NULL;
+  const char        *id;
+  char               filter[GM_FILTER_MAX], conds[GM_FILTER_MAX], stamp[32];
+  char              *attrs[GM_ATTRS_MAX + 2], *print = NULL, *s, *t;
+  char             **command = NULL;
+  char              *cos[GM_ATTRS_MAX];
+  int                change_count = 0, command_count = 0, cos_count = 0;
+  int                window = GM_WINDOW, sessions = GM_SESSIONS, i, n;
+  long               failed = 0;
+
+  program_name = argv[0];
+  dl_zmsetvars (argc, argv);
+
+  memset (&find, 0, sizeof (find));
+  conds[0] = '\0';
+
+  if ((ctx = dl_context_new ()) == NULL
+      || (changes = malloc (argc * sizeof (*changes))) == NULL) {
+    fprintf (stderr, "%s: out of memory\n", program_name);
+    exit (EXIT_FAILURE);
+  }
+  ctx->program_name = program_name;
+
+  while (--argc > 0 && (*++argv)[0] == '-') {
+    for (s = argv[0]+1; *s != '\0'; s++) {
+      if (strchr ("aCfFgHLmpQuzZAjMwt", *s) != NULL && argc < 2) {
+        fprintf (stderr, "%s: option -%c needs a value\n", program_name, *s);
+        usage ();
+        exit (EXIT_FAILURE);
+      }
+      switch (*s) {
+      case 'a':                 /* Account status */
+        gm_filter_add (conds, "zimbraAccountStatus", *++argv);
+        --argc;
+        break;
+      case 'C':                 /* Class of service, resolved once connected */
+        if (cos_count == GM_ATTRS_MAX) {
+          fprintf (stderr, "%s: too many -C options\n", program_name);
+          exit (EXIT_FAILURE);
+        }
+        cos[cos_count++] = *++argv;
+        --argc;
+        break;
+      case 'f':                 /* Feature enabled */
+        n = snprintf (filter, sizeof (filter), "zimbraFeature%sEnabled", *++argv);
+        if (n < 0 || (size_t)n >= sizeof (filter)) {
+          fprintf (stderr, "%s: feature name too long\n", program_name);
+          exit (EXIT_FAILURE);
+        }
+        gm_filter_add (conds, filter, "TRUE");
+        --argc;
+        break;
+      case 'F':                 /* Preferred forwarding address */
+        gm_filter_add (conds, "zimbraPrefMailForwardingAddress", *++argv);
+        --argc;
+        break;
+      case 'g':                 /* Admin forwarding address */
+        gm_filter_add (conds, "zimbraMailForwardingAddress", *++argv);
+        --argc;
+        break;
+      case 'H':                 /* Mail host */
+        gm_filter_add (conds, "zimbraMailHost", *++argv);
+        --argc;
+        break;
+      case 'L':                 /* Last logon at or before */
+        if (gm_timestamp (*++argv, stamp, sizeof (stamp)) != 0) {
+          fprintf (stderr, "%s: bad date: %s\n", program_name, *argv);
+          exit (EXIT_FAILURE);
+        }
+        n = strlen (conds);
+        if (snprintf (conds + n, sizeof (conds) - n, "(zimbraLastLogonTimestamp<=%s)",
+                      stamp) >= (int)(sizeof (conds) - n)) {
+          fprintf (stderr, "%s: filter too long\n", program_name);
+          exit (EXIT_FAILURE);
+        }
+        --argc;
+        break;
+      case 'm':                 /* Mail address */
+        gm_filter_add (conds, "mail", *++argv);
+        --argc;
+        break;
+      case 'p':                 /* Preferred zimlet */
+        gm_filter_add (conds, "zimbraPrefZimlets", *++argv);
+        --argc;
+        break;
+      case 'Q':                 /* Mail quota */
+        gm_filter_add (conds, "zimbraMailQuota", *++argv);
+        --argc;
+        break;
+      case 'u':                 /* Account uid */
+        gm_filter_add (conds, "uid", *++argv);
+        --argc;
+        break;
+      case 'z':                 /* Available zimlet */
+        gm_filter_add (conds, "zimbraZimletAvailableZimlets", *++argv);
+        --argc;
+        break;
+      case 'Z':                 /* Result limit */
+        find.limit = atol (*++argv);
+        --argc;
+        break;
+      case 'A':                 /* Attributes to print */
+        print = *++argv;
+        --argc;
+        break;
+      case 'e':                 /* zmprov command, up to ';' */
+        command = ++argv;
+        for (--argc; argc > 0 && strcmp (*argv, ";") != 0; argc--, argv++)
+          command_count++;
+        if (argc == 0 || command_count == 0) {
+          fprintf (stderr, "%s: syntax error: -e needs a command ending in ';'\n",
+                   program_name);
+          exit (EXIT_FAILURE);
+        }
+        break;
+      case 'j':                 /* zmprov sessions */
+        sessions = atoi (*++argv);
+        --argc;
+        break;
+      case 'M':                 /* Direct modify */
+        if (gm_change_parse (*++argv, &changes[change_count]) != 0) {
+          fprintf (stderr, "%s: bad change: %s\n", program_name, *argv);
+          exit (EXIT_FAILURE);
+        }
+        change_count++;
+        --argc;
+        break;
+      case 'w':                 /* Modify window */
+        window = atoi (*++argv);
+        --argc;
+        break;
+      case 't':                 /* Per-operation timeout */
+        ctx->op_timeout = atoi (*++argv);
+        --argc;
+        break;
+      case 'd':                 /* Toggle debug mode */
+        ctx->debug = !ctx->debug;
+        break;
+      case 'h':
+        usage ();
+        exit (EXIT_SUCCESS);
+      default:
+        fprintf (stderr, "%s: illegal option -%c\n", program_name, *s);
+        usage ();
+        exit (EXIT_FAILURE);
+      }
+    }
+  }
+
+  if (argc > 0) {
+    usage ();
+    exit (EXIT_FAILURE);
+  }
+
+  /* Only the attributes printed or needed to act on are read. */
+  n = 0;
+  attrs[n++] = "uid";
+  for (s = print; s != NULL && *s != '\0'; s = t) {
+    if ((t = strchr (s, ',')) != NULL)
+      *t++ = '\0';
+    if (*s == '\0')
+      continue;
+    if (n == GM_ATTRS_MAX + 1) {
+      fprintf (stderr, "%s: too many attributes to print\n", program_name);
+      exit (EXIT_FAILURE);
+    }
+    attrs[n++] = s;
+  }
+  attrs[n] = NULL;
+  find.print = attrs + 1;
+  find.print_count = n - 1;
+  find.keep = change_count > 0 || command_count > 0;
+
+  if (dl_init (ctx) != DL_SUCCESS) {
+    dl_perror (ctx, "dl_init");
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < cos_count; i++) {
+    if ((id = gm_cos_id (ctx, cos[i])) == NULL) {
+      fprintf (stderr, "%s: no such COS: %s\n", program_name, cos[i]);
+      exit (EXIT_FAILURE);
+    }
+    gm_filter_add (conds, "zimbraCOSId", id);
+  }
+
+  n = snprintf (filter, sizeof (filter), "(&(uid=*)%s)", conds);
+  if (n < 0 || (size_t)n >= sizeof (filter)) {
+    fprintf (stderr, "%s: filter too long\n", program_name);
+    exit (EXIT_FAILURE);
+  }
+  if (ctx->debug)
+    fprintf (stderr, "Filter: %s\n", filter);
+
+  if (dl_search_paged (ctx, NULL, filter, attrs, gm_found, &find) != DL_SUCCESS) {
+    dl_perror (ctx, "search");
+    exit (EXIT_FAILURE);
+  }
+  fflush (stdout);
+
+  if (change_count > 0)
+    failed = gm_modify (ctx, &find, changes, change_count, window);
+  if (failed >= 0 && command_count > 0) {
+    long lost = gm_execute (ctx, &find, command, command_count, sessions);
+
+    failed = lost < 0 ? -1 : failed + lost;
+  }
+
+  if (failed > 0)
+    fprintf (stderr, "%s: %ld account(s) not changed\n", program_name, failed);
+
+  dl_cleanup (ctx);
+  dl_context_free (ctx);
+
+  exit (failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
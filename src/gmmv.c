@@ -0,0 +1,1004 @@
+/**********************************************************************
+ * gmmv (C) M. Brent Harp 2010-2012
+ *
+ * Move Gryph Mail accounts between servers.
+ *
+ * The mail host of every account is read in a few directory
+ * searches, or from a host map, then moves are run several at a time, no more than a set
+ * number leaving any one server or arriving at any one, in the order
+ * asked for.  The old mailbox is purged after each move without
+ * holding up the next one.  Every step is logged to a state file, so
+ * a run that is stopped can be started again where it left off.
+ ***********************************************************************/
+
+#include <string.h>
+
+#include <config.h>
+#include <errno.h>
+#include <pwd.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "dlsync.h"
+
+#define MV_ZMPROV        "/opt/zimbra/bin/zmprov"
+#define MV_ZMMAILBOXMOVE "/opt/zimbra/bin/zmmailboxmove"
+#define MV_SUDO          "sudo -u zimbra "  /* When not run as zimbra. */
+#define MV_JOBS          (4)                /* Moves at once by default. */
+#define MV_PER_SOURCE    (1)
+#define MV_PER_TARGET    (2)
+#define MV_PURGES        (2)
+
+enum mv_state {
+  MV_PENDING,                           /* Waiting to move. */
+  MV_MOVING,
+  MV_MOVED,                             /* Waiting to purge. */
+  MV_PURGING,
+  MV_DONE,
+  MV_FAILED,
+  MV_SKIPPED
+};
+
+enum mv_order {
+  MV_ORDER_GIVEN,
+  MV_ORDER_LARGEST,
+  MV_ORDER_SMALLEST
+};
+
+struct mv_job {
+  char             *name;               /* As given. */
+  char             *target;
+  char             *source;             /* Mail host, NULL until looked up. */
+  char             *moved_to;           /* Target of a move the state file saw start. */
+  char             *moved_from;
+  char            **mail;               /* Addresses, for matching usage. */
+  int               mail_count;
+  long long         size;               /* Bytes used, -1 if unknown. */
+  long              seq;                /* Position given. */
+  int               state;
+  pid_t             pid;
+};
+
+/* An address of a job's, for matching usage to it. */
+struct mv_mail {
+  const char    *mail;
+  struct mv_job *job;
+};
+
+struct mv_host {
+  char *name;
+  int   from;                           /* Moves leaving it. */
+  int   to;                             /* Moves arriving. */
+  int   sized;                          /* Its usage has been read. */
+};
+
+char *program_name;
+
+static struct mv_job  *jobs;
+static long            job_count;
+static long            job_max;
+static struct mv_host **hosts;        /* Apart, so a host stays put. */
+static int             host_count;
+static FILE           *state_file;
+static const char     *zmprov;
+static const char     *zmmailboxmove;
+static volatile sig_atomic_t stopping;
+
+
+
+/*
+----------------------------------------------------------------------
+
+
+                         Local Functions
+
+
+----------------------------------------------------------------------
+*/
+
+
+void
+usage
+(
+ void
+)
+{
+  fprintf(stderr,
+	  "Usage: %s [options] target [account...]\n"
+	  "\n"
+	  "\tMoves accounts to target, purging each old mailbox once\n"
+	  "\tits move succeeds.  With no accounts, reads lines of\n"
+	  "\t'account [target]' from standard input; a target of - means\n"
+	  "\tevery line names its own.\n"
+	  "\n"
+	  "Options:\n"
+	  "  -j moves     Moves at once (default %d)\n"
+	  "\n"
+	  "  -s moves     Moves at once from any one server (default %d)\n"
+	  "\n"
+	  "  -T moves     Moves at once to any one server (default %d)\n"
+	  "\n"
+	  "  -P purges    Purges at once (default %d)\n"
+	  "\n"
+	  "  -o order     Move the 'largest' or 'smallest' mailboxes first,\n"
+	  "               by zmprov getQuotaUsage (default as given)\n"
+	  "\n"
+	  "  -f file      State file: record progress, and skip what an\n"
+	  "               earlier run with the same file finished\n"
+	  "\n"
+	  "  -m file      Host map: read lines of 'account mailhost\n"
+	  "               [address...]' instead of the directory\n"
+	  "\n"
+	  "  -n           Print the moves in order without making them\n"
+	  "\n"
+	  "  -t seconds   Timeout for each LDAP operation\n"
+	  "\n"
+	  "  -d           Debug mode\n"
+	  "\n"
+	  "  -h           Display this help message\n"
+	  "\n"
+	  "\tZMPROV and ZMMAILBOXMOVE override the commands run.\n"
+	  "\n"
+	  ,program_name, MV_JOBS, MV_PER_SOURCE, MV_PER_TARGET, MV_PURGES);
+}
+
+
+void
+mv_nomem
+(
+ void
+)
+{
+  fprintf (stderr, "%s: out of memory\n", program_name);
+  exit (EXIT_FAILURE);
+}
+
+
+char *
+mv_strdup
+(
+ const char *s
+)
+{
+  char *copy;
+
+  if ((copy = strdup (s)) == NULL)
+    mv_nomem ();
+  return copy;
+}
+
+
+void
+mv_stop
+(
+ int sig
+)
+{
+  (void) sig;
+  stopping = 1;
+}
+
+
+/* A Zimbra command, run through sudo unless we are zimbra. */
+const char *
+mv_command
+(
+ const char *env,
+ const char *path
+)
+{
+  struct passwd *pw;
+  const char    *s;
+  char          *command;
+
+  if ((s = getenv (env)) != NULL)
+    return s;
+  if ((pw = getpwuid (geteuid ())) != NULL && strcmp (pw->pw_name, "zimbra") == 0)
+    return path;
+  if ((command = malloc (strlen (MV_SUDO) + strlen (path) + 1)) == NULL)
+    mv_nomem ();
+  strcpy (command, MV_SUDO);
+  strcat (command, path);
+
+  return command;
+}
+
+
+/* Records a step in the state file, on disk before going on. */
+void
+mv_record
+(
+ const char    *event,
+ struct mv_job *job,
+ const char    *source
+)
+{
+  if (state_file == NULL)
+    return;
+  fprintf (state_file, "%ld %s %s %s %s\n", (long)time (NULL), event, job->name,
+           source != NULL ? source : "-", job->target);
+  fflush (state_file);
+  fsync (fileno (state_file));
+}
+
+
+void
+mv_add_job
+(
+ const char *name,
+ const char *target
+)
+{
+  struct mv_job *j;
+
+  if (job_count == job_max) {
+    job_max = job_max ? 2 * job_max : 256;
+    if ((j = realloc (jobs, job_max * sizeof (*j))) == NULL)
+      mv_nomem ();
+    jobs = j;
+  }
+  j = &jobs[job_count];
+  memset (j, 0, sizeof (*j));
+  j->name = mv_strdup (name);
+  j->target = mv_strdup (target);
+  j->size = -1;
+  j->seq = job_count++;
+}
+
+
+int
+mv_name_cmp
+(
+ const void *a,
+ const void *b
+)
+{
+  return strcasecmp (((const struct mv_job *)a)->name, ((const struct mv_job *)b)->name);
+}
+
+
+struct mv_job *
+mv_find
+(
+ const char *name
+)
+{
+  struct mv_job key;
+
+  key.name = (char *)name;
+  return bsearch (&key, jobs, job_count, sizeof (key), mv_name_cmp);
+}
+
+
+int
+mv_order_cmp
+(
+ const void *a,
+ const void *b
+)
+{
+  const struct mv_job *x = a, *y = b;
+
+  return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+
+int
+mv_largest_cmp
+(
+ const void *a,
+ const void *b
+)
+{
+  const struct mv_job *x = a, *y = b;
+
+  if (x->size != y->size)
+    return x->size > y->size ? -1 : 1;
+  return mv_order_cmp (a, b);
+}
+
+
+int
+mv_smallest_cmp
+(
+ const void *a,
+ const void *b
+)
+{
+  const struct mv_job *x = a, *y = b;
+
+  if (x->size != y->size)
+    return x->size < y->size ? -1 : 1;
+  return mv_order_cmp (a, b);
+}
+
+
+int
+mv_mail_cmp
+(
+ const void *a,
+ const void *b
+)
+{
+  const struct mv_mail *x = a, *y = b;
+
+  return strcasecmp (x->mail, y->mail);
+}
+
+
+struct mv_host *
+mv_host
+(
+ const char *name
+)
+{
+  struct mv_host **v, *h;
+  int              i;
+
+  for (i = 0; i < host_count; i++)
+    if (strcasecmp (hosts[i]->name, name) == 0)
+      return hosts[i];
+
+  if ((v = realloc (hosts, (host_count + 1) * sizeof (*v))) == NULL
+      || (h = malloc (sizeof (*h))) == NULL)
+    mv_nomem ();
+  hosts = v;
+  hosts[host_count++] = h;
+  h->name = mv_strdup (name);
+  h->from = h->to = h->sized = 0;
+
+  return h;
+}
+
+
+/* Adds an address of a job's, for matching usage to it. */
+void
+mv_add_mail
+(
+ struct mv_job *j,
+ const char    *mail
+)
+{
+  char **v;
+
+  if ((v = realloc (j->mail, (j->mail_count + 2) * sizeof (*v))) == NULL)
+    mv_nomem ();
+  j->mail = v;
+  j->mail[j->mail_count++] = mv_strdup (mail);
+  j->mail[j->mail_count] = NULL;
+}
+
+
+/**
+   mv_read_map
+
+   Reads the mail host of each account from a file of lines of
+   'account mailhost [address...]', in place of the directory.  The
+   addresses match the account's usage; without any, its name does.
+   Accounts not in the file have no mail host.
+*/
+void
+mv_read_map
+(
+ const char *path
+)
+{
+  FILE          *f;
+  struct mv_job *j;
+  char          *line = NULL, *name, *host, *mail;
+  size_t         max = 0;
+
+  if ((f = fopen (path, "r")) == NULL) {
+    perror (path);
+    exit (EXIT_FAILURE);
+  }
+
+  while (getline (&line, &max, f) > 0) {
+    if ((name = strtok (line, " \t\r\n")) == NULL || name[0] == '#'
+        || (host = strtok (NULL, " \t\r\n")) == NULL
+        || (j = mv_find (name)) == NULL || j->source != NULL)
+      continue;
+    j->source = mv_strdup (host);
+    while ((mail = strtok (NULL, " \t\r\n")) != NULL)
+      mv_add_mail (j, mail);
+    if (j->mail_count == 0)
+      mv_add_mail (j, name);
+  }
+
+  free (line);
+  fclose (f);
+}
+
+
+/* Files the mail host and addresses of each account found. */
+int
+mv_account_found
+(
+ dl_context  *ctx,
+ LDAPMessage *entry,
+ void        *arg
+)
+{
+  static char    *keys[] = { "uid", "mail", NULL };
+  struct berval **vals, **host, **mail;
+  struct mv_job  *j;
+  int             i, k, n;
+
+  (void) arg;
+  host = ldap_get_values_len (ctx->ldap, entry, "zimbraMailHost");
+  mail = ldap_get_values_len (ctx->ldap, entry, "mail");
+
+  for (k = 0; keys[k] != NULL; k++) {
+    if ((vals = ldap_get_values_len (ctx->ldap, entry, keys[k])) == NULL)
+      continue;
+    for (i = 0; vals[i] != NULL; i++) {
+      char name[512];
+
+      snprintf (name, sizeof (name), "%.*s", (int)vals[i]->bv_len, vals[i]->bv_val);
+      if ((j = mv_find (name)) == NULL || j->source != NULL || host == NULL)
+        continue;
+      j->source = strndup (host[0]->bv_val, host[0]->bv_len);
+      for (n = 0; mail != NULL && mail[n] != NULL; n++)
+        ;
+      if (j->source == NULL || (j->mail = calloc (n + 1, sizeof (*j->mail))) == NULL)
+        mv_nomem ();
+      for (j->mail_count = 0; j->mail_count < n; j->mail_count++)
+        if ((j->mail[j->mail_count] = strndup (mail[j->mail_count]->bv_val,
+                                               mail[j->mail_count]->bv_len)) == NULL)
+          mv_nomem ();
+    }
+    ldap_value_free_len (vals);
+  }
+
+  if (host != NULL)
+    ldap_value_free_len (host);
+  if (mail != NULL)
+    ldap_value_free_len (mail);
+
+  return 0;
+}
+
+
+/**
+   mv_lookup
+
+   Reads the mail host of every account with dl_search_accounts.
+   Returns DL_SUCCESS or DL_FAILURE.
+*/
+int
+mv_lookup
+(
+ dl_context *ctx
+)
+{
+  static char  *attrs[] = { "uid", "mail", "zimbraMailHost", NULL };
+  char        **names;
+  long          i;
+  int           status;
+
+  if ((names = malloc ((job_count + 1) * sizeof (*names))) == NULL)
+    mv_nomem ();
+  for (i = 0; i < job_count; i++)
+    names[i] = jobs[i].name;
+  status = dl_search_accounts (ctx, names, job_count, attrs, mv_account_found, NULL);
+  free (names);
+
+  return status;
+}
+
+
+/**
+   mv_resume
+
+   Reads a state file left by an earlier run.  The last step recorded
+   for an account decides what is left: nothing once purged, the
+   purge once moved, and for a move that was started but never
+   finished, the purge if the directory has the account on its new
+   server, or the move again if not.
+*/
+void
+mv_resume
+(
+ const char *path
+)
+{
+  FILE          *f;
+  struct mv_job *j;
+  char           line[1024], event[32], name[512], source[256], target[256];
+  long           when;
+
+  if ((f = fopen (path, "r")) == NULL) {
+    if (errno != ENOENT) {
+      perror (path);
+      exit (EXIT_FAILURE);
+    }
+    return;
+  }
+
+  while (fgets (line, sizeof (line), f) != NULL) {
+    if (sscanf (line, "%ld %31s %511s %255s %255s", &when, event, name, source, target) != 5
+        || (j = mv_find (name)) == NULL)
+      continue;
+    free (j->moved_from);
+    free (j->moved_to);
+    j->moved_from = j->moved_to = NULL;
+
+    if (strcmp (event, "purged") == 0)
+      j->state = MV_DONE;
+    else if (strcmp (event, "moved") == 0 || strcmp (event, "purgefailed") == 0) {
+      j->state = MV_MOVED;
+      j->moved_from = mv_strdup (source);
+    } else if (strcmp (event, "start") == 0) {
+      j->state = MV_PENDING;
+      j->moved_from = mv_strdup (source);
+      j->moved_to = mv_strdup (target);
+    } else
+      j->state = MV_PENDING;
+  }
+  fclose (f);
+
+  for (j = jobs; j < jobs + job_count; j++) {
+    if (j->moved_to == NULL || j->source == NULL)
+      continue;
+    if (strcasecmp (j->source, j->moved_to) == 0)
+      j->state = MV_MOVED;              /* The move got as far as the directory. */
+    else {
+      free (j->moved_from);
+      j->moved_from = NULL;
+    }
+  }
+}
+
+
+/* Reads each mailbox's size from one getQuotaUsage per source server. */
+void
+mv_sizes
+(
+ int debug
+)
+{
+  struct mv_mail *index, key, *hit;
+  struct mv_host *h;
+  FILE           *p;
+  char           *command, line[1024], name[512];
+  long long       quota, used;
+  long            i, n = 0;
+  int             k;
+
+  for (i = 0; i < job_count; i++)
+    n += jobs[i].mail_count;
+  if ((index = malloc ((n + 1) * sizeof (*index))) == NULL)
+    mv_nomem ();
+  for (i = 0, n = 0; i < job_count; i++)
+    for (k = 0; k < jobs[i].mail_count; k++) {
+      index[n].mail = jobs[i].mail[k];
+      index[n++].job = &jobs[i];
+    }
+  qsort (index, n, sizeof (*index), mv_mail_cmp);
+
+  for (i = 0; i < job_count; i++) {
+    if (jobs[i].state != MV_PENDING || (h = mv_host (jobs[i].source))->sized)
+      continue;
+    h->sized = 1;
+    if ((command = malloc (strlen (zmprov) + strlen (h->name) + 32)) == NULL)
+      mv_nomem ();
+    sprintf (command, "%s getQuotaUsage '%s'", zmprov, h->name);
+    if (debug)
+      fprintf (stderr, "%s\n", command);
+    if ((p = popen (command, "r")) == NULL) {
+      perror (command);
+      exit (EXIT_FAILURE);
+    }
+    while (fgets (line, sizeof (line), p) != NULL) {
+      if (sscanf (line, "%511s %lld %lld", name, &quota, &used) != 3)
+        continue;
+      key.mail = name;
+      if ((hit = bsearch (&key, index, n, sizeof (*index), mv_mail_cmp)) != NULL)
+        hit->job->size = used;
+    }
+    if (pclose (p) != 0)
+      fprintf (stderr, "%s: %s failed\n", program_name, command);
+    free (command);
+  }
+
+  free (index);
+}
+
+
+/* Starts a move or purge.  Returns 0, or -1 if it could not be run. */
+int
+mv_spawn
+(
+ struct mv_job *job,
+ int            purge
+)
+{
+  const char *source = purge && job->moved_from != NULL ? job->moved_from : job->source;
+  char       *script;
+
+  if ((script = malloc (strlen (zmmailboxmove) + 64)) == NULL)
+    mv_nomem ();
+  if (purge)
+    sprintf (script, "%s -a \"$1\" -s \"$2\" -po", zmmailboxmove);
+  else
+    sprintf (script, "%s -a \"$1\" -s \"$2\" -t \"$3\"", zmmailboxmove);
+
+  if ((job->pid = fork ()) < 0) {
+    free (script);
+    return -1;
+  }
+  if (job->pid == 0) {
+    setpgid (0, 0);                     /* Once started, a move is not interrupted. */
+    execl ("/bin/sh", "sh", "-c", script, "sh", job->name, source, job->target, (char *)NULL);
+    _exit (127);
+  }
+  free (script);
+
+  return 0;
+}
+
+
+/**
+   mv_start
+
+   Starts every move the caps allow, in order, then every purge
+   waiting.  A move or purge that cannot be run fails and is counted
+   in *failed.  Returns the number started.
+*/
+int
+mv_start
+(
+ int   max_jobs,
+ int   per_source,
+ int   per_target,
+ int   max_purges,
+ int  *moving,
+ int  *purging,
+ long *failed
+)
+{
+  struct mv_host *from, *to;
+  struct mv_job  *j;
+  int             started = 0;
+
+  for (j = jobs; j < jobs + job_count && !stopping; j++) {
+    if (j->state == MV_MOVED && *purging < max_purges) {
+      const char *source = j->moved_from != NULL ? j->moved_from : j->source;
+
+      syslog (LOG_INFO, "starting mailbox purge (account=%s; source=%s)", j->name, source);
+      if (mv_spawn (j, 1) != 0) {
+        syslog (LOG_ERR, "fork: %m");
+        syslog (LOG_INFO, "purge failed (account=%s; source=%s)", j->name, source);
+        mv_record ("purgefailed", j, source);
+        j->state = MV_FAILED;
+        (*failed)++;
+        continue;
+      }
+      j->state = MV_PURGING;
+      (*purging)++;
+      started++;
+      continue;
+    }
+    if (j->state != MV_PENDING || *moving >= max_jobs)
+      continue;
+    from = mv_host (j->source);
+    to = mv_host (j->target);
+    if (from->from >= per_source || to->to >= per_target)
+      continue;
+
+    syslog (LOG_INFO, "starting mailbox move (account=%s; source=%s; target=%s)",
+            j->name, j->source, j->target);
+    mv_record ("start", j, j->source);
+    if (mv_spawn (j, 0) != 0) {
+      syslog (LOG_ERR, "fork: %m");
+      syslog (LOG_INFO, "move failed (account=%s; source=%s; target=%s)",
+              j->name, j->source, j->target);
+      mv_record ("failed", j, j->source);
+      j->state = MV_FAILED;
+      (*failed)++;
+      continue;
+    }
+    j->state = MV_MOVING;
+    from->from++;
+    to->to++;
+    (*moving)++;
+    started++;
+  }
+
+  return started;
+}
+
+
+/* Notes a move or purge that has exited. */
+void
+mv_reap
+(
+ pid_t pid,
+ int   status,
+ int  *moving,
+ int  *purging,
+ long *failed
+)
+{
+  struct mv_job *j;
+  int            ok = WIFEXITED (status) && WEXITSTATUS (status) == 0;
+
+  for (j = jobs; j < jobs + job_count && j->pid != pid; j++)
+    ;
+  if (j == jobs + job_count)
+    return;
+  j->pid = 0;
+
+  if (j->state == MV_MOVING) {
+    mv_host (j->source)->from--;
+    mv_host (j->target)->to--;
+    (*moving)--;
+    if (ok) {
+      syslog (LOG_INFO, "move complete (account=%s; source=%s; target=%s)",
+              j->name, j->source, j->target);
+      mv_record ("moved", j, j->source);
+      j->state = MV_MOVED;
+    } else {
+      syslog (LOG_INFO, "move failed (account=%s; source=%s; target=%s)",
+              j->name, j->source, j->target);
+      mv_record ("failed", j, j->source);
+      j->state = MV_FAILED;
+      (*failed)++;
+    }
+  } else if (j->state == MV_PURGING) {
+    const char *source = j->moved_from != NULL ? j->moved_from : j->source;
+
+    (*purging)--;
+    if (ok) {
+      syslog (LOG_INFO, "purge complete (account=%s; source=%s)", j->name, source);
+      mv_record ("purged", j, source);
+      j->state = MV_DONE;
+    } else {
+      syslog (LOG_INFO, "purge failed (account=%s; source=%s)", j->name, source);
+      mv_record ("purgefailed", j, source);
+      j->state = MV_FAILED;
+      (*failed)++;
+    }
+  }
+}
+
+
+
+/*
+----------------------------------------------------------------------
+
+
+                               Main
+
+
+----------------------------------------------------------------------
+*/
+
+
+int
+main
+(
+ int   argc,
+ char *argv[]
+)
+{
+  dl_context       *ctx;
+  struct sigaction  sa;
+  struct mv_job    *j, dup;
+  const char       *target, *state_path = NULL, *map_path = NULL;
+  char             *s, *line = NULL, *name, *t;
+  size_t            max = 0;
+  long              failed = 0, skipped = 0, moved = 0, i, n;
+  int               max_jobs = MV_JOBS, per_source = MV_PER_SOURCE, per_target = MV_PER_TARGET;
+  int               max_purges = MV_PURGES, order = MV_ORDER_GIVEN, dry_run = 0;
+  int               moving = 0, purging = 0, status, debug;
+  pid_t             pid;
+
+  program_name = argv[0];
+  dl_zmsetvars (argc, argv);
+
+  if ((ctx = dl_context_new ()) == NULL)
+    mv_nomem ();
+  ctx->program_name = program_name;
+
+  while (--argc > 0 && (*++argv)[0] == '-' && (*argv)[1] != '\0') {
+    for (s = argv[0]+1; *s != '\0'; s++) {
+      if (strchr ("jsTPofmt", *s) != NULL && argc < 2) {
+        usage ();
+        exit (EXIT_FAILURE);
+      }
+      switch (*s) {
+      case 'j':                 /* Moves at once */
+        max_jobs = atoi (*++argv);
+        --argc;
+        break;
+      case 's':                 /* Moves per source */
+        per_source = atoi (*++argv);
+        --argc;
+        break;
+      case 'T':                 /* Moves per target */
+        per_target = atoi (*++argv);
+        --argc;
+        break;
+      case 'P':                 /* Purges at once */
+        max_purges = atoi (*++argv);
+        --argc;
+        break;
+      case 'o':                 /* Order */
+        --argc;
+        if (strcmp (*++argv, "largest") == 0)
+          order = MV_ORDER_LARGEST;
+        else if (strcmp (*argv, "smallest") == 0)
+          order = MV_ORDER_SMALLEST;
+        else {
+          usage ();
+          exit (EXIT_FAILURE);
+        }
+        break;
+      case 'f':                 /* State file */
+        state_path = *++argv;
+        --argc;
+        break;
+      case 'm':                 /* Host map */
+        map_path = *++argv;
+        --argc;
+        break;
+      case 'n':                 /* Dry run */
+        dry_run = !dry_run;
+        break;
+      case 't':                 /* Per-operation timeout */
+        ctx->op_timeout = atoi (*++argv);
+        --argc;
+        break;
+      case 'd':                 /* Toggle debug mode */
+        ctx->debug = !ctx->debug;
+        break;
+      case 'h':
+        usage ();
+        exit (EXIT_SUCCESS);
+      default:
+        fprintf (stderr, "%s: illegal option -%c\n", program_name, *s);
+        usage ();
+        exit (EXIT_FAILURE);
+      }
+    }
+  }
+
+  if (argc < 1 || max_jobs < 1 || per_source < 1 || per_target < 1 || max_purges < 1) {
+    usage ();
+    exit (EXIT_FAILURE);
+  }
+  target = *argv++;
+  argc--;
+
+  if (argc > 0) {
+    if (strcmp (target, "-") == 0) {
+      usage ();
+      exit (EXIT_FAILURE);
+    }
+    for (; argc > 0; argc--, argv++)
+      mv_add_job (*argv, target);
+  } else {
+    while (getline (&line, &max, stdin) > 0) {
+      if ((name = strtok (line, " \t\r\n")) == NULL)
+        continue;
+      if ((t = strtok (NULL, " \t\r\n")) == NULL)
+        t = (char *)target;
+      if (strcmp (t, "-") == 0) {
+        fprintf (stderr, "%s: %s: no target\n", program_name, name);
+        exit (EXIT_FAILURE);
+      }
+      mv_add_job (name, t);
+    }
+    free (line);
+  }
+  if (job_count == 0)
+    exit (EXIT_SUCCESS);
+
+  openlog ("gmmv", LOG_PID | LOG_PERROR, LOG_MAIL);
+  zmprov = mv_command ("ZMPROV", MV_ZMPROV);
+  zmmailboxmove = mv_command ("ZMMAILBOXMOVE", MV_ZMMAILBOXMOVE);
+
+  /* Accounts are looked up by name; a name given twice is one job. */
+  qsort (jobs, job_count, sizeof (*jobs), mv_name_cmp);
+  for (i = n = 0; i < job_count; i++) {
+    if (n == 0 || strcasecmp (jobs[n - 1].name, jobs[i].name) != 0) {
+      jobs[n++] = jobs[i];
+      continue;
+    }
+    if (jobs[i].seq < jobs[n - 1].seq) {  /* The first given stands. */
+      dup = jobs[n - 1];
+      jobs[n - 1] = jobs[i];
+    } else
+      dup = jobs[i];
+    free (dup.name);
+    free (dup.target);
+  }
+  job_count = n;
+
+  if (map_path != NULL)
+    mv_read_map (map_path);
+  else if (dl_init (ctx) != DL_SUCCESS || mv_lookup (ctx) != DL_SUCCESS) {
+    dl_perror (ctx, program_name);
+    exit (EXIT_FAILURE);
+  }
+  debug = ctx->debug;
+  dl_cleanup (ctx);
+  dl_context_free (ctx);
+
+  if (state_path != NULL) {
+    mv_resume (state_path);
+    if (!dry_run && (state_file = fopen (state_path, "a")) == NULL) {
+      perror (state_path);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  for (j = jobs; j < jobs + job_count; j++) {
+    if (j->state != MV_PENDING)
+      continue;
+    if (j->source == NULL) {
+      syslog (LOG_INFO, "no mailhost (account=%s)", j->name);
+      j->state = MV_FAILED;
+      failed++;
+    } else if (strcasecmp (j->source, j->target) == 0) {
+      syslog (LOG_INFO, "%s and %s are the same (account=%s)", j->source, j->target, j->name);
+      j->state = MV_SKIPPED;
+      skipped++;
+    }
+  }
+
+  if (order != MV_ORDER_GIVEN) {
+    mv_sizes (debug);
+    qsort (jobs, job_count, sizeof (*jobs),
+           order == MV_ORDER_LARGEST ? mv_largest_cmp : mv_smallest_cmp);
+  } else
+    qsort (jobs, job_count, sizeof (*jobs), mv_order_cmp);
+  if (dry_run) {
+    for (j = jobs; j < jobs + job_count; j++)
+      if (j->state == MV_PENDING)
+        printf ("move %s %s %s %lld\n", j->name, j->source, j->target, j->size);
+      else if (j->state == MV_MOVED)
+        printf ("purge %s %s\n", j->name, j->moved_from != NULL ? j->moved_from : j->source);
+    exit (EXIT_SUCCESS);
+  }
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = mv_stop;
+  sigaction (SIGINT, &sa, NULL);
+  sigaction (SIGTERM, &sa, NULL);
+  sigaction (SIGHUP, &sa, NULL);
+
+  for (;;) {
+    mv_start (max_jobs, per_source, per_target, max_purges, &moving, &purging, &failed);
+    if (moving == 0 && purging == 0)
+      break;
+    if ((pid = waitpid (-1, &status, 0)) < 0) {
+      if (errno == EINTR) {
+        if (stopping)
+          syslog (LOG_INFO, "stopping after %d move(s) and %d purge(s) running",
+                  moving, purging);
+        continue;
+      }
+      syslog (LOG_ERR, "waitpid: %m");
+      break;
+    }
+    mv_reap (pid, status, &moving, &purging, &failed);
+  }
+
+  if (state_file != NULL)
+    fclose (state_file);
+
+  for (j = jobs; j < jobs + job_count; j++)
+    moved += j->state == MV_DONE;
+  syslog (LOG_INFO, "%ld moved, %ld failed, %ld skipped%s", moved, failed, skipped,
+          stopping ? ", stopped" : "");
+
+  exit (failed == 0 && !stopping ? EXIT_SUCCESS : EXIT_FAILURE);
+}
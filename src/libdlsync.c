@@ -0,0 +1,2207 @@
+/**********************************************************************
+ * libdlsync (C) M. Brent Harp 2010-2012
+ *
+ * Synchronize Zimbra distribution lists from LDAP.
+ ***********************************************************************/
+
+#include <string.h>
+
+#include <config.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ldap.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <time.h>
+#include <poll.h>
+
+#include "dlsync.h"
+
+
+/*
+----------------------------------------------------------------------
+
+
+                        Zmprov Functions
+
+
+----------------------------------------------------------------------
+*/
+
+#define ZMPROV   "${ZMPROV:-zmprov}>/dev/null" /* environment var or default */
+
+int
+zmprov_open(
+ dl_context *ctx
+){
+   if (ctx->zmprov != NULL)
+     return (0);  /* only open one instance */
+
+   if ((ctx->zmprov = popen (ZMPROV,  "w")) == NULL) {
+     fprintf(stderr,
+             "%s: zmprov_open: popen: failed to open '%s'\n",
+             ctx->program_name,
+             ZMPROV);
+     return (-1);
+   }
+
+   return (0);
+}
+
+int
+zmprov_close(
+  dl_context *ctx
+){
+  if (ctx->zmprov != NULL) {
+    fflush (ctx->zmprov);
+    if (pclose (ctx->zmprov) == -1) {
+      ctx->zmprov = NULL;
+      return (-1);
+    }
+    ctx->zmprov = NULL;
+  }
+  return (0);
+}
+
+int
+zmprov_add_dl_member(
+  dl_context *ctx,
+  const char *dlname,
+  const char *addr
+){
+  if (ctx->zmprov == NULL)
+    return (-1);
+
+  if (fprintf (ctx->zmprov, "adlm '%s' '%s'\n", dlname, addr) < 0) {
+    return (-1);
+  }
+
+  return (0);
+}
+
+int
+zmprov_remove_dl_member(
+  dl_context *ctx,
+  const char *dlname,
+  const char *addr
+){
+  if (ctx->zmprov == NULL)
+    return (-1);
+
+  if (fprintf (ctx->zmprov, "rdlm '%s' '%s'\n", dlname, addr) < 0) {
+    return (-1);
+  }
+
+  return (0);
+}
+
+
+
+
+/*
+  ----------------------------------------------------------------------
+
+
+                         zmmailbox
+
+
+  ----------------------------------------------------------------------
+*/
+
+
+#define ZMMAILBOX  "${ZMMAILBOX:-zmmailbox}" /* environment var or default */
+
+int
+zmmailbox_open(
+ dl_context *ctx
+){
+   if (ctx->zmmailbox != NULL)
+     return (0);  /* only open one instance */
+
+   if ((ctx->zmmailbox = popen (ZMMAILBOX,  "w")) == NULL) {
+     fprintf(stderr,
+             "%s: zmmailbox_open: popen: failed to open '%s'\n",
+             ctx->program_name,
+             ZMMAILBOX);
+     return (-1);
+   }
+
+   return (0);
+}
+
+int
+zmmailbox_close(
+  dl_context *ctx
+){
+  if (ctx->zmmailbox != NULL) {
+    fflush (ctx->zmmailbox);
+    if (pclose (ctx->zmmailbox) == -1) {
+      ctx->zmmailbox = NULL;
+      return (-1);
+    }
+    ctx->zmmailbox = NULL;
+  }
+  return (0);
+}
+
+
+int
+zmmailbox_select_mailbox(
+  dl_context *ctx,
+  const char *name
+){
+  if (ctx->zmmailbox == NULL)
+    return (-1);
+
+  if (fprintf (ctx->zmmailbox, "sm \"%s\"\n", name) < 0) {
+    return (-1);
+  }
+
+  return (0);
+}
+
+
+int
+zmmailbox_create_mountpoint(
+  dl_context *ctx,
+  const char *flags,
+  const char *path,
+  const char *email,
+  const char *folder
+){
+  if (ctx->zmmailbox == NULL)
+    return (-1);
+
+  if (fprintf (ctx->zmmailbox, "cm -F \"%s\" \"%s\" \"%s\" \"%s\"\n",
+               flags, path, email, folder) < 0) {
+    return (-1);
+  }
+
+  return (0);
+}
+
+
+int
+zmmailbox_delete_folder(
+  dl_context *ctx,
+  const char *path
+){
+  if (ctx->zmmailbox == NULL)
+    return (-1);
+
+  if (fprintf (ctx->zmmailbox, "df \"%s\"\n", path) < 0) {
+    return (-1);
+  }
+
+  return (0);
+}
+
+
+
+/*
+  ----------------------------------------------------------------------
+
+
+                         BEncoding
+
+
+  ----------------------------------------------------------------------
+*/
+
+static int
+B_decode
+(
+  const char *string,
+  const char *format,
+  ...)
+{
+  char *s = (char *)string;
+  char *f = (char *)format;
+  int   n, slen, nmatch = 0;
+  char *c;
+  int  *d;
+  va_list ap;
+
+  va_start(ap, format);
+
+  while (*s && *f)
+  {
+    switch (*f++)
+    {
+      case '%':
+        switch (*f++) {
+          case 's':        /* match a string */
+            if (sscanf(s, "%d:%n", &slen, &n) < 1)
+              return -1;
+            s += n;
+            c = va_arg(ap, char *);
+            strncpy(c, s, slen);
+            c[slen] = '\0';
+            s += slen;
+            nmatch++;
+            break;
+
+          case 'd':        /* match an int */
+            d = va_arg(ap, int *);
+            if (sscanf(s, "i%de%n", d, &n) < 1)
+              return -1;
+            s += n;
+            nmatch++;
+            break;
+
+          default:         /* match literal */
+            if (*s++ != (*(f-1)))
+              return -1;
+            break;
+        }
+        break;
+
+      case '{':            /* match a dictionary */
+        if (*s++ != 'd')
+          return -1;
+        break;
+
+      case '[':            /* match a list */
+        if (*s++ != 'l')
+          return -1;
+        break;
+
+      case '}':            /* match end */
+      case ']':
+        if (*s++ != 'e')
+          return -1;
+        break;
+
+      default:             /* match literal string */
+        f--;
+        if (sscanf(s, "%d:%n", &slen, &n) < 1)
+          return -1;
+        s += n;
+        if (strncmp(s, f, slen) != 0)
+          return -1;
+        s += slen;
+        f += slen;
+        break;
+    }
+  }
+
+  va_end(ap);
+
+  if (*f != '\0')
+    return -1;
+
+  return nmatch;
+}
+
+
+static char *
+strrep
+(
+  char *string,
+  char  from,
+  char  to
+)
+{
+  char *s;
+  for (s = string; *s; s++)
+    if (*s == from)
+      *s = to;
+  return string;
+}
+
+
+
+
+/*
+  ----------------------------------------------------------------------
+
+
+                        Distribution Lists
+
+
+  ----------------------------------------------------------------------
+
+
+  Functions for manipulating Zimbra distribution lists via LDAP. Only
+  one list can be operated on at a time per context. To select a
+  list, call dl_select.
+
+*/
+
+
+#define DL_MAX_FILTER (256)
+#define DL_BATCH_SIZE (256)                    /* Members per streamed modify. */
+#define DL_LDAP_LIST_NAME_ATTRIBUTE "zimbraMailAlias"
+#define DL_LDAP_MEMBER_ATTRIBUTE "zimbraMailForwardingAddress"
+#define DL_LDAP_SHARE_INFO_ATTRIBUTE "zimbraShareInfo"
+#define DL_LDAP_URL      "ldap_master_url"
+#define DL_LDAP_USERDN   "zimbra_ldap_userdn"
+#define DL_LDAP_PASSWORD "zimbra_ldap_password"
+#define DL_LDAP_REPLICA_URL "ldap_url"
+#define DL_LDAP_CSN_ATTRIBUTE "entryCSN"
+#define DL_ZMSHUTIL      "/opt/zimbra/bin/zmshutil"
+#define DL_ZMSETVARS_GUARD "DL_ZMSETVARS"          /* Set once zmsetvars has run. */
+#define DL_REPLICA_RETRY (30)                  /* Seconds before retrying a replica. */
+#define DL_HEDGE_MIN_SAMPLES (20)              /* Reads timed before hedging starts. */
+
+/* Result codes that mean the server, not the request, is at fault. */
+#define DL_LDAP_UNREACHABLE(rc) \
+  ((rc) == LDAP_SERVER_DOWN || (rc) == LDAP_CONNECT_ERROR || \
+   (rc) == LDAP_TIMEOUT || (rc) == LDAP_UNAVAILABLE || (rc) == LDAP_BUSY)
+
+static const char *dl_error_messages[] = {
+  "no error",
+  "LDAP error",
+  "LDAP connection error",
+  "error parsing LDAP URL",
+  "no distribution list selected",
+  "unrecognized sync source",
+  "list not found",
+  "out of memory",
+  "source results not in sorted order",
+  "deadline exceeded",
+  "cannot read or write membership index"
+};
+
+
+/**
+   dl_ldap_error
+
+   Records an LDAP failure in the context.  If rc is not a result
+   code (as from ldap_result), the code is read back from the handle.
+*/
+static int
+dl_ldap_error
+(
+ dl_context *ctx,
+ LDAP       *ld,
+ int         rc
+)
+{
+  if (rc == -1 && ld != NULL)
+    ldap_get_option (ld, LDAP_OPT_RESULT_CODE, &rc);
+
+  ctx->error = rc == LDAP_TIMEOUT ? DL_ERR_TIMEOUT : DL_ERR_LDAP;
+  ctx->ldap_error = rc;
+
+  return DL_FAILURE;
+}
+
+
+/*
+  Timeouts.  Every connect and operation is bounded by op_timeout, and
+  everything done for one list by the deadline dl_sync sets from
+  list_timeout.  An operation that runs out of time fails with
+  LDAP_TIMEOUT, which is reported as DL_ERR_TIMEOUT.
+*/
+
+
+static double
+dl_now
+(
+ void
+)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/**
+   dl_remaining
+
+   Stores in *tv the time the next operation may take.  Returns 1 if
+   it is limited, 0 if it is not, or -1 if the deadline has passed.
+*/
+static int
+dl_remaining
+(
+ dl_context     *ctx,
+ struct timeval *tv
+)
+{
+  double left = ctx->op_timeout > 0 ? ctx->op_timeout : -1.0;
+
+  if (ctx->deadline > 0.0) {
+    double until = ctx->deadline - dl_now ();
+    if (until <= 0.0)
+      return -1;
+    if (left < 0.0 || until < left)
+      left = until;
+  }
+
+  if (left < 0.0)
+    return 0;
+
+  tv->tv_sec = (long)left;
+  tv->tv_usec = (long)((left - tv->tv_sec) * 1e6);
+  return 1;
+}
+
+
+/**
+   dl_set_timeouts
+
+   Bounds connects and synchronous operations on a handle.
+*/
+static void
+dl_set_timeouts
+(
+ dl_context *ctx,
+ LDAP       *ld
+)
+{
+  struct timeval tv;
+
+  if (dl_remaining (ctx, &tv) > 0) {
+    ldap_set_option (ld, LDAP_OPT_NETWORK_TIMEOUT, &tv);
+    ldap_set_option (ld, LDAP_OPT_TIMEOUT, &tv);
+  }
+}
+
+
+/**
+   dl_context_new
+
+   Allocates a context with default settings.  Returns NULL if out
+   of memory.
+*/
+dl_context *
+dl_context_new
+(
+ void
+)
+{
+  dl_context *ctx;
+
+  if ((ctx = calloc (1, sizeof (dl_context))) == NULL)
+    return NULL;
+
+  ctx->program_name = "dlsync";
+  ctx->create_shared_folders = 1;
+  ctx->sync_attribute = "mail";
+  ctx->ldap_base = "dc=uoguelph,dc=ca";
+  ctx->ldap_scope = LDAP_SCOPE_SUBTREE;
+  ctx->ldap_version = 3;
+
+  return ctx;
+}
+
+
+/**
+   dl_context_free
+
+   Releases a context and everything it holds, including helper
+   processes that are still open.
+*/
+void
+dl_context_free
+(
+ dl_context *ctx
+)
+{
+  int i;
+
+  if (ctx == NULL)
+    return;
+
+  dl_cleanup (ctx);
+  zmprov_close (ctx);
+  zmmailbox_close (ctx);
+  dl_index_close (ctx);
+
+  free (ctx->name);
+  for (i = 0; i < ctx->share_info_count; i++)
+    free (ctx->share_info[i]);
+  free (ctx->share_info);
+  for (i = 0; i < ctx->replica_count; i++)
+    free (ctx->replicas[i].url);
+  free (ctx->replicas);
+  free (ctx->members_csn);
+  free (ctx);
+}
+
+
+/**
+   dl_strerror
+
+   Returns a message describing the latest error in the context.
+*/
+const char *
+dl_strerror
+(
+ dl_context *ctx
+)
+{
+  if (ctx->error == DL_ERR_LDAP && ctx->ldap_error != LDAP_SUCCESS)
+    return ldap_err2string (ctx->ldap_error);
+
+  return dl_error_messages[ctx->error];
+}
+
+
+/**
+   dl_perror
+
+   Prints the latest error to stderr.
+*/
+void
+dl_perror
+(
+ dl_context *ctx,
+ const char *msg
+)
+{
+  if (msg != NULL && *msg != '\0') {
+    fputs (msg, stderr);
+    fputs (": ", stderr);
+  }
+
+  fputs (dl_error_messages[ctx->error], stderr);
+
+  if (ctx->error == DL_ERR_LDAP && ctx->ldap_error != LDAP_SUCCESS) {
+    fputs (": ", stderr);
+    fputs (ldap_err2string (ctx->ldap_error), stderr);
+  }
+
+  fputs ("\n", stderr);
+
+  fflush (stderr);
+}
+
+
+
+/*
+  Read replicas.  When a read policy is set, searches that do not
+  modify the directory are sent to the replicas listed in ldap_url;
+  the master (ctx->ldap) takes writes, and takes reads when no replica
+  is healthy.  A replica that fails to bind or answer is left alone
+  for DL_REPLICA_RETRY seconds and then reconnected on demand.
+*/
+
+
+static void
+dl_replica_down
+(
+ dl_context *ctx,
+ dl_replica *r
+)
+{
+  if (ctx->debug) {
+    fprintf (stderr, "Replica down: %s\n", r->url);
+  }
+
+  if (r->ldap != NULL) {
+    ldap_unbind (r->ldap);
+    r->ldap = NULL;
+  }
+  r->healthy = 0;
+  r->retry_at = time (NULL) + DL_REPLICA_RETRY;
+}
+
+
+static int
+dl_replica_connect
+(
+ dl_context *ctx,
+ dl_replica *r
+)
+{
+  if (r->ldap != NULL)
+    return DL_SUCCESS;
+
+  if (ctx->debug) {
+    fprintf (stderr, "Connect to replica: %s\n", r->url);
+  }
+
+  if (ldap_initialize (&r->ldap, r->url) != LDAP_SUCCESS) {
+    r->ldap = NULL;
+    dl_replica_down (ctx, r);
+    return DL_FAILURE;
+  }
+
+  ldap_set_option (r->ldap, LDAP_OPT_PROTOCOL_VERSION, &ctx->ldap_version);
+  dl_set_timeouts (ctx, r->ldap);
+
+  if (ldap_simple_bind_s (r->ldap, ctx->ldap_binddn, ctx->ldap_passwd
+                          ) != LDAP_SUCCESS) {
+    dl_replica_down (ctx, r);
+    return DL_FAILURE;
+  }
+
+  r->healthy = 1;
+  return DL_SUCCESS;
+}
+
+
+/**
+   dl_replicas_init
+
+   Splits the replica URL list into ctx->replicas.  Connections are
+   made when a replica is first read from.
+*/
+static int
+dl_replicas_init
+(
+ dl_context *ctx
+)
+{
+  char *urls, *url, *last;
+  int   n;
+
+  if (ctx->replicas != NULL || ctx->read_policy == DL_READ_MASTER)
+    return DL_SUCCESS;
+
+  if (ctx->replica_urls == NULL)
+    ctx->replica_urls = getenv (DL_LDAP_REPLICA_URL);
+  if (ctx->replica_urls == NULL)
+    return DL_SUCCESS;
+
+  if ((urls = strdup (ctx->replica_urls)) == NULL
+      || (ctx->replicas = calloc (strlen (urls) / 2 + 1, sizeof (dl_replica))) == NULL) {
+    free (urls);
+    ctx->error = DL_ERR_OUT_OF_MEMORY;
+    return DL_FAILURE;
+  }
+
+  n = 0;
+  for (url = strtok_r (urls, " \t,", &last); url != NULL;
+       url = strtok_r (NULL, " \t,", &last)) {
+    if ((ctx->replicas[n].url = strdup (url)) == NULL) {
+      ctx->replica_count = n;
+      free (urls);
+      ctx->error = DL_ERR_OUT_OF_MEMORY;
+      return DL_FAILURE;
+    }
+    ctx->replicas[n++].healthy = 1;
+    if (ctx->debug) {
+      fprintf (stderr, "  replica = %s\n", url);
+    }
+  }
+  ctx->replica_count = n;
+  free (urls);
+
+  return DL_SUCCESS;
+}
+
+
+/**
+   dl_read_pick
+
+   Chooses the replica for the next read according to the read
+   policy.  Returns NULL if reads should go to the master.
+*/
+static dl_replica *
+dl_read_pick
+(
+ dl_context *ctx
+)
+{
+  dl_replica *r, *best = NULL;
+  time_t      now = time (NULL);
+  int         i, j;
+
+  if (ctx->read_master || ctx->read_policy == DL_READ_MASTER)
+    return NULL;
+
+  for (j = 0; j < ctx->replica_count; j++) {
+    i = (ctx->replica_next + j) % ctx->replica_count;
+    r = &ctx->replicas[i];
+    if (!r->healthy && now < r->retry_at)
+      continue;
+    if (ctx->read_policy == DL_READ_ROUND_ROBIN) {
+      ctx->replica_next = i + 1;
+      return r;
+    }
+    if (best == NULL || r->latency < best->latency)
+      best = r;
+  }
+
+  return best;
+}
+
+
+/**
+   dl_latency_p95
+
+   Returns the 95th percentile of recent replica read latencies, or
+   0 if too few reads have been timed.
+*/
+static double
+dl_latency_p95
+(
+ dl_context *ctx
+)
+{
+  double sorted[DL_LATENCY_SAMPLES];
+  int    i, j, n = ctx->sample_count;
+  double v;
+
+  if (n > DL_LATENCY_SAMPLES)
+    n = DL_LATENCY_SAMPLES;
+  if (n < DL_HEDGE_MIN_SAMPLES)
+    return 0.0;
+
+  /* Insertion sort; the sample is small. */
+  for (i = 0; i < n; i++) {
+    v = ctx->samples[i];
+    for (j = i; j > 0 && sorted[j-1] > v; j--)
+      sorted[j] = sorted[j-1];
+    sorted[j] = v;
+  }
+
+  return sorted[(n * 95 + 99) / 100 - 1];
+}
+
+
+/**
+   dl_read_hedged
+
+   Sends a search to replica r; if no answer arrives within p95 ms,
+   sends it again to another healthy replica and takes whichever
+   answer comes first.  The other request is abandoned.  A replica
+   whose connection fails is marked down and leaves the race.  Stores
+   the replica that answered, or the last one to fail, in *winner and
+   returns an LDAP result code.
+*/
+static int
+dl_read_hedged
+(
+ dl_context  *ctx,
+ dl_replica  *r,
+ const char  *base,
+ int          scope,
+ const char  *filter,
+ char       **attrs,
+ LDAPMessage **res,
+ double       p95,
+ dl_replica **winner
+)
+{
+  dl_replica    *racer[2] = { r, NULL };
+  int            msgid[2], fd[2], n = 1, i, t, rc, err, got;
+  int            hedge = 1;             /* A hedge may still be sent. */
+  struct pollfd  pfd[2];
+  struct timeval tv, zero = { 0, 0 };
+  double         start = dl_now (), wait;
+
+  *winner = r;
+
+  rc = ldap_search_ext (r->ldap, base, scope, filter, attrs, 0,
+                        NULL, NULL, NULL, LDAP_NO_LIMIT, &msgid[0]);
+  if (rc != LDAP_SUCCESS)
+    return rc;
+  ldap_get_option (r->ldap, LDAP_OPT_DESC, &fd[0]);
+
+  for (;;) {
+    /* Wait until the hedge is due, or the deadline if sooner. */
+    if ((t = dl_remaining (ctx, &tv)) < 0) {
+      rc = LDAP_TIMEOUT;
+      break;
+    }
+    wait = t ? tv.tv_sec * 1e3 + tv.tv_usec / 1e3 : -1.0;
+    if (n == 1 && hedge) {
+      double due = p95 - (dl_now () - start) * 1e3;
+      if (due < 0.0)
+        due = 0.0;
+      if (wait < 0.0 || due < wait)
+        wait = due;
+    }
+
+    for (i = 0; i < n; i++) {
+      pfd[i].fd = fd[i];
+      pfd[i].events = POLLIN;
+    }
+    if (poll (pfd, n, wait < 0.0 ? -1 : (int)wait + 1) < 0) {
+      rc = LDAP_SERVER_DOWN;
+      break;
+    }
+
+    for (i = 0, got = 0; i < n; i++) {
+      if (!pfd[i].revents)
+        continue;
+      if ((got = ldap_result (racer[i]->ldap, msgid[i], LDAP_MSG_ALL, &zero, res)) != 0)
+        break;
+    }
+
+    /* A racer whose connection failed drops out; the other runs on. */
+    if (i < n && got < 0) {
+      if (n == 1) {
+        *winner = racer[0];
+        return LDAP_SERVER_DOWN;
+      }
+      dl_replica_down (ctx, racer[i]);
+      if (i == 0) {
+        racer[0] = racer[1];
+        msgid[0] = msgid[1];
+        fd[0] = fd[1];
+      }
+      racer[1] = NULL;
+      n = 1;
+      hedge = 0;
+      continue;
+    }
+
+    if (i < n) {
+      err = LDAP_SUCCESS;
+      ldap_parse_result (racer[i]->ldap, *res, &err, NULL, NULL, NULL, NULL, 0);
+      rc = err;
+      *winner = racer[i];
+      if (n == 2) {
+        ldap_abandon_ext (racer[1-i]->ldap, msgid[1-i], NULL, NULL);
+        if (ctx->debug) {
+          fprintf (stderr, "  hedged read won by %s\n", racer[i]->url);
+        }
+      }
+      return rc;
+    }
+
+    /* Past p95 with no answer: send the same read to another replica. */
+    if (n == 1 && hedge && (dl_now () - start) * 1e3 >= p95) {
+      for (i = 0; i < ctx->replica_count; i++) {
+        dl_replica *h = &ctx->replicas[(ctx->replica_next + i) % ctx->replica_count];
+        if (h == r || !h->healthy || dl_replica_connect (ctx, h) != DL_SUCCESS)
+          continue;
+        if (ldap_search_ext (h->ldap, base, scope, filter, attrs, 0,
+                             NULL, NULL, NULL, LDAP_NO_LIMIT, &msgid[1]) != LDAP_SUCCESS)
+          continue;
+        ldap_get_option (h->ldap, LDAP_OPT_DESC, &fd[1]);
+        racer[1] = h;
+        break;
+      }
+      if (racer[1] == NULL)
+        hedge = 0;      /* Nobody to hedge with; just wait. */
+      else
+        n = 2;
+    }
+  }
+
+  for (i = 0; i < n; i++)
+    ldap_abandon_ext (racer[i]->ldap, msgid[i], NULL, NULL);
+
+  return rc;
+}
+
+
+/**
+   dl_read_search
+
+   Runs a search that does not need the master.  On return,
+   ctx->read_ldap holds the handle that produced *res, to be used
+   when walking the result.  Returns an LDAP result code.
+*/
+static int
+dl_read_search
+(
+ dl_context  *ctx,
+ const char  *base,
+ int          scope,
+ const char  *filter,
+ char       **attrs,
+ LDAPMessage **res
+)
+{
+  struct timeval tv;
+  dl_replica *r, *winner;
+  double      start, ms, p95;
+  int         rc, t;
+
+  *res = NULL;
+
+  while ((r = dl_read_pick (ctx)) != NULL) {
+    if ((t = dl_remaining (ctx, &tv)) < 0)
+      return LDAP_TIMEOUT;
+
+    if (dl_replica_connect (ctx, r) != DL_SUCCESS)
+      continue;
+
+    start = dl_now ();
+    if (ctx->hedge && ctx->replica_count > 1
+        && (p95 = dl_latency_p95 (ctx)) > 0.0) {
+      rc = dl_read_hedged (ctx, r, base, scope, filter, attrs, res, p95, &winner);
+    } else {
+      winner = r;
+      rc = ldap_search_ext_s (r->ldap, base, scope, filter, attrs, 0,
+                              NULL, NULL, t ? &tv : NULL, LDAP_NO_LIMIT, res);
+    }
+    ms = (dl_now () - start) * 1e3;
+
+    if (DL_LDAP_UNREACHABLE (rc)) {
+      if (*res != NULL) {
+        ldap_msgfree (*res);
+        *res = NULL;
+      }
+      dl_replica_down (ctx, winner);
+      continue;
+    }
+
+    /* Smooth latency so one slow answer does not swing the choice. */
+    r = winner;
+    r->latency = r->latency == 0.0 ? ms : 0.8 * r->latency + 0.2 * ms;
+    r->healthy = 1;
+    ctx->samples[ctx->sample_count++ % DL_LATENCY_SAMPLES] = ms;
+
+    if (ctx->debug) {
+      fprintf (stderr, "  read from %s (%.2f ms)\n", r->url, ms);
+    }
+
+    ctx->read_ldap = r->ldap;
+    return rc;
+  }
+
+  if ((t = dl_remaining (ctx, &tv)) < 0)
+    return LDAP_TIMEOUT;
+
+  ctx->read_ldap = ctx->ldap;
+  return ldap_search_ext_s (ctx->ldap, base, scope, filter, attrs, 0,
+                            NULL, NULL, t ? &tv : NULL, LDAP_NO_LIMIT, res);
+}
+
+
+/**
+   dl_members_current
+
+   Checks the members last read by dl_get_members against the master
+   by comparing the list entry's entryCSN.  Returns 1 if they are
+   current, 0 if the replica was behind, or -1 on error.
+*/
+static int
+dl_members_current
+(
+ dl_context *ctx
+)
+{
+  LDAPMessage *result, *entry;
+  char        *attrs[] = { DL_LDAP_CSN_ATTRIBUTE, NULL };
+  char        **values;
+  struct timeval tv;
+  int          rc, t, current;
+
+  if (ctx->read_ldap == ctx->ldap)
+    return 1;
+
+  result = NULL;
+  if ((t = dl_remaining (ctx, &tv)) < 0)
+    rc = LDAP_TIMEOUT;
+  else
+    rc = ldap_search_ext_s (ctx->ldap, ctx->ldap_dn, LDAP_SCOPE_BASE,
+                            "(objectClass=*)", attrs, 0, NULL, NULL,
+                            t ? &tv : NULL, LDAP_NO_LIMIT, &result);
+  if (rc != LDAP_SUCCESS) {
+    if (result != NULL)
+      ldap_msgfree (result);
+    dl_ldap_error (ctx, ctx->ldap, rc);
+    return -1;
+  }
+
+  entry = ldap_first_entry (ctx->ldap, result);
+  values = entry ? (char **)ldap_get_values (ctx->ldap, entry, DL_LDAP_CSN_ATTRIBUTE) : NULL;
+  current = values != NULL && values[0] != NULL && ctx->members_csn != NULL
+    && strcmp (values[0], ctx->members_csn) == 0;
+
+  if (ctx->debug) {
+    fprintf (stderr, "Validate members against master: %s\n",
+             current ? "current" : "stale");
+  }
+
+  if (values != NULL)
+    ldap_value_free (values);
+  ldap_msgfree (result);
+
+  return current;
+}
+
+
+/**
+   dl_get_members_validated
+
+   Like dl_get_members, but if the members came from a replica that
+   has not caught up with the master, reads them again from the
+   master.  Used before any change is made to the list.
+*/
+static char **
+dl_get_members_validated
+(
+ dl_context *ctx
+)
+{
+  char **members;
+  int    current, m;
+
+  if ((members = dl_get_members (ctx)) == NULL)
+    return NULL;
+
+  if ((current = dl_members_current (ctx)) == 1)
+    return members;
+
+  for (m = 0; members[m] != NULL; m++)
+    free (members[m]);
+  free (members);
+
+  if (current < 0)
+    return NULL;
+
+  ctx->read_master = 1;
+  members = dl_get_members (ctx);
+  ctx->read_master = 0;
+
+  return members;
+}
+
+
+
+/**
+   dl_zmsetvars
+
+   Runs the program again with the Zimbra environment loaded by
+   zmsetvars, as the shell tools do, unless the directory settings
+   dl_init reads are already there.  Returns only if it did not.
+*/
+void
+dl_zmsetvars
+(
+ int   argc,
+ char *argv[]
+)
+{
+  char **args;
+  int    i;
+
+  if (getenv (DL_LDAP_URL) != NULL || getenv (DL_ZMSETVARS_GUARD) != NULL)
+    return;
+  if (access (DL_ZMSHUTIL, R_OK) != 0)
+    return;
+  if ((args = malloc ((argc + 4) * sizeof (*args))) == NULL)
+    return;
+
+  args[0] = "sh";
+  args[1] = "-c";
+  args[2] = ". " DL_ZMSHUTIL " && zmsetvars && "
+    DL_ZMSETVARS_GUARD "=1 && export " DL_ZMSETVARS_GUARD " && exec \"$0\" \"$@\"";
+  for (i = 0; i < argc; i++)
+    args[i + 3] = argv[i];
+  args[argc + 3] = NULL;
+
+  execv ("/bin/sh", args);
+  free (args);
+}
+
+
+
+/**
+   dl_init
+
+   Connects the context to the Zimbra directory.  Connection settings
+   not already set in the context are taken from the environment.
+*/
+int
+dl_init
+(
+ dl_context *ctx
+)
+{
+  int rc;
+
+  if (ctx->debug) {
+    fprintf (stderr, "Initialize:\n");
+  }
+
+  if (dl_cleanup (ctx) != DL_SUCCESS)
+    return DL_FAILURE;
+
+  if (ctx->ldap_url == NULL)
+    ctx->ldap_url = getenv (DL_LDAP_URL);
+  if (ctx->ldap_binddn == NULL)
+    ctx->ldap_binddn = getenv (DL_LDAP_USERDN);
+  if (ctx->ldap_passwd == NULL)
+    ctx->ldap_passwd = getenv (DL_LDAP_PASSWORD);
+
+  if (ctx->debug) {
+    fprintf (stderr, "  ldap_url = %s\n", ctx->ldap_url);
+    fprintf (stderr, "  ldap_binddn = %s\n", ctx->ldap_binddn);
+    fprintf (stderr, "  ldap_passwd = %s\n", ctx->ldap_passwd);
+  }
+
+  /* Connect to LDAP server. */
+  rc = ldap_initialize (&ctx->ldap, ctx->ldap_url);
+  if (rc != LDAP_SUCCESS) {
+    return dl_ldap_error (ctx, NULL, rc);
+  }
+
+  ldap_set_option (ctx->ldap, LDAP_OPT_PROTOCOL_VERSION, &ctx->ldap_version);
+  dl_set_timeouts (ctx, ctx->ldap);
+
+  if ((rc = ldap_simple_bind_s (ctx->ldap, ctx->ldap_binddn, ctx->ldap_passwd
+                                )) != LDAP_SUCCESS) {
+    return dl_ldap_error (ctx, ctx->ldap, rc);
+  }
+
+  return dl_replicas_init (ctx);
+}
+
+
+
+/**
+   dl_cleanup
+
+   Closes the context's directory connection and forgets the selected
+   list.  The context can be initialized again with dl_init.
+*/
+int
+dl_cleanup
+(
+ dl_context *ctx
+)
+{
+  int status, i;
+
+  for (i = 0; i < ctx->replica_count; i++) {
+    if (ctx->replicas[i].ldap != NULL) {
+      ldap_unbind (ctx->replicas[i].ldap);
+      ctx->replicas[i].ldap = NULL;
+    }
+  }
+  ctx->read_ldap = NULL;
+
+  if (ctx->ldap != NULL) {
+    status = ldap_unbind (ctx->ldap);
+    ctx->ldap = NULL;
+    if (status != LDAP_SUCCESS)
+      return DL_FAILURE;
+  }
+
+  if (ctx->ldap_dn != NULL) {
+    ldap_memfree (ctx->ldap_dn);
+    ctx->ldap_dn = NULL;
+  }
+
+  return DL_SUCCESS;
+}
+
+
+
+/**
+   dl_select
+
+   Select a distribution list by name. The selected DL is the implicit
+   target for all further operations on the context, until a new list
+   is selected. On success, ctx->ldap_dn is set.
+
+   Return 0 on success. On error, set ctx->error appropriately and
+   return -1.
+*/
+int
+dl_select
+(
+ dl_context *ctx,
+ const char *name
+)
+{
+  LDAPMessage *result;
+  LDAPMessage *entry;
+  char        filter[DL_MAX_FILTER+1];
+  char        *attrs[] = { "dn", "zimbraShareInfo", NULL };
+  char       **values;
+  int         status;
+  int         i;
+
+  if (ctx->debug) {
+    fprintf (stderr, "Select distribution list:\n");
+    fprintf (stderr, "  name = %s\n", name);
+  }
+
+  /* Free the name from a previous call. */
+  if (ctx->name != NULL) {
+    free (ctx->name);
+    ctx->name = NULL;
+  }
+
+  /* Save the DL name. */
+  if ((ctx->name = strdup (name)) == NULL) {
+    ctx->error = DL_ERR_OUT_OF_MEMORY;
+    return DL_FAILURE;
+  }
+
+  /* Free the DN from a previous call. */
+  if (ctx->ldap_dn != NULL) {
+    ldap_memfree (ctx->ldap_dn);
+    ctx->ldap_dn = NULL;
+  }
+
+  /* Free share info from a previous call. */
+  if (ctx->share_info != NULL) {
+    for (i = 0; i < ctx->share_info_count; i++) {
+      if (ctx->share_info[i] != NULL) {
+        free (ctx->share_info[i]);
+        ctx->share_info[i] = NULL;
+      }
+    }
+    free(ctx->share_info);
+    ctx->share_info = NULL;
+    ctx->share_info_count = 0;
+  }
+
+  snprintf(filter, sizeof(filter), "(%s=%s)", DL_LDAP_LIST_NAME_ATTRIBUTE, name);
+
+  if (ctx->debug) {
+    fprintf (stderr, "Search for DL entry:\n");
+    fprintf (stderr, "  ldap_base = %s\n", ctx->ldap_base);
+    fprintf (stderr, "  ldap_scope = %d\n", ctx->ldap_scope);
+    fprintf (stderr, "  filter = %s\n", filter);
+    fprintf (stderr, "  attrs = %s\n", attrs[0]);
+  }
+
+  status = dl_read_search
+    (ctx,
+     ctx->ldap_base,
+     ctx->ldap_scope,
+     filter,
+     attrs,
+     &result);
+
+  if (status != LDAP_SUCCESS) {
+    if (result != NULL)
+      ldap_msgfree (result);
+    return dl_ldap_error (ctx, ctx->read_ldap, status);
+  }
+
+  /* Get the list's DN. */
+  entry = ldap_first_entry (ctx->read_ldap, result);
+
+  if (entry == NULL) {
+    if (ctx->debug) {
+      fprintf (stderr, "  %s: dl not found\n", name);
+    }
+    if (result != NULL)
+      ldap_msgfree (result);
+    ctx->error = DL_ERR_LIST_NOT_FOUND;
+    return DL_FAILURE;
+  }
+
+  ctx->ldap_dn = ldap_get_dn (ctx->read_ldap, entry);
+
+  if (ctx->ldap_dn == NULL) {
+    if (ctx->debug) {
+      fprintf (stderr, "  %s: dl not found\n", name);
+    }
+    if (result != NULL)
+      ldap_msgfree (result);
+    ctx->error = DL_ERR_LIST_NOT_FOUND;
+    return DL_FAILURE;
+  }
+
+  if (ctx->debug) {
+    fprintf (stderr, "Copy share info strings.\n");
+  }
+  values = (char **)ldap_get_values (ctx->read_ldap, entry, DL_LDAP_SHARE_INFO_ATTRIBUTE);
+  ctx->share_info_count = ldap_count_values (values);
+  ctx->share_info = calloc((ctx->share_info_count + 1), sizeof(char*));
+  if (ctx->share_info == NULL) {
+    ctx->share_info_count = 0;
+    ctx->error = DL_ERR_OUT_OF_MEMORY;
+    return -1;
+  }
+  for (i = 0; i < ctx->share_info_count; i++) {
+    if ((ctx->share_info[i] = strdup(values[i])) == NULL) {
+      ctx->error = DL_ERR_OUT_OF_MEMORY;
+      return -1;
+    }
+    if (ctx->debug) {
+      fprintf(stderr, "ShareInfo[%d]: %s\n", i, ctx->share_info[i]);
+    }
+  }
+  if (values != NULL)
+    ldap_value_free(values);
+
+  if (ctx->debug) {
+    fprintf (stderr, "  return %s\n", ctx->ldap_dn);
+  }
+
+  /* Clean up. */
+  if (result != NULL)
+    ldap_msgfree (result);
+
+  return DL_SUCCESS;
+}
+
+
+
+/**
+   dl_modify
+
+   Applies mods to the current list on the master, bounded by
+   op_timeout and the deadline.  A write that runs out of time is
+   abandoned.  Returns an LDAP result code.
+*/
+static int
+dl_modify
+(
+ dl_context *ctx,
+ LDAPMod   **mods
+)
+{
+  LDAPMessage   *res;
+  struct timeval tv;
+  int            msgid, rc, t, err = LDAP_SUCCESS;
+
+  if ((t = dl_remaining (ctx, &tv)) < 0)
+    return LDAP_TIMEOUT;
+
+  if ((rc = ldap_modify_ext (ctx->ldap, ctx->ldap_dn, mods,
+                             NULL, NULL, &msgid)) != LDAP_SUCCESS)
+    return rc;
+
+  if ((rc = ldap_result (ctx->ldap, msgid, LDAP_MSG_ALL, t ? &tv : NULL, &res)) == 0) {
+    ldap_abandon_ext (ctx->ldap, msgid, NULL, NULL);
+    return LDAP_TIMEOUT;
+  }
+  if (rc < 0)
+    return -1;
+
+  ldap_parse_result (ctx->ldap, res, &err, NULL, NULL, NULL, NULL, 1);
+  return err;
+}
+
+
+
+/**
+   dl_remove_members
+
+   Removes members from the current distribution list.  Returns
+   DL_SUCCESS if the members are removed, DL_FAILURE if an error
+   occurs.  In the case of an error, ctx->error is set appropriately.
+*/
+int
+dl_remove_members
+(
+ dl_context *ctx,
+ char      **mail
+)
+{
+  LDAPMod     *mods[2], mod;
+  int          rc;
+
+  if (ctx->ldap_dn == NULL) {
+    ctx->error = DL_ERR_NO_LIST_SELECTED;
+    return DL_FAILURE;
+  }
+
+  mod.mod_op = LDAP_MOD_DELETE;
+  mod.mod_type = DL_LDAP_MEMBER_ATTRIBUTE;
+  mod.mod_values = mail;
+  mods[0] = &mod;
+  mods[1] = NULL;
+
+  if ((rc = dl_modify (ctx, mods)) != LDAP_SUCCESS) {
+    return dl_ldap_error (ctx, ctx->ldap, rc);
+  }
+
+  return DL_SUCCESS;
+}
+
+
+
+/**
+   dl_add_members
+
+   Adds a list of members to the current distribtion list.
+*/
+int
+dl_add_members
+(
+ dl_context *ctx,
+ char      **mail
+)
+{
+  LDAPMod     *mods[2], mod;
+  int         share_index;
+  int         rc;
+
+  if (ctx->ldap_dn == NULL) {
+    ctx->error = DL_ERR_NO_LIST_SELECTED;
+    return DL_FAILURE;
+  }
+
+  mod.mod_op = LDAP_MOD_ADD;
+  mod.mod_type = DL_LDAP_MEMBER_ATTRIBUTE;
+  mod.mod_values = mail;
+  mods[0] = &mod;
+  mods[1] = NULL;
+
+  if ((rc = dl_modify (ctx, mods)) != LDAP_SUCCESS) {
+    return dl_ldap_error (ctx, ctx->ldap, rc);
+  }
+
+  /* Mount published shares. */
+  for (share_index = 0; share_index < ctx->share_info_count; share_index++) {
+    char path[512], *share_info, *share_data, *last;
+    char disp[256], email[256], fldr[256], **m;
+    int  view;
+    if ((share_info = strdup(ctx->share_info[share_index])) == NULL) {
+      ctx->error = DL_ERR_OUT_OF_MEMORY;
+      return DL_FAILURE;
+    }
+    strtok_r(share_info, ";", &last);   /* owner id */
+    strtok_r(NULL, ";", &last);         /* folder id */
+    share_data = strtok_r(NULL, ";", &last);
+    if (share_data == NULL
+        || B_decode(share_data, "[{d%se%sf%sv%d}", disp, email, fldr, &view) < 0) {
+      free(share_info);
+      continue;
+    }
+    snprintf(path, 512, "/%s's %s", disp, fldr+1);
+    strrep(path, '\"', '\'');
+    for (m = mail; *m; m++) {
+      zmmailbox_select_mailbox(ctx, *m);
+      if (ctx->delete_shared_folders)
+        zmmailbox_delete_folder(ctx, path);
+      if (ctx->create_shared_folders)
+        zmmailbox_create_mountpoint(ctx, "#", path, email, fldr);
+    }
+    free(share_info);
+  }
+
+  return DL_SUCCESS;
+}
+
+
+int
+dl_add_member
+(
+ dl_context *ctx,
+ const char *addr
+)
+{
+  if (ctx->usezmprov) {
+    if (zmprov_add_dl_member(ctx, dl_get_name(ctx), addr) != 0)
+      return DL_FAILURE;
+  }
+  return DL_SUCCESS;
+}
+
+
+int
+dl_remove_member
+(
+ dl_context *ctx,
+ const char *addr
+)
+{
+  if (ctx->usezmprov) {
+    if (zmprov_remove_dl_member(ctx, dl_get_name(ctx), addr) != 0)
+      return DL_FAILURE;
+  }
+  return DL_SUCCESS;
+}
+
+
+
+/**
+   dl_get_members
+
+   Returns a NULL terminated copy of the current list's members, which
+   the caller frees.  Returns NULL on error.
+*/
+char**
+dl_get_members
+(
+ dl_context *ctx
+)
+{
+  char        **members;
+  char        **values;
+  LDAPMessage *result;
+  LDAPMessage *entry;
+  char        filter[DL_MAX_FILTER+1];
+  char        *attrs[] = { DL_LDAP_MEMBER_ATTRIBUTE, DL_LDAP_CSN_ATTRIBUTE, NULL };
+  int         state;
+  int         count;
+
+  if (ctx->ldap_dn == NULL) {
+    ctx->error = DL_ERR_NO_LIST_SELECTED;
+    return NULL;
+  }
+
+  snprintf(filter, sizeof(filter), "(%s=%s)", DL_LDAP_LIST_NAME_ATTRIBUTE, ctx->name);
+
+  if (ctx->debug) {
+    fprintf (stderr, "Get DL Members:\n");
+    fprintf (stderr, "  filter='%s'\n", filter);
+  }
+
+  /* Search for entries matching filter. */
+  state = dl_read_search(
+     ctx,                      /* context */
+     ctx->ldap_base,           /* search base */
+     ctx->ldap_scope,          /* search scope */
+     filter,                   /* search filter */
+     attrs,                    /* search attributes */
+     &result);
+
+  if (state != LDAP_SUCCESS) {
+    if (result != NULL)
+      ldap_msgfree (result);
+    dl_ldap_error (ctx, ctx->read_ldap, state);
+    return NULL;
+  }
+
+  /* there can only be one match */
+  entry = ldap_first_entry (ctx->read_ldap, result);
+
+  if (entry == NULL) {
+    ldap_msgfree (result);
+    ctx->error = DL_ERR_LIST_NOT_FOUND;
+    return NULL;
+  }
+
+  /* Remember the entry's version for dl_members_current. */
+  free (ctx->members_csn);
+  values = (char **)ldap_get_values (ctx->read_ldap, entry, DL_LDAP_CSN_ATTRIBUTE);
+  ctx->members_csn = values && values[0] ? strdup (values[0]) : NULL;
+  if (values != NULL)
+    ldap_value_free (values);
+
+  values = (char **)ldap_get_values (ctx->read_ldap, entry, DL_LDAP_MEMBER_ATTRIBUTE);
+  count = ldap_count_values (values);
+  if ((members = calloc (count + 1, sizeof (char*))) == NULL) {
+    ctx->error = DL_ERR_OUT_OF_MEMORY;
+    count = 0;
+  }
+  while (members != NULL && --count >= 0) {
+    if ((members[count] = strdup (values[count])) == NULL) {
+      ctx->error = DL_ERR_OUT_OF_MEMORY;
+      while (members[++count] != NULL)
+        free (members[count]);
+      free (members);
+      members = NULL;
+      break;
+    }
+    if (ctx->debug) {
+      fprintf (stderr, "  member='%s'\n", members[count]);
+    }
+  }
+  if (values != NULL)
+    ldap_value_free (values);
+  ldap_msgfree (result);
+
+  return members;
+}
+
+/**
+   dl_get_name
+
+   Returns the name of the currently selected list.
+*/
+char *
+dl_get_name
+(
+ dl_context *ctx
+)
+{
+  if (ctx->ldap_dn == NULL) {
+    ctx->error = DL_ERR_NO_LIST_SELECTED;
+    return NULL;
+  }
+
+  return ctx->name;
+}
+
+
+static int
+set_difference
+(
+  void *set1, int n1,
+  void *set2, int n2,
+  void *result_set, size_t sz,
+  int (*compare)(const void *, const void *)
+)
+{
+  char *first1, *first2, *last1, *last2, *result;
+
+  first1 = set1;
+  first2 = set2;
+  last1 = first1 + n1 * sz;
+  last2 = first2 + n2 * sz;
+  result = result_set;
+
+  while ( first1 != last1 && first2 != last2 )
+    {
+      int d;
+
+      if ((d = compare(first1, first2)) < 0)
+         {
+           memcpy(result, first1, sz);
+           result += sz;
+           first1 += sz;
+         }
+      else if (d > 0)
+         {
+           first2 += sz;
+         }
+      else
+         {
+           first1 += sz;
+           first2 += sz;
+         }
+    }
+
+  while (first1 != last1)
+    {
+      memcpy(result, first1, sz);
+      result += sz;
+      first1 += sz;
+    }
+
+  return ((result - (char *)result_set) / sz);
+}
+
+
+static int
+copy_attribute
+(
+  LDAP *ld,
+  LDAPMessage *res,
+  const char *attribute,
+  char **result
+)
+{
+  LDAPMessage *ent;
+  char **values;
+  int n = 0;
+  for (ent = ldap_first_entry(ld, res); ent != NULL; ent = ldap_next_entry(ld, ent))
+    if ((values = (char **)ldap_get_values(ld, ent, attribute)) != NULL) {
+      if (values[0] && (result[n++] = strdup(values[0])) == NULL) {
+        ldap_value_free(values);
+        return -1;
+      }
+      ldap_value_free(values);
+    }
+  return n;
+}
+
+
+/**
+   dl_send_batches
+
+   Sends n pending adds or removes to the current list, DL_BATCH_SIZE
+   at a time, and notes them in the reverse index.  The list must have
+   room for a terminating NULL after the last entry.
+*/
+static int
+dl_send_batches
+(
+ dl_context *ctx,
+ char      **list,
+ int         n,
+ int         adding
+)
+{
+  char *save;
+  int   k, len, status = DL_SUCCESS;
+
+  for (k = 0; k < n && status == DL_SUCCESS; k += len) {
+    len = n - k < DL_BATCH_SIZE ? n - k : DL_BATCH_SIZE;
+    save = list[k + len];
+    list[k + len] = NULL;
+
+    if (ctx->debug) {
+      int i;
+      fprintf (stderr, "Members to %s:\n", adding ? "add" : "delete");
+      for (i = k; i < k + len; i++)
+        fprintf (stderr, "  %s\n", list[i]);
+    }
+
+    status = adding ? dl_add_members (ctx, list + k) : dl_remove_members (ctx, list + k);
+    if (status == DL_SUCCESS)
+      status = dl_index_note (ctx, list + k, len, adding ? DL_INDEX_ADD : DL_INDEX_DEL);
+
+    list[k + len] = save;
+  }
+
+  return status;
+}
+
+
+/**
+   dl_ldap_sync_sorted
+
+   Streaming variant of dl_ldap_sync.  Asks the source server to sort
+   its results (RFC 2891) and merges them, one entry at a time, against
+   the sorted list members.  Addresses are compared with
+   dl_alphacasesort, as in the unsorted diff.
+
+   Source entries already on the list are not kept, but the adds are
+   buffered until the whole result has been checked, so memory grows
+   with the members plus the changes: O(n) for a new list of n, the
+   same as the unsorted diff, and far less for a list that changes
+   little.
+
+   Nothing is sent until the whole result has been seen in order.  A
+   source that returns entries out of order, or an entry with more
+   than one address, sets DL_ERR_UNSORTED and changes nothing, so the
+   caller can fall back to the unsorted diff.  Otherwise the changes
+   are sent in batches of DL_BATCH_SIZE, and the net change in list
+   size is stored in *count.
+*/
+static int
+dl_ldap_sync_sorted
+(
+ dl_context  *ctx,
+ LDAP        *ld,
+ LDAPURLDesc *lud,
+ const char  *mail,
+ int         *count
+)
+{
+  LDAPSortKey **keys = NULL;
+  LDAPControl *sort = NULL, *sctrls[2];
+  LDAPMessage *msg, *entry;
+  struct timeval tv;
+  char        *attrs[2], **values, *last = NULL;
+  char        **members, **add = NULL, **del = NULL, **grow;
+  int         m, i = 0, n_add = 0, n_del = 0, max_add = 0;
+  int         msgid, state, err = LDAP_SUCCESS, d, t, done = 0, status = DL_SUCCESS;
+
+  *count = 0;
+
+  /* Get current members, sorted the way the server will sort. */
+  if ((members = dl_get_members_validated (ctx)) == NULL)
+    return DL_FAILURE;
+  m = ldap_count_values (members);
+  qsort (members, m, sizeof(char*), dl_alphacasesort);
+
+  /* Removes are members, so there are at most m of them. */
+  if ((del = calloc (m + 1, sizeof (char *))) == NULL) {
+    ctx->error = DL_ERR_OUT_OF_MEMORY;
+    status = DL_FAILURE;
+    goto cleanup;
+  }
+
+  if ((state = ldap_create_sort_keylist (&keys, (char *)mail)) != LDAP_SUCCESS
+      || (state = ldap_create_sort_control (ld, keys, 1, &sort)) != LDAP_SUCCESS) {
+    status = dl_ldap_error (ctx, ld, state);
+    goto cleanup;
+  }
+  sctrls[0] = sort;
+  sctrls[1] = NULL;
+
+  attrs[0] = (char *)mail;
+  attrs[1] = NULL;
+
+  if (ctx->debug) {
+    fprintf (stderr, "Search for sorted entries:\n");
+    fprintf (stderr, "  lud->lud_filter = %s\n", lud->lud_filter);
+    fprintf (stderr, "  sort key = %s\n", mail);
+  }
+
+  state = ldap_search_ext (ld, lud->lud_dn, lud->lud_scope, lud->lud_filter,
+                           attrs, 0, sctrls, NULL, NULL, 0, &msgid);
+  if (state != LDAP_SUCCESS) {
+    status = dl_ldap_error (ctx, ld, state);
+    goto cleanup;
+  }
+
+  while (!done && status == DL_SUCCESS) {
+    if ((t = dl_remaining (ctx, &tv)) < 0
+        || (state = ldap_result (ld, msgid, LDAP_MSG_ONE, t ? &tv : NULL, &msg)) == 0) {
+      status = dl_ldap_error (ctx, ld, LDAP_TIMEOUT);
+      break;
+    }
+    if (state < 0) {
+      status = dl_ldap_error (ctx, ld, -1);
+      break;
+    }
+
+    switch (ldap_msgtype (msg)) {
+    case LDAP_RES_SEARCH_ENTRY:
+      entry = ldap_first_entry (ld, msg);
+      values = (char **)ldap_get_values (ld, entry, mail);
+      if (values == NULL || values[0] == NULL) {
+        if (values) ldap_value_free (values);
+        break;
+      }
+
+      /* Which value the server sorted on is its own choice. */
+      if (values[1] != NULL) {
+        if (ctx->debug)
+          fprintf (stderr, "  %s has more than one %s\n", values[0], mail);
+        ctx->error = DL_ERR_UNSORTED;
+        status = DL_FAILURE;
+        ldap_value_free (values);
+        break;
+      }
+
+      /* Skip duplicates; anything smaller means the sort was ignored. */
+      if (last != NULL && (d = dl_alphacasesort (&values[0], &last)) <= 0) {
+        if (d < 0) {
+          ctx->error = DL_ERR_UNSORTED;
+          status = DL_FAILURE;
+        }
+        ldap_value_free (values);
+        break;
+      }
+      free (last);
+      if ((last = strdup (values[0])) == NULL) {
+        ctx->error = DL_ERR_OUT_OF_MEMORY;
+        status = DL_FAILURE;
+        ldap_value_free (values);
+        break;
+      }
+
+      /* Members sorting before this entry are gone from the source. */
+      while (i < m && dl_alphacasesort (&members[i], &values[0]) < 0)
+        del[n_del++] = members[i++];
+
+      if (i < m && dl_alphacasesort (&members[i], &values[0]) == 0) {
+        i++;
+      } else {
+        if (n_add + 1 >= max_add) {
+          max_add = max_add ? max_add * 2 : DL_BATCH_SIZE;
+          if ((grow = realloc (add, max_add * sizeof (char *))) == NULL) {
+            ctx->error = DL_ERR_OUT_OF_MEMORY;
+            status = DL_FAILURE;
+            ldap_value_free (values);
+            break;
+          }
+          add = grow;
+        }
+        if ((add[n_add] = strdup (values[0])) == NULL) {
+          ctx->error = DL_ERR_OUT_OF_MEMORY;
+          status = DL_FAILURE;
+        } else
+          add[++n_add] = NULL;
+      }
+      ldap_value_free (values);
+      break;
+
+    case LDAP_RES_SEARCH_RESULT:
+      ldap_parse_result (ld, msg, &err, NULL, NULL, NULL, NULL, 0);
+      if (err != LDAP_SUCCESS)
+        status = dl_ldap_error (ctx, ld, err);
+      done = 1;
+      break;
+    }
+
+    ldap_msgfree (msg);
+  }
+
+  if (status != DL_SUCCESS) {
+    if (!done)
+      ldap_abandon_ext (ld, msgid, NULL, NULL);
+    goto cleanup;
+  }
+
+  /* Members past the last entry are gone too. */
+  while (i < m)
+    del[n_del++] = members[i++];
+
+  /* The whole result was in order; now change the list. */
+  if (dl_index_begin (ctx, members, m) != DL_SUCCESS
+      || dl_send_batches (ctx, del, n_del, 0) != DL_SUCCESS
+      || dl_send_batches (ctx, add, n_add, 1) != DL_SUCCESS)
+    status = DL_FAILURE;
+  *count = n_add - n_del;
+
+ cleanup:
+  while (n_add) free (add[--n_add]);
+  while (m) free (members[--m]);
+  free (members);
+  free (add);
+  free (del);
+  free (last);
+  if (sort) ldap_control_free (sort);
+  if (keys) ldap_free_sort_keylist (keys);
+
+  return status;
+}
+
+
+/**
+   dl_ldap_sync
+
+   Replaces list membership with results of the given LDAP query.  The
+   'mail' attribute is added as a member for every search result.
+   Stores the net change in list size in *count.  Returns DL_SUCCESS,
+   or DL_FAILURE if an error occured, in which case ctx->error is set
+   appropriately.
+*/
+int
+dl_ldap_sync
+(
+ dl_context *ctx,
+ const char *url,
+ const char *mail,
+ const char *binddn,
+ const char *passwd,
+ int        *count
+)
+{
+  LDAP        *ld  = 0;
+  LDAPURLDesc *lud = 0;
+  LDAPMessage *res = NULL;
+  struct timeval tv;
+  char        **members = NULL, **matches = NULL, **add = NULL, **del = NULL;
+  int         m = 0, n = 0, n_del = 0, n_add = 0;  /* Counters */
+  int         state, t;
+  int         status = DL_SUCCESS;
+  int         v3 = 3;
+
+  state = ldap_url_parse (url, &lud);
+
+  if (state != 0) {
+    ctx->error = DL_ERR_LDAP_URL;
+    return DL_FAILURE;
+  }
+
+  if (ctx->debug) {
+    fprintf (stderr, "Connect to LDAP server:\n");
+    fprintf (stderr, "  lud->lud_host = %s\n", lud->lud_host);
+    fprintf (stderr, "  lud->lud_port = %d\n", lud->lud_port);
+  }
+
+  /* Connect to the LDAP server. */
+  ld = (LDAP *)ldap_init (lud->lud_host, lud->lud_port);
+  if (ld == NULL) {
+    ldap_free_urldesc (lud);
+    ctx->error = DL_ERR_LDAP_CONNECT;
+    return DL_FAILURE;
+  }
+
+  if (ctx->debug) {
+    fprintf (stderr, "Set protocol version: %d\n", v3);
+  }
+
+  /* Use LDAP v3 */
+  ldap_set_option (ld, LDAP_OPT_PROTOCOL_VERSION, &v3);
+
+  /* Don't let a hung server hold up the run. */
+  dl_set_timeouts (ctx, ld);
+
+  if (ctx->debug) {
+    fprintf (stderr, "Start TLS.\n");
+  }
+
+  /* Use TLS */
+  if ((state = ldap_start_tls_s (ld, NULL, NULL))
+      != LDAP_SUCCESS) {
+    dl_ldap_error (ctx, ld, state);
+    ldap_unbind (ld);
+    ldap_free_urldesc (lud);
+    return DL_FAILURE;
+  }
+
+  if (ctx->debug) {
+    fprintf (stderr, "LDAP simple bind:\n");
+    fprintf (stderr, "  binddn = %s\n", binddn);
+    fprintf (stderr, "  passwd = %s\n", passwd);
+  }
+
+  /* Bind */
+  if ((state = ldap_simple_bind_s (ld, binddn, passwd
+                                   )) != LDAP_SUCCESS) {
+    dl_ldap_error (ctx, ld, state);
+    ldap_unbind (ld);
+    ldap_free_urldesc (lud);
+    return DL_FAILURE;
+  }
+
+  if (ctx->server_side_sort) {
+    status = dl_ldap_sync_sorted (ctx, ld, lud, mail, count);
+    if (status == DL_SUCCESS || ctx->error != DL_ERR_UNSORTED) {
+      ldap_unbind (ld);
+      ldap_free_urldesc (lud);
+      return status;
+    }
+    /* Nothing was changed; diff the unsorted results instead. */
+    if (ctx->debug)
+      fprintf (stderr, "Sorted results unusable, falling back.\n");
+    ctx->error = DL_ERR_NONE;
+    status = DL_SUCCESS;
+  }
+
+  if (ctx->debug) {
+    fprintf (stderr, "Search for entries matching filter:\n");
+    fprintf (stderr, "  lud->lud_dn = %s\n", lud->lud_dn);
+    fprintf (stderr, "  lud->lud_scope = %d\n", lud->lud_scope);
+    fprintf (stderr, "  lud->lud_filter = %s\n", lud->lud_filter);
+  }
+
+  /* Search for entries matching filter. */
+  if ((t = dl_remaining (ctx, &tv)) < 0)
+    state = LDAP_TIMEOUT;
+  else
+    state = ldap_search_ext_s (ld,
+                               lud->lud_dn,
+                               lud->lud_scope,
+                               lud->lud_filter,
+                               lud->lud_attrs,
+                               0,
+                               NULL,
+                               NULL,
+                               t ? &tv : NULL,
+                               LDAP_NO_LIMIT,
+                               &res);
+
+  if (state != LDAP_SUCCESS) {
+    if (res != NULL)
+      ldap_msgfree (res);
+    dl_ldap_error (ctx, ld, state);
+    ldap_unbind (ld);
+    ldap_free_urldesc (lud);
+    return DL_FAILURE;
+  }
+
+  /* Allocate space for matching addresses. */
+  n = ldap_count_entries (ld, res);
+  if ((matches = calloc(n+1, sizeof(char *))) == NULL
+      || (n = copy_attribute(ld, res, mail, matches)) < 0) {
+    n = 0;
+    ctx->error = DL_ERR_OUT_OF_MEMORY;
+    status = DL_FAILURE;
+    goto cleanup;
+  }
+
+  /* Get current members, confirmed against the master. */
+  if ((members = dl_get_members_validated (ctx)) == NULL) {
+    status = DL_FAILURE;
+    goto cleanup;
+  }
+  m = ldap_count_values (members);
+
+  /* Sort alphabetically, as the sorted path does. */
+  qsort (members, m, sizeof(char*), dl_alphacasesort);
+  qsort (matches, n, sizeof(char*), dl_alphacasesort);
+
+  /* Allocate space for add and delete lists. */
+  del = calloc (m + 1, sizeof (char *));
+  add = calloc (n + 1, sizeof (char *));
+  if (del == NULL || add == NULL) {
+    ctx->error = DL_ERR_OUT_OF_MEMORY;
+    status = DL_FAILURE;
+    goto cleanup;
+  }
+
+  /* Compute add and delete lists. */
+  n_del = set_difference (members, m, matches, n, del, sizeof (char *), dl_alphacasesort);
+  n_add = set_difference (matches, n, members, m, add, sizeof (char *), dl_alphacasesort);
+
+  if (ctx->debug)
+    {
+      int i;
+      fprintf (stderr, "Members to delete:\n");
+      for (i = 0; i < n_del; i++)
+        fprintf (stderr, "  %s\n", del[i]);
+      fprintf (stderr, "Members to add:\n");
+      for (i = 0; i < n_add; i++)
+        fprintf (stderr, "  %s\n", add[i]);
+    }
+
+  /* Update DL, logging what changed for the reverse index. */
+  if (dl_index_begin (ctx, members, m) != DL_SUCCESS) {
+    status = DL_FAILURE;
+    goto cleanup;
+  }
+  if (n_del > 0 && (dl_remove_members (ctx, del) != DL_SUCCESS
+                    || dl_index_note (ctx, del, n_del, DL_INDEX_DEL) != DL_SUCCESS))
+    status = DL_FAILURE;
+  if (n_add > 0 && (dl_add_members (ctx, add) != DL_SUCCESS
+                    || dl_index_note (ctx, add, n_add, DL_INDEX_ADD) != DL_SUCCESS))
+    status = DL_FAILURE;
+
+ cleanup:
+  while (m) free (members[--m]);
+  while (n) free (matches[--n]);
+
+  if (members) free (members);
+  if (matches) free (matches);
+  if (del) free (del);
+  if (add) free (add);
+
+  ldap_msgfree (res);
+  ldap_unbind (ld);
+  ldap_free_urldesc (lud);
+
+  *count = n_add - n_del;
+
+  return status;
+}
+
+
+
+
+
+
+
+/**
+   dl_sync
+
+   Replaces list membership from an external source.  On success the
+   net change in list size is stored in *count.  If ctx->list_timeout
+   is set, the whole sync must finish within that many seconds or it
+   fails with DL_ERR_TIMEOUT.
+*/
+int
+dl_sync
+(
+ dl_context *ctx,
+ const char *name,
+ const char *source,
+ const char *binddn,
+ const char *passwd,
+ int        *count
+)
+{
+  int n = 0;
+  int status;
+
+  if (ctx->debug) {
+    fprintf (stderr, "Synchronize DL:\n");
+    fprintf (stderr, "  name = %s\n", name);
+    fprintf (stderr, "  source = %s\n", source);
+    fprintf (stderr, "  binddn = %s\n", binddn);
+    fprintf (stderr, "  passwd = %s\n", passwd);
+  }
+
+  ctx->deadline = ctx->list_timeout > 0 ? dl_now () + ctx->list_timeout : 0.0;
+
+  if (dl_select (ctx, name) != DL_SUCCESS) {
+    status = DL_FAILURE;
+  } else if (ldap_is_ldap_url (source)) {
+    status = dl_ldap_sync (ctx, source, ctx->sync_attribute, binddn, passwd, &n);
+    if (status == DL_SUCCESS && count != NULL)
+      *count = n;
+  } else {
+    ctx->error = DL_ERR_UNRECOGNIZED_SYNC_SOURCE;
+    status = DL_FAILURE;
+  }
+
+  ctx->deadline = 0.0;
+
+  return status;
+}
+
+
+
+int
+dl_alphasort
+(
+ const void *p1,
+ const void *p2
+)
+{
+  return strcmp(* (char * const *) p1, * (char * const *) p2);
+}
+
+
+int
+dl_alphacasesort
+(
+ const void *p1,
+ const void *p2
+)
+{
+  return strcasecmp(* (char * const *) p1, * (char * const *) p2);
+}
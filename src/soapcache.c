@@ -0,0 +1,586 @@
+/**********************************************************************
+ * soapcache
+ *
+ * Columnar cache of zmstat soap.csv days for soapstat.
+ *
+ * A finished day is parsed once into columns and written next to its
+ * soap.csv.gz as soap.csv.col; later queries map that file and filter
+ * the columns instead of inflating and parsing the text again.  The
+ * cache records the size and modification time of the file it was
+ * made from and is only used while they still match.
+ *
+ * The file is in native byte order, each part padded to 8 bytes:
+ *
+ *   struct soap_col_header     magic, counts, source size and time
+ *   double count[rows]         calls in the interval
+ *   double ms[rows]            their average time
+ *   uint32_t dt[rows]          seconds from the first interval
+ *   uint16_t method[rows]      number in the dictionary
+ *   uint16_t lat[rows]         latency bucket of ms
+ *   char names[]               the dictionary, NUL terminated names
+ *
+ * Queries pick rows in blocks: a branch free pass over the method and
+ * time columns writes the numbers of the rows that match, and only
+ * those are added up.
+ ***********************************************************************/
+
+#include <string.h>
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "soapstat.h"
+
+#define SOAP_COL_MAGIC   "SOC1"
+#define SOAP_COL_METHODS (65536)        /* Methods a day can hold. */
+#define SOAP_COL_BLOCK   (4096)         /* Rows picked at a time. */
+
+#define SOAP_PAD(n) (((n) + 7) & ~(size_t)7)
+
+struct soap_col_header {
+  char     magic[4];
+  uint32_t methods;
+  uint64_t rows;
+  int64_t  base;                        /* Time of dt 0. */
+  int64_t  size;                        /* Of the source file. */
+  int64_t  mtime;                       /* Of the source file. */
+  uint32_t sorted;
+  uint32_t nameslen;                    /* Bytes of names, unpadded. */
+};
+
+
+
+/* ---- Building ---- */
+
+
+static uint64_t
+soap_cols_hash
+(
+ const char *name,
+ size_t      len
+)
+{
+  uint64_t h = 14695981039346656037ULL;
+
+  for (; len > 0; name++, len--)
+    h = (h ^ (unsigned char)*name) * 1099511628211ULL;
+
+  return h;
+}
+
+
+static int
+soap_cols_grow
+(
+ struct soap_cols *c
+)
+{
+  size_t  max = c->max ? 2 * c->max : 16384;
+  void   *p;
+
+  if ((p = realloc (c->count, max * sizeof (*c->count))) == NULL)
+    return -1;
+  c->count = p;
+  if ((p = realloc (c->ms, max * sizeof (*c->ms))) == NULL)
+    return -1;
+  c->ms = p;
+  if ((p = realloc (c->time, max * sizeof (*c->time))) == NULL)
+    return -1;
+  c->time = p;
+  if ((p = realloc (c->method, max * sizeof (*c->method))) == NULL)
+    return -1;
+  c->method = p;
+  c->max = max;
+
+  return 0;
+}
+
+
+/* Doubles the dictionary's hash index. */
+static int
+soap_cols_rehash
+(
+ struct soap_cols *c
+)
+{
+  uint32_t *dict;
+  char    **names;
+  size_t    size = c->dict ? 2 * (c->dictmask + 1) : 256, i, j;
+
+  if ((dict = calloc (size, sizeof (*dict))) == NULL)
+    return -1;
+  if ((names = realloc (c->names, (size / 2) * sizeof (*names))) == NULL) {
+    free (dict);
+    return -1;
+  }
+  c->names = names;
+
+  for (i = 0; i < c->nmethods; i++) {
+    j = soap_cols_hash (names[i], strlen (names[i])) & (size - 1);
+    while (dict[j] != 0)
+      j = (j + 1) & (size - 1);
+    dict[j] = i + 1;
+  }
+
+  free (c->dict);
+  c->dict = dict;
+  c->dictmask = size - 1;
+
+  return 0;
+}
+
+
+/* Numbers a method, adding it to the dictionary if it is new. */
+static int
+soap_cols_method
+(
+ struct soap_cols *c,
+ const char       *name,
+ size_t            len
+)
+{
+  size_t i;
+  char  *s;
+
+  if ((c->dict == NULL || 2 * (c->nmethods + 1) > c->dictmask + 1)
+      && soap_cols_rehash (c) != 0)
+    return -1;
+
+  for (i = soap_cols_hash (name, len) & c->dictmask; c->dict[i] != 0; i = (i + 1) & c->dictmask) {
+    s = c->names[c->dict[i] - 1];
+    if (strncmp (s, name, len) == 0 && s[len] == '\0')
+      return c->dict[i] - 1;
+  }
+
+  if (c->nmethods >= SOAP_COL_METHODS) {
+    errno = EOVERFLOW;
+    return -1;
+  }
+  if ((s = malloc (len + 1)) == NULL)
+    return -1;
+  memcpy (s, name, len);
+  s[len] = '\0';
+  c->names[c->nmethods] = s;
+  c->dict[i] = ++c->nmethods;
+
+  return c->dict[i] - 1;
+}
+
+
+static int
+soap_cols_push
+(
+ const struct soap_row *row,
+ void                  *arg
+)
+{
+  struct soap_cols *c = arg;
+  int               m;
+
+  if ((c->rows == c->max && soap_cols_grow (c) != 0)
+      || (m = soap_cols_method (c, row->method, row->methodlen)) < 0) {
+    c->sorted = errno ? -errno : -ENOMEM;
+    return 1;
+  }
+  c->count[c->rows] = row->count;
+  c->ms[c->rows] = row->ms;
+  c->time[c->rows] = row->time;
+  c->method[c->rows] = m;
+  c->rows++;
+
+  return 0;
+}
+
+
+/**
+   soap_cols_build
+
+   Parses a day file into columns.  Returns 0, or -1 with errno set;
+   EOVERFLOW if the day has too many methods or spans too long.
+*/
+int
+soap_cols_build
+(
+ struct soap_cols *c,
+ const char       *path
+)
+{
+  time_t  lo, hi;
+  size_t  i;
+  int     err;
+
+  memset (c, 0, sizeof (*c));
+
+  if (soap_read (path, soap_cols_push, c) != 0 || c->sorted < 0) {
+    err = c->sorted < 0 ? -c->sorted : errno;
+    goto fail;
+  }
+
+  lo = hi = c->rows > 0 ? c->time[0] : 0;
+  for (i = 1; i < c->rows; i++) {
+    if (c->time[i] < lo)
+      lo = c->time[i];
+    if (c->time[i] > hi)
+      hi = c->time[i];
+  }
+  if ((uint64_t)(hi - lo) > UINT32_MAX) {
+    err = EOVERFLOW;
+    goto fail;
+  }
+
+  c->dt = malloc ((c->rows + 1) * sizeof (*c->dt));
+  c->lat = malloc ((c->rows + 1) * sizeof (*c->lat));
+  if (c->dt == NULL || c->lat == NULL) {
+    err = ENOMEM;
+    goto fail;
+  }
+  c->base = lo;
+  c->sorted = 1;
+  for (i = 0; i < c->rows; i++) {
+    c->dt[i] = c->time[i] - lo;
+    c->lat[i] = soap_lat_bucket (c->ms[i]);
+    if (i > 0 && c->dt[i] < c->dt[i - 1])
+      c->sorted = 0;
+  }
+
+  free (c->time);
+  free (c->dict);
+  c->time = NULL;
+  c->dict = NULL;
+
+  return 0;
+
+ fail:
+  soap_cols_free (c);
+  errno = err;
+  return -1;
+}
+
+
+
+/* ---- Cache files ---- */
+
+
+/**
+   soap_cols_save
+
+   Writes built columns to path, through a temporary file renamed into
+   place, stamped with the size and time of their source.  Returns 0,
+   or -1 with errno set.
+*/
+int
+soap_cols_save
+(
+ const struct soap_cols *c,
+ const char             *source,
+ const char             *path
+)
+{
+  static const char       zero[8];
+  struct soap_col_header  h;
+  struct stat             sb;
+  char                    tmp[PATH_MAX];
+  size_t                  i, len;
+  FILE                   *file;
+  int                     err;
+
+  if (stat (source, &sb) != 0)
+    return -1;
+
+  memset (&h, 0, sizeof (h));
+  memcpy (h.magic, SOAP_COL_MAGIC, 4);
+  h.methods = c->nmethods;
+  h.rows = c->rows;
+  h.base = c->base;
+  h.size = sb.st_size;
+  h.mtime = sb.st_mtime;
+  h.sorted = c->sorted;
+  for (i = 0; i < c->nmethods; i++)
+    h.nameslen += strlen (c->names[i]) + 1;
+
+  snprintf (tmp, sizeof (tmp), "%s.%ld.tmp", path, (long)getpid ());
+  if ((file = fopen (tmp, "w")) == NULL)
+    return -1;
+
+  len = c->rows;
+  if (fwrite (&h, sizeof (h), 1, file) != 1
+      || fwrite (c->count, sizeof (*c->count), len, file) != len
+      || fwrite (c->ms, sizeof (*c->ms), len, file) != len
+      || fwrite (c->dt, sizeof (*c->dt), len, file) != len
+      || fwrite (zero, 1, SOAP_PAD (len * 4) - len * 4, file) != SOAP_PAD (len * 4) - len * 4
+      || fwrite (c->method, sizeof (*c->method), len, file) != len
+      || fwrite (zero, 1, SOAP_PAD (len * 2) - len * 2, file) != SOAP_PAD (len * 2) - len * 2
+      || fwrite (c->lat, sizeof (*c->lat), len, file) != len
+      || fwrite (zero, 1, SOAP_PAD (len * 2) - len * 2, file) != SOAP_PAD (len * 2) - len * 2)
+    goto fail;
+  for (i = 0; i < c->nmethods; i++)
+    if (fwrite (c->names[i], strlen (c->names[i]) + 1, 1, file) != 1)
+      goto fail;
+  if (fflush (file) != 0)
+    goto fail;
+  fclose (file);
+
+  if (rename (tmp, path) != 0) {
+    err = errno;
+    unlink (tmp);
+    errno = err;
+    return -1;
+  }
+
+  return 0;
+
+ fail:
+  err = errno;
+  fclose (file);
+  unlink (tmp);
+  errno = err;
+  return -1;
+}
+
+
+/**
+   soap_cols_open
+
+   Maps the cache of a day file.  Returns 0, or -1 with errno set:
+   ENOENT if there is none, ESTALE if the day file has changed since,
+   EINVAL if it is not a cache file.
+*/
+int
+soap_cols_open
+(
+ struct soap_cols *c,
+ const char       *source,
+ const char       *path
+)
+{
+  const struct soap_col_header *h;
+  struct stat                   sb, src;
+  const char                   *map, *p, *end;
+  size_t                        rows, i;
+  int                           fd;
+
+  memset (c, 0, sizeof (*c));
+
+  if (stat (source, &src) != 0)
+    return -1;
+  if ((fd = open (path, O_RDONLY)) < 0)
+    return -1;
+  if (fstat (fd, &sb) != 0) {
+    close (fd);
+    return -1;
+  }
+  if (sb.st_size < (off_t)sizeof (*h)) {
+    close (fd);
+    errno = EINVAL;
+    return -1;
+  }
+  map = mmap (NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+    return -1;
+  c->map = (void *)map;
+  c->maplen = sb.st_size;
+
+  h = (const struct soap_col_header *)map;
+  rows = h->rows;
+  if (memcmp (h->magic, SOAP_COL_MAGIC, 4) != 0
+      || rows > (uint64_t)sb.st_size
+      || sizeof (*h) + 16 * rows + SOAP_PAD (4 * rows) + 2 * SOAP_PAD (2 * rows)
+         + h->nameslen != (uint64_t)sb.st_size
+      || (h->nameslen > 0 && map[sb.st_size - 1] != '\0')
+      || h->methods > h->nameslen) {
+    soap_cols_free (c);
+    errno = EINVAL;
+    return -1;
+  }
+  if (h->size != src.st_size || h->mtime != src.st_mtime) {
+    soap_cols_free (c);
+    errno = ESTALE;
+    return -1;
+  }
+
+  p = map + sizeof (*h);
+  c->rows = rows;
+  c->base = h->base;
+  c->sorted = h->sorted;
+  c->count = (double *)p;
+  c->ms = (double *)(p += 8 * rows);
+  c->dt = (uint32_t *)(p += 8 * rows);
+  c->method = (uint16_t *)(p += SOAP_PAD (4 * rows));
+  c->lat = (uint16_t *)(p += SOAP_PAD (2 * rows));
+  p += SOAP_PAD (2 * rows);
+  end = map + sb.st_size;
+
+  /* Every name takes a byte at least, so methods is bounded by the file. */
+  if ((c->names = malloc (((size_t)h->methods + 1) * sizeof (*c->names)))
+      == NULL) {
+    soap_cols_free (c);
+    errno = ENOMEM;
+    return -1;
+  }
+  for (i = 0; i < h->methods && p < end; i++, p += strlen (p) + 1)
+    c->names[i] = (char *)p;
+  c->nmethods = i;
+  if (i < h->methods) {
+    soap_cols_free (c);
+    errno = EINVAL;
+    return -1;
+  }
+  for (i = 0; i < rows; i++)
+    if (c->method[i] >= c->nmethods || c->lat[i] >= SOAP_LAT_BUCKETS)
+      break;
+  if (i < rows) {
+    soap_cols_free (c);
+    errno = EINVAL;
+    return -1;
+  }
+
+  return 0;
+}
+
+
+void
+soap_cols_free
+(
+ struct soap_cols *c
+)
+{
+  size_t i;
+
+  if (c->map != NULL) {
+    munmap (c->map, c->maplen);
+    free (c->names);
+  } else {
+    for (i = 0; i < c->nmethods; i++)
+      free (c->names[i]);
+    free (c->names);
+    free (c->count);
+    free (c->ms);
+    free (c->dt);
+    free (c->method);
+    free (c->lat);
+    free (c->time);
+    free (c->dict);
+  }
+  memset (c, 0, sizeof (*c));
+}
+
+
+
+/* ---- Queries ---- */
+
+
+/* The first row at or after dt, in sorted columns. */
+static size_t
+soap_cols_find
+(
+ const struct soap_cols *c,
+ uint64_t                dt
+)
+{
+  size_t lo = 0, hi = c->rows, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (c->dt[mid] < dt)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+
+/**
+   soap_cols_query
+
+   Adds the intervals of one method, or of all of them if method is
+   NULL, from time from up to but not including to, into a table.
+   Returns 0, or -1 if out of memory.
+*/
+int
+soap_cols_query
+(
+ const struct soap_cols *c,
+ struct soap_table      *t,
+ const char             *method,
+ time_t                  from,
+ time_t                  to
+)
+{
+  struct soap_stat **stats;
+  uint32_t           sel[SOAP_COL_BLOCK];
+  uint64_t           lo_dt, hi_dt;
+  size_t             lo, hi, i, j, n, m;
+  unsigned           id = 0;
+  int                status = 0;
+
+  if (c->rows == 0 || to <= from || to <= c->base)
+    return 0;
+  lo_dt = from <= c->base ? 0 : (uint64_t)(from - c->base);
+  hi_dt = (uint64_t)(to - c->base);
+
+  if (method != NULL) {
+    for (id = 0; id < c->nmethods && strcmp (c->names[id], method) != 0; id++)
+      ;
+    if (id == c->nmethods)
+      return 0;
+  }
+
+  if ((stats = calloc (c->nmethods, sizeof (*stats))) == NULL
+      || soap_table_reserve (t, method != NULL ? 1 : c->nmethods) != 0) {
+    free (stats);
+    return -1;
+  }
+  for (i = 0; i < c->nmethods; i++)
+    if (method == NULL || i == id)
+      if ((stats[i] = soap_table_get (t, c->names[i], strlen (c->names[i]))) == NULL) {
+        free (stats);
+        return -1;
+      }
+
+  if (c->sorted) {
+    lo = soap_cols_find (c, lo_dt);
+    hi = soap_cols_find (c, hi_dt);
+  } else {
+    lo = 0;
+    hi = c->rows;
+  }
+
+  for (i = lo; i < hi && status == 0; i += n) {
+    n = hi - i < SOAP_COL_BLOCK ? hi - i : SOAP_COL_BLOCK;
+    m = 0;
+    if (c->sorted && method == NULL)
+      for (j = 0; j < n; j++)
+        sel[m++] = i + j;
+    else if (c->sorted)
+      for (j = 0; j < n; j++) {
+        sel[m] = i + j;
+        m += c->method[i + j] == id;
+      }
+    else
+      for (j = 0; j < n; j++) {
+        sel[m] = i + j;
+        m += (method == NULL || c->method[i + j] == id)
+          & (c->dt[i + j] >= lo_dt) & (c->dt[i + j] < hi_dt);
+      }
+
+    for (j = 0; j < m && status == 0; j++) {
+      size_t r = sel[j];
+
+      status = soap_stat_add (stats[c->method[r]], t->step, c->count[r], c->ms[r], c->lat[r]);
+    }
+  }
+
+  free (stats);
+
+  return status;
+}
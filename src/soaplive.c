@@ -0,0 +1,442 @@
+/**********************************************************************
+ * soaplive
+ *
+ * Following the current zmstat soap.csv for soapstat -f.
+ *
+ * The file is read from the start and then polled for what zmstat
+ * appends; when it is rotated away or truncated the new one is read
+ * from its start.  Each method keeps its intervals of the last hour
+ * in a ring, and a soap_stat for each of the 1, 5 and 60 minute
+ * windows.  An interval is added to the windows as it is read and
+ * taken out of each as it falls behind it, so the windows are kept
+ * up to date without going over anything twice.
+ *
+ * The clock is the time of the last interval read plus the time since
+ * it was read, which keeps to zmstat's local time without knowing the
+ * zone, and lets the windows drain when zmstat stops writing.
+ ***********************************************************************/
+
+#include <string.h>
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "soapstat.h"
+
+#define SOAP_LIVE_WINDOWS (3)
+#define SOAP_LIVE_BLOCK   (64 * 1024)   /* Bytes read at a time. */
+
+static const int soap_live_minutes[SOAP_LIVE_WINDOWS] = { 1, 5, 60 };
+
+struct soap_live_row {
+  time_t   time;
+  double   count;
+  double   ms;
+  unsigned lat;
+};
+
+struct soap_live {
+  char                 *name;
+  struct soap_live_row *ring;
+  size_t                mask;
+  size_t                tail;           /* Rows ever added. */
+  size_t                head[SOAP_LIVE_WINDOWS];  /* First row in each window. */
+  struct soap_stat      win[SOAP_LIVE_WINDOWS];
+};
+
+struct soap_follow {
+  struct soap_live **methods;           /* By name. */
+  size_t             count;
+  size_t             max;
+  const char        *method;            /* Only this one, if not NULL. */
+  double             step;
+  time_t             last;              /* Time of the last interval read. */
+  time_t             read_at;           /* When it was read. */
+  int                err;
+};
+
+
+
+/* ---- Windows ---- */
+
+
+static void
+soap_live_free
+(
+ struct soap_live *m
+)
+{
+  int w;
+
+  for (w = 0; w < SOAP_LIVE_WINDOWS; w++)
+    soap_stat_free (&m->win[w]);
+  free (m->ring);
+  free (m->name);
+  free (m);
+}
+
+
+/* Finds a method, adding it if it is not there; NULL if out of memory. */
+static struct soap_live *
+soap_live_get
+(
+ struct soap_follow *f,
+ const char         *name,
+ size_t              len
+)
+{
+  struct soap_live  *m, **v;
+  size_t             lo = 0, hi = f->count, mid;
+  int                c, w;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    m = f->methods[mid];
+    if ((c = strncmp (m->name, name, len)) == 0)
+      c = m->name[len] != '\0';
+    if (c == 0)
+      return m;
+    if (c < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (f->count == f->max) {
+    f->max = f->max ? 2 * f->max : 64;
+    if ((v = realloc (f->methods, f->max * sizeof (*v))) == NULL)
+      return NULL;
+    f->methods = v;
+  }
+  if ((m = calloc (1, sizeof (*m))) == NULL)
+    return NULL;
+  m->mask = 63;
+  m->name = malloc (len + 1);
+  m->ring = malloc ((m->mask + 1) * sizeof (*m->ring));
+  for (w = 0; w < SOAP_LIVE_WINDOWS; w++)
+    m->win[w].lat = calloc (SOAP_LAT_BUCKETS, sizeof (*m->win[w].lat));
+  if (m->name == NULL || m->ring == NULL || m->win[0].lat == NULL
+      || m->win[1].lat == NULL || m->win[2].lat == NULL) {
+    soap_live_free (m);
+    return NULL;
+  }
+  memcpy (m->name, name, len);
+  m->name[len] = '\0';
+
+  memmove (f->methods + lo + 1, f->methods + lo, (f->count - lo) * sizeof (*v));
+  f->methods[lo] = m;
+  f->count++;
+
+  return m;
+}
+
+
+/* Takes the rows that have fallen out of each window out of it. */
+static void
+soap_live_expire
+(
+ struct soap_follow *f,
+ struct soap_live   *m,
+ time_t              now
+)
+{
+  struct soap_live_row *r;
+  int                   w;
+
+  for (w = 0; w < SOAP_LIVE_WINDOWS; w++) {
+    while (m->head[w] < m->tail) {
+      r = &m->ring[m->head[w] & m->mask];
+      if (r->time > now - 60 * soap_live_minutes[w])
+        break;
+      soap_stat_remove (&m->win[w], f->step, r->count, r->ms, r->lat);
+      m->head[w]++;
+    }
+    if (m->head[w] == m->tail) {
+      /* Empty: drop what rounding left behind. */
+      memset (m->win[w].n, 0, m->win[w].nbins * sizeof (*m->win[w].n));
+      memset (m->win[w].calls, 0, m->win[w].nbins * sizeof (*m->win[w].calls));
+      memset (m->win[w].ms, 0, m->win[w].nbins * sizeof (*m->win[w].ms));
+      memset (m->win[w].lat, 0, SOAP_LAT_BUCKETS * sizeof (*m->win[w].lat));
+    }
+  }
+}
+
+
+static int
+soap_live_add
+(
+ const struct soap_row *row,
+ void                  *arg
+)
+{
+  struct soap_follow   *f = arg;
+  struct soap_live     *m;
+  struct soap_live_row *ring, *r;
+  size_t                i, size;
+  int                   w;
+
+  if (f->method != NULL
+      && (strncmp (row->method, f->method, row->methodlen) != 0
+          || f->method[row->methodlen] != '\0'))
+    return 0;
+  if ((m = soap_live_get (f, row->method, row->methodlen)) == NULL)
+    goto fail;
+
+  /* The ring holds the hour window, the longest. */
+  if (m->tail - m->head[SOAP_LIVE_WINDOWS - 1] > m->mask) {
+    size = 2 * (m->mask + 1);
+    if ((ring = malloc (size * sizeof (*ring))) == NULL)
+      goto fail;
+    for (i = m->head[SOAP_LIVE_WINDOWS - 1]; i < m->tail; i++)
+      ring[i & (size - 1)] = m->ring[i & m->mask];
+    free (m->ring);
+    m->ring = ring;
+    m->mask = size - 1;
+  }
+
+  r = &m->ring[m->tail & m->mask];
+  r->time = row->time;
+  r->count = row->count;
+  r->ms = row->ms;
+  r->lat = soap_lat_bucket (row->ms);
+  for (w = 0; w < SOAP_LIVE_WINDOWS; w++)
+    if (soap_stat_add (&m->win[w], f->step, r->count, r->ms, r->lat) != 0)
+      goto fail;
+  m->tail++;
+
+  if (row->time > f->last) {
+    f->last = row->time;
+    f->read_at = time (NULL);
+  }
+  soap_live_expire (f, m, f->last);
+
+  return 0;
+
+ fail:
+  f->err = ENOMEM;
+  return 1;
+}
+
+
+
+/* ---- Output ---- */
+
+
+static double
+soap_live_avg
+(
+ double   sum,
+ uint64_t n
+)
+{
+  return n > 0 ? sum / n : 0;
+}
+
+
+static double
+soap_live_pct
+(
+ const struct soap_stat *s,
+ double                  p
+)
+{
+  double v = soap_percentile (s, p);
+
+  return isnan (v) ? 0 : v;
+}
+
+
+/* Prints every method with intervals in the last hour. */
+static void
+soap_live_print
+(
+ struct soap_follow *f,
+ const char         *host,
+ time_t              now,
+ double              limit,
+ int                 stream,
+ int                 clear
+)
+{
+  struct soap_live *m;
+  struct tm         tm;
+  uint64_t          n, bn;
+  double            calls, ms, bcalls, bms;
+  char              when[32];
+  size_t            i;
+  int               w;
+
+  gmtime_r (&now, &tm);
+  strftime (when, sizeof (when), "%Y-%m-%dT%H:%M:%S", &tm);
+
+  if (!stream) {
+    if (clear)
+      fputs ("\033[H\033[2J", stdout);
+    printf ("%s\t%s\tbusy over %.0f calls\n", host, when, limit);
+    printf ("%-24.24s %3.3s %6.6s %9.9s %9.9s %6.6s %9.9s %9.9s %9.9s %9.9s %9.9s\n",
+            "Method", "Win", "Int", "AvgCnt", "AvgMs", "Busy", "BusyCnt", "BusyMs",
+            "p50", "p95", "p99");
+  }
+
+  for (i = 0; i < f->count; i++) {
+    m = f->methods[i];
+    soap_live_expire (f, m, now);
+    if (m->head[SOAP_LIVE_WINDOWS - 1] == m->tail)
+      continue;
+
+    for (w = 0; w < SOAP_LIVE_WINDOWS; w++) {
+      soap_stat_over (&m->win[w], 0, &n, &calls, &ms);
+      soap_stat_over (&m->win[w], (size_t)(limit / f->step), &bn, &bcalls, &bms);
+      if (stream)
+        printf ("time=%s host=%s method=%s window=%d intervals=%llu avg_cnt=%.3f"
+                " avg_ms=%.3f busy_limit=%.0f busy_intervals=%llu busy_avg_cnt=%.3f"
+                " busy_avg_ms=%.3f p50_ms=%.3f p95_ms=%.3f p99_ms=%.3f\n",
+                when, host, m->name, soap_live_minutes[w], (unsigned long long)n,
+                soap_live_avg (calls, n), soap_live_avg (ms, n), limit,
+                (unsigned long long)bn, soap_live_avg (bcalls, bn), soap_live_avg (bms, bn),
+                soap_live_pct (&m->win[w], 0.50), soap_live_pct (&m->win[w], 0.95),
+                soap_live_pct (&m->win[w], 0.99));
+      else
+        printf ("%-24.24s %2dm %6llu %9.3f %9.3f %6llu %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+                w == 0 ? m->name : "", soap_live_minutes[w], (unsigned long long)n,
+                soap_live_avg (calls, n), soap_live_avg (ms, n), (unsigned long long)bn,
+                soap_live_avg (bcalls, bn), soap_live_avg (bms, bn),
+                soap_live_pct (&m->win[w], 0.50), soap_live_pct (&m->win[w], 0.95),
+                soap_live_pct (&m->win[w], 0.99));
+    }
+  }
+
+  if (!stream && !clear)
+    putchar ('\n');
+  fflush (stdout);
+}
+
+
+
+/* ---- Following ---- */
+
+
+/* Hands the complete lines in buf to soap_live_add; returns bytes used. */
+static size_t
+soap_live_lines
+(
+ struct soap_follow *f,
+ char               *buf,
+ size_t              len
+)
+{
+  struct soap_row  row;
+  char            *p = buf, *nl, *end = buf + len;
+
+  while (!f->err && (nl = memchr (p, '\n', end - p)) != NULL) {
+    if (soap_parse_line (p, nl - p, &row) == 0)
+      soap_live_add (&row, f);
+    p = nl + 1;
+  }
+
+  return p - buf;
+}
+
+
+/**
+   soap_follow
+
+   Follows path, printing the windows of one method, or of all if
+   method is NULL, every interval seconds: as a table, redrawn in
+   place on a terminal, or with stream as name=value lines.  The busy
+   columns count intervals over limit calls, a multiple of step.
+   Stops after count reports if count is positive.  Returns only on
+   error, or after count reports, with 0 or -1 and errno set.
+*/
+int
+soap_follow
+(
+ const char *path,
+ const char *method,
+ const char *host,
+ double      step,
+ double      limit,
+ int         interval,
+ int         stream,
+ long        count
+)
+{
+  struct soap_follow  f;
+  struct stat         sb, fsb;
+  struct timespec     nap = { 1, 0 };
+  char               *buf;
+  size_t              have = 0, used, i;
+  time_t              next, now;
+  ssize_t             n;
+  int                 fd = -1, clear = !stream && isatty (STDOUT_FILENO);
+  int                 status = 0;
+
+  memset (&f, 0, sizeof (f));
+  f.method = method;
+  f.step = step;
+  if ((buf = malloc (SOAP_LIVE_BLOCK)) == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  next = time (NULL);
+
+  for (;;) {
+    /* (Re)open when the file is first there, replaced or truncated. */
+    if (stat (path, &sb) == 0
+        && (fd < 0 || fstat (fd, &fsb) != 0 || sb.st_ino != fsb.st_ino
+            || sb.st_dev != fsb.st_dev || lseek (fd, 0, SEEK_CUR) > sb.st_size)) {
+      if (fd >= 0) {
+        /* Finish the old file first; zmstat may have written more. */
+        while ((n = read (fd, buf + have, SOAP_LIVE_BLOCK - have)) > 0) {
+          have += n;
+          used = soap_live_lines (&f, buf, have);
+          memmove (buf, buf + used, have - used);
+          have -= used;
+          if (have == SOAP_LIVE_BLOCK)
+            have = 0;
+        }
+        close (fd);
+      }
+      have = 0;
+      fd = open (path, O_RDONLY);
+    }
+
+    while (fd >= 0 && (n = read (fd, buf + have, SOAP_LIVE_BLOCK - have)) > 0) {
+      have += n;
+      used = soap_live_lines (&f, buf, have);
+      memmove (buf, buf + used, have - used);
+      have -= used;
+      if (have == SOAP_LIVE_BLOCK)
+        have = 0;                       /* A line too long to be ours. */
+    }
+    if (f.err) {
+      errno = f.err;
+      status = -1;
+      break;
+    }
+
+    if ((now = time (NULL)) >= next) {
+      soap_live_print (&f, host, f.last + (now - f.read_at), limit, stream, clear);
+      next = now + interval;
+      if (count > 0 && --count == 0)
+        break;
+    }
+    nanosleep (&nap, NULL);
+  }
+
+  if (fd >= 0)
+    close (fd);
+  free (buf);
+  for (i = 0; i < f.count; i++)
+    soap_live_free (f.methods[i]);
+  free (f.methods);
+
+  return status;
+}
@@ -0,0 +1,736 @@
+/**********************************************************************
+ * soapread
+ *
+ * Reading and aggregating zmstat soap.csv files for soapstat.
+ *
+ * Files are read in large blocks and split into lines in place; with
+ * zlib a file is read through gzread, which handles plain and gzipped
+ * files alike, so each day is decompressed exactly once.
+ *
+ * Methods are kept in an open addressing table.  For each method the
+ * intervals are binned by call count, SOAP_STEP calls to a bin, so
+ * that one pass gives the zmsoapstat table for every limit, and the
+ * calls are binned by interval average time on a log scale for the
+ * percentiles.
+ ***********************************************************************/
+
+#include <string.h>
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
+#include "soapstat.h"
+
+#define SOAP_BLOCK     (256 * 1024)     /* Bytes read at a time. */
+#define SOAP_LAT_MIN   (0.01)           /* Lower edge of latency bucket 0. */
+#define SOAP_LAT_RATIO (1.01)           /* Width of a latency bucket. */
+
+
+
+/* ---- Parsing ---- */
+
+
+/* Parses an unsigned decimal of exactly n digits. */
+static int
+soap_digits
+(
+ const char *s,
+ int         n,
+ int        *v
+)
+{
+  for (*v = 0; n > 0; n--, s++) {
+    if (*s < '0' || *s > '9')
+      return -1;
+    *v = *v * 10 + (*s - '0');
+  }
+
+  return 0;
+}
+
+
+/**
+   soap_civil
+
+   Midnight UTC of a proleptic Gregorian date.
+*/
+time_t
+soap_civil
+(
+ int y,
+ int m,
+ int d
+)
+{
+  long era, yoe, doy;
+
+  y -= m <= 2;
+  era = (y >= 0 ? y : y - 399) / 400;
+  yoe = y - era * 400;
+  doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+
+  return (time_t)(era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468) * 86400;
+}
+
+
+/* Parses "MM/DD/YYYY HH:MM:SS" as UTC. */
+static int
+soap_time
+(
+ const char *s,
+ size_t      len,
+ time_t     *t
+)
+{
+  int mo, d, y, h, mi, sec;
+
+  if (len != 19 || s[2] != '/' || s[5] != '/' || s[10] != ' '
+      || s[13] != ':' || s[16] != ':')
+    return -1;
+  if (soap_digits (s, 2, &mo) || soap_digits (s + 3, 2, &d)
+      || soap_digits (s + 6, 4, &y) || soap_digits (s + 11, 2, &h)
+      || soap_digits (s + 14, 2, &mi) || soap_digits (s + 17, 2, &sec))
+    return -1;
+  if (mo < 1 || mo > 12 || d < 1 || d > 31)
+    return -1;
+
+  *t = soap_civil (y, mo, d) + h * 3600 + mi * 60 + sec;
+
+  return 0;
+}
+
+
+/* Parses a number filling all of s..s+len. */
+static int
+soap_number
+(
+ const char *s,
+ size_t      len,
+ double     *v
+)
+{
+  char  buf[64], *end;
+
+  if (len == 0 || len >= sizeof (buf))
+    return -1;
+  memcpy (buf, s, len);
+  buf[len] = '\0';
+  *v = strtod (buf, &end);
+
+  return (*end == '\0' && isfinite (*v)) ? 0 : -1;
+}
+
+
+/**
+   soap_parse_line
+
+   Splits a soap.csv line, without its newline, into a row.  Fields
+   may be padded with blanks.  Returns -1 for the header and anything
+   else that is not a data line.
+*/
+int
+soap_parse_line
+(
+ const char      *line,
+ size_t           len,
+ struct soap_row *row
+)
+{
+  const char *field[4], *end = line + len, *p;
+  size_t      flen[4];
+  int         i;
+
+  if (len > 0 && line[len - 1] == '\r')
+    end--;
+
+  for (i = 0, p = line; i < 4; i++) {
+    const char *s = p, *e;
+
+    if (i < 3) {
+      if ((e = memchr (p, ',', end - p)) == NULL)
+        return -1;
+      p = e + 1;
+    } else
+      e = end;
+    while (s < e && (*s == ' ' || *s == '\t'))
+      s++;
+    while (e > s && (e[-1] == ' ' || e[-1] == '\t'))
+      e--;
+    field[i] = s;
+    flen[i] = e - s;
+  }
+
+  if (soap_time (field[0], flen[0], &row->time) != 0
+      || flen[1] == 0
+      || soap_number (field[2], flen[2], &row->count) != 0
+      || soap_number (field[3], flen[3], &row->ms) != 0)
+    return -1;
+  row->method = field[1];
+  row->methodlen = flen[1];
+
+  return 0;
+}
+
+
+/* Hands the complete lines in buf to fn; returns bytes consumed. */
+static size_t
+soap_lines
+(
+ char        *buf,
+ size_t       len,
+ soap_row_fn  fn,
+ void        *arg,
+ int         *stop
+)
+{
+  struct soap_row  row;
+  char            *p = buf, *nl, *end = buf + len;
+
+  while (!*stop && (nl = memchr (p, '\n', end - p)) != NULL) {
+    if (soap_parse_line (p, nl - p, &row) == 0 && fn (&row, arg) != 0)
+      *stop = 1;
+    p = nl + 1;
+  }
+
+  return p - buf;
+}
+
+
+/**
+   soap_read
+
+   Calls fn for every data line of a soap.csv file, plain or, with
+   zlib, gzipped.  A last line without a newline is still read.  fn
+   returns non-zero to stop early.  Returns -1 with errno set if the
+   file cannot be read.
+*/
+int
+soap_read
+(
+ const char  *path,
+ soap_row_fn  fn,
+ void        *arg
+)
+{
+  char   *buf;
+  size_t  have = 0, used;
+  int     n, stop = 0, err = 0;
+#ifdef HAVE_LIBZ
+  gzFile  gz;
+
+  if ((gz = gzopen (path, "rb")) == NULL) {
+    if (errno == 0)
+      errno = ENOMEM;
+    return -1;
+  }
+  gzbuffer (gz, SOAP_BLOCK);
+#else
+  int     fd;
+  size_t  pl = strlen (path);
+
+  if (pl > 3 && strcmp (path + pl - 3, ".gz") == 0) {
+    errno = ENOTSUP;
+    return -1;
+  }
+  if ((fd = open (path, O_RDONLY)) < 0)
+    return -1;
+#endif
+
+  if ((buf = malloc (SOAP_BLOCK + 1)) == NULL)
+    err = ENOMEM;
+
+  while (!err && !stop) {
+#ifdef HAVE_LIBZ
+    if ((n = gzread (gz, buf + have, SOAP_BLOCK - have)) < 0) {
+      int zerr;
+
+      gzerror (gz, &zerr);
+      err = zerr == Z_ERRNO ? errno : EIO;
+      break;
+    }
+#else
+    if ((n = read (fd, buf + have, SOAP_BLOCK - have)) < 0) {
+      if (errno == EINTR)
+        continue;
+      err = errno;
+      break;
+    }
+#endif
+    if (n == 0) {
+      if (have > 0) {
+        buf[have++] = '\n';
+        soap_lines (buf, have, fn, arg, &stop);
+      }
+      break;
+    }
+    have += n;
+    used = soap_lines (buf, have, fn, arg, &stop);
+    if (used == 0 && have == SOAP_BLOCK)
+      used = have;                      /* A line too long to be ours. */
+    memmove (buf, buf + used, have - used);
+    have -= used;
+  }
+
+  free (buf);
+#ifdef HAVE_LIBZ
+  gzclose (gz);
+#else
+  close (fd);
+#endif
+
+  if (err) {
+    errno = err;
+    return -1;
+  }
+
+  return 0;
+}
+
+
+
+/* ---- Aggregates ---- */
+
+
+static uint64_t
+soap_hash
+(
+ const char *name,
+ size_t      len
+)
+{
+  uint64_t h = 14695981039346656037ULL;
+
+  for (; len > 0; name++, len--)
+    h = (h ^ (unsigned char)*name) * 1099511628211ULL;
+
+  return h ? h : 1;
+}
+
+
+/**
+   soap_table_init
+
+   Starts an empty table binning intervals every step calls.
+*/
+int
+soap_table_init
+(
+ struct soap_table *t,
+ double             step
+)
+{
+  t->mask = 63;
+  t->count = 0;
+  t->step = step;
+
+  return (t->slots = calloc (t->mask + 1, sizeof (*t->slots))) ? 0 : -1;
+}
+
+
+void
+soap_stat_free
+(
+ struct soap_stat *s
+)
+{
+  free (s->name);
+  free (s->n);
+  free (s->calls);
+  free (s->ms);
+  free (s->lat);
+  memset (s, 0, sizeof (*s));
+}
+
+
+void
+soap_table_free
+(
+ struct soap_table *t
+)
+{
+  size_t i;
+
+  for (i = 0; t->slots != NULL && i <= t->mask; i++) {
+    struct soap_stat *s = &t->slots[i];
+
+    if (s->hash != 0)
+      soap_stat_free (s);
+  }
+  free (t->slots);
+  t->slots = NULL;
+}
+
+
+static int
+soap_table_grow
+(
+ struct soap_table *t
+)
+{
+  struct soap_stat *slots;
+  size_t            size = 2 * (t->mask + 1), i, j;
+
+  if ((slots = calloc (size, sizeof (*slots))) == NULL)
+    return -1;
+
+  for (i = 0; i <= t->mask; i++) {
+    if (t->slots[i].hash == 0)
+      continue;
+    for (j = t->slots[i].hash & (size - 1); slots[j].hash != 0; j = (j + 1) & (size - 1))
+      ;
+    slots[j] = t->slots[i];
+  }
+
+  free (t->slots);
+  t->slots = slots;
+  t->mask = size - 1;
+
+  return 0;
+}
+
+
+/**
+   soap_table_reserve
+
+   Makes room for n more methods, so that adding them does not move
+   the ones already there.
+*/
+int
+soap_table_reserve
+(
+ struct soap_table *t,
+ size_t             n
+)
+{
+  while (2 * (t->count + n) > t->mask + 1)
+    if (soap_table_grow (t) != 0)
+      return -1;
+
+  return 0;
+}
+
+
+/**
+   soap_table_get
+
+   Finds a method, adding it if it is not there.  Adding one may move
+   the others, unless room was reserved.  Returns NULL if out of
+   memory.
+*/
+struct soap_stat *
+soap_table_get
+(
+ struct soap_table *t,
+ const char        *name,
+ size_t             len
+)
+{
+  struct soap_stat *s;
+  uint64_t          hash = soap_hash (name, len);
+  size_t            i;
+
+  if (2 * (t->count + 1) > t->mask + 1 && soap_table_grow (t) != 0)
+    return NULL;
+
+  for (i = hash & t->mask; t->slots[i].hash != 0; i = (i + 1) & t->mask) {
+    s = &t->slots[i];
+    if (s->hash == hash && strncmp (s->name, name, len) == 0 && s->name[len] == '\0')
+      return s;
+  }
+
+  s = &t->slots[i];
+  memset (s, 0, sizeof (*s));
+  if ((s->name = malloc (len + 1)) == NULL
+      || (s->lat = calloc (SOAP_LAT_BUCKETS, sizeof (*s->lat))) == NULL) {
+    free (s->name);
+    return NULL;
+  }
+  memcpy (s->name, name, len);
+  s->name[len] = '\0';
+  s->hash = hash;
+  t->count++;
+
+  return s;
+}
+
+
+/* Makes room for count bin k. */
+static int
+soap_stat_bins
+(
+ struct soap_stat *s,
+ size_t            k
+)
+{
+  uint64_t *n;
+  double   *calls, *ms;
+  size_t    size;
+
+  if (k < s->nbins)
+    return 0;
+
+  for (size = s->nbins ? s->nbins : 16; size <= k; size *= 2)
+    ;
+  if ((n = realloc (s->n, size * sizeof (*n))) != NULL)
+    s->n = n;
+  if ((calls = realloc (s->calls, size * sizeof (*calls))) != NULL)
+    s->calls = calls;
+  if ((ms = realloc (s->ms, size * sizeof (*ms))) != NULL)
+    s->ms = ms;
+  if (n == NULL || calls == NULL || ms == NULL)
+    return -1;
+
+  memset (n + s->nbins, 0, (size - s->nbins) * sizeof (*n));
+  memset (calls + s->nbins, 0, (size - s->nbins) * sizeof (*calls));
+  memset (ms + s->nbins, 0, (size - s->nbins) * sizeof (*ms));
+  s->nbins = size;
+
+  return 0;
+}
+
+
+/**
+   soap_lat_bucket
+
+   The latency bucket of an average time.
+*/
+unsigned
+soap_lat_bucket
+(
+ double ms
+)
+{
+  double b;
+
+  if (ms <= SOAP_LAT_MIN)
+    return 0;
+  b = log (ms / SOAP_LAT_MIN) / log (SOAP_LAT_RATIO);
+
+  return b >= SOAP_LAT_BUCKETS - 1 ? SOAP_LAT_BUCKETS - 1 : (unsigned)b;
+}
+
+
+/**
+   soap_stat_add
+
+   Counts one interval of a method, with the latency bucket of its
+   average time.  An interval of c calls goes in bin ceil(c/step) - 1,
+   so it is in the average for every limit below c; idle intervals are
+   in none.
+*/
+int
+soap_stat_add
+(
+ struct soap_stat *s,
+ double            step,
+ double            count,
+ double            ms,
+ unsigned          lat
+)
+{
+  double k;
+
+  if (!(count > 0))
+    return 0;
+
+  k = ceil (count / step) - 1;
+  if (k > 1e9 || soap_stat_bins (s, (size_t)k) != 0)
+    return -1;
+  s->n[(size_t)k]++;
+  s->calls[(size_t)k] += count;
+  s->ms[(size_t)k] += ms;
+  s->lat[lat] += count;
+
+  return 0;
+}
+
+
+/**
+   soap_stat_remove
+
+   Takes back an interval counted by soap_stat_add with the same
+   arguments.
+*/
+void
+soap_stat_remove
+(
+ struct soap_stat *s,
+ double            step,
+ double            count,
+ double            ms,
+ unsigned          lat
+)
+{
+  size_t k;
+
+  if (!(count > 0))
+    return;
+
+  k = (size_t)(ceil (count / step) - 1);
+  s->n[k]--;
+  s->calls[k] -= count;
+  s->ms[k] -= ms;
+  s->lat[lat] -= count;
+}
+
+
+/**
+   soap_stat_over
+
+   Sums the intervals over limit j steps, as one row of the table.
+*/
+void
+soap_stat_over
+(
+ const struct soap_stat *s,
+ size_t                  j,
+ uint64_t               *n,
+ double                 *calls,
+ double                 *ms
+)
+{
+  size_t k;
+
+  *n = 0;
+  *calls = *ms = 0;
+  for (k = j; k < s->nbins; k++) {
+    *n += s->n[k];
+    *calls += s->calls[k];
+    *ms += s->ms[k];
+  }
+}
+
+
+/**
+   soap_table_add
+
+   Counts one interval of a row's method.
+*/
+int
+soap_table_add
+(
+ struct soap_table     *t,
+ const struct soap_row *row
+)
+{
+  struct soap_stat *s;
+
+  if ((s = soap_table_get (t, row->method, row->methodlen)) == NULL)
+    return -1;
+
+  return soap_stat_add (s, t->step, row->count, row->ms, soap_lat_bucket (row->ms));
+}
+
+
+/**
+   soap_table_merge
+
+   Adds the counts of another table with the same step into t.
+*/
+int
+soap_table_merge
+(
+ struct soap_table       *t,
+ const struct soap_table *from
+)
+{
+  size_t i, k;
+
+  for (i = 0; i <= from->mask; i++) {
+    const struct soap_stat *f = &from->slots[i];
+    struct soap_stat       *s;
+
+    if (f->hash == 0)
+      continue;
+    if ((s = soap_table_get (t, f->name, strlen (f->name))) == NULL
+        || (f->nbins > 0 && soap_stat_bins (s, f->nbins - 1) != 0))
+      return -1;
+    for (k = 0; k < f->nbins; k++) {
+      s->n[k] += f->n[k];
+      s->calls[k] += f->calls[k];
+      s->ms[k] += f->ms[k];
+    }
+    for (k = 0; k < SOAP_LAT_BUCKETS; k++)
+      s->lat[k] += f->lat[k];
+  }
+
+  return 0;
+}
+
+
+static int
+soap_stat_cmp
+(
+ const void *a,
+ const void *b
+)
+{
+  return strcmp ((*(struct soap_stat * const *)a)->name,
+                 (*(struct soap_stat * const *)b)->name);
+}
+
+
+/**
+   soap_table_sorted
+
+   Returns the methods by name in a NULL terminated array for the
+   caller to free.
+*/
+struct soap_stat **
+soap_table_sorted
+(
+ const struct soap_table *t
+)
+{
+  struct soap_stat **v;
+  size_t             i, n = 0;
+
+  if ((v = malloc ((t->count + 1) * sizeof (*v))) == NULL)
+    return NULL;
+  for (i = 0; i <= t->mask; i++)
+    if (t->slots[i].hash != 0)
+      v[n++] = &t->slots[i];
+  v[n] = NULL;
+  qsort (v, n, sizeof (*v), soap_stat_cmp);
+
+  return v;
+}
+
+
+/**
+   soap_percentile
+
+   The average time below which fraction p of the calls were served,
+   taking each call to have taken its interval's average.  Accurate to
+   the 1% width of a bucket; NAN if there were no calls.
+*/
+double
+soap_percentile
+(
+ const struct soap_stat *s,
+ double                  p
+)
+{
+  double total = 0, sum = 0;
+  size_t k;
+
+  for (k = 0; k < SOAP_LAT_BUCKETS; k++)
+    total += s->lat[k];
+  if (total <= 0)
+    return NAN;
+
+  for (k = 0; k < SOAP_LAT_BUCKETS - 1; k++)
+    if ((sum += s->lat[k]) >= p * total)
+      break;
+
+  return k == 0 ? SOAP_LAT_MIN : SOAP_LAT_MIN * pow (SOAP_LAT_RATIO, k + 0.5);
+}
@@ -0,0 +1,612 @@
+/**********************************************************************
+ * soapstat
+ *
+ * SOAP method response times for a month, from the zmstat soap.csv
+ * files.  Prints zmsoapstat's table of intervals, calls and average
+ * time for every call limit, with latency percentiles, for one method
+ * or for all of them.
+ *
+ * Every day file is read once, by a pool of threads taking the days
+ * in turn, and all the limits and methods come out of that one pass.
+ * Finished days are kept in a columnar cache (see soapcache.c) the
+ * first time they are read, so later reports over them only map and
+ * filter columns; -I builds the cache ahead, from cron say.
+ *
+ * With -f the day being written is followed instead, and the last 1,
+ * 5 and 60 minutes of every method are shown as they change (see
+ * soaplive.c).
+ ***********************************************************************/
+
+#include <string.h>
+
+#include <config.h>
+#include <errno.h>
+#include <glob.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "soapstat.h"
+
+#define SOAP_HOME   "/opt/zimbra"
+#define SOAP_METHOD "SearchRequest"
+#define SOAP_REFRESH (5)                /* Seconds between reports, with -f. */
+
+struct soap_worker {
+  pthread_t          thread;
+  struct soap_table  table;
+  int                err;
+};
+
+char *program_name;
+
+static char            **files;         /* Day files. */
+static size_t            nfiles;
+static size_t            next_file;     /* Next file for a worker. */
+static pthread_mutex_t   next_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char       *method;        /* One method, or NULL for all. */
+static double            step = SOAP_STEP;
+static time_t            from, to;      /* Intervals counted, to exclusive. */
+static int               cache = 1;     /* Use and make day caches. */
+static int               indexing;      /* Only make them. */
+
+
+/*
+----------------------------------------------------------------------
+
+
+                         Local Functions
+
+
+----------------------------------------------------------------------
+*/
+
+
+void
+usage
+(
+ void
+)
+{
+  fprintf(stderr,
+	  "Usage: %s [-r method | -a] [-m month] [-y year | -s start -e end]\n"
+	  "       [-d dir] [-i step] [-j threads] [-N]\n"
+	  "       %s -I [-m month] [-y year | -s start -e end] [-d dir] [-j threads]\n"
+	  "       %s -f [-r method | -a] [-d dir] [-i step] [-l limit] [-u seconds]\n"
+	  "       [-p] [-n reports]\n"
+	  "\n"
+	  "\tPrints SOAP method response times over a month from the\n"
+	  "\tzmstat soap.csv files, for intervals (minutes) with more\n"
+	  "\tthan 0, 100, 200, ... calls, up to the first limit no\n"
+	  "\tinterval is over, and the 50th, 95th and 99th percentile\n"
+	  "\tresponse times of all calls.\n"
+	  "\n"
+	  "\tColumns are the call limit, the intervals over it, their\n"
+	  "\taverage calls, and their average response time in ms.\n"
+	  "\n"
+	  "Options:\n"
+	  "  -r method    SOAP method (default %s)\n"
+	  "\n"
+	  "  -a           Every method\n"
+	  "\n"
+	  "  -m month     Month, Jan = 1 (default this month)\n"
+	  "\n"
+	  "  -y year      Four digit year (default this year)\n"
+	  "\n"
+	  "  -s start     Report from start instead, as YYYY-MM-DD or\n"
+	  "               YYYY-MM-DDTHH:MM[:SS] in zmstat's local time\n"
+	  "\n"
+	  "  -e end       Up to end, which is not included\n"
+	  "\n"
+	  "  -d dir       zmstat directory (default $HOME/zmstat, with\n"
+	  "               HOME defaulting to %s)\n"
+	  "\n"
+	  "  -i step      Call limit step (default %d)\n"
+	  "\n"
+	  "  -j threads   Threads reading days (default one per CPU)\n"
+	  "\n"
+	  "  -N           Neither use nor make the cache of finished days\n"
+	  "\n"
+	  "  -I           Only cache the finished days of the month, the\n"
+	  "               range, or, with neither given, of every day\n"
+	  "\n"
+	  "  -f           Follow today's soap.csv and show the last 1, 5\n"
+	  "               and 60 minutes of each method, with busy\n"
+	  "               intervals over the limit counted apart\n"
+	  "\n"
+	  "  -l limit     Calls over which an interval is busy, a multiple\n"
+	  "               of the step (default %d)\n"
+	  "\n"
+	  "  -u seconds   Seconds between reports (default %d)\n"
+	  "\n"
+	  "  -p           Report name=value lines instead of a table\n"
+	  "\n"
+	  "  -n reports   Stop after this many reports\n"
+	  "\n",
+	  program_name, program_name, program_name, SOAP_METHOD, SOAP_HOME, SOAP_STEP,
+	  SOAP_STEP, SOAP_REFRESH);
+}
+
+
+/* The name zmstat files the server under, as zmsoapstat finds it. */
+static void
+soap_hostname
+(
+ const char *home,
+ char       *buf,
+ size_t      size
+)
+{
+  char  cmd[4096];
+  FILE *p;
+
+  buf[0] = '\0';
+  snprintf (cmd, sizeof (cmd), "%s/bin/zmhostname", home);
+  if (access (cmd, X_OK) == 0 && (p = popen (cmd, "r")) != NULL) {
+    if (fgets (buf, size, p) == NULL)
+      buf[0] = '\0';
+    pclose (p);
+    buf[strcspn (buf, "\r\n")] = '\0';
+  }
+  if (buf[0] == '\0' && gethostname (buf, size) != 0)
+    snprintf (buf, size, "localhost");
+  buf[size - 1] = '\0';
+}
+
+
+/**
+   soap_when
+
+   Parses YYYY-MM-DD, optionally followed by a space or T and
+   HH:MM[:SS], as zmstat's timestamps are read.
+*/
+static int
+soap_when
+(
+ const char *s,
+ time_t     *t
+)
+{
+  int  y, mo, d, h = 0, mi = 0, sec = 0, n = 0;
+  char sep;
+
+  if (sscanf (s, "%4d-%2d-%2d%n", &y, &mo, &d, &n) != 3)
+    return -1;
+  s += n;
+  if (*s != '\0') {
+    n = 0;
+    if (sscanf (s, "%c%2d:%2d%n", &sep, &h, &mi, &n) != 3 || (sep != ' ' && sep != 'T'))
+      return -1;
+    s += n;
+    if (*s == ':' && (n = 0, sscanf (s, ":%2d%n", &sec, &n)) == 1)
+      s += n;
+  }
+  if (*s != '\0' || mo < 1 || mo > 12 || d < 1 || d > 31 || h > 23 || mi > 59 || sec > 60)
+    return -1;
+  *t = soap_civil (y, mo, d) + h * 3600 + mi * 60 + sec;
+
+  return 0;
+}
+
+
+/**
+   soap_days
+
+   Collects the soap.csv files of the days from first up to but not
+   including last: the gzipped files of past days, and the plain file
+   of a day not yet rotated.
+*/
+static int
+soap_days
+(
+ const char *dir,
+ time_t      first,
+ time_t      last
+)
+{
+  char        pattern[4096];
+  const char *base;
+  glob_t      g;
+  struct stat sb;
+  time_t      day;
+  size_t      i, len;
+  int         rc, y, mo, d;
+
+  if (snprintf (pattern, sizeof (pattern), "%s/[0-9][0-9][0-9][0-9]-[0-9][0-9]-[0-9][0-9]", dir)
+      >= (int)sizeof (pattern)) {
+    fprintf (stderr, "%s: %s: %s\n", program_name, dir, strerror (ENAMETOOLONG));
+    return -1;
+  }
+  if ((rc = glob (pattern, 0, NULL, &g)) == GLOB_NOMATCH)
+    return 0;
+  if (rc != 0 || (files = calloc (g.gl_pathc, sizeof (*files))) == NULL) {
+    fprintf (stderr, "%s: cannot list %s\n", program_name, pattern);
+    return -1;
+  }
+
+  for (i = 0; i < g.gl_pathc; i++) {
+    base = strrchr (g.gl_pathv[i], '/') + 1;
+    if (sscanf (base, "%4d-%2d-%2d", &y, &mo, &d) != 3)
+      continue;
+    day = soap_civil (y, mo, d);
+    if (day < first || day >= last)
+      continue;
+
+    len = strlen (g.gl_pathv[i]) + sizeof ("/soap.csv.gz");
+    if ((files[nfiles] = malloc (len)) == NULL) {
+      fprintf (stderr, "%s: out of memory\n", program_name);
+      return -1;
+    }
+    snprintf (files[nfiles], len, "%s/soap.csv.gz", g.gl_pathv[i]);
+    if (stat (files[nfiles], &sb) != 0) {
+      files[nfiles][len - 4] = '\0';
+      if (indexing || stat (files[nfiles], &sb) != 0) {
+        free (files[nfiles]);
+        continue;
+      }
+    }
+    nfiles++;
+  }
+  globfree (&g);
+
+  return 0;
+}
+
+
+static int
+soap_count
+(
+ const struct soap_row *row,
+ void                  *arg
+)
+{
+  struct soap_worker *w = arg;
+
+  if (method != NULL
+      && (strncmp (row->method, method, row->methodlen) != 0
+          || method[row->methodlen] != '\0'))
+    return 0;
+  if (row->time < from || row->time >= to)
+    return 0;
+  if (soap_table_add (&w->table, row) != 0) {
+    w->err = ENOMEM;
+    return 1;
+  }
+
+  return 0;
+}
+
+
+/**
+   soap_day
+
+   Counts the intervals of one day file.  A gzipped file is a finished
+   day, read from its cache, which is made first if it is missing or
+   out of date.  Failing to write a cache only matters with -I.
+*/
+static int
+soap_day
+(
+ struct soap_worker *w,
+ const char         *path
+)
+{
+  struct soap_cols  c;
+  char              col[PATH_MAX];
+  size_t            len = strlen (path);
+
+  if (!cache || len < 3 || strcmp (path + len - 3, ".gz") != 0)
+    return indexing ? 0 : soap_read (path, soap_count, w);
+
+  snprintf (col, sizeof (col), "%.*s.col", (int)(len - 3), path);
+  if (soap_cols_open (&c, path, col) != 0) {
+    if (soap_cols_build (&c, path) != 0)
+      return -1;
+    if (soap_cols_save (&c, path, col) != 0 && indexing) {
+      fprintf (stderr, "%s: %s: %s\n", program_name, col, strerror (errno));
+      w->err = errno;
+    }
+  }
+
+  if (!indexing && soap_cols_query (&c, &w->table, method, from, to) != 0) {
+    soap_cols_free (&c);
+    errno = ENOMEM;
+    return -1;
+  }
+  soap_cols_free (&c);
+
+  return 0;
+}
+
+
+static void *
+soap_work
+(
+ void *arg
+)
+{
+  struct soap_worker *w = arg;
+  size_t              i;
+
+  for (;;) {
+    pthread_mutex_lock (&next_lock);
+    i = next_file++;
+    pthread_mutex_unlock (&next_lock);
+    if (i >= nfiles)
+      break;
+    if (soap_day (w, files[i]) != 0) {
+      w->err = errno;
+      fprintf (stderr, "%s: %s: %s\n", program_name, files[i], strerror (errno));
+    }
+  }
+
+  return NULL;
+}
+
+
+/**
+   soap_report
+
+   Prints the zmsoapstat table for a method: a row for each limit
+   from 0 up in steps until one has no intervals over it, then the
+   percentiles.  The rows are suffix sums of the count bins.
+*/
+static void
+soap_report
+(
+ struct soap_stat *s,
+ const char       *host,
+ const char       *period
+)
+{
+  static const double pct[] = { 0.50, 0.95, 0.99 };
+  uint64_t            n = 0;
+  double              calls = 0, ms = 0;
+  size_t              k, i;
+
+  printf ("%s\t%s\t%s\n", s != NULL ? s->name : method, host, period);
+  printf ("%4.4s %6.6s %9.9s %9.9s\n", "Lim", "Int", "AvgCnt", "AvgMs");
+  if (s == NULL || s->nbins == 0)
+    return;
+
+  for (k = s->nbins; k-- > 0; ) {
+    n += s->n[k];
+    calls += s->calls[k];
+    ms += s->ms[k];
+    s->n[k] = n;
+    s->calls[k] = calls;
+    s->ms[k] = ms;
+  }
+  for (k = 0; k < s->nbins && s->n[k] > 0; k++)
+    printf ("%4.0f %6llu %9.3f %9.3f\n", k * step, (unsigned long long)s->n[k],
+            s->calls[k] / s->n[k], s->ms[k] / s->n[k]);
+
+  for (i = 0; i < sizeof (pct) / sizeof (pct[0]); i++)
+    printf ("%3.0f%% %6s %9s %9.3f\n", pct[i] * 100, "", "", soap_percentile (s, pct[i]));
+}
+
+
+/*
+----------------------------------------------------------------------
+
+
+                         Main
+
+
+----------------------------------------------------------------------
+*/
+
+
+int
+main
+(
+ int argc,
+ char *argv[]
+)
+{
+  struct soap_worker  *workers;
+  struct soap_table    table;
+  struct soap_stat   **sorted;
+  struct tm           *tm;
+  time_t               now = time (NULL), first, last;
+  char                 host[256], dirbuf[4096], path[4096 + 16], period[64];
+  char                *s, *home, *dir = NULL, *start = NULL, *end = NULL;
+  double               limit = SOAP_STEP;
+  long                 reports = 0;
+  int                  month, year, all = 0, nthreads, err = 0, dated = 0;
+  int                  follow = 0, refresh = SOAP_REFRESH, stream = 0;
+  int                  i;
+
+  program_name = argv[0];
+  tm = localtime (&now);
+  month = tm->tm_mon + 1;
+  year = tm->tm_year + 1900;
+  method = SOAP_METHOD;
+  if ((nthreads = sysconf (_SC_NPROCESSORS_ONLN)) < 1)
+    nthreads = 1;
+
+  while (--argc > 0 && (*++argv)[0] == '-') {
+    for (s = argv[0]+1; *s != '\0'; s++)
+      switch (*s) {
+      case 'r':                 /* Method */
+        method = *++argv;
+        --argc;
+        break;
+      case 'a':                 /* All methods */
+        all = 1;
+        break;
+      case 'm':                 /* Month */
+        month = atoi (*++argv);
+        --argc;
+        dated = 1;
+        break;
+      case 'y':                 /* Year */
+        year = atoi (*++argv);
+        --argc;
+        dated = 1;
+        break;
+      case 's':                 /* Start */
+        start = *++argv;
+        --argc;
+        break;
+      case 'e':                 /* End */
+        end = *++argv;
+        --argc;
+        break;
+      case 'd':                 /* zmstat directory */
+        dir = *++argv;
+        --argc;
+        break;
+      case 'i':                 /* Limit step */
+        step = atof (*++argv);
+        --argc;
+        break;
+      case 'j':                 /* Threads */
+        nthreads = atoi (*++argv);
+        --argc;
+        break;
+      case 'N':                 /* No cache */
+        cache = 0;
+        break;
+      case 'I':                 /* Cache only */
+        indexing = 1;
+        break;
+      case 'f':                 /* Follow */
+        follow = 1;
+        break;
+      case 'l':                 /* Busy limit */
+        limit = atof (*++argv);
+        --argc;
+        break;
+      case 'u':                 /* Refresh */
+        refresh = atoi (*++argv);
+        --argc;
+        break;
+      case 'p':                 /* Stream */
+        stream = 1;
+        break;
+      case 'n':                 /* Reports */
+        reports = atol (*++argv);
+        --argc;
+        break;
+      case 'h':                 /* Help */
+        usage ();
+        exit (EXIT_SUCCESS);
+      default:
+        fprintf (stderr, "%s: illegal option %c\n", program_name, *s);
+        usage ();
+        exit (EXIT_FAILURE);
+      }
+  }
+
+  if (argc != 0 || month < 1 || month > 12 || year < 1 || !(step >= 1)
+      || nthreads < 1 || (start == NULL) != (end == NULL)
+      || (start != NULL && dated) || (indexing && !cache)
+      || (follow && (indexing || dated || start != NULL || refresh < 1 || reports < 0
+                     || !(limit >= 0) || fmod (limit, step) != 0))) {
+    usage ();
+    exit (EXIT_FAILURE);
+  }
+  if (all)
+    method = NULL;
+
+  /* A month is its day directories, as zmsoapstat takes it; a range
+     is its intervals, from the days either side too. */
+  if (start != NULL) {
+    if (soap_when (start, &from) != 0 || soap_when (end, &to) != 0 || to <= from) {
+      fprintf (stderr, "%s: bad range %s to %s\n", program_name, start, end);
+      exit (EXIT_FAILURE);
+    }
+    first = from - from % 86400 - 86400;
+    last = to + 86400;
+    snprintf (period, sizeof (period), "%s %s", start, end);
+  } else {
+    first = soap_civil (year, month, 1);
+    last = month == 12 ? soap_civil (year + 1, 1, 1) : soap_civil (year, month + 1, 1);
+    if (indexing && !dated) {
+      first = soap_civil (1, 1, 1);
+      last = soap_civil (10000, 1, 1);
+    }
+    from = soap_civil (1, 1, 1);
+    to = soap_civil (10000, 1, 1);
+    snprintf (period, sizeof (period), "%02d/%04d", month, year);
+  }
+
+  if ((home = getenv ("HOME")) == NULL || *home == '\0')
+    home = SOAP_HOME;
+  if (dir == NULL) {
+    snprintf (dirbuf, sizeof (dirbuf), "%s/zmstat", home);
+    dir = dirbuf;
+  }
+  if (!indexing)
+    soap_hostname (home, host, sizeof (host));
+
+  if (follow) {
+    snprintf (path, sizeof (path), "%s/soap.csv", dir);
+    if (soap_follow (path, method, host, step, limit, refresh, stream, reports) != 0) {
+      fprintf (stderr, "%s: %s: %s\n", program_name, path, strerror (errno));
+      exit (EXIT_FAILURE);
+    }
+    exit (EXIT_SUCCESS);
+  }
+
+  if (soap_days (dir, first, last) != 0)
+    exit (EXIT_FAILURE);
+  if ((size_t)nthreads > nfiles)
+    nthreads = nfiles > 0 ? nfiles : 1;
+
+  if ((workers = calloc (nthreads, sizeof (*workers))) == NULL
+      || soap_table_init (&table, step) != 0) {
+    fprintf (stderr, "%s: out of memory\n", program_name);
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < nthreads; i++) {
+    if (soap_table_init (&workers[i].table, step) != 0
+        || pthread_create (&workers[i].thread, NULL, soap_work, &workers[i]) != 0) {
+      perror (program_name);
+      exit (EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < nthreads; i++) {
+    pthread_join (workers[i].thread, NULL);
+    if (workers[i].err)
+      err = 1;
+    else if (soap_table_merge (&table, &workers[i].table) != 0) {
+      fprintf (stderr, "%s: out of memory\n", program_name);
+      exit (EXIT_FAILURE);
+    }
+    soap_table_free (&workers[i].table);
+  }
+  if (err)
+    exit (EXIT_FAILURE);
+
+  if (indexing)
+    ;                           /* Nothing to report. */
+  else if (method != NULL)
+    soap_report (soap_table_get (&table, method, strlen (method)), host, period);
+  else {
+    if ((sorted = soap_table_sorted (&table)) == NULL) {
+      fprintf (stderr, "%s: out of memory\n", program_name);
+      exit (EXIT_FAILURE);
+    }
+    for (i = 0; sorted[i] != NULL; i++) {
+      if (i > 0)
+        putchar ('\n');
+      soap_report (sorted[i], host, period);
+    }
+    free (sorted);
+  }
+
+  soap_table_free (&table);
+  free (workers);
+  for (i = 0; (size_t)i < nfiles; i++)
+    free (files[i]);
+  free (files);
+
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,119 @@
+/**********************************************************************
+ * soapstat
+ *
+ * SOAP method statistics from the zmstat soap.csv files, which hold
+ * one line per method per minute:
+ *
+ *   timestamp,command,exec_count,exec_ms_avg
+ ***********************************************************************/
+
+#ifndef SOAPSTAT_H
+#define SOAPSTAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define SOAP_STEP        (100)          /* Call limit step of the table. */
+#define SOAP_LAT_BUCKETS (2048)         /* Latency histogram, 1% wide. */
+
+extern char *program_name;
+
+
+/*
+  A parsed soap.csv line.  The method points into the input and is
+  only valid during the callback.
+*/
+
+struct soap_row {
+  time_t      time;                     /* As UTC; zmstat writes local time. */
+  const char *method;
+  size_t      methodlen;
+  double      count;
+  double      ms;
+};
+
+typedef int (*soap_row_fn) (const struct soap_row *, void *);
+
+time_t           soap_civil (int, int, int);
+int              soap_parse_line (const char *, size_t, struct soap_row *);
+int              soap_read (const char *, soap_row_fn, void *);
+
+
+/*
+  Per method aggregates.  Intervals are binned by call count, one bin
+  per step, so the table for every limit comes from suffix sums; calls
+  are binned by latency for percentiles.
+*/
+
+struct soap_stat {
+  uint64_t  hash;                       /* 0 for an empty slot. */
+  char     *name;
+  size_t    nbins;
+  uint64_t *n;                          /* Intervals in count bin k. */
+  double   *calls;                      /* Their calls. */
+  double   *ms;                         /* Their average times. */
+  double   *lat;                        /* Calls per latency bucket. */
+};
+
+struct soap_table {
+  struct soap_stat *slots;
+  size_t            mask;
+  size_t            count;
+  double            step;
+};
+
+int               soap_table_init (struct soap_table *, double);
+void              soap_table_free (struct soap_table *);
+int               soap_table_reserve (struct soap_table *, size_t);
+struct soap_stat *soap_table_get (struct soap_table *, const char *, size_t);
+unsigned          soap_lat_bucket (double);
+int               soap_stat_add (struct soap_stat *, double, double, double, unsigned);
+void              soap_stat_remove (struct soap_stat *, double, double, double, unsigned);
+void              soap_stat_over (const struct soap_stat *, size_t, uint64_t *, double *,
+                                  double *);
+void              soap_stat_free (struct soap_stat *);
+int               soap_table_add (struct soap_table *, const struct soap_row *);
+int               soap_table_merge (struct soap_table *, const struct soap_table *);
+struct soap_stat **soap_table_sorted (const struct soap_table *);
+double            soap_percentile (const struct soap_stat *, double);
+
+
+
+/*
+  A day of rows by column, as read from a day file and cached next to
+  it.  Times are seconds from the first; methods are numbered in a
+  dictionary of the day.  The columns are either owned or mapped from
+  a cache file.
+*/
+
+struct soap_cols {
+  size_t     rows;
+  size_t     nmethods;
+  time_t     base;
+  int        sorted;                    /* Times never go back. */
+  double    *count;
+  double    *ms;
+  uint32_t  *dt;
+  uint16_t  *method;
+  uint16_t  *lat;                       /* Latency bucket of ms. */
+  char     **names;
+  void      *map;                       /* Cache file, or NULL if owned. */
+  size_t     maplen;
+  size_t     max;                       /* Rows allocated, while owned. */
+  time_t    *time;                      /* Times, while building. */
+  uint32_t  *dict;                      /* Method number + 1 by hash, building. */
+  size_t     dictmask;
+};
+
+int               soap_cols_build (struct soap_cols *, const char *);
+int               soap_cols_save (const struct soap_cols *, const char *, const char *);
+int               soap_cols_open (struct soap_cols *, const char *, const char *);
+int               soap_cols_query (const struct soap_cols *, struct soap_table *, const char *,
+                                   time_t, time_t);
+void              soap_cols_free (struct soap_cols *);
+
+int               soap_follow (const char *, const char *, const char *, double, double, int,
+                               int, long);
+
+#endif /* SOAPSTAT_H */
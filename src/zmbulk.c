@@ -0,0 +1,791 @@
+/**********************************************************************
+ * zmbulk (C) M. Brent Harp 2010-2012
+ *
+ * Bulk changes to Zimbra accounts straight through the directory.
+ *
+ * The accounts named are read in a few paged searches, every COS in
+ * one more, the changes are worked out in memory and then sent as
+ * pipelined modifies on the one connection.  This does the work of
+ * quota++, zmzimletmerge and zmgdlm without a zmprov per account.
+ ***********************************************************************/
+
+#include <string.h>
+
+#include <config.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dlsync.h"
+
+#define ZB_DEFAULT_COS  "default"       /* For accounts with no zimbraCOSId. */
+#define ZB_QUOTA_STEP   (1073741824LL)  /* quota++ adds a gigabyte. */
+#define ZB_WINDOW       (64)            /* Modifies in flight by default. */
+
+#define ZB_QUOTA   "zimbraMailQuota"
+#define ZB_ZIMLETS "zimbraZimletAvailableZimlets"
+#define ZB_MEMBERS "zimbraMailForwardingAddress"
+
+char *program_name;
+
+/* A list of attribute values. */
+struct zb_values {
+  char **v;
+  int    count;
+  int    max;
+};
+
+/* What a COS gives its accounts, kept as its dl_cos data. */
+struct zb_cos {
+  long long         quota;              /* -1 if not set. */
+  struct zb_values  zimlets;
+};
+
+/* An account named on the command line or standard input. */
+struct zb_account {
+  char             *name;               /* As given: uid or address. */
+  char             *dn;                 /* NULL until found. */
+  char             *cos_id;
+  long long         quota;              /* -1 if not set. */
+  struct zb_values  zimlets;
+};
+
+struct zb_run {
+  struct zb_account *accounts;          /* Sorted by name. */
+  long               count;
+  long               max;
+  dl_cos_list       *cos;
+  long long          step;              /* Quota increment. */
+  int                dry_run;           /* Print LDIF instead. */
+  int                window;
+  long               changed;
+};
+
+
+
+/*
+----------------------------------------------------------------------
+
+
+                         Local Functions
+
+
+----------------------------------------------------------------------
+*/
+
+
+void
+usage
+(
+ void
+)
+{
+  fprintf(stderr,
+	  "Usage: %s [options] quota [name...]\n"
+	  "       %s [options] zimlets [name...]\n"
+	  "       %s [options] members list...\n"
+	  "\n"
+	  "\tquota adds to the mail quota of each account, as quota++.\n"
+	  "\tzimlets merges each account's available zimlets with its\n"
+	  "\tCOS's, as zmzimletmerge.  members prints the members of\n"
+	  "\tdistribution lists, as zmgdlm.  Accounts are named by uid or\n"
+	  "\taddress, on the command line or one per line on standard input.\n"
+	  "\n"
+	  "Options:\n"
+	  "  -q bytes     Quota increment (default %lld)\n"
+	  "\n"
+	  "  -n           Print the changes as LDIF instead of making them\n"
+	  "\n"
+	  "  -w window    Modifies in flight at once (default %d)\n"
+	  "\n"
+	  "  -t seconds   Timeout for each LDAP operation\n"
+	  "\n"
+	  "  -d           Debug mode\n"
+	  "\n"
+	  "  -h           Display this help message\n"
+	  "\n"
+	  ,program_name, program_name, program_name, ZB_QUOTA_STEP, ZB_WINDOW);
+}
+
+
+void
+zb_nomem
+(
+ void
+)
+{
+  fprintf (stderr, "%s: out of memory\n", program_name);
+  exit (EXIT_FAILURE);
+}
+
+
+void
+zb_values_add
+(
+ struct zb_values *l,
+ const char       *value
+)
+{
+  char **v;
+
+  if (l->count == l->max) {
+    l->max = l->max ? 2 * l->max : 8;
+    if ((v = realloc (l->v, l->max * sizeof (*v))) == NULL)
+      zb_nomem ();
+    l->v = v;
+  }
+  if ((l->v[l->count++] = strdup (value)) == NULL)
+    zb_nomem ();
+}
+
+
+void
+zb_values_free
+(
+ struct zb_values *l
+)
+{
+  while (l->count > 0)
+    free (l->v[--l->count]);
+  free (l->v);
+  l->v = NULL;
+  l->max = 0;
+}
+
+
+/* Reads every value of attr into l. */
+void
+zb_values_get
+(
+ LDAP             *ld,
+ LDAPMessage      *entry,
+ const char       *attr,
+ struct zb_values *l
+)
+{
+  struct berval **vals;
+  char            buf[1024];
+  size_t          len;
+  int             i;
+
+  if ((vals = ldap_get_values_len (ld, entry, attr)) == NULL)
+    return;
+  for (i = 0; vals[i] != NULL; i++) {
+    len = vals[i]->bv_len < sizeof (buf) - 1 ? vals[i]->bv_len : sizeof (buf) - 1;
+    memcpy (buf, vals[i]->bv_val, len);
+    buf[len] = '\0';
+    zb_values_add (l, buf);
+  }
+  ldap_value_free_len (vals);
+}
+
+
+/* First value of attr as a number, or -1 if it has none. */
+long long
+zb_number
+(
+ LDAP        *ld,
+ LDAPMessage *entry,
+ const char  *attr
+)
+{
+  struct zb_values l;
+  long long        n;
+
+  memset (&l, 0, sizeof (l));
+  zb_values_get (ld, entry, attr, &l);
+  n = l.count > 0 ? strtoll (l.v[0], NULL, 10) : -1;
+  zb_values_free (&l);
+
+  return n;
+}
+
+
+int
+zb_account_cmp
+(
+ const void *a,
+ const void *b
+)
+{
+  return strcasecmp (((const struct zb_account *)a)->name,
+                     ((const struct zb_account *)b)->name);
+}
+
+
+/* Adds a name to work on. */
+void
+zb_add_name
+(
+ struct zb_run *run,
+ const char    *name
+)
+{
+  struct zb_account *a;
+
+  if (run->count == run->max) {
+    run->max = run->max ? 2 * run->max : 1024;
+    if ((a = realloc (run->accounts, run->max * sizeof (*a))) == NULL)
+      zb_nomem ();
+    run->accounts = a;
+  }
+  a = &run->accounts[run->count];
+  memset (a, 0, sizeof (*a));
+  if ((a->name = strdup (name)) == NULL)
+    zb_nomem ();
+  a->quota = -1;
+  run->count++;
+}
+
+
+/* Reads the names to work on from args, or standard input if none. */
+void
+zb_read_names
+(
+ struct zb_run *run,
+ int            argc,
+ char          *argv[]
+)
+{
+  char   *line = NULL, *s;
+  size_t  max = 0;
+  long    i, n;
+
+  if (argc > 0) {
+    for (; argc > 0; argc--, argv++)
+      zb_add_name (run, *argv);
+  } else {
+    while (getline (&line, &max, stdin) > 0) {
+      for (s = line; *s == ' ' || *s == '\t'; s++)
+        ;
+      s[strcspn (s, " \t\r\n")] = '\0';
+      if (*s != '\0')
+        zb_add_name (run, s);
+    }
+    free (line);
+  }
+
+  qsort (run->accounts, run->count, sizeof (*run->accounts), zb_account_cmp);
+  for (i = n = 0; i < run->count; i++) {
+    if (n > 0 && strcasecmp (run->accounts[n - 1].name, run->accounts[i].name) == 0)
+      free (run->accounts[i].name);
+    else
+      run->accounts[n++] = run->accounts[i];
+  }
+  run->count = n;
+}
+
+
+struct zb_account *
+zb_find
+(
+ struct zb_run *run,
+ const char    *name
+)
+{
+  struct zb_account key;
+
+  key.name = (char *)name;
+  return bsearch (&key, run->accounts, run->count, sizeof (key), zb_account_cmp);
+}
+
+
+/* Files an account entry under each name it was given by. */
+int
+zb_account_found
+(
+ dl_context  *ctx,
+ LDAPMessage *entry,
+ void        *arg
+)
+{
+  struct zb_run     *run = arg;
+  struct zb_account *a;
+  struct zb_values   names, cos;
+  char              *dn;
+  int                i;
+
+  memset (&names, 0, sizeof (names));
+  memset (&cos, 0, sizeof (cos));
+  zb_values_get (ctx->ldap, entry, "uid", &names);
+  zb_values_get (ctx->ldap, entry, "mail", &names);
+  zb_values_get (ctx->ldap, entry, "zimbraCOSId", &cos);
+
+  for (i = 0; i < names.count; i++) {
+    if ((a = zb_find (run, names.v[i])) == NULL || a->dn != NULL)
+      continue;
+    if ((dn = ldap_get_dn (ctx->ldap, entry)) == NULL)
+      continue;
+    if ((a->dn = strdup (dn)) == NULL
+        || (cos.count > 0 && (a->cos_id = strdup (cos.v[0])) == NULL))
+      zb_nomem ();
+    ldap_memfree (dn);
+    a->quota = zb_number (ctx->ldap, entry, ZB_QUOTA);
+    zb_values_get (ctx->ldap, entry, ZB_ZIMLETS, &a->zimlets);
+  }
+
+  zb_values_free (&names);
+  zb_values_free (&cos);
+
+  return 0;
+}
+
+
+/**
+   zb_read_accounts
+
+   Reads the accounts named with dl_search_accounts.  Returns the
+   number not found, or -1 if a search failed.
+*/
+long
+zb_read_accounts
+(
+ dl_context    *ctx,
+ struct zb_run *run
+)
+{
+  static char  *attrs[] = { "uid", "mail", "zimbraCOSId", ZB_QUOTA, ZB_ZIMLETS, NULL };
+  char        **names;
+  long          i, missing = 0;
+  int           status;
+
+  if ((names = malloc ((run->count + 1) * sizeof (*names))) == NULL)
+    zb_nomem ();
+  for (i = 0; i < run->count; i++)
+    names[i] = run->accounts[i].name;
+  status = dl_search_accounts (ctx, names, run->count, attrs, zb_account_found, run);
+  free (names);
+  if (status != DL_SUCCESS)
+    return -1;
+
+  for (i = 0; i < run->count; i++)
+    if (run->accounts[i].dn == NULL) {
+      fprintf (stderr, "%s: %s: no such account\n", program_name, run->accounts[i].name);
+      missing++;
+    }
+
+  return missing;
+}
+
+
+/* dl_cos_read callback: what a COS gives its accounts. */
+void *
+zb_cos_found
+(
+ dl_context  *ctx,
+ LDAPMessage *entry,
+ void        *arg
+)
+{
+  struct zb_cos *c;
+
+  (void) arg;
+  if ((c = calloc (1, sizeof (*c))) == NULL)
+    zb_nomem ();
+  c->quota = zb_number (ctx->ldap, entry, ZB_QUOTA);
+  zb_values_get (ctx->ldap, entry, ZB_ZIMLETS, &c->zimlets);
+
+  return c;
+}
+
+
+void
+zb_cos_free
+(
+ void *data
+)
+{
+  struct zb_cos *c = data;
+
+  zb_values_free (&c->zimlets);
+  free (c);
+}
+
+
+/* The COS an account gets its defaults from, or NULL. */
+struct zb_cos *
+zb_account_cos
+(
+ struct zb_run     *run,
+ struct zb_account *a
+)
+{
+  const struct dl_cos *c;
+
+  c = dl_cos_find (run->cos, a->cos_id, a->cos_id != NULL ? NULL : ZB_DEFAULT_COS);
+
+  return c != NULL ? c->data : NULL;
+}
+
+
+/* Reports a modify the server refused. */
+void
+zb_modify_failed
+(
+ dl_context *ctx,
+ const char *dn,
+ int         rc,
+ void       *arg
+)
+{
+  (void) ctx;
+  (void) arg;
+  fprintf (stderr, "%s: %s: %s\n", program_name, dn, ldap_err2string (rc));
+}
+
+
+/**
+   zb_replace
+
+   Replaces attr of an account with values, through the batch, or
+   printed as LDIF for a dry run.  Returns as dl_batch_modify.
+*/
+int
+zb_replace
+(
+ struct zb_run *run,
+ dl_batch      *b,
+ const char    *dn,
+ const char    *attr,
+ char         **values,
+ int            count
+)
+{
+  LDAPMod  mod, *mods[2];
+  char   **vals;
+  int      i, status;
+
+  run->changed++;
+  if (run->dry_run) {
+    printf ("dn: %s\nchangetype: modify\nreplace: %s\n", dn, attr);
+    for (i = 0; i < count; i++)
+      printf ("%s: %s\n", attr, values[i]);
+    printf ("-\n\n");
+    return DL_SUCCESS;
+  }
+
+  if ((vals = malloc ((count + 1) * sizeof (*vals))) == NULL)
+    zb_nomem ();
+  memcpy (vals, values, count * sizeof (*vals));
+  vals[count] = NULL;
+
+  mod.mod_op = LDAP_MOD_REPLACE;
+  mod.mod_type = (char *)attr;
+  mod.mod_values = count > 0 ? vals : NULL;
+  mods[0] = &mod;
+  mods[1] = NULL;
+  status = dl_batch_modify (b, dn, mods);
+  free (vals);
+
+  return status;
+}
+
+
+/* Adds run->step to each account's quota, or its COS's if it has none. */
+int
+zb_quota
+(
+ struct zb_run *run,
+ dl_batch      *b
+)
+{
+  struct zb_account *a;
+  struct zb_cos     *c;
+  long long          quota;
+  char               buf[32], *value = buf;
+  long               i;
+
+  for (i = 0; i < run->count; i++) {
+    a = &run->accounts[i];
+    if (a->dn == NULL)
+      continue;
+    quota = a->quota;
+    if (quota < 0 && (c = zb_account_cos (run, a)) != NULL)
+      quota = c->quota;
+    if (quota < 0)
+      quota = 0;
+    snprintf (buf, sizeof (buf), "%lld", quota + run->step);
+    if (zb_replace (run, b, a->dn, ZB_QUOTA, &value, 1) != DL_SUCCESS)
+      return DL_FAILURE;
+  }
+
+  return DL_SUCCESS;
+}
+
+
+/**
+   zb_zimlets
+
+   Sets each account's available zimlets to its COS's merged with its
+   own.  A value is a zimlet name after a one character flag (+, -
+   or !); the account's flag for a zimlet wins.  Accounts that would
+   not change are left alone.
+*/
+int
+zb_zimlets
+(
+ struct zb_run *run,
+ dl_batch      *b
+)
+{
+  struct zb_account *a;
+  struct zb_cos     *c;
+  struct zb_values   merged;
+  long               i;
+  int                j, k, same;
+
+  memset (&merged, 0, sizeof (merged));
+
+  for (i = 0; i < run->count; i++) {
+    a = &run->accounts[i];
+    if (a->dn == NULL)
+      continue;
+
+    if ((c = zb_account_cos (run, a)) != NULL)
+      for (j = 0; j < c->zimlets.count; j++)
+        if (c->zimlets.v[j][0] != '\0')
+          zb_values_add (&merged, c->zimlets.v[j]);
+
+    for (j = 0; j < a->zimlets.count; j++) {
+      const char *v = a->zimlets.v[j];
+
+      if (v[0] == '\0')
+        continue;
+      for (k = 0; k < merged.count && strcmp (merged.v[k] + 1, v + 1) != 0; k++)
+        ;
+      if (k < merged.count)
+        merged.v[k][0] = v[0];
+      else
+        zb_values_add (&merged, v);
+    }
+
+    same = merged.count == a->zimlets.count;
+    for (j = 0; same && j < merged.count; j++)
+      same = strcmp (merged.v[j], a->zimlets.v[j]) == 0;
+
+    if (!same && zb_replace (run, b, a->dn, ZB_ZIMLETS, merged.v, merged.count) != DL_SUCCESS) {
+      zb_values_free (&merged);
+      return DL_FAILURE;
+    }
+    zb_values_free (&merged);
+  }
+
+  return DL_SUCCESS;
+}
+
+
+/* Prints the members of one list found, prefixed by its name if asked. */
+int
+zb_list_found
+(
+ dl_context  *ctx,
+ LDAPMessage *entry,
+ void        *arg
+)
+{
+  struct zb_values members, names;
+  const char      *prefix = arg;
+  int              i;
+
+  memset (&members, 0, sizeof (members));
+  memset (&names, 0, sizeof (names));
+  zb_values_get (ctx->ldap, entry, ZB_MEMBERS, &members);
+  if (prefix != NULL)
+    zb_values_get (ctx->ldap, entry, "mail", &names);
+
+  for (i = 0; i < members.count; i++)
+    if (prefix != NULL)
+      printf ("%s\t%s\n", names.count > 0 ? names.v[0] : "", members.v[i]);
+    else
+      puts (members.v[i]);
+
+  zb_values_free (&members);
+  zb_values_free (&names);
+
+  return 0;
+}
+
+
+/**
+   zb_members
+
+   Prints the members of the lists named, in one search.  With more
+   than one list each member is prefixed by its list's address.
+*/
+int
+zb_members
+(
+ dl_context    *ctx,
+ struct zb_run *run
+)
+{
+  static char *attrs[] = { "mail", ZB_MEMBERS, NULL };
+  char        *filter;
+  size_t       len;
+  long         i;
+  int          status;
+
+  if ((filter = malloc (run->count * 850 + 64)) == NULL)
+    zb_nomem ();
+  len = sprintf (filter, "(&(objectClass=zimbraDistributionList)(|");
+  for (i = 0; i < run->count; i++) {
+    if (strlen (run->accounts[i].name) > 128)
+      continue;
+    len += sprintf (filter + len, "(mail=");
+    len += dl_filter_escape (filter + len, run->accounts[i].name);
+    len += sprintf (filter + len, ")(zimbraMailAlias=");
+    len += dl_filter_escape (filter + len, run->accounts[i].name);
+    len += sprintf (filter + len, ")");
+  }
+  sprintf (filter + len, "))");
+
+  status = dl_search_paged (ctx, NULL, filter, attrs, zb_list_found,
+                            run->count > 1 ? "" : NULL);
+  free (filter);
+
+  return status;
+}
+
+
+
+/*
+----------------------------------------------------------------------
+
+
+                               Main
+
+
+----------------------------------------------------------------------
+*/
+
+
+int
+main
+(
+ int   argc,
+ char *argv[]
+)
+{
+  dl_context    *ctx;
+  struct zb_run  run;
+  dl_batch      *b = NULL;
+  const char    *command;
+  char          *s;
+  static char   *cos_attrs[] = { ZB_QUOTA, ZB_ZIMLETS, NULL };
+  long           missing, sent = 0, failed = 0;
+  int            status;
+
+  program_name = argv[0];
+
+  memset (&run, 0, sizeof (run));
+  run.step = ZB_QUOTA_STEP;
+  run.window = ZB_WINDOW;
+
+  if ((ctx = dl_context_new ()) == NULL)
+    zb_nomem ();
+  ctx->program_name = program_name;
+
+  while (--argc > 0 && (*++argv)[0] == '-') {
+    for (s = argv[0]+1; *s != '\0'; s++) {
+      if (strchr ("qwt", *s) != NULL && argc < 2) {
+        usage ();
+        exit (EXIT_FAILURE);
+      }
+      switch (*s) {
+      case 'q':                 /* Quota increment */
+        run.step = strtoll (*++argv, NULL, 10);
+        --argc;
+        break;
+      case 'n':                 /* Dry run */
+        run.dry_run = !run.dry_run;
+        break;
+      case 'w':                 /* Modify window */
+        run.window = atoi (*++argv);
+        --argc;
+        break;
+      case 't':                 /* Per-operation timeout */
+        ctx->op_timeout = atoi (*++argv);
+        --argc;
+        break;
+      case 'd':                 /* Toggle debug mode */
+        ctx->debug = !ctx->debug;
+        break;
+      case 'h':
+        usage ();
+        exit (EXIT_SUCCESS);
+      default:
+        fprintf (stderr, "%s: illegal option -%c\n", program_name, *s);
+        usage ();
+        exit (EXIT_FAILURE);
+      }
+    }
+  }
+
+  if (argc < 1) {
+    usage ();
+    exit (EXIT_FAILURE);
+  }
+  command = *argv++;
+  argc--;
+  if (strcmp (command, "quota") != 0 && strcmp (command, "zimlets") != 0
+      && strcmp (command, "members") != 0) {
+    fprintf (stderr, "%s: unknown command: %s\n", program_name, command);
+    usage ();
+    exit (EXIT_FAILURE);
+  }
+  if (strcmp (command, "members") == 0 && argc < 1) {
+    usage ();
+    exit (EXIT_FAILURE);
+  }
+
+  zb_read_names (&run, argc, argv);
+  if (run.count == 0)
+    exit (EXIT_SUCCESS);
+
+  if (dl_init (ctx) != DL_SUCCESS) {
+    dl_perror (ctx, "dl_init");
+    exit (EXIT_FAILURE);
+  }
+
+  if (strcmp (command, "members") == 0) {
+    if (zb_members (ctx, &run) != DL_SUCCESS) {
+      dl_perror (ctx, "search");
+      exit (EXIT_FAILURE);
+    }
+    dl_cleanup (ctx);
+    dl_context_free (ctx);
+    exit (EXIT_SUCCESS);
+  }
+
+  /* Every read is done before the first modify is sent. */
+  if ((missing = zb_read_accounts (ctx, &run)) < 0
+      || (run.cos = dl_cos_read (ctx, cos_attrs, zb_cos_found, NULL)) == NULL) {
+    dl_perror (ctx, "search");
+    exit (EXIT_FAILURE);
+  }
+
+  if (!run.dry_run
+      && (b = dl_batch_new (ctx, run.window, zb_modify_failed, NULL)) == NULL)
+    zb_nomem ();
+
+  if (strcmp (command, "quota") == 0)
+    status = zb_quota (&run, b);
+  else
+    status = zb_zimlets (&run, b);
+
+  if (b != NULL && dl_batch_free (b, &sent, &failed) != DL_SUCCESS)
+    status = DL_FAILURE;
+  if (status != DL_SUCCESS)
+    dl_perror (ctx, "modify");
+
+  if (ctx->debug)
+    fprintf (stderr, "%ld accounts, %ld not found, %ld changed, %ld failed\n",
+             run.count, missing, run.changed, failed);
+
+  dl_cos_free (run.cos, zb_cos_free);
+  dl_cleanup (ctx);
+  dl_context_free (ctx);
+
+  exit (status == DL_SUCCESS && missing == 0 && failed == 0
+        ? EXIT_SUCCESS : EXIT_FAILURE);
+}
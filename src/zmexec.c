@@ -0,0 +1,635 @@
+/**********************************************************************
+ * zmexec (C) M. Brent Harp 2010-2012
+ *
+ * Run zmprov or zmmailbox commands on a pool of warm sessions.
+ *
+ * Commands are read one per line, as zmprov and zmmailbox read them,
+ * and spread over a few long running sessions, so a file of thousands
+ * costs a few JVM starts instead of one per command.  A zmprov
+ * command names an account or list, and for some commands (adlm,
+ * ra, aaa and the like) others after it; commands that share a name
+ * run in the order given, whichever sessions they go to, so a list
+ * member is created before it is added.  For zmmailbox, a
+ * selectMailbox and the commands after it are kept together, and are
+ * not run if the mailbox cannot be selected.  Each command's output
+ * is checked for an error, so every command gets its own result.
+ ***********************************************************************/
+
+#include <string.h>
+
+#include <config.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dlsync.h"
+
+#define EX_ZMPROV    "${ZMPROV:-/opt/zimbra/bin/zmprov} 2>&1"
+#define EX_ZMMAILBOX "${ZMMAILBOX:-/opt/zimbra/bin/zmmailbox} -z 2>&1"
+#define EX_SESSIONS  (4)                /* Sessions by default. */
+#define EX_DEPTH     (8)                /* Commands sent ahead by default. */
+#define EX_WORD_MAX  (512)
+#define EX_KEYS      (4096)             /* Hash buckets for names in use. */
+#define EX_WAIT      (-2)               /* ex_place: a name is held elsewhere. */
+
+char *program_name;
+
+/* Commands naming others after the first, and whether they only read them. */
+static const struct {
+  const char *name;
+  const char *abbrev;
+  int         shared;
+} ex_refs[] = {
+  { "addDistributionListMember",    "adlm", 1 },
+  { "removeDistributionListMember", "rdlm", 1 },
+  { "renameAccount",                "ra",   0 },
+  { "renameDistributionList",       "rdl",  0 },
+  { "addAccountAlias",              "aaa",  0 },
+  { "removeAccountAlias",           "raa",  0 },
+  { "addDistributionListAlias",     "adla", 0 },
+  { "removeDistributionListAlias",  "rdla", 0 },
+  { NULL,                           NULL,   0 }
+};
+
+/* A name a command uses; shared uses may run at once. */
+struct ex_use {
+  char *name;
+  int   shared;
+};
+
+/* A name in use by commands not yet finished, and on which sessions. */
+struct ex_key {
+  struct ex_key *next;
+  char          *name;
+  int            total;
+  int            excl;                  /* Not shared; all on one session. */
+  int           *use;                   /* Per session. */
+};
+
+/* A command submitted, and where it came from. */
+struct ex_command {
+  const char    *file;
+  long           line;
+  char          *text;
+  int            session;
+  int            nuses;
+  struct ex_use *uses;
+};
+
+struct ex_run {
+  int             mailbox;              /* zmmailbox, not zmprov. */
+  int             results;              /* One result line per command. */
+  int             debug;
+  int             sessions;
+  long            ok;
+  long            failed;
+  long            skipped;
+  struct ex_key **keys;                 /* EX_KEYS buckets. */
+};
+
+
+
+/*
+----------------------------------------------------------------------
+
+
+                         Local Functions
+
+
+----------------------------------------------------------------------
+*/
+
+
+void
+usage
+(
+ void
+)
+{
+  fprintf(stderr,
+	  "Usage: %s [options] prov|mailbox [file...]\n"
+	  "\n"
+	  "\tRuns zmprov or zmmailbox -z commands, one per line, from the\n"
+	  "\tfiles or standard input, on a pool of sessions.  Commands that\n"
+	  "\tname the same account or list run in the order given (adlm\n"
+	  "\tafter the ca of its member); for mailbox, commands follow the\n"
+	  "\tselectMailbox before them.\n"
+	  "\n"
+	  "Options:\n"
+	  "  -j sessions  Sessions to run (default %d)\n"
+	  "\n"
+	  "  -p depth     Commands sent to a session ahead of its answers\n"
+	  "               (default %d)\n"
+	  "\n"
+	  "  -r           Print a result line per command instead of its\n"
+	  "               output: where, ok|failed|skipped, command\n"
+	  "\n"
+	  "  -d           Debug mode\n"
+	  "\n"
+	  "  -h           Display this help message\n"
+	  "\n"
+	  "\tZMPROV and ZMMAILBOX override the commands run.\n"
+	  "\n"
+	  ,program_name, EX_SESSIONS, EX_DEPTH);
+}
+
+
+void
+ex_nomem
+(
+ void
+)
+{
+  fprintf (stderr, "%s: out of memory\n", program_name);
+  exit (EXIT_FAILURE);
+}
+
+
+/**
+   ex_word
+
+   Copies word n of a command line into buf, unquoted as zmprov and
+   zmmailbox would.  Returns buf, or NULL if the line is shorter.
+*/
+char *
+ex_word
+(
+ const char *line,
+ int         n,
+ char       *buf,
+ size_t      max
+)
+{
+  const char *s = line;
+  size_t      len;
+  char        quote;
+  int         i;
+
+  for (i = 0; ; i++) {
+    while (isspace ((unsigned char)*s))
+      s++;
+    if (*s == '\0')
+      return NULL;
+    for (len = 0, quote = '\0'; *s != '\0'; s++) {
+      if (quote == '\0' && isspace ((unsigned char)*s))
+        break;
+      if (quote == '\0' && (*s == '"' || *s == '\''))
+        quote = *s;
+      else if (quote != '\0' && *s == quote)
+        quote = '\0';
+      else {
+        if (quote == '"' && *s == '\\' && s[1] != '\0')
+          s++;
+        if (i == n && len < max - 1)
+          buf[len++] = *s;
+      }
+    }
+    if (i == n) {
+      buf[len] = '\0';
+      return buf;
+    }
+  }
+}
+
+
+/* Frees a command and the names it used. */
+void
+ex_free
+(
+ struct ex_command *c
+)
+{
+  int i;
+
+  for (i = 0; i < c->nuses; i++)
+    free (c->uses[i].name);
+  free (c->uses);
+  free (c->text);
+  free (c);
+}
+
+
+/**
+   ex_uses
+
+   Records the names a zmprov command uses: the one after the command,
+   and for those in ex_refs the rest.  A name used twice is shared only
+   if both uses are.  Exits if out of memory.
+*/
+void
+ex_uses
+(
+ struct ex_command *c,
+ const char        *command
+)
+{
+  char word[EX_WORD_MAX];
+  int  i, j, n, shared = 0, all = 0;
+
+  for (i = 0; ex_refs[i].name != NULL; i++)
+    if (strcasecmp (command, ex_refs[i].name) == 0
+        || strcasecmp (command, ex_refs[i].abbrev) == 0) {
+      shared = ex_refs[i].shared;
+      all = 1;
+      break;
+    }
+
+  for (n = 1; ex_word (c->text, n, word, sizeof (word)) != NULL && (n == 1 || all); n++) {
+    for (j = 0; j < c->nuses && strcasecmp (c->uses[j].name, word) != 0; j++)
+      ;
+    if (j < c->nuses) {
+      c->uses[j].shared &= shared;
+      continue;
+    }
+    if ((c->uses = realloc (c->uses, (c->nuses + 1) * sizeof (*c->uses))) == NULL
+        || (c->uses[c->nuses].name = strdup (word)) == NULL)
+      ex_nomem ();
+    c->uses[c->nuses++].shared = shared;
+  }
+}
+
+
+/* Returns the bucket of name in the table of names in use. */
+struct ex_key **
+ex_bucket
+(
+ struct ex_run *run,
+ const char    *name
+)
+{
+  unsigned long h = 2166136261UL;       /* FNV-1a */
+
+  for (; *name != '\0'; name++)
+    h = ((h ^ tolower ((unsigned char)*name)) * 16777619UL) & 0xffffffffUL;
+
+  return &run->keys[h % EX_KEYS];
+}
+
+
+struct ex_key *
+ex_key_find
+(
+ struct ex_run *run,
+ const char    *name
+)
+{
+  struct ex_key *k;
+
+  for (k = *ex_bucket (run, name); k != NULL; k = k->next)
+    if (strcasecmp (k->name, name) == 0)
+      return k;
+
+  return NULL;
+}
+
+
+/**
+   ex_place
+
+   Returns the session a command must go to so that it runs after
+   every unfinished command using one of its names, unless the use
+   and theirs are both shared; -1 if any session will do; or EX_WAIT
+   if they are on different sessions, and some must finish first.
+*/
+int
+ex_place
+(
+ struct ex_run     *run,
+ struct ex_command *c
+)
+{
+  struct ex_key *k;
+  int            i, j, at, session = -1;
+
+  for (i = 0; i < c->nuses; i++) {
+    if ((k = ex_key_find (run, c->uses[i].name)) == NULL
+        || (c->uses[i].shared && k->excl == 0))
+      continue;
+    for (j = 0, at = -1; j < run->sessions; j++)
+      if (k->use[j] > 0) {
+        if (at >= 0)
+          return EX_WAIT;
+        at = j;
+      }
+    if (session >= 0 && session != at)
+      return EX_WAIT;
+    session = at;
+  }
+
+  return session;
+}
+
+
+/* Marks a command's names in use on its session.  Exits if out of memory. */
+void
+ex_hold
+(
+ struct ex_run     *run,
+ struct ex_command *c
+)
+{
+  struct ex_key *k, **b;
+  int            i;
+
+  for (i = 0; i < c->nuses; i++) {
+    if ((k = ex_key_find (run, c->uses[i].name)) == NULL) {
+      if ((k = calloc (1, sizeof (*k))) == NULL
+          || (k->name = strdup (c->uses[i].name)) == NULL
+          || (k->use = calloc (run->sessions, sizeof (*k->use))) == NULL)
+        ex_nomem ();
+      b = ex_bucket (run, k->name);
+      k->next = *b;
+      *b = k;
+    }
+    k->use[c->session]++;
+    k->total++;
+    if (!c->uses[i].shared)
+      k->excl++;
+  }
+}
+
+
+/* Releases a finished command's names, forgetting those no longer used. */
+void
+ex_release
+(
+ struct ex_run     *run,
+ struct ex_command *c
+)
+{
+  struct ex_key *k, **b;
+  int            i;
+
+  for (i = 0; i < c->nuses; i++) {
+    for (b = ex_bucket (run, c->uses[i].name); (k = *b) != NULL; b = &k->next)
+      if (strcasecmp (k->name, c->uses[i].name) == 0)
+        break;
+    if (k == NULL)
+      continue;
+    k->use[c->session]--;
+    if (!c->uses[i].shared)
+      k->excl--;
+    if (--k->total == 0) {
+      *b = k->next;
+      free (k->use);
+      free (k->name);
+      free (k);
+    }
+  }
+}
+
+
+/* Reports a command that was not run. */
+void
+ex_skip
+(
+ struct ex_run     *run,
+ struct ex_command *c,
+ const char        *why
+)
+{
+  run->skipped++;
+  if (run->results)
+    printf ("%s:%ld\tskipped\t%s\n", c->file, c->line, c->text);
+  else
+    fprintf (stderr, "%s: %s:%ld: %s: %s\n", program_name, c->file, c->line, why, c->text);
+}
+
+
+/**
+   ex_done
+
+   Pool callback: reports a command's result.  Returns non-zero if it
+   failed, which for a selectMailbox drops the commands after it.
+*/
+int
+ex_done
+(
+ const char *out,
+ size_t      len,
+ void       *tag,
+ void       *arg
+)
+{
+  struct ex_command *c = tag;
+  struct ex_run     *run = arg;
+  int                failed = 0;
+
+  if (out == NULL)
+    ex_skip (run, c, "not run");
+  else if ((failed = zm_output_error (out))) {
+    run->failed++;
+    if (run->results)
+      printf ("%s:%ld\tfailed\t%s\n", c->file, c->line, c->text);
+    else {
+      fprintf (stderr, "%s: %s:%ld: %s\n", program_name, c->file, c->line, c->text);
+      fwrite (out, 1, len, stderr);
+    }
+  } else {
+    run->ok++;
+    if (run->results)
+      printf ("%s:%ld\tok\t%s\n", c->file, c->line, c->text);
+    else
+      fwrite (out, 1, len, stdout);
+  }
+  fflush (stdout);
+
+  ex_release (run, c);
+  ex_free (c);
+
+  return out == NULL || failed;
+}
+
+
+/**
+   ex_run_file
+
+   Submits every command in a file.  A selectMailbox opens a block
+   that stays on one session until the next.  A zmprov command that
+   must follow unfinished commands on different sessions waits for
+   them.  Exits if out of memory.
+*/
+void
+ex_run_file
+(
+ zm_pool       *pool,
+ struct ex_run *run,
+ FILE          *fp,
+ const char    *file
+)
+{
+  struct ex_command *c;
+  char              *line = NULL, word[EX_WORD_MAX];
+  size_t             max = 0, len;
+  long               n = 0;
+  int                session = -1, gate, selected = 0;
+
+  while (getline (&line, &max, fp) > 0) {
+    n++;
+    for (len = strlen (line); len > 0 && isspace ((unsigned char)line[len - 1]); len--)
+      line[len - 1] = '\0';
+    if (ex_word (line, 0, word, sizeof (word)) == NULL || word[0] == '#'
+        || strcasecmp (word, "exit") == 0 || strcasecmp (word, "quit") == 0)
+      continue;                         /* The session must outlive the file. */
+
+    if ((c = calloc (1, sizeof (*c))) == NULL || (c->text = strdup (line)) == NULL)
+      ex_nomem ();
+    c->file = file;
+    c->line = n;
+
+    gate = run->mailbox
+      && (strcasecmp (word, "sm") == 0 || strcasecmp (word, "selectMailbox") == 0);
+    if (gate) {
+      selected = 1;
+      session = ex_word (line, 1, word, sizeof (word)) != NULL
+        ? zm_pool_route (pool, word) : -1;
+    } else if (run->mailbox) {
+      if (!selected) {
+        ex_skip (run, c, "no mailbox selected");
+        ex_free (c);
+        continue;
+      }
+    } else {
+      ex_uses (c, word);
+      while ((session = ex_place (run, c)) == EX_WAIT)
+        if (zm_pool_wait (pool) != 0)
+          break;
+      if (session == -1 && c->nuses > 0)
+        session = zm_pool_route (pool, c->uses[0].name);
+    }
+
+    if (run->debug)
+      fprintf (stderr, "%s:%ld: [%d] %s\n", file, n, session, line);
+    if (session == EX_WAIT)
+      ;                                 /* zm_pool_wait set errno. */
+    else if (session < 0 && (run->mailbox || c->nuses > 0))
+      errno = EPIPE;
+    else {
+      c->session = session;
+      ex_hold (run, c);
+      if (zm_pool_submit (pool, session, line, c, gate) == 0)
+        continue;
+      ex_release (run, c);
+    }
+    if (errno == ENOMEM)
+      ex_nomem ();
+    ex_skip (run, c, "session died");
+    ex_free (c);
+  }
+
+  free (line);
+}
+
+
+
+/*
+----------------------------------------------------------------------
+
+
+                               Main
+
+
+----------------------------------------------------------------------
+*/
+
+
+int
+main
+(
+ int   argc,
+ char *argv[]
+)
+{
+  struct ex_run  run;
+  zm_pool       *pool;
+  FILE          *fp;
+  const char    *tool;
+  char          *s;
+  int            sessions = EX_SESSIONS, depth = EX_DEPTH;
+  long           lost;
+
+  program_name = argv[0];
+  memset (&run, 0, sizeof (run));
+
+  while (--argc > 0 && (*++argv)[0] == '-') {
+    for (s = argv[0]+1; *s != '\0'; s++) {
+      if (strchr ("jp", *s) != NULL && argc < 2) {
+        usage ();
+        exit (EXIT_FAILURE);
+      }
+      switch (*s) {
+      case 'j':                 /* Sessions */
+        sessions = atoi (*++argv);
+        --argc;
+        break;
+      case 'p':                 /* Pipeline depth */
+        depth = atoi (*++argv);
+        --argc;
+        break;
+      case 'r':                 /* Result lines */
+        run.results = !run.results;
+        break;
+      case 'd':                 /* Toggle debug mode */
+        run.debug = !run.debug;
+        break;
+      case 'h':
+        usage ();
+        exit (EXIT_SUCCESS);
+      default:
+        fprintf (stderr, "%s: illegal option -%c\n", program_name, *s);
+        usage ();
+        exit (EXIT_FAILURE);
+      }
+    }
+  }
+
+  if (argc < 1 || sessions < 1 || depth < 1) {
+    usage ();
+    exit (EXIT_FAILURE);
+  }
+  tool = *argv++;
+  argc--;
+  if (strcmp (tool, "mailbox") == 0)
+    run.mailbox = 1;
+  else if (strcmp (tool, "prov") != 0) {
+    fprintf (stderr, "%s: unknown tool: %s\n", program_name, tool);
+    usage ();
+    exit (EXIT_FAILURE);
+  }
+
+  run.sessions = sessions;
+  if ((run.keys = calloc (EX_KEYS, sizeof (*run.keys))) == NULL)
+    ex_nomem ();
+
+  signal (SIGPIPE, SIG_IGN);
+  if ((pool = zm_pool_new (run.mailbox ? EX_ZMMAILBOX : EX_ZMPROV, run.mailbox ? "mbox" : "prov",
+                           sessions, depth, ex_done, &run)) == NULL) {
+    perror (program_name);
+    exit (EXIT_FAILURE);
+  }
+
+  if (argc == 0)
+    ex_run_file (pool, &run, stdin, "stdin");
+  for (; argc > 0; argc--, argv++) {
+    if ((fp = fopen (*argv, "r")) == NULL) {
+      perror (*argv);
+      run.skipped++;
+      continue;
+    }
+    ex_run_file (pool, &run, fp, *argv);
+    fclose (fp);
+  }
+
+  zm_pool_drain (pool);
+  lost = zm_pool_free (pool);
+  free (run.keys);                      /* Every name has been released. */
+
+  if (run.debug)
+    fprintf (stderr, "%ld ok, %ld failed, %ld skipped, %ld lost to sessions that died\n",
+             run.ok, run.failed, run.skipped, lost);
+
+  exit (run.failed == 0 && run.skipped == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}